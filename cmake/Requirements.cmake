@@ -3,6 +3,8 @@
 
 include(CheckIncludeFile) 
 include(CheckLibraryExists)
+include(CheckFunctionExists)
+include(CheckCSourceRuns)
 include(FindPkgConfig)
 
 # look for header files we need first
@@ -14,6 +16,9 @@ check_include_file(sys/statvfs.h HAVE_SYS_STATVFS_H)
 check_include_file(time.h HAVE_TIME_H)
 check_include_file(semaphore.h HAVE_SEMAPHORE_H)
 
+# look for functions which are nice to have [optional]
+check_function_exists(syncfs HAVE_SYNCFS)
+
 # look for zlib
 find_library(HAVE_ZLIB NAMES z zlib)
 if (NOT HAVE_ZLIB)
@@ -76,8 +81,24 @@ endif (HAVE_GCRYPT)
 # check for gnutls
 pkg_check_modules (GNUTLS REQUIRED gnutls)
 
-# check for sqlite3
-pkg_check_modules (SQLITE REQUIRED sqlite3)
+# check for sqlite3; 3.7.17 is the first with PRAGMA mmap_size
+pkg_check_modules (SQLITE REQUIRED sqlite3>=3.7.17)
+
+# check sqlite3 can make FTS4 tables, for the store's full-text index [optional]
+set(CMAKE_REQUIRED_INCLUDES ${SQLITE_INCLUDE_DIRS})
+set(CMAKE_REQUIRED_LIBRARIES ${SQLITE_LDFLAGS})
+check_c_source_runs("
+#include <sqlite3.h>
+int main(void) {
+	sqlite3 *db;
+	int result;
+	if (sqlite3_open(\":memory:\", &db) != SQLITE_OK) return 1;
+	result = sqlite3_exec(db, \"CREATE VIRTUAL TABLE t USING fts4(c);\", 0, 0, 0);
+	sqlite3_close(db);
+	return result != SQLITE_OK;
+}" HAVE_SQLITE_FTS4)
+unset(CMAKE_REQUIRED_INCLUDES)
+unset(CMAKE_REQUIRED_LIBRARIES)
 
 # check for curl
 pkg_check_modules (CURL REQUIRED libcurl)
@@ -31,6 +31,10 @@
     #cmakedefine HAVE_SEMAPHORE_H
 #endif// Directories.txt
 
+#cmakedefine HAVE_SYNCFS	1
+
+#cmakedefine HAVE_SQLITE_FTS4	1
+
 #cmakedefine HAVE_ICAL_H	1
 #cmakedefine HAVE_OLD_ICAL_H	1
 
@@ -52,6 +52,8 @@ typedef long (* SourceReader)(void *sourceHandle, char *buffer, unsigned long bu
 BOOL BongoStreamSearchMimePart(SourceReader readerFunction, void *source, size_t sourceSize, char *charset, char *encoding, char *subtype, char *searchString);
 BOOL BongoStreamSearchRfc822Header(SourceReader readerFunction, void *source, size_t sourceSize, char *headerName, char *substring);
 char *BongoStreamGrabRfc822Header(SourceReader readerFunction, void *source, size_t sourceSize, char *headerName);
+char *BongoStreamGrabRfc822HeaderText(SourceReader readerFunction, void *source, size_t sourceSize, char *headerName);
+char *BongoStreamGrabMimePart(SourceReader readerFunction, void *source, size_t sourceSize, char *charset, char *encoding, char *subtype);
 
 XPL_END_C_LINKAGE
 
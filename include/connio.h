@@ -48,6 +48,15 @@ typedef struct {
 #define CONN_TCP_THRESHOLD              256
 #define DEFAULT_CONNECTION_TIMEOUT      (15 * 60)
 
+/* raw deflate (rfc1951) as used by IMAP COMPRESS=DEFLATE (rfc4978).  we send */
+/* with a small window to keep per-connection memory down, but must be able */
+/* to inflate anything a peer sends, so the receiving side keeps the full 32k. */
+/* the memory budget is sized for CONN_COMPRESS_SESSIONS unless set otherwise */
+#define CONN_COMPRESS_LEVEL             5
+#define CONN_COMPRESS_WINDOW_BITS       10
+#define CONN_COMPRESS_MEM_LEVEL         3
+#define CONN_COMPRESS_SESSIONS          10000
+
 /* CONNIO return values */
 #define CONN_ERROR_NETWORK              -1
 #define CONN_ERROR_MEMORY               -2
@@ -167,6 +176,12 @@ typedef struct _Connection {
         gnutls_certificate_credentials_t credentials;
     } ssl;
 
+    struct {
+        BOOL enable;
+
+        void *state;
+    } compress;
+
     struct sockaddr_in socketAddress;
 
     ConnectionBuffer receive;
@@ -259,6 +274,9 @@ IPSOCKET ConnConnect(Connection *conn, struct sockaddr *saddr, socklen_t slen, b
 
 int ConnEncrypt(Connection *conn, bongo_ssl_context *context);
 BOOL ConnNegotiate(Connection *conn, bongo_ssl_context *Context);
+int ConnCompress(Connection *conn);
+BOOL ConnCompressAvailable(void);
+void ConnCompressSetSessions(unsigned long sessions);
 
 int ConnClose(Connection *Conn);
 void ConnCloseAll();
@@ -274,6 +292,7 @@ int ConnRead(Connection *Conn, char *Dest, int Length);
 int ConnReadCount(Connection *Conn, char *Dest, int Count);
 int ConnReadLine(Connection *Conn, char *Line, int Length);
 int ConnReadAnswer(Connection *Conn, char *Line, int Length);
+BOOL ConnLinePending(Connection *Conn);
 long ConnReadToAllocatedBuffer(Connection *c, char **buffer, unsigned long *bufferSize);
 int ConnReadToFile(Connection *Conn, FILE *Dest, int Count);
 int ConnReadToFileUntilEOS(Connection *Src, FILE *Dest);
@@ -44,10 +44,20 @@ EXPORT void MsgAuthUserListFree(char **list[]);
 
 // SQL Routines
 
+typedef struct _MsgSQLCachedStatement {
+	char *query;
+	uint32_t hash;
+	sqlite3_stmt *stmt;
+	BOOL inUse;
+	uint64_t lastUsed;
+	struct _MsgSQLHandle *handle;
+} MsgSQLCachedStatement;
+
 typedef struct _MsgSQLStatement {
 	sqlite3_stmt *stmt;
 	void *userdata;
 	const char *query;
+	MsgSQLCachedStatement *cached;	// set if stmt belongs to the statement cache
 } MsgSQLStatement;
 
 typedef struct _MsgSQLHandle {
@@ -62,10 +72,34 @@ typedef struct _MsgSQLHandle {
 	BongoMemStack *memstack;
 	XplMutex transactionLock;
 	int transactionDepth;
+	XplThreadID transactionOwner;	// who holds transactionLock, if anyone
 	int lockTimeoutMs;
 	BOOL isNew;		// have we just created this?
+
+	struct {
+		XplMutex lock;
+		MsgSQLCachedStatement *entries;
+		int size;
+		uint64_t clock;
+		uint64_t hits;
+		uint64_t misses;
+	} cache;
 } MsgSQLHandle;
 
+typedef struct _MsgSQLTuning {
+	BOOL wal;		// use write-ahead logging with synchronous=NORMAL
+	int cacheSizeKB;	// page cache per handle; 0 leaves the SQLite default
+	int64_t mmapSize;	// bytes of the file to memory map; 0 to not map
+	int statementCacheSize;	// prepared statements kept by MsgSQLPrepareCached()
+} MsgSQLTuning;
+
+typedef struct _MsgSQLSpace {
+	int64_t pageCount;	// pages in the database file
+	int64_t freePages;	// of which unused
+	int64_t pageSize;	// bytes
+	BOOL incremental;	// free pages can be given back with MsgSQLVacuum()
+} MsgSQLSpace;
+
 typedef enum {
 	MSGAPI_DIR_START,
 	MSGAPI_DIR_BIN,
@@ -99,15 +133,19 @@ MsgGetFile(MsgApiFile file, char *buffer, size_t buffer_size);
 EXPORT const char *
 MsgGetDir(MsgApiDirectory directory, char *buffer, size_t buffer_size);
 
-#define MSGSQL_STMT_SLEEP_MS 250
-
 MsgSQLHandle *MsgSQLOpen(char *path, BongoMemStack *memstack, int locktimeoutms);
 BongoMemStack *MsgSQLGetMemStack(MsgSQLHandle *handle);
 MsgSQLStatement *MsgSQLPrepare(MsgSQLHandle *handle, const char *statement, MsgSQLStatement *stmt);
+MsgSQLStatement *MsgSQLPrepareCached(MsgSQLHandle *handle, const char *statement, MsgSQLStatement *stmt);
+void	MsgSQLStatementCacheStats(MsgSQLHandle *handle, uint64_t *hits, uint64_t *misses);
 void 	MsgSQLClose(MsgSQLHandle *handle);
 void 	MsgSQLSetMemStack(MsgSQLHandle *handle, BongoMemStack *memstack);
 void 	MsgSQLSetLockTimeout(MsgSQLHandle *handle, int timeoutms);
 void	MsgSQLReset(MsgSQLHandle *handle);
+int	MsgSQLTune(MsgSQLHandle *handle, const MsgSQLTuning *tuning);
+int	MsgSQLCheckpoint(MsgSQLHandle *handle);
+int	MsgSQLGetSpace(MsgSQLHandle *handle, MsgSQLSpace *space);
+int	MsgSQLVacuum(MsgSQLHandle *handle, int pages);
 int	MsgSQLBeginTransaction(MsgSQLHandle *handle);
 int	MsgSQLCommitTransaction(MsgSQLHandle *handle);
 int	MsgSQLAbortTransaction(MsgSQLHandle *handle);
@@ -117,11 +155,13 @@ int	MsgSQLBindString(MsgSQLStatement *stmt, int var, const char *str, BOOL nulli
 int	MsgSQLBindInt(MsgSQLStatement *stmt, int var, int value);
 int	MsgSQLBindInt64(MsgSQLStatement *stmt, int var, uint64_t value);
 int	MsgSQLBindNull(MsgSQLStatement *stmt, int var);
+int	MsgSQLBindBlob(MsgSQLStatement *stmt, int var, const void *data, size_t len);
 
 int	MsgSQLResultInt(MsgSQLStatement *_stmt, int column);
 uint64_t MsgSQLResultInt64(MsgSQLStatement *_stmt, int column);
 int	MsgSQLResultText(MsgSQLStatement *_stmt, int column, char *result, size_t result_size);
 int	MsgSQLResultTextPtr(MsgSQLStatement *_stmt, int column, char **ptr);
+int	MsgSQLResultBlob(MsgSQLStatement *_stmt, int column, void **ptr, size_t *len);
 int	MsgSQLResults(MsgSQLHandle *handle, MsgSQLStatement *_stmt);
 
 int	MsgSQLQuickExecute(MsgSQLHandle *handle, const char *query);
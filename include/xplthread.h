@@ -25,6 +25,7 @@
 #ifdef HAVE_SEMAPHORE_H
 #include <semaphore.h>
 #endif
+#include <stdint.h>
 
 typedef struct { volatile int counter; } XplAtomic;
 
@@ -42,17 +43,36 @@ static __inline__ void _XplSafeAdd (int i, XplAtomic *v)
 		:"=m" (v->counter)
 		:"ir" (i), "m" (v->counter));
 }
-#else /* we don't have any asm, so use a generic mutex-based definition */
-#include <pthread.h>
-static pthread_mutex_t __xpl_safe_add_mutex = PTHREAD_MUTEX_INITIALIZER;
+#else /* we don't have any asm, so leave it to the compiler; a mutex here
+       would be one per file, and so not shared by everyone adding */
 static __inline__ void _XplSafeAdd (int i, XplAtomic *v)
 {
-    pthread_mutex_lock(&__xpl_safe_add_mutex);
-    v->counter += i;
-    pthread_mutex_unlock(&__xpl_safe_add_mutex);
+	__sync_fetch_and_add(&v->counter, i);
 }
 #endif /* end of per-arch definition of _XplSafeAdd(); */
 
+/* a 64-bit counter which hands out values; returns what it held before */
+typedef struct { volatile uint64_t counter; } XplAtomic64;
+
+#if defined(__x86_64__)
+static __inline__ uint64_t _XplSafeFetchAdd64 (uint64_t i, XplAtomic64 *v)
+{
+	__asm__ __volatile__ (
+		"lock; xaddq %0,%1"
+		:"+r" (i), "+m" (v->counter)
+		:
+		:"memory");
+	return i;
+}
+#else
+static __inline__ uint64_t _XplSafeFetchAdd64 (uint64_t i, XplAtomic64 *v)
+{
+	return __sync_fetch_and_add(&v->counter, i);
+}
+#endif
+
+#define XplSafeFetchAdd64(Variable, Value) _XplSafeFetchAdd64((Value), &(Variable))
+
 #define	XplSafeRead(Variable)         ((Variable).counter)
 #define	XplSafeWrite(Variable, Value) (Variable).counter = (Value)
 #define	XplSafeIncrement(Variable)    XplSafeAdd (Variable, 1)
@@ -227,11 +227,19 @@ FindPurgeSequenceNumbers(OpenedFolder *selected, PurgeEvent *purge, unsigned lon
 }
 
 __inline static long
-SendExpungeResponses(Connection *conn, PurgeEvent *purge, unsigned long purgeCount)
+SendExpungeResponses(Connection *conn, PurgeEvent *purge, unsigned long purgeCount, BOOL vanished)
 {
+    long ccode;
+
     /* send the highest sequence numbers first; otherwise sequence numbers would have to be recalculated everytime */
     do {
-        if (ConnWriteF(conn, "* %lu EXPUNGE\r\n", purge->sequence + 1) != -1) {
+        if (vanished) {
+            ccode = ConnWriteF(conn, "* VANISHED %lu\r\n", purge->uid);
+        } else {
+            ccode = ConnWriteF(conn, "* %lu EXPUNGE\r\n", purge->sequence + 1);
+        }
+
+        if (ccode != -1) {
             purgeCount--;
             purge--;
             continue;
@@ -291,22 +299,26 @@ MessageListAddNewMessages(Connection *storeConn, OpenedFolder *folder, NewEvent
     long ccode;
     long result;
     long headerSize;
+    uint64_t modseq;
     unsigned char reply[1024];
 
     do {
         result = STATUS_CONTINUE;
 
-        if (NMAPSendCommandF(storeConn, "INFO %lx Pnmap.mail.headersize\r\n", newEvent->guid) != -1) {
+        if (NMAPSendCommandF(storeConn, "INFO %lx Pnmap.mail.headersize,nmap.modseq\r\n", newEvent->guid) != -1) {
             ccode = NMAPReadResponse(storeConn, reply, sizeof(reply), TRUE);
             if (ccode == 2001) {
                 ccode = NMAPReadDecimalPropertyResponse(storeConn, "nmap.mail.headersize", &headerSize);
-                if (ccode == 2001) {
-                    result = MessageListAddMessage(folder, reply, headerSize);
-                } else if (ccode == 3245) {
-                    result = MessageListAddMessage(folder, reply, 0);
-                } else {
+                if (ccode == 3245) {
+                    headerSize = 0;
+                } else if (ccode != 2001) {
                     return(ccode);
                 }
+
+                if ((ccode = ReadModseqPropertyResponse(storeConn, &modseq)) != STATUS_CONTINUE) {
+                    return(ccode);
+                }
+                result = MessageListAddMessage(folder, reply, headerSize, modseq);
             }
 
             ccode = NMAPReadResponse(storeConn, NULL, 0, 0);
@@ -327,8 +339,47 @@ MessageListAddNewMessages(Connection *storeConn, OpenedFolder *folder, NewEvent
     return(STATUS_CONTINUE);
 }
 
+/* bring the modseqs of the messages that changed since the client was last
+   told up to date, so the flag changes can carry them (rfc4551) */
 __inline static long
-SendFlagEvents(Connection *clientConn, StoreEvents *events, OpenedFolder *folder)
+MessageListRefreshModseqs(Connection *storeConn, OpenedFolder *folder)
+{
+    long ccode;
+    char reply[1024];
+    unsigned long long modseq;
+    unsigned long uid;
+    unsigned long messageId;
+
+    if (NMAPSendCommandF(storeConn, "CHANGES %llx %llu\r\n", folder->info->guid, (unsigned long long)(folder->highestModseq - 1)) != -1) {
+        for (;;) {
+            ccode = NMAPReadResponse(storeConn, reply, sizeof(reply), TRUE);
+            if (ccode == 2001) {
+                /* <guid> <modseq> <kind> <uid> <flags> */
+                if ((sscanf(reply, "%*s %llu %*s %lu", &modseq, &uid) == 2) && (folder->messageCount > 0)) {
+                    if (UidToSequenceNum(folder->message, folder->messageCount, uid, &messageId) == STATUS_CONTINUE) {
+                        folder->message[messageId].modseq = modseq + 1;
+                    }
+                }
+                continue;
+            }
+
+            if (ccode == 1000) {
+                folder->highestModseq = strtoull(reply, NULL, 10) + 1;
+                return(STATUS_CONTINUE);
+            }
+
+            if (ccode == 4263) {
+                /* the log has moved on; the modseqs we have will have to do */
+                return(STATUS_CONTINUE);
+            }
+            return(CheckForNMAPCommError(ccode));
+        }
+    }
+    return(STATUS_NMAP_COMM_ERROR);
+}
+
+__inline static long
+SendFlagEvents(Connection *clientConn, StoreEvents *events, OpenedFolder *folder, BOOL condstore)
 {
     long ccode;
     FlagEvent *flag = &(events->flag[0]);
@@ -337,7 +388,7 @@ SendFlagEvents(Connection *clientConn, StoreEvents *events, OpenedFolder *folder
     do {
         if ((ccode = UidToSequenceNum(folder->message, folder->messageCount, flag->uid, &messageId)) == STATUS_CONTINUE) {
             folder->message[messageId].flags = flag->value;
-            ccode = SendFetchFlag(clientConn, messageId, flag->value, 0);
+            ccode = SendFetchFlag(clientConn, messageId, flag->value, 0, condstore ? folder->message[messageId].modseq : 0);
             if (ccode == STATUS_CONTINUE) {
                 events->flagCount--;
                 flag++;
@@ -354,7 +405,7 @@ SendFlagEvents(Connection *clientConn, StoreEvents *events, OpenedFolder *folder
 }
 
 __inline static long
-SendPurgeEvents(Connection *clientConn, StoreEvents *events, OpenedFolder *folder)
+SendPurgeEvents(Connection *clientConn, StoreEvents *events, OpenedFolder *folder, BOOL vanished)
 {
     long ccode;
 
@@ -362,7 +413,7 @@ SendPurgeEvents(Connection *clientConn, StoreEvents *events, OpenedFolder *folde
     events->purgeCount = FindPurgeSequenceNumbers(folder, &(events->purge[0]), events->purgeCount);
     if (events->purgeCount > 0) {
         MessageListCompact(folder, events->purge, events->purgeCount);
-        if((ccode = SendExpungeResponses(clientConn, &(events->purge[events->purgeCount - 1]), events->purgeCount)) != STATUS_CONTINUE) {
+        if((ccode = SendExpungeResponses(clientConn, &(events->purge[events->purgeCount - 1]), events->purgeCount, vanished)) != STATUS_CONTINUE) {
             return(ccode);
         }
     }
@@ -392,14 +443,17 @@ MarkPurgedMessages(Connection *clientConn, StoreEvents *events, OpenedFolder *fo
 }
 
 __inline static long
-SendRememberedEvents(Connection *clientConn, Connection *storeConn, OpenedFolder *selectedFolder, unsigned long typesAllowed)
+SendRememberedEvents(Connection *clientConn, Connection *storeConn, OpenedFolder *selectedFolder, unsigned long typesAllowed, unsigned long enabled)
 {
     long ccode;
     BOOL sequenceChanged = FALSE;
     StoreEvents *events = &(selectedFolder->events);
 
     if ((events->remembered & STORE_EVENT_FLAG) && (events->remembered & STORE_EVENT_FLAG)) {
-        SendFlagEvents(clientConn, events, selectedFolder);
+        if (enabled & IMAP_ENABLED_CONDSTORE) {
+            MessageListRefreshModseqs(storeConn, selectedFolder);
+        }
+        SendFlagEvents(clientConn, events, selectedFolder, (enabled & IMAP_ENABLED_CONDSTORE) ? TRUE : FALSE);
         events->flagCount = 0;
         events->remembered &= ~STORE_EVENT_FLAG;
     }
@@ -407,7 +461,7 @@ SendRememberedEvents(Connection *clientConn, Connection *storeConn, OpenedFolder
     if (events->remembered & STORE_EVENT_PURGE) {
         if (typesAllowed & STORE_EVENT_PURGE) {
             sequenceChanged = TRUE;
-            ccode = SendPurgeEvents(clientConn, events, selectedFolder);
+            ccode = SendPurgeEvents(clientConn, events, selectedFolder, (enabled & IMAP_ENABLED_QRESYNC) ? TRUE : FALSE);
             events->purgeCount = 0;
             events->remembered &= ~STORE_EVENT_PURGE;
         } else {
@@ -543,7 +597,7 @@ EventsSend(ImapSession *session, unsigned long typesAllowed)
             if (!session->folder.selected.events.remembered) {
                 return(STATUS_CONTINUE);
             }
-            return(SendRememberedEvents(session->client.conn, session->store.conn, &(session->folder.selected), typesAllowed));
+            return(SendRememberedEvents(session->client.conn, session->store.conn, &(session->folder.selected), typesAllowed, session->client.enabled));
         }
         return(ccode);
     }
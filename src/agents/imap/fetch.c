@@ -791,6 +791,18 @@ FetchFlagResponderUid(void *param1, void *param2, void *param3)
     return(STATUS_ABORT);
 }
 
+static long 
+FetchFlagResponderModseq(void *param1, void *param2, void *param3)
+{
+    ImapSession *session = (ImapSession *)param1;
+    FetchStruct *FetchRequest = (FetchStruct *)param2;
+
+    if (ConnWriteF(session->client.conn, "MODSEQ (%llu)", (unsigned long long)FetchRequest->message->modseq) != -1) {
+        return(STATUS_CONTINUE);
+    }
+    return(STATUS_ABORT);
+}
+
 static long 
 FetchFlagResponderFlags(void *param1, void *param2, void *param3)
 {
@@ -2741,6 +2753,7 @@ ParseFetchFlagBodyPart(unsigned char **parentPtr, FetchFlagStruct *flag)
 #define FETCH_ATT_FLAGS \
     {"UID", sizeof("UID") - 1, F_UID, NULL, FetchFlagResponderUid}, \
     {"FLAGS", sizeof("FLAGS") - 1, F_FLAGS, NULL, FetchFlagResponderFlags}, \
+    {"MODSEQ", sizeof("MODSEQ") - 1, F_MODSEQ, NULL, FetchFlagResponderModseq}, \
     {"ENVELOPE", sizeof("ENVELOPE") - 1, F_ENVELOPE, NULL, FetchFlagResponderEnvelope}, \
     {"XSENDER", sizeof("XSENDER") - 1, F_XSENDER, NULL, FetchFlagResponderXSender}, \
     {"INTERNALDATE", sizeof("INTERNALDATE") - 1, F_INTERNALDATE, NULL, FetchFlagResponderInternalDate}, \
@@ -2835,10 +2848,49 @@ AddNewFlag(FetchStruct *FetchRequest, FetchResponder responder)
     return(NULL);
 }
 
+/* the fetch modifiers are " (CHANGEDSINCE <modseq>)" (rfc4551), with
+   " VANISHED" before the paren once QRESYNC is enabled (rfc5162) */
+__inline static long
+ParseFetchModifiers(ImapSession *session, unsigned char *ptr, FetchStruct *FetchRequest, long allFlags)
+{
+    char *end;
+
+    if (*ptr != '\0') {
+        if (XplStrNCaseCmp(ptr, " (CHANGEDSINCE ", strlen(" (CHANGEDSINCE ")) != 0) {
+            return(F_PARSE_ERROR);
+        }
+
+        FetchRequest->changedSince.modseq = strtoull(ptr + strlen(" (CHANGEDSINCE "), &end, 10);
+        if ((*end == ' ') && (XplStrNCaseCmp(end + 1, "VANISHED", strlen("VANISHED")) == 0) && (session->client.enabled & IMAP_ENABLED_QRESYNC)) {
+            FetchRequest->changedSince.vanished = TRUE;
+            end += strlen(" VANISHED");
+        }
+
+        if ((end[0] != ')') || (end[1] != '\0')) {
+            return(F_PARSE_ERROR);
+        }
+        FetchRequest->changedSince.requested = TRUE;
+
+        /* CHANGEDSINCE implies MODSEQ */
+        if (!(allFlags & F_MODSEQ)) {
+            if (AddNewFlag(FetchRequest, FetchFlagResponderModseq) == NULL) {
+                return(F_SYSTEM_ERROR);
+            }
+            allFlags |= F_MODSEQ;
+        }
+    }
+
+    if (allFlags & F_MODSEQ) {
+        session->client.enabled |= IMAP_ENABLED_CONDSTORE;
+    }
+    return(allFlags);
+}
+
 __inline static long
 ParseFetchArguments(ImapSession *session, unsigned char *ptr, FetchStruct *FetchRequest)
 {
     unsigned char *Items;
+    unsigned char *modifiers;
     long allFlags = FetchRequest->flags;
     long flagID;
     FetchFlag flagInfo;
@@ -2857,6 +2909,7 @@ ParseFetchArguments(ImapSession *session, unsigned char *ptr, FetchStruct *Fetch
                         /* we have parens so we can have one or more 'fetch-att' flags */
                         ccode = GrabArgument(session, &ptr, &Items);
                         if (ccode == STATUS_CONTINUE) {
+                            modifiers = ptr;
                             ptr = Items - 1;
                             do {
                                 ptr++;
@@ -2893,7 +2946,7 @@ ParseFetchArguments(ImapSession *session, unsigned char *ptr, FetchStruct *Fetch
 
                             if (*ptr == '\0') {
                                 MemFree(Items);
-                                return(allFlags);
+                                return(ParseFetchModifiers(session, modifiers, FetchRequest, allFlags));
                             }
 
                             MemFree(Items);
@@ -2911,14 +2964,14 @@ ParseFetchArguments(ImapSession *session, unsigned char *ptr, FetchStruct *Fetch
                         currentFlag = AddNewFlag(FetchRequest, flagInfo.responder);
                         if (currentFlag) {
                             if (flagInfo.parser == NULL) {
-                                if (*ptr == '\0') {
+                                if ((*ptr == '\0') || (*ptr == ' ')) {
                                     if ((!(flagInfo.value & F_UID)) || (!(allFlags & F_UID))) {
                                         allFlags |= flagInfo.value;
                                     } else {
                                         RemoveLastFlag(FetchRequest);
                                     }
 
-                                    return(allFlags);
+                                    return(ParseFetchModifiers(session, ptr, FetchRequest, allFlags));
                                 }
 
                                 return(F_PARSE_ERROR);
@@ -2929,8 +2982,8 @@ ParseFetchArguments(ImapSession *session, unsigned char *ptr, FetchStruct *Fetch
                             ccode = flagInfo.parser(&ptr, currentFlag);
                             FetchRequest->hasAllocated |= currentFlag->hasAllocated;
                             if (ccode == 0) {
-                                if (*ptr == '\0') {
-                                    return(allFlags);
+                                if ((*ptr == '\0') || (*ptr == ' ')) {
+                                    return(ParseFetchModifiers(session, ptr, FetchRequest, allFlags));
                                 }
                                 return(F_PARSE_ERROR);
                             }
@@ -2978,73 +3031,177 @@ SetMessageSeenFlag(ImapSession *session, FetchStruct *FetchRequest)
     return(STATUS_NMAP_COMM_ERROR);
 }
 
+/* Ask the store for the headers and mime reports of the next FETCH_BATCH_SIZE messages in the range with one DETAILS command */
 __inline static long
-GetMessageHeader(ImapSession *session, FetchStruct *FetchRequest)
+FetchBatchRequest(ImapSession *session, FetchStruct *FetchRequest, FetchBatch *batch, unsigned long *currentMessage, unsigned long rangeEnd, BOOL *purgedMessage)
 {
-    int ccode;
-    size_t count;
-    
-    /* Request the header */
-    if (NMAPSendCommandF(session->store.conn, "READ %llx 0 %lu\r\n", FetchRequest->message->guid, FetchRequest->message->headerSize) != -1) {
-        if ((ccode = NMAPReadPropertyValueLength(session->store.conn, "nmap.document", &count)) == 2001) {
-            FetchRequest->message->headerSize = (long)count;
-            FetchRequest->messageDetail.header = MemMalloc(FetchRequest->message->headerSize + 1);
-            if (FetchRequest->messageDetail.header) {
-                if ((ccode = NMAPReadCount(session->store.conn, FetchRequest->messageDetail.header, FetchRequest->message->headerSize)) > 0) {
-                    if ((unsigned long)ccode == FetchRequest->message->headerSize) {
-                        if (NMAPReadCrLf(session->store.conn) == 2) {
-                            FetchRequest->messageDetail.header[FetchRequest->message->headerSize] = '\0';
-                            MakeRFC822Header(FetchRequest->messageDetail.header, &FetchRequest->message->headerSize);
-                            return(0);
-                        }
-                    }
-                }
-            }    
+    char command[CONN_BUFSIZE + 1];
+    size_t len;
+    MessageInformation *message;
+
+    batch->count = 0;
+    batch->requested = FALSE;
 
-            return(STATUS_ABORT);            
+    len = 0;
+    while ((*currentMessage <= rangeEnd) && (batch->count < FETCH_BATCH_SIZE) && (len < sizeof(command) - 64)) {
+        message = &(session->folder.selected.message[*currentMessage]);
+        if (FetchRequest->changedSince.requested && (message->modseq <= FetchRequest->changedSince.modseq)) {
+            ;
+        } else if (!(message->flags & STORE_MSG_FLAG_PURGED)) {
+            memset(&(batch->detail[batch->count]), 0, sizeof(MessageDetail));
+            batch->message[batch->count] = message;
+            batch->status[batch->count] = 0;
+            batch->detail[batch->count].sequenceNumber = *currentMessage;
+
+            if (len == 0) {
+                len = snprintf(command, sizeof(command), "DETAILS %llx/%lu", message->guid, message->headerSize);
+            } else {
+                len += snprintf(command + len, sizeof(command) - len, ",%llx/%lu", message->guid, message->headerSize);
+            }
+            batch->count++;
+        } else {
+            *purgedMessage = TRUE;
         }
 
-        return(CheckForNMAPCommError(ccode));
+        (*currentMessage)++;
+    }
+
+    if ((batch->count == 0) || !(FetchRequest->flags & (F_NEED_HEADER | F_NEED_MIME))) {
+        return(STATUS_CONTINUE);
+    }
+
+    len += snprintf(command + len, sizeof(command) - len, "%s%s\r\n", (FetchRequest->flags & F_NEED_HEADER) ? " H" : "", (FetchRequest->flags & F_NEED_MIME) ? " M" : "");
+    if (NMAPSendCommand(session->store.conn, command, len) != -1) {
+        batch->requested = TRUE;
+        return(STATUS_CONTINUE);
     }
     return(STATUS_NMAP_COMM_ERROR);
 }
 
 __inline static long
-GetMimeInfo(ImapSession *session, FetchStruct *FetchRequest)
+FetchBatchReadHeader(ImapSession *session, FetchBatch *batch, unsigned long i, unsigned long length)
 {
-    long ccode;
+    MessageDetail *detail = &(batch->detail[i]);
 
-    if (FetchRequest->messageDetail.mimeInfo == NULL) {
-        FetchRequest->messageDetail.mimeInfo = g_array_new(FALSE, FALSE, sizeof(char *));
-        if (! FetchRequest->messageDetail.mimeInfo) {
-            return(STATUS_MEMORY_ERROR);
+    batch->message[i]->headerSize = length;
+    detail->header = MemMalloc(length + 1);
+    if (detail->header) {
+        if ((length == 0) || ((unsigned long)NMAPReadCount(session->store.conn, detail->header, length) == length)) {
+            if (NMAPReadCrLf(session->store.conn) == 2) {
+                detail->header[length] = '\0';
+                MakeRFC822Header(detail->header, &(batch->message[i]->headerSize));
+                return(STATUS_CONTINUE);
+            }
         }
-    } else {
-        g_array_free(FetchRequest->messageDetail.mimeInfo, TRUE);
     }
+    return(STATUS_ABORT);
+}
 
-    if (NMAPSendCommandF(session->store.conn, "MIME %llx\r\n", FetchRequest->message->guid) != -1) {
-        ccode = NMAPReadResponse(session->store.conn, session->store.response, sizeof(session->store.response), FALSE);
-        while(ccode != 1000) {
-            if ((ccode > 2001) && (ccode < 2005)) {
-                char *entry;
-                size_t len = sizeof(char) * (strlen(session->store.response) + 1);
+/* Read the reply to FetchBatchRequest(); a message the store could not
+   describe keeps the store's error code as its status */
+__inline static long
+FetchBatchRead(ImapSession *session, FetchStruct *FetchRequest, FetchBatch *batch)
+{
+    long ccode;
+    unsigned long i;
+    unsigned long length;
+    char *ptr;
+    char *entry;
+    size_t len;
 
-                entry = MemMalloc(len);
-                memcpy(entry, session->store.response, len);
+    if (!batch->requested) {
+        return(STATUS_CONTINUE);
+    }
+    batch->requested = FALSE;
 
-                g_array_append_val(FetchRequest->messageDetail.mimeInfo, entry);
-                ccode = NMAPReadResponse(session->store.conn, session->store.response, sizeof(session->store.response), FALSE);
-                continue;
-            }
-            
+    ccode = NMAPReadResponse(session->store.conn, session->store.response, sizeof(session->store.response), FALSE);
+    for (i = 0; i < batch->count; i++) {
+        /* 2001 <guid> <status> <header length> */
+        if (ccode != 2001) {
             return(CheckForNMAPCommError(ccode));
         }
 
+        if (HexToUInt64(session->store.response + 5, &ptr) != batch->message[i]->guid) {
+            return(STATUS_NMAP_COMM_ERROR);
+        }
+        batch->status[i] = strtol(ptr, &ptr, 10);
+        length = strtoul(ptr, NULL, 10);
+
+        if (batch->status[i] == 0) {
+            if (FetchRequest->flags & F_NEED_HEADER) {
+                if ((ccode = FetchBatchReadHeader(session, batch, i, length)) != STATUS_CONTINUE) {
+                    return(ccode);
+                }
+            }
+
+            if (FetchRequest->flags & F_NEED_MIME) {
+                batch->detail[i].mimeInfo = g_array_new(FALSE, FALSE, sizeof(char *));
+                if (!batch->detail[i].mimeInfo) {
+                    return(STATUS_MEMORY_ERROR);
+                }
+            }
+        }
+
+        ccode = NMAPReadResponse(session->store.conn, session->store.response, sizeof(session->store.response), FALSE);
+        while ((ccode > 2001) && (ccode < 2005) && batch->detail[i].mimeInfo) {
+            len = sizeof(char) * (strlen(session->store.response) + 1);
+            entry = MemMalloc(len);
+            if (!entry) {
+                return(STATUS_MEMORY_ERROR);
+            }
+            memcpy(entry, session->store.response, len);
+            g_array_append_val(batch->detail[i].mimeInfo, entry);
+
+            ccode = NMAPReadResponse(session->store.conn, session->store.response, sizeof(session->store.response), FALSE);
+        }
+    }
+
+    if (ccode == 1000) {
         return(STATUS_CONTINUE);
     }
+    return(CheckForNMAPCommError(ccode));
+}
 
-    return(STATUS_NMAP_COMM_ERROR);
+/* Will answering for this batch go back to the store?  If not, the request
+   for the next batch can go out before we answer the client for this one */
+__inline static BOOL
+FetchBatchNeedsStore(FetchStruct *FetchRequest, FetchBatch *batch)
+{
+    unsigned long i;
+    unsigned long j;
+    char *line;
+
+    if (FetchRequest->flags & F_NEED_STORE) {
+        return(TRUE);
+    }
+
+    if (FetchRequest->flags & F_NEED_STORE_RFC822) {
+        for (i = 0; i < batch->count; i++) {
+            if (!batch->detail[i].mimeInfo) {
+                continue;
+            }
+
+            for (j = 0; j < batch->detail[i].mimeInfo->len; j++) {
+                /* 2002 <type> <subtype> ... */
+                line = g_array_index(batch->detail[i].mimeInfo, char *, j);
+                if ((atol(line) == 2002) && (XplStrNCaseCmp(line + 5, "message rfc822 ", strlen("message rfc822 ")) == 0)) {
+                    return(TRUE);
+                }
+            }
+        }
+    }
+    return(FALSE);
+}
+
+__inline static void
+FetchBatchFree(FetchBatch *batch)
+{
+    unsigned long i;
+
+    for (i = 0; i < batch->count; i++) {
+        MessageDetailsFree(&(batch->detail[i]));
+    }
+    batch->count = 0;
 }
 
 __inline static long
@@ -3079,29 +3236,6 @@ SendResponseForFetchFlags(ImapSession *session, FetchStruct *FetchRequest)
     return(STATUS_ABORT);
 }
 
-__inline static long
-MessageDetailsGet(ImapSession *session, FetchStruct *FetchRequest)
-{
-    long ccode;
- 
-    if (FetchRequest->flags & F_NEED_HEADER) {
-        if ((ccode = GetMessageHeader(session, FetchRequest)) == 0) {
-            ;
-        } else {
-            return(ccode);
-        }
-    }
-
-    if (FetchRequest->flags & F_NEED_MIME) {
-        if ((ccode = GetMimeInfo(session, FetchRequest)) == STATUS_CONTINUE) {
-            ;
-        } else {
-            return(ccode);
-        }
-    }
-    return(STATUS_CONTINUE);
-}
-
 __inline static long
 SetSeenFlag(ImapSession *session, FetchStruct *FetchRequest)
 {
@@ -3113,54 +3247,79 @@ SetSeenFlag(ImapSession *session, FetchStruct *FetchRequest)
 }
 
 __inline static long
-SendResponseForMessage(ImapSession *session, FetchStruct *FetchRequest)
+SendResponseForBatch(ImapSession *session, FetchStruct *FetchRequest, FetchBatch *batch)
 {
     long ccode;
+    unsigned long i;
 
-    if ((ccode = SetSeenFlag(session, FetchRequest)) == STATUS_CONTINUE) {
-        if ((ccode = MessageDetailsGet(session, FetchRequest)) == STATUS_CONTINUE) {
-            ccode = SendResponseForFetchFlags(session, FetchRequest);
-            MessageDetailsFree(&(FetchRequest->messageDetail));
+    for (i = 0; i < batch->count; i++) {
+        FetchRequest->message = batch->message[i];
+        FetchRequest->messageDetail = batch->detail[i];
+        memset(&(batch->detail[i]), 0, sizeof(MessageDetail));
+
+        if (batch->status[i] == 0) {
+            if ((ccode = SetSeenFlag(session, FetchRequest)) == STATUS_CONTINUE) {
+                ccode = SendResponseForFetchFlags(session, FetchRequest);
+            }
+        } else {
+            ccode = CheckForNMAPCommError(batch->status[i]);
         }
-    }
-    return(ccode);
-}
 
-__inline static BOOL
-MessageStillExists(FetchStruct *FetchRequest)
-{
-    if (!(FetchRequest->message->flags & STORE_MSG_FLAG_PURGED)) {
-        return(TRUE);
+        MessageDetailsFree(&(FetchRequest->messageDetail));
+        if (ccode != STATUS_CONTINUE) {
+            return(ccode);
+        }
     }
-    return(FALSE);
+    return(STATUS_CONTINUE);
 }
 
-
 __inline static long
 SendResponseForMessageRange(ImapSession *session, FetchStruct *FetchRequest, unsigned long rangeStart, unsigned long rangeEnd, BOOL *purgedMessage)
 {
     long ccode;
     unsigned long currentMessage;
+    FetchBatch batch[2];
+    FetchBatch *current = &(batch[0]);
+    FetchBatch *next = &(batch[1]);
+    FetchBatch *tmp;
+    BOOL pipeline;
 
+    memset(batch, 0, sizeof(batch));
     currentMessage = rangeStart;
-    ccode = STATUS_CONTINUE;
 
-    do {
-        FetchRequest->message = &(session->folder.selected.message[currentMessage]);
-        FetchRequest->messageDetail.sequenceNumber = currentMessage;
+    ccode = FetchBatchRequest(session, FetchRequest, current, &currentMessage, rangeEnd, purgedMessage);
+    while ((ccode == STATUS_CONTINUE) && (current->count > 0)) {
+        if ((ccode = FetchBatchRead(session, FetchRequest, current)) != STATUS_CONTINUE) {
+            break;
+        }
 
-        if (MessageStillExists(FetchRequest)) {
-            if ((ccode = SendResponseForMessage(session, FetchRequest)) == STATUS_CONTINUE) {
-                currentMessage++;
-                continue;
+        pipeline = !FetchBatchNeedsStore(FetchRequest, current);
+        if (pipeline) {
+            if ((ccode = FetchBatchRequest(session, FetchRequest, next, &currentMessage, rangeEnd, purgedMessage)) != STATUS_CONTINUE) {
+                break;
+            }
+        }
+
+        if ((ccode = SendResponseForBatch(session, FetchRequest, current)) != STATUS_CONTINUE) {
+            /* don't leave a reply behind on the store connection */
+            if (FetchBatchRead(session, FetchRequest, next) != STATUS_CONTINUE) {
+                ccode = STATUS_NMAP_COMM_ERROR;
             }
             break;
         }
 
-        currentMessage++;
-        *purgedMessage = TRUE;
-    } while (currentMessage <= rangeEnd);
+        if (!pipeline) {
+            ccode = FetchBatchRequest(session, FetchRequest, next, &currentMessage, rangeEnd, purgedMessage);
+        }
+
+        tmp = current;
+        current = next;
+        next = tmp;
+        next->count = 0;
+    }
 
+    FetchBatchFree(current);
+    FetchBatchFree(next);
     return(ccode);
 }
 
@@ -3181,6 +3340,11 @@ ImapCommandFetch(void *param)
             memset(&FetchRequest, 0, sizeof(FetchRequest));
       
             FetchRequest.flags = ParseFetchArguments(session, session->command.buffer + 6, &FetchRequest); 
+            if (FetchRequest.changedSince.vanished) {
+                /* only meaningful with uids (rfc5162) */
+                FetchRequest.flags |= F_PARSE_ERROR;
+            }
+
             if (!(FetchRequest.flags & F_ERROR)) {
                 nextRange = FetchRequest.messageSet;
 
@@ -3225,6 +3389,7 @@ ImapCommandUidFetch(void *param)
     unsigned long rangeStart;
     unsigned long rangeEnd;
     BOOL purgedMessage = FALSE;
+    BOOL expunged;
     FetchFlagStruct *firstFlag;
 
     if ((ccode = CheckState(session, STATE_SELECTED)) == STATUS_CONTINUE) {
@@ -3239,6 +3404,17 @@ ImapCommandUidFetch(void *param)
             if (firstFlag) {
                 FetchRequest.flags = ParseFetchArguments(session, session->command.buffer + 6, &FetchRequest); 
                 if (!(FetchRequest.flags & F_ERROR)) {
+                    if (FetchRequest.changedSince.vanished) {
+                        ccode = FolderSendChanges(session, FetchRequest.changedSince.modseq, NULL, FALSE, &expunged);
+                        if ((ccode == STATUS_CONTINUE) && expunged) {
+                            ccode = FolderSendVanished(session, FetchRequest.messageSet);
+                        }
+
+                        if (ccode != STATUS_CONTINUE) {
+                            FreeFetchResourcesFailure(&FetchRequest);
+                            return(SendError(session->client.conn, session->command.tag, "UID FETCH", ccode));
+                        }
+                    }
 
                     nextRange = FetchRequest.messageSet;
 
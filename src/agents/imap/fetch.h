@@ -42,12 +42,17 @@
 #define F_BODY_HEADER_FIELDS_NOT (1<<20)
 #define F_BODY_PART (1<<21)
 #define F_BODY_SEEN (1<<22) 
+#define F_MODSEQ (1<<23)
 
 #define F_PARSE_ERROR (1<<30)
 #define F_SYSTEM_ERROR (1<<31)
 
 #define F_NEED_HEADER (F_BODY_HEADER | F_BODY_HEADER_PARTIAL | F_RFC822_HEADER | F_RFC822_BOTH | F_ENVELOPE | F_BODY_HEADER_FIELDS | F_BODY_HEADER_FIELDS_NOT | F_BODY_MIME | F_BODY_MIME_PARTIAL)
 #define F_NEED_MIME (F_BODY_PART | F_BODYSTRUCTURE | F_BODY)
+/* responders for these go back to the store for more than the header and mime report */
+#define F_NEED_STORE (F_RFC822_TEXT | F_RFC822_BOTH | F_BODY_TEXT | F_BODY_TEXT_PARTIAL | F_BODY_BOTH | F_BODY_BOTH_PARTIAL | F_BODY_PART | F_BODY_SEEN | F_XSENDER)
+/* and these only for the header of a message/rfc822 part */
+#define F_NEED_STORE_RFC822 (F_BODYSTRUCTURE | F_BODY)
 
 #define F_ERROR (F_PARSE_ERROR | F_SYSTEM_ERROR)
 
@@ -95,6 +100,17 @@ typedef struct {
     GArray *mimeInfo;
 } MessageDetail;
 
+/* headers and mime reports are requested from the store for this many messages at a time */
+#define FETCH_BATCH_SIZE 32
+
+typedef struct {
+    unsigned long count;
+    BOOL requested;
+    MessageInformation *message[FETCH_BATCH_SIZE];
+    long status[FETCH_BATCH_SIZE];
+    MessageDetail detail[FETCH_BATCH_SIZE];
+} FetchBatch;
+
 typedef struct {
     FetchResponder responder;
 
@@ -119,6 +135,12 @@ typedef struct {
 
     MessageInformation *message;
     MessageDetail messageDetail;
+
+    struct {
+        BOOL requested;                                     /* only messages changed since modseq */
+        uint64_t modseq;
+        BOOL vanished;                                      /* report expunges too (rfc5162)    */
+    } changedSince;
 } FetchStruct;
 
 typedef unsigned long (* FetchFlagParser)(unsigned char **ptr, FetchFlagStruct *flag);
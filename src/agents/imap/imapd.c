@@ -83,6 +83,9 @@ static ProtocolCommand ImapProtocolCommands[] = {
     { IMAP_COMMAND_GETQUOTA, IMAP_HELP_NOT_DEFINED, sizeof(IMAP_COMMAND_GETQUOTA) - 1, ImapCommandGetQuota, NULL, NULL },
     { IMAP_COMMAND_GETQUOTAROOT, IMAP_HELP_NOT_DEFINED, sizeof(IMAP_COMMAND_GETQUOTAROOT) - 1, ImapCommandGetQuotaRoot, NULL, NULL },
     { IMAP_COMMAND_NAMESPACE, IMAP_HELP_NOT_DEFINED, sizeof(IMAP_COMMAND_NAMESPACE) - 1, ImapCommandNameSpace, NULL, NULL },
+    { IMAP_COMMAND_IDLE, IMAP_HELP_NOT_DEFINED, sizeof(IMAP_COMMAND_IDLE) - 1, ImapCommandIdle, NULL, NULL },
+    { IMAP_COMMAND_ENABLE, IMAP_HELP_NOT_DEFINED, sizeof(IMAP_COMMAND_ENABLE) - 1, ImapCommandEnable, NULL, NULL },
+    { IMAP_COMMAND_COMPRESS, IMAP_HELP_NOT_DEFINED, sizeof(IMAP_COMMAND_COMPRESS) - 1, ImapCommandCompress, NULL, NULL },
     { NULL, NULL, 0, NULL, NULL, NULL }
 };
 
@@ -425,12 +428,36 @@ FolderSendStatus(Connection *conn, OpenedFolder *folder)
                            (unsigned long)(folder->info->guid & 0x00000000FFFFFFFF),
                            (unsigned long)folder->info->uidNext);
     }
+
+    if (ccode != -1) {
+        ccode = ConnWriteF(conn, "* OK [HIGHESTMODSEQ %llu] Highest\r\n", (unsigned long long)folder->highestModseq);
+    }
+
     if (ccode != -1) {
         return(STATUS_CONTINUE);
     }
     return(STATUS_ABORT);
 }
 
+/* IMAP modseqs are the store's plus one, which leaves 1 for messages that
+   haven't changed since the folder's change log began (rfc4551 reserves 0) */
+long
+FolderGetHighestModseq(Connection *storeConn, OpenedFolder *openFolder)
+{
+    long ccode;
+    char reply[64];
+
+    if (NMAPSendCommandF(storeConn, "CHANGES %llx\r\n", openFolder->info->guid) != -1) {
+        ccode = NMAPReadResponse(storeConn, reply, sizeof(reply), TRUE);
+        if (ccode == 1000) {
+            openFolder->highestModseq = strtoull(reply, NULL, 10) + 1;
+            return(STATUS_CONTINUE);
+        }
+        return(CheckForNMAPCommError(ccode));
+    }
+    return(STATUS_NMAP_COMM_ERROR);
+}
+
 long
 FolderOpen(Connection *storeConn, OpenedFolder *openFolder, FolderInformation *folder, BOOL readOnly)
 {
@@ -442,7 +469,11 @@ FolderOpen(Connection *storeConn, OpenedFolder *openFolder, FolderInformation *f
         ccode = FolderGetHighestUid(storeConn, folder, &highestUid);
         if (ccode == STATUS_CONTINUE) {
             openFolder->info = folder;
-            ccode = MessageListLoad(storeConn, openFolder);
+            /* asked before the list, so a change made in between is reported again rather than missed */
+            ccode = FolderGetHighestModseq(storeConn, openFolder);
+            if (ccode == STATUS_CONTINUE) {
+                ccode = MessageListLoad(storeConn, openFolder);
+            }
             if (ccode == STATUS_CONTINUE) {
                 /* the nmap.mail.imapuid property is managed by the store agent.  */
                 /* On a collection, this property contains the highest uid ever assigned */
@@ -460,6 +491,42 @@ FolderOpen(Connection *storeConn, OpenedFolder *openFolder, FolderInformation *f
     return(ccode);
 }
 
+/* Like FolderOpen, but only finds out what STATUS needs from the totals
+   the store keeps, rather than loading every message in the folder. */
+__inline static long
+FolderCount(Connection *storeConn, OpenedFolder *openFolder, FolderInformation *folder)
+{
+    char reply[1024];
+    long ccode;
+    uint32_t highestUid = 0;
+    unsigned long messages;
+    unsigned long unseen;
+
+    ccode = FolderGetHighestUid(storeConn, folder, &highestUid);
+    if (ccode == STATUS_CONTINUE) {
+        if (NMAPSendCommandF(storeConn, "STATUS %llx\r\n", folder->guid) != -1) {
+            ccode = NMAPReadResponse(storeConn, reply, sizeof(reply), TRUE);
+            if (ccode == 1000) {
+                if (sscanf(reply, "%lu %lu", &messages, &unseen) == 2) {
+                    openFolder->info = folder;
+                    openFolder->messageCount = messages;
+                    openFolder->unseenCount = unseen;
+                    if ((messages == 0) || (folder->uidNext <= highestUid)) {
+                        folder->uidNext = highestUid + 1;
+                    }
+                    openFolder->readOnly = TRUE;
+                    return(STATUS_CONTINUE);
+                }
+                return(STATUS_NMAP_PROTOCOL_ERROR);
+            }
+            return(CheckForNMAPCommError(ccode));
+        }
+        return(STATUS_NMAP_COMM_ERROR);
+    }
+
+    return(ccode);
+}
+
 __inline static long
 FolderSelect(ImapSession *session, char *folderName, BOOL readOnly)
 {
@@ -731,32 +798,29 @@ MessageListReset(OpenedFolder *folder)
     return(STATUS_MEMORY_ERROR);
 }
 
-static int
-CompareMessageInformation(const void *param1, const void *param2)
-{
-    MessageInformation *msg1 = (MessageInformation *)param1;
-    MessageInformation *msg2 = (MessageInformation *)param2;
-
-    return(msg1->uid - msg2->uid);
-}
-
 long
 MessageListLoad(Connection *storeConn, OpenedFolder *folder)
 {
     char reply[1024];
     long ccode;
     long headerSize;
+    uint64_t modseq;
 
     if ((ccode = MessageListReset(folder)) == STATUS_CONTINUE) {
-        if (NMAPSendCommandF(storeConn, "LIST %llx Pnmap.mail.headersize\r\n", folder->info->guid) != -1) {
+        /* the store sorts them by uid for us */
+        if (NMAPSendCommandF(storeConn, "LIST %llx Ouid Pnmap.mail.headersize,nmap.modseq\r\n", folder->info->guid) != -1) {
             for (;;) {
                 ccode = NMAPReadResponse(storeConn, reply, sizeof(reply), TRUE);
                 if (ccode == 2001) {
                     ccode = NMAPReadDecimalPropertyResponse(storeConn, "nmap.mail.headersize", &headerSize);
                     if (ccode == 2001) {
+                        if ((ccode = ReadModseqPropertyResponse(storeConn, &modseq)) != STATUS_CONTINUE) {
+                            return(ccode);
+                        }
+
                         // don't look at mails which are obviously bad. Bug #11199
                         if (headerSize > 0) {
-                            ccode = MessageListAddMessage(folder, reply, headerSize);
+                            ccode = MessageListAddMessage(folder, reply, headerSize, modseq);
                         } else {
                             // ignore this for now - we need to log a message
                             // bug #11200
@@ -765,7 +829,11 @@ MessageListLoad(Connection *storeConn, OpenedFolder *folder)
                     }
 
                     if (ccode == 3245) {
-                        ccode = MessageListAddMessage(folder, reply, 0);
+                        if ((ccode = ReadModseqPropertyResponse(storeConn, &modseq)) != STATUS_CONTINUE) {
+                            return(ccode);
+                        }
+
+                        ccode = MessageListAddMessage(folder, reply, 0, modseq);
                         continue;
                     }
 
@@ -780,8 +848,6 @@ MessageListLoad(Connection *storeConn, OpenedFolder *folder)
                 return(CheckForNMAPCommError(ccode));
             }
 
-            qsort(folder->message, folder->messageCount, sizeof(MessageInformation), CompareMessageInformation);
-
             return(STATUS_CONTINUE);
         }
         return(STATUS_NMAP_COMM_ERROR);
@@ -892,6 +958,264 @@ ImapCommandLogout(void *param)
 
 /********** IMAP session commands - authenticated state **********/
 
+int
+ImapCommandEnable(void *param)
+{
+    ImapSession *session = (ImapSession *)param;
+    unsigned long requested = 0;
+    unsigned long enabled;
+    char *ptr;
+
+    if (CheckState(session, STATE_AUTH) == STATUS_CONTINUE) {
+        ptr = session->command.buffer + strlen("ENABLE");
+        while (*ptr == ' ') {
+            ptr++;
+            if ((XplStrNCaseCmp(ptr, "CONDSTORE", strlen("CONDSTORE")) == 0) && ((ptr[strlen("CONDSTORE")] == ' ') || (ptr[strlen("CONDSTORE")] == '\0'))) {
+                requested |= IMAP_ENABLED_CONDSTORE;
+            } else if ((XplStrNCaseCmp(ptr, "QRESYNC", strlen("QRESYNC")) == 0) && ((ptr[strlen("QRESYNC")] == ' ') || (ptr[strlen("QRESYNC")] == '\0'))) {
+                requested |= IMAP_ENABLED_QRESYNC;
+            }
+
+            /* extensions we don't know are ignored (rfc5161) */
+            while (*ptr && (*ptr != ' ')) {
+                ptr++;
+            }
+        }
+
+        /* only what this command newly turned on is reported */
+        enabled = requested & ~(session->client.enabled);
+        session->client.enabled |= requested;
+        if (requested & IMAP_ENABLED_QRESYNC) {
+            session->client.enabled |= IMAP_ENABLED_CONDSTORE;
+        }
+
+        if (ConnWriteF(session->client.conn, "* ENABLED%s%s\r\n", 
+                       (enabled & IMAP_ENABLED_CONDSTORE) ? " CONDSTORE" : "", 
+                       (enabled & IMAP_ENABLED_QRESYNC) ? " QRESYNC" : "") != -1) {
+            return(SendOk(session, "ENABLE"));
+        }
+        return(STATUS_ABORT);
+    }
+    return(SendError(session->client.conn, session->command.tag, "ENABLE", STATUS_INVALID_STATE));
+}
+
+typedef struct {
+    BOOL requested;
+    unsigned long uidValidity;                              /* what the client last saw         */
+    uint64_t modseq;
+    char *knownUids;                                        /* NULL when not given              */
+} QResyncParameters;
+
+/* SELECT and EXAMINE take "(CONDSTORE)" (rfc4551) or, once enabled,
+   "(QRESYNC (<uidvalidity> <modseq> [<known uids>] [(<seqs> <uids>)]))" (rfc5162) */
+static long
+ParseSelectParameters(ImapSession *session, char *ptr, QResyncParameters *qresync)
+{
+    char *knownUidsEnd = NULL;
+
+    memset(qresync, 0, sizeof(QResyncParameters));
+
+    while (*ptr == ' ') {
+        ptr++;
+    }
+
+    if (*ptr == '\0') {
+        return(STATUS_CONTINUE);
+    }
+
+    if (XplStrNCaseCmp(ptr, "(CONDSTORE)", strlen("(CONDSTORE)")) == 0) {
+        session->client.enabled |= IMAP_ENABLED_CONDSTORE;
+        return(STATUS_CONTINUE);
+    }
+
+    if (!(session->client.enabled & IMAP_ENABLED_QRESYNC) || (XplStrNCaseCmp(ptr, "(QRESYNC (", strlen("(QRESYNC (")) != 0)) {
+        return(STATUS_INVALID_ARGUMENT);
+    }
+    ptr += strlen("(QRESYNC (");
+
+    qresync->uidValidity = strtoul(ptr, &ptr, 10);
+    if (*ptr != ' ') {
+        return(STATUS_INVALID_ARGUMENT);
+    }
+
+    qresync->modseq = strtoull(ptr + 1, &ptr, 10);
+    if (qresync->modseq == 0) {
+        return(STATUS_INVALID_ARGUMENT);
+    }
+
+    if ((*ptr == ' ') && (isdigit(ptr[1]) || (ptr[1] == '*'))) {
+        qresync->knownUids = ptr + 1;
+        ptr = knownUidsEnd = qresync->knownUids + strspn(qresync->knownUids, "0123456789:,*");
+    }
+
+    /* the sequence match data only saves us work we don't do */
+    if ((*ptr == ' ') && (ptr[1] == '(')) {
+        if ((ptr = strchr(ptr, ')')) == NULL) {
+            return(STATUS_INVALID_ARGUMENT);
+        }
+        ptr++;
+    }
+
+    if ((ptr[0] != ')') || (ptr[1] != ')')) {
+        return(STATUS_INVALID_ARGUMENT);
+    }
+
+    if (knownUidsEnd) {
+        *knownUidsEnd = '\0';
+    }
+    qresync->requested = TRUE;
+    return(STATUS_CONTINUE);
+}
+
+/* Tell the client what happened to the selected folder since the modseq it
+   last saw, from the store's change log; messages the change log reports
+   which arrived after the folder was loaded are left to the NEW event. */
+long
+FolderSendChanges(ImapSession *session, uint64_t since, char *knownUids, BOOL sendFetch, BOOL *expunged)
+{
+    long ccode;
+    long result = STATUS_CONTINUE;
+    char reply[1024];
+    unsigned long uid;
+    unsigned long sequence;
+    unsigned long count;
+    MessageInformation *message;
+    OpenedFolder *folder = &session->folder.selected;
+
+    *expunged = FALSE;
+    if (since >= folder->highestModseq) {
+        return(STATUS_CONTINUE);
+    }
+
+    /* the client's modseq 0 is before anything the store has logged */
+    if (since > 0) {
+        if (NMAPSendCommandF(session->store.conn, "CHANGES %llx %llu\r\n", folder->info->guid, (unsigned long long)(since - 1)) == -1) {
+            return(STATUS_NMAP_COMM_ERROR);
+        }
+
+        for (;;) {
+            ccode = NMAPReadResponse(session->store.conn, reply, sizeof(reply), TRUE);
+            if (ccode == 2001) {
+                /* <guid> <modseq> <kind> <uid> <flags>, with a uid of 0 once the document has gone */
+                if (sscanf(reply, "%*s %*s %*s %lu", &uid) == 1) {
+                    if (uid == 0) {
+                        *expunged = TRUE;
+                    } else if (sendFetch && (result == STATUS_CONTINUE) && (folder->messageCount > 0) && (UidToSequenceNum(folder->message, folder->messageCount, uid, &sequence) == STATUS_CONTINUE)) {
+                        message = &(folder->message[sequence]);
+                        if ((message->modseq > since) && (!knownUids || UidInSet(knownUids, uid, folder->info->uidNext - 1))) {
+                            result = SendFetchFlag(session->client.conn, sequence, message->flags, message->uid, message->modseq);
+                        }
+                    }
+                }
+                continue;
+            }
+
+            if (ccode == 1000) {
+                return(result);
+            }
+
+            if (ccode == 4263) {
+                break;
+            }
+            return(CheckForNMAPCommError(ccode));
+        }
+    }
+
+    /* the change log no longer reaches back that far, so anything may have gone */
+    *expunged = TRUE;
+    if (sendFetch) {
+        message = folder->message;
+        for (count = 0; count < folder->messageCount; count++, message++) {
+            if ((message->modseq > since) && (!knownUids || UidInSet(knownUids, message->uid, folder->info->uidNext - 1))) {
+                if ((result = SendFetchFlag(session->client.conn, count, message->flags, message->uid, message->modseq)) != STATUS_CONTINUE) {
+                    return(result);
+                }
+            }
+        }
+    }
+    return(STATUS_CONTINUE);
+}
+
+/* The change log doesn't keep the uids of documents that have gone, so
+   report every uid in the set the folder no longer has (rfc5162 allows
+   uids the client never saw) */
+long
+FolderSendVanished(ImapSession *session, char *uidSet)
+{
+    long ccode;
+    OpenedFolder *folder = &session->folder.selected;
+    unsigned long highest = folder->info->uidNext - 1;
+    unsigned long start;
+    unsigned long end;
+    unsigned long gapEnd;
+    unsigned long i;
+    char *separator = "* VANISHED (EARLIER) ";
+    char *ptr = uidSet;
+
+    while (ParseUidSetRange(&ptr, highest, &start, &end)) {
+        if (start == 0) {
+            start = 1;
+        }
+
+        if (end > highest) {
+            end = highest;
+        }
+
+        i = MessageListFindUid(folder->message, folder->messageCount, start);
+        while (start <= end) {
+            if ((i < folder->messageCount) && (folder->message[i].uid == start)) {
+                i++;
+                start++;
+                continue;
+            }
+
+            if ((i < folder->messageCount) && (folder->message[i].uid <= end)) {
+                gapEnd = folder->message[i].uid - 1;
+            } else {
+                gapEnd = end;
+            }
+
+            if (gapEnd == start) {
+                ccode = ConnWriteF(session->client.conn, "%s%lu", separator, start);
+            } else {
+                ccode = ConnWriteF(session->client.conn, "%s%lu:%lu", separator, start, gapEnd);
+            }
+
+            if (ccode == -1) {
+                return(STATUS_ABORT);
+            }
+            separator = ",";
+            start = gapEnd + 1;
+        }
+    }
+
+    if (*separator == ',') {
+        if (ConnWrite(session->client.conn, "\r\n", 2) == -1) {
+            return(STATUS_ABORT);
+        }
+    }
+    return(STATUS_CONTINUE);
+}
+
+__inline static long
+FolderResync(ImapSession *session, QResyncParameters *qresync)
+{
+    long ccode;
+    BOOL expunged;
+    OpenedFolder *folder = &session->folder.selected;
+
+    if (qresync->uidValidity != (unsigned long)(folder->info->guid & 0x00000000FFFFFFFF)) {
+        /* the client has to start over */
+        return(STATUS_CONTINUE);
+    }
+
+    ccode = FolderSendChanges(session, qresync->modseq, qresync->knownUids, TRUE, &expunged);
+    if ((ccode == STATUS_CONTINUE) && expunged) {
+        ccode = FolderSendVanished(session, qresync->knownUids ? qresync->knownUids : "1:*");
+    }
+    return(ccode);
+}
+
 int
 ImapCommandSelect(void *param)
 {
@@ -899,15 +1223,22 @@ ImapCommandSelect(void *param)
     long ccode;
     char *ptr;
     FolderPath path;
+    QResyncParameters qresync;
 
     if ((ccode = CheckState(session, STATE_AUTH)) == STATUS_CONTINUE) {
         ccode = GetPathArgument(session, session->command.buffer + strlen("SELECT"), &ptr, &path, FALSE);
         if (ccode == STATUS_CONTINUE) {
-            ccode = FolderListLoad(session);
+            ccode = ParseSelectParameters(session, ptr, &qresync);
+            if (ccode == STATUS_CONTINUE) {
+                ccode = FolderListLoad(session);
+            }
             if (ccode == STATUS_CONTINUE) {
                 ccode = FolderSelect(session, path.name, FALSE);
                 if (ccode == STATUS_CONTINUE) {
                     ccode = FolderSendStatus(session->client.conn, &session->folder.selected);
+                    if ((ccode == STATUS_CONTINUE) && qresync.requested) {
+                        ccode = FolderResync(session, &qresync);
+                    }
                     if (ccode == STATUS_CONTINUE) {
                         FreePathArgument(&path);
                         return(SendOk(session, "[READ-WRITE] SELECT"));
@@ -928,15 +1259,22 @@ ImapCommandExamine(void *param)
     long ccode;
     char *ptr;
     FolderPath path;
+    QResyncParameters qresync;
 
     if ((ccode = CheckState(session, STATE_AUTH)) == STATUS_CONTINUE) {
         ccode = GetPathArgument(session, session->command.buffer + strlen("EXAMINE"), &ptr, &path, FALSE);
         if (ccode == STATUS_CONTINUE) {
-            ccode = FolderListLoad(session);
+            ccode = ParseSelectParameters(session, ptr, &qresync);
+            if (ccode == STATUS_CONTINUE) {
+                ccode = FolderListLoad(session);
+            }
             if (ccode == STATUS_CONTINUE) {
                 ccode = FolderSelect(session, path.name, TRUE);
                 if (ccode == STATUS_CONTINUE) {
                     ccode = FolderSendStatus(session->client.conn, &session->folder.selected);
+                    if ((ccode == STATUS_CONTINUE) && qresync.requested) {
+                        ccode = FolderResync(session, &qresync);
+                    }
                     if (ccode == STATUS_CONTINUE) {
                         FreePathArgument(&path);
                         return(SendOk(session, "[READ-ONLY] EXAMINE"));
@@ -1916,6 +2254,11 @@ CheckUnseen(OpenedFolder *openFolder)
     unsigned long count = openFolder->messageCount;
     unsigned long unseenCount = 0;
 
+    if (openFolder->message == NULL) {
+        /* only counted, by FolderCount */
+        return(openFolder->unseenCount);
+    }
+
     message = &openFolder->message[0];
     while (count> 0) {
         if (!(message->flags & STORE_MSG_FLAG_SEEN)) {
@@ -1928,6 +2271,12 @@ CheckUnseen(OpenedFolder *openFolder)
     return(unseenCount);
 }
 
+static unsigned long
+CheckHighestmodseq(OpenedFolder *openFolder)
+{
+    return((unsigned long)openFolder->highestModseq);
+}
+
 typedef unsigned long (* CheckResultFunction)(OpenedFolder *openFolder);
 
 typedef struct {
@@ -1942,6 +2291,7 @@ static StatusCommandOption StatusCommandOptions[] = {
     { "UIDNEXT",        sizeof("UIDNEXT") - 1,      CheckUidnext },
     { "UIDVALIDITY",    sizeof("UIDVALIDITY") - 1,  CheckUidvalidity },
     { "UNSEEN",         sizeof("UNSEEN") - 1,       CheckUnseen },
+    { "HIGHESTMODSEQ",  sizeof("HIGHESTMODSEQ") - 1, CheckHighestmodseq },
     { NULL,             0,                          0 }
 };
 
@@ -2085,8 +2435,18 @@ ImapCommandStatus(void *param)
                     if ((ccode = FolderListLoad(session)) == STATUS_CONTINUE) {
                         if ((ccode = FolderGetByName(session, folderPath.name, &folder)) == STATUS_CONTINUE) {
                             memset(&openFolder, 0, sizeof(OpenedFolder));
-                            if ((ccode = FolderOpen(session->store.conn, &openFolder, folder, TRUE)) == STATUS_CONTINUE) {
+                            /* only RECENT needs the messages themselves */
+                            if (BongoStrCaseStr((char *)items, "RECENT")) {
+                                ccode = FolderOpen(session->store.conn, &openFolder, folder, TRUE);
+                            } else {
+                                ccode = FolderCount(session->store.conn, &openFolder, folder);
+                                if ((ccode == STATUS_CONTINUE) && BongoStrCaseStr((char *)items, "HIGHESTMODSEQ")) {
+                                    ccode = FolderGetHighestModseq(session->store.conn, &openFolder);
+                                }
+                            }
+                            if (ccode == STATUS_CONTINUE) {
                                 ccode = SendStatusResponse(session->client.conn, &openFolder, items);
+                                FolderClose(&openFolder);
                             }
                         }
                     }
@@ -2290,7 +2650,7 @@ AppendFlags(Connection *storeConn, uint64_t guid, unsigned long flags, unsigned
     long ccode;
 
     if (flags) {
-        if ((ccode = StoreMessageFlag(storeConn, guid, "+", flags, resultFlags)) == STATUS_CONTINUE) {
+        if ((ccode = StoreMessageFlag(storeConn, guid, "+", flags, resultFlags, NULL, NULL)) == STATUS_CONTINUE) {
             return(STATUS_CONTINUE);
         }
         return(ccode);
@@ -2378,7 +2738,14 @@ PurgeDeletedMessages(ImapSession *session, BOOL client_response, MessageInformat
             ccode = NMAPReadResponse(store, NULL, 0, 0);
             if (ccode == 1000) {
                 if (client_response) {
-                    if (ConnWriteF(client, "* %lu EXPUNGE\r\n", count) != -1) {
+                    if (session->client.enabled & IMAP_ENABLED_QRESYNC) {
+                        /* rfc5162 */
+                        ccode = ConnWriteF(client, "* VANISHED %lu\r\n", (unsigned long)message->uid);
+                    } else {
+                        ccode = ConnWriteF(client, "* %lu EXPUNGE\r\n", count);
+                    }
+
+                    if (ccode != -1) {
                         message--;
                         count--;
                         continue;
@@ -3172,6 +3539,117 @@ ImapCommandNameSpace(void *param)
     return(STATUS_ABORT);
 }
 
+/********** IMAP Idle command rfc2177 **********/
+
+__inline static long
+IdleStoreStart(ImapSession *session, BOOL *storeIdle)
+{
+    /* the store only has events for us while a folder is selected */
+    if (session->client.state == STATE_SELECTED) {
+        if (NMAPSendCommand(session->store.conn, "IDLE\r\n", strlen("IDLE\r\n")) != -1) {
+            *storeIdle = TRUE;
+            return(STATUS_CONTINUE);
+        }
+        return(STATUS_NMAP_COMM_ERROR);
+    }
+    return(STATUS_CONTINUE);
+}
+
+__inline static long
+IdleStoreStop(ImapSession *session, BOOL *storeIdle)
+{
+    if (*storeIdle) {
+        *storeIdle = FALSE;
+        /* any events sent while we were idle are picked up by EventsCallback() */
+        if (NMAPSendCommand(session->store.conn, "DONE\r\n", strlen("DONE\r\n")) != -1) {
+            return(CheckStoreResponseCode(1000, NMAPReadResponse(session->store.conn, NULL, 0, 0)));
+        }
+        return(STATUS_NMAP_COMM_ERROR);
+    }
+    return(STATUS_CONTINUE);
+}
+
+int
+ImapCommandIdle(void *param)
+{
+    ImapSession *session = (ImapSession *)param;
+    struct pollfd pfd[2];
+    BOOL storeIdle = FALSE;
+    long ccode;
+
+    if ((ccode = CheckState(session, STATE_AUTH)) != STATUS_CONTINUE) {
+        return(SendError(session->client.conn, session->command.tag, "IDLE", ccode));
+    }
+
+    if ((ccode = EventsSend(session, STORE_EVENT_ALL)) != STATUS_CONTINUE) {
+        return(SendError(session->client.conn, session->command.tag, "IDLE", ccode));
+    }
+
+    if ((ConnWrite(session->client.conn, "+ idling\r\n", strlen("+ idling\r\n")) == -1) || (ConnFlush(session->client.conn) == -1)) {
+        return(STATUS_ABORT);
+    }
+
+    /* rather than polling the store, sleep until it tells us about a change 
+       to the selected folder or the client says DONE */
+    ccode = IdleStoreStart(session, &storeIdle);
+    while ((ccode == STATUS_CONTINUE) && !ConnLinePending(session->client.conn)) {
+        pfd[0].fd = session->client.conn->socket;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = storeIdle ? session->store.conn->socket : -1;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        /* wake up now and then to notice the server shutting down */
+        if ((poll(pfd, 2, 60 * 1000) < 0) && (errno != EINTR)) {
+            ccode = STATUS_ABORT;
+            break;
+        }
+
+        if (Imap.exiting) {
+            ccode = STATUS_ABORT;
+            break;
+        }
+
+        if (pfd[1].revents) {
+            if ((ccode = IdleStoreStop(session, &storeIdle)) == STATUS_CONTINUE) {
+                if ((ccode = EventsSend(session, STORE_EVENT_ALL)) == STATUS_CONTINUE) {
+                    if (ConnFlush(session->client.conn) != -1) {
+                        ccode = IdleStoreStart(session, &storeIdle);
+                        continue;
+                    }
+                    ccode = STATUS_ABORT;
+                }
+            }
+            break;
+        }
+
+        if (pfd[0].revents) {
+            break;
+        }
+    }
+
+    if (ccode == STATUS_CONTINUE) {
+        ccode = IdleStoreStop(session, &storeIdle);
+    }
+    if (ccode == STATUS_ABORT) {
+        return(STATUS_ABORT);
+    }
+
+    if (ReadCommandLine(session->client.conn, &(session->command.buffer), &(session->command.bufferLen)) != STATUS_CONTINUE) {
+        return(STATUS_ABORT);
+    }
+
+    if (ccode != STATUS_CONTINUE) {
+        return(SendError(session->client.conn, session->command.tag, "IDLE", ccode));
+    }
+
+    if (XplStrCaseCmp(session->command.buffer, "DONE") == 0) {
+        return(SendOk(session, "IDLE"));
+    }
+    return(SendError(session->client.conn, session->command.tag, "IDLE", STATUS_INVALID_ARGUMENT));
+}
+
 static BOOL
 HandleConnection(void *param)
 {
@@ -3376,6 +3854,7 @@ InitializeImapGlobals()
     XplSafeWrite(Imap.session.served, 0);
     XplSafeWrite(Imap.session.badPassword, 0);
     Imap.session.threads.max = 100000;
+    Imap.session.compressMax = CONN_COMPRESS_SESSIONS;
 
     /*      Imap.server.        */
     XplSafeWrite(Imap.server.active, 0);
@@ -3391,8 +3870,8 @@ InitializeImapGlobals()
     /*      Imap.command.        */    
     Imap.command.capability.acl.enabled = TRUE;
     /* FIXME: ACL ?? */
-    Imap.command.capability.len = sprintf(Imap.command.capability.message, "%s\r\n", "* CAPABILITY IMAP4 IMAP4rev1 AUTH=LOGIN NAMESPACE XSENDER");
-    Imap.command.capability.ssl.len = sprintf(Imap.command.capability.ssl.message, "%s\r\n", "* CAPABILITY IMAP4 IMAP4rev1 AUTH=LOGIN NAMESPACE STARTTLS XSENDER LOGINDISABLED");
+    Imap.command.capability.len = sprintf(Imap.command.capability.message, "%s\r\n", "* CAPABILITY IMAP4 IMAP4rev1 AUTH=LOGIN NAMESPACE IDLE ENABLE CONDSTORE QRESYNC COMPRESS=DEFLATE ESEARCH XSENDER");
+    Imap.command.capability.ssl.len = sprintf(Imap.command.capability.ssl.message, "%s\r\n", "* CAPABILITY IMAP4 IMAP4rev1 AUTH=LOGIN NAMESPACE IDLE ENABLE CONDSTORE QRESYNC COMPRESS=DEFLATE ESEARCH STARTTLS XSENDER LOGINDISABLED");
 
     Imap.command.months[0] = "Jan";
     Imap.command.months[1] = "Feb";
@@ -3717,6 +4196,7 @@ static BongoConfigItem IMAPConfig[] = {
         { BONGO_JSON_INT, "o:port/i", &Imap.server.port },
         { BONGO_JSON_INT, "o:port_ssl/i", &Imap.server.ssl.port },
         { BONGO_JSON_INT, "o:threads_max/i", &Imap.session.threads.max },
+        { BONGO_JSON_INT, "o:compress_max/i", &Imap.session.compressMax },
         { BONGO_JSON_NULL, NULL, NULL }
 };
 
@@ -3742,6 +4222,8 @@ ReadConfiguration(void)
         return FALSE;
     }
 
+    ConnCompressSetSessions(Imap.session.compressMax);
+
     return(TRUE);
 }
 
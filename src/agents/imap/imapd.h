@@ -35,6 +35,7 @@ typedef struct {
     unsigned long internalDate;
     unsigned long headerSize;
     unsigned long bodySize;
+    uint64_t modseq;
 } MessageInformation;
 
 typedef struct _ProgressUpdate {
@@ -99,6 +100,8 @@ typedef enum {
     STATUS_NMAPID_NOT_FOUND,
     STATUS_REQUESTED_MESSAGE_NO_LONGER_EXISTS,
     STATUS_IMAPID_NOT_FOUND,
+    STATUS_MESSAGE_MODIFIED,
+    STATUS_COMPRESSION_ACTIVE,
     STATUS_BUG,
 
     STATUS_MAX
@@ -142,6 +145,7 @@ static ImapErrorString ImapErrorStrings[] = {
     { STATUS_INVALID_STATE,                      "%s BAD %s invalid command in current state\r\n" },
     { STATUS_UNKNOWN_COMMAND,                    "* BAD command unrecognized\r\n" },
     { STATUS_TLS_NEGOTIATION_FAILURE,            "%s BAD %s negotiation failed\r\n" },
+    { STATUS_COMPRESSION_ACTIVE,                 "%s NO [COMPRESSIONACTIVE] %s already active\r\n" },
     { 0, NULL }
 };
 
@@ -198,6 +202,15 @@ static ImapErrorString ImapErrorStrings[] = {
 /* IMAP Namespace command rfc2342 */
 #define IMAP_COMMAND_NAMESPACE "NAMESPACE"
 
+/* IMAP Idle command rfc2177 */
+#define IMAP_COMMAND_IDLE "IDLE"
+
+/* IMAP Enable command rfc5161 */
+#define IMAP_COMMAND_ENABLE "ENABLE"
+
+/* IMAP Compress command rfc4978 */
+#define IMAP_COMMAND_COMPRESS "COMPRESS"
+
 /* non-standard commands */
 #define IMAP_COMMAND_PROXYAUTH "PROXYAUTH"  /* depricated - should use SASL */
 #define IMAP_HELP_NOT_DEFINED "%s - HELP not defined.\r\n"
@@ -212,6 +225,10 @@ static ImapErrorString ImapErrorStrings[] = {
 #define STATE_SELECTED (1<<2)
 #define STATE_EXITING (1<<3)
 
+/* Extensions turned on by ENABLE */
+#define IMAP_ENABLED_CONDSTORE (1<<0)
+#define IMAP_ENABLED_QRESYNC (1<<1)
+
 #define BUFSIZE    1023
 
 /* Minutes * 60 (1 second granularity) */
@@ -279,6 +296,8 @@ typedef struct {
     unsigned long messageCount;                             /* number of messages in folder     */
     unsigned long messageAllocated;                         /* number of message structs	*/
     unsigned long recentCount;                              /* number of messages discovered    */
+    unsigned long unseenCount;                              /* when counted but not loaded      */
+    uint64_t highestModseq;                                 /* last change the client was told  */
 } OpenedFolder;
 
 typedef struct {
@@ -299,6 +318,7 @@ typedef struct {
         Connection          *conn;                          /* client socket information        */
         int                 state;                          /* IMAP state                       */
         int                 authFailures;                   /* number of authentication failures*/
+        unsigned long       enabled;                        /* extensions turned on by ENABLE   */
     } client;
 
     struct {
@@ -353,6 +373,9 @@ typedef struct {
             XplAtomic idle;
             unsigned long max;
         } threads;
+
+        /* sessions the COMPRESS memory budget is sized for */
+        unsigned long compressMax;
         
         XplAtomic served;
         XplAtomic badPassword;
@@ -408,6 +431,9 @@ long FolderOpen(Connection *storeConn, OpenedFolder *openFolder, FolderInformati
 long FolderListLoad(ImapSession *session);
 long FolderListInitialize(ImapSession *session);
 long MessageListLoad(Connection *conn, OpenedFolder *selected);
+long FolderGetHighestModseq(Connection *storeConn, OpenedFolder *openFolder);
+long FolderSendChanges(ImapSession *session, uint64_t since, char *knownUids, BOOL sendFetch, BOOL *expunged);
+long FolderSendVanished(ImapSession *session, char *uidSet);
 
 /* progress.c */
 void DoUpdate(void);
@@ -461,5 +487,8 @@ int ImapCommandSetQuota(void *param);
 int ImapCommandGetQuota(void *param);
 int ImapCommandGetQuotaRoot(void *param);
 int ImapCommandNameSpace(void *param);
+int ImapCommandIdle(void *param);
+int ImapCommandEnable(void *param);
+int ImapCommandCompress(void *param);
 
 #include "inline.h"
@@ -382,7 +382,7 @@ RememberFlags(unsigned long *unseenFlags, unsigned long msgNum, unsigned long ms
 }
 
 __inline static long
-SendFetchFlag(Connection *conn, unsigned long sequenceNumber, unsigned long flags, unsigned long uid)
+SendFetchFlag(Connection *conn, unsigned long sequenceNumber, unsigned long flags, unsigned long uid, uint64_t modseq)
 {
     long ccode;
     char *space = "";
@@ -419,12 +419,19 @@ SendFetchFlag(Connection *conn, unsigned long sequenceNumber, unsigned long flag
         space = " ";
     }
 
-    if (!uid) {
-        ccode = ConnWrite(conn, "))\r\n", sizeof("))\r\n") - 1);
-    } else {
-        ccode = ConnWriteF(conn, ") UID %lu)\r\n", uid);
+    ccode = ConnWrite(conn, ")", 1);
+
+    if (uid) {
+        ccode = ConnWriteF(conn, " UID %lu", uid);
+    }
+
+    /* only sent once the client has asked for CONDSTORE (rfc4551) */
+    if (modseq) {
+        ccode = ConnWriteF(conn, " MODSEQ (%llu)", (unsigned long long)modseq);
     }
 
+    ccode = ConnWrite(conn, ")\r\n", 3);
+
     if (ccode != -1) {
         return(STATUS_CONTINUE);
     }
@@ -702,7 +709,27 @@ MessageListMakeSpace(OpenedFolder *folder)
 
 
 __inline static long
-MessageListAddMessage(OpenedFolder *folder, char *response, long headerSize)
+ReadModseqPropertyResponse(Connection *storeConn, uint64_t *modseq)
+{
+    long ccode;
+    long value;
+
+    ccode = NMAPReadDecimalPropertyResponse(storeConn, "nmap.modseq", &value);
+    if ((ccode == 2001) || (ccode == 3245)) {
+        /* IMAP modseqs are the store's plus one, so documents that haven't
+           changed since the change log began, and have none, are at 1 */
+        if ((ccode == 2001) && (value > 0)) {
+            *modseq = (uint64_t)value + 1;
+        } else {
+            *modseq = 1;
+        }
+        return(STATUS_CONTINUE);
+    }
+    return(CheckForNMAPCommError(ccode));
+}
+
+__inline static long
+MessageListAddMessage(OpenedFolder *folder, char *response, long headerSize, uint64_t modseq)
 {
     long ccode;
     MessageInformation *currentMessage;
@@ -724,6 +751,7 @@ MessageListAddMessage(OpenedFolder *folder, char *response, long headerSize)
 
                 currentMessage->headerSize = headerSize;
                 currentMessage->bodySize = currentMessage->size - headerSize;
+                currentMessage->modseq = modseq;
 
                 folder->messageCount++;
                 return(STATUS_CONTINUE);
@@ -863,33 +891,68 @@ FolderGetByGuid(ImapSession *session, uint64_t folderGuid, FolderInformation **f
     return(STATUS_NO_SUCH_FOLDER);
 }
 
+/* with unchangedSince, the store only makes the change if the message
+   hasn't been modified since then; modseq gets the message's new modseq.
+   Both are IMAP modseqs, one more than the store's. */
 __inline static long
-StoreMessageFlag(Connection *storeConn, uint64_t guid, char *actionString, unsigned long flags, unsigned long *newFlags)
+StoreMessageFlag(Connection *storeConn, uint64_t guid, char *actionString, unsigned long flags, unsigned long *newFlags, const uint64_t *unchangedSince, uint64_t *modseq)
 {
     long ccode;
+    long result;
     char *ptr;
-    char buffer[30];
+    char buffer[64];
     
-    if (NMAPSendCommandF(storeConn, "FLAG %llx %s%lu\r\n", guid, actionString, flags) != -1) {
-        if (newFlags) {
+    if (unchangedSince) {
+        result = NMAPSendCommandF(storeConn, "FLAG %llx %s%lu %llu\r\n", guid, actionString, flags, (unsigned long long)(*unchangedSince - 1));
+    } else {
+        result = NMAPSendCommandF(storeConn, "FLAG %llx %s%lu\r\n", guid, actionString, flags);
+    }
+
+    if (result != -1) {
+        if (newFlags || modseq) {
             if ((ccode = CheckForNMAPCommError(NMAPReadResponse(storeConn, buffer, sizeof(buffer), TRUE))) == 1000) {
+                /* the reply is "<old flags> <new flags> <modseq>" */
                 if ((ptr = strchr(buffer, ' ')) != NULL) {
-                    if (*newFlags & STORE_MSG_FLAG_RECENT) {
-                        *newFlags = (atol(ptr + 1) | STORE_MSG_FLAG_RECENT);
-                    } else {
-                        *newFlags = atol(ptr + 1);
+                    ptr++;
+                    if (newFlags) {
+                        if (*newFlags & STORE_MSG_FLAG_RECENT) {
+                            *newFlags = (atol(ptr) | STORE_MSG_FLAG_RECENT);
+                        } else {
+                            *newFlags = atol(ptr);
+                        }
+                    }
+
+                    if (modseq) {
+                        *modseq = 1;
+                        if ((ptr = strchr(ptr, ' ')) != NULL) {
+                            *modseq += strtoull(ptr + 1, NULL, 10);
+                        }
                     }
                 } else {
-                    *newFlags = 0;
+                    if (newFlags) {
+                        *newFlags = 0;
+                    }
+
+                    if (modseq) {
+                        *modseq = 1;
+                    }
                 }
                 return(STATUS_CONTINUE);
             }
+
+            if (ccode == 4264) {
+                return(STATUS_MESSAGE_MODIFIED);
+            }
             return(ccode);
         }
         
         if ((ccode = CheckForNMAPCommError(NMAPReadResponse(storeConn, NULL, 0, 0))) == 1000) {
             return(STATUS_CONTINUE);
         }
+
+        if (ccode == 4264) {
+            return(STATUS_MESSAGE_MODIFIED);
+        }
         return(ccode);
     }
     return(STATUS_NMAP_COMM_ERROR);
@@ -936,3 +999,78 @@ SearchKnownMessagesByGuid(MessageInformation *messageList, unsigned long message
     return(NULL);
 }
 
+/* read one range off a uid set like "1:5,7,9:*", where * is the highest uid */
+__inline static BOOL
+ParseUidSetRange(char **set, unsigned long highest, unsigned long *start, unsigned long *end)
+{
+    char *ptr = *set;
+    unsigned long tmp;
+
+    if (!ptr || !(isdigit(*ptr) || (*ptr == '*'))) {
+        return(FALSE);
+    }
+
+    if (*ptr == '*') {
+        *start = highest;
+        ptr++;
+    } else {
+        *start = strtoul(ptr, &ptr, 10);
+    }
+
+    *end = *start;
+    if (*ptr == ':') {
+        ptr++;
+        if (*ptr == '*') {
+            *end = highest;
+            ptr++;
+        } else {
+            *end = strtoul(ptr, &ptr, 10);
+        }
+    }
+
+    /* contents of a range are independent of the order of the range endpoints.  (rfc3501 6.4.8) */
+    if (*start > *end) {
+        tmp = *start;
+        *start = *end;
+        *end = tmp;
+    }
+
+    if (*ptr == ',') {
+        ptr++;
+    }
+    *set = ptr;
+    return(TRUE);
+}
+
+__inline static BOOL
+UidInSet(char *set, unsigned long uid, unsigned long highest)
+{
+    unsigned long start;
+    unsigned long end;
+
+    while (ParseUidSetRange(&set, highest, &start, &end)) {
+        if ((uid >= start) && (uid <= end)) {
+            return(TRUE);
+        }
+    }
+    return(FALSE);
+}
+
+/* index of the first message whose uid is at least uid */
+__inline static unsigned long
+MessageListFindUid(MessageInformation *messageList, unsigned long messageCount, unsigned long uid)
+{
+    unsigned long start = 0;
+    unsigned long end = messageCount;
+    unsigned long mean;
+
+    while (start < end) {
+        mean = start + ((end - start) >> 1);
+        if (messageList[mean].uid < uid) {
+            start = mean + 1;
+        } else {
+            end = mean;
+        }
+    }
+    return(start);
+}
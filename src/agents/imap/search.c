@@ -25,8 +25,8 @@
 #include "search.h"
 #include <bongostream.h>
 
-long SearchHandleKey(ImapSession *session, char **keyString, SearchKey *key);
-static long SearchHandleSubKey(ImapSession *session, char **keyString, SearchKey *key);
+long SearchHandleKey(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node);
+static long SearchHandleSubKey(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node);
 typedef long (* SearchRemainingMatch)(ImapSession *session, MessageInformation *message, char *arg1, void *arg2, BOOL *result);
 long ReadSourceFile(void *source, char *buffer, unsigned long maxRead);
 long ReadSourceConn(void *source, char *buffer, unsigned long maxRead);
@@ -65,7 +65,6 @@ MarkedMatchesPreserve(SearchKey *key)
 
     if (writeNum < readNum) {
         key->matchList[writeNum] = -1;
-        key->matchDropped = TRUE;
     }
 }
 
@@ -88,7 +87,6 @@ MarkedMatchesRemove(SearchKey *key)
     }
     if (writeNum < readNum) {
         key->matchList[writeNum] = -1;
-        key->matchDropped = TRUE;
     }
 }
 
@@ -133,7 +131,6 @@ SearchKeyObjectDuplicate(SearchKey *key, SearchKey *newKey)
     memset(newKey, 0, sizeof(SearchKey));
 
     strcpy(newKey->charset, key->charset);
-    newKey->matchDropped = key->matchDropped;
     newKey->messageCount = key->messageCount;
     newKey->matchList = MemMalloc((key->messageCount + 1) * sizeof(long));
     if (newKey->matchList) {
@@ -370,49 +367,28 @@ GetMessageSetArg(ImapSession *session, char **keyString, long **messageSet)
 }
 
 
+/* mark the messages the store finds the string in; it answers with */
+/* "<guid> <uid>" for each, the uid in hex */
 __inline static long
-FullListNoMatch(SearchKey *key)
-{
-    key->matchList[0] = -1;
-    return(STATUS_CONTINUE);
-}
-
-__inline static long
-FullListProcessMatch(ImapSession *session, SearchKey *key, char *response)
+FullListSubstringSearch(ImapSession *session, char *searchString, char *subcommand, long *messageSet)
 {
     long ccode;
     char *ptr;
     unsigned long sequenceNum;
 
-    ptr = strchr(response, ' ');
-    if (ptr) {
-        ptr++;
-        ccode = UidToSequenceNum(&session->folder.selected.message[0], session->folder.selected.messageCount, (uint32_t)HexToUInt64(ptr, NULL), &sequenceNum);
-        if (ccode == STATUS_CONTINUE) {
-            key->matchList[sequenceNum] = -2 - key->matchList[sequenceNum];
-            return(STATUS_CONTINUE);
-        }
-        return(ccode);
-    }
-    return(STATUS_NMAP_PROTOCOL_ERROR);
-}
-
-__inline static long
-FullListSubstringSearch(ImapSession *session, SearchKey *key, char *searchString, char *subcommand)
-{
-    long ccode;
-
     if (NMAPSendCommandF(session->store.conn, "SEARCH %llx %s \"%s\"\r\n", session->folder.selected.info->guid, subcommand, searchString) != -1) {
         for (;;) {
             ccode = NMAPReadResponse(session->store.conn, session->store.response, sizeof(session->store.response), TRUE);
             if (ccode == 2001) {
-                FullListProcessMatch(session, key, session->store.response + 5);
+                ptr = strchr(session->store.response, ' ');
+                if (ptr && (UidToSequenceNum(&session->folder.selected.message[0], session->folder.selected.messageCount, (uint32_t)HexToUInt64(ptr + 1, NULL), &sequenceNum) == STATUS_CONTINUE)) {
+                    messageSet[sequenceNum] = 1;
+                }
                 continue;
             }
             break;
         }
         if (ccode == 1000) {
-            MarkedMatchesPreserve(key);
             return(STATUS_CONTINUE);
         }
         
@@ -432,22 +408,6 @@ SearchRemainingMatchFlag(ImapSession *session, MessageInformation *message, char
     return(STATUS_CONTINUE);
 }
 
-static long
-SearchRemainingMatchFlagNot(ImapSession *session, MessageInformation *message, char *arg1, void *arg2, BOOL *found)
-{
-    unsigned long flag = (unsigned long)arg2;
-
-    *found = ((message->flags & flag) == 0);
-    return(STATUS_CONTINUE);
-}
-
-static long
-SearchRemainingMatchNew(ImapSession *session, MessageInformation *message, char *arg1, void *arg2, BOOL *found)
-{
-    *found = (((message->flags & STORE_MSG_FLAG_RECENT) != 0) && ((message->flags & STORE_MSG_FLAG_SEEN) == 0));
-    return(STATUS_CONTINUE);
-}
-
 static long
 SearchRemainingMatchBefore(ImapSession *session, MessageInformation *message, char *arg1, void *arg2, BOOL *found)
 {
@@ -536,24 +496,12 @@ SearchRemainingMatchSmaller(ImapSession *session, MessageInformation *message, c
 }
 
 static long
-SearchRemainingMatchSubstring(ImapSession *session, MessageInformation *message, char *subcommand, void *arg2, BOOL *found)
+SearchRemainingMatchModseq(ImapSession *session, MessageInformation *message, char *arg1, void *arg2, BOOL *found)
 {
-    char *searchString = (char *)arg2;
-    long ccode;
-
-    if (NMAPSendCommandF(session->store.conn, "SEARCH %llx %s \"%s\"\r\n", message->guid, subcommand, searchString) != -1) {
-        if ((ccode = NMAPReadResponse(session->store.conn, session->store.response, sizeof(session->store.response), TRUE)) == 1000) {
-            *found = FALSE;
-            return(STATUS_CONTINUE);
-        }
+    uint64_t modseq = *(uint64_t *)arg2;
 
-        if (ccode == 2001) {
-            *found = TRUE;
-            return(CheckStoreResponseCode(1000, NMAPReadResponse(session->store.conn, NULL, 0, 0)));
-        }
-        return(ccode);
-    }
-    return(STATUS_NMAP_COMM_ERROR);
+    *found = (message->modseq >= modseq);
+    return(STATUS_CONTINUE);
 }
 
 
@@ -588,7 +536,6 @@ SearchRemainingMatches(ImapSession *session, SearchKey *key, SearchRemainingMatc
 
     if (writeNum < readNum) {
         key->matchList[writeNum] = -1;
-        key->matchDropped = TRUE;
     }
     return(STATUS_CONTINUE);
 }
@@ -616,48 +563,149 @@ MessageSetAnd(ImapSession *session, SearchKey *key, long *messageSet)
 
     if (writeNum < readNum) {
         key->matchList[writeNum] = -1;
-        key->matchDropped = TRUE;
     }
     return(STATUS_CONTINUE);
 }
 
 
 
+/* search nodes begin */
+
+/* The search keys are parsed into a tree of nodes first, since literals */
+/* in the search string mean it can only be read once.  The tree is then */
+/* either answered by the store in a single query, or evaluated here. */
+
+static void
+SearchNodeFree(SearchNode *node)
+{
+    if (node) {
+        SearchNodeFree(node->left);
+        SearchNodeFree(node->right);
+        if (node->messageSet) {
+            MemFree(node->messageSet);
+        }
+        if (node->string) {
+            MemFree(node->string);
+        }
+        MemFree(node);
+    }
+}
+
+__inline static long
+SearchNodeCreate(SearchNode **node, SearchNodeType type, uint64_t value)
+{
+    *node = MemMalloc0(sizeof(SearchNode));
+    if (*node) {
+        (*node)->type = type;
+        (*node)->value = value;
+        return(STATUS_CONTINUE);
+    }
+    return(STATUS_MEMORY_ERROR);
+}
+
+/* joins two nodes under a new one; both are freed if that fails */
+__inline static long
+SearchNodeJoin(SearchNode **node, SearchNodeType type, SearchNode *left, SearchNode *right)
+{
+    long ccode;
+
+    if ((ccode = SearchNodeCreate(node, type, 0)) == STATUS_CONTINUE) {
+        (*node)->left = left;
+        (*node)->right = right;
+        return(STATUS_CONTINUE);
+    }
+    SearchNodeFree(left);
+    SearchNodeFree(right);
+    return(ccode);
+}
+
+/* a list of keys means all of them have to match */
+__inline static long
+SearchNodeAddToList(SearchNode **list, SearchNode *node)
+{
+    if (*list) {
+        return(SearchNodeJoin(list, SEARCH_NODE_AND, *list, node));
+    }
+    *list = node;
+    return(STATUS_CONTINUE);
+}
+
+__inline static long
+SearchNodeCreateFlag(SearchNode **node, unsigned long flag, BOOL set)
+{
+    long ccode;
+    SearchNode *flagNode;
+
+    if ((ccode = SearchNodeCreate(&flagNode, SEARCH_NODE_FLAG, flag)) == STATUS_CONTINUE) {
+        if (set) {
+            *node = flagNode;
+            return(STATUS_CONTINUE);
+        }
+        return(SearchNodeJoin(node, SEARCH_NODE_NOT, flagNode, NULL));
+    }
+    return(ccode);
+}
+
 __inline static long
-SubStringSearch(ImapSession *session, char **keyString, SearchKey *key, char *subcommand)
+SearchNodeCreateText(SearchNode **node, ImapSession *session, char **keyString, SearchKey *key, char *subcommand)
 {
     long ccode;
     char *utf8SearchString;
-    
+
     if ((ccode = GetSearchStringArg(session, key, keyString, &utf8SearchString)) == STATUS_CONTINUE) {
-        if (key->matchDropped) {
-            ccode = SearchRemainingMatches(session, key, SearchRemainingMatchSubstring, subcommand, utf8SearchString);
-        } else {
-            ccode = FullListSubstringSearch(session, key, utf8SearchString, subcommand);
+        if ((ccode = SearchNodeCreate(node, SEARCH_NODE_TEXT, 0)) == STATUS_CONTINUE) {
+            (*node)->string = utf8SearchString;
+            strncpy((*node)->subcommand, subcommand, sizeof((*node)->subcommand) - 1);
+            return(STATUS_CONTINUE);
         }
         MemFree(utf8SearchString);
     }
-    
-    return(ccode);    
+    return(ccode);
+}
+
+__inline static long
+SearchNodeCreateDate(SearchNode **node, ImapSession *session, char **keyString, SearchNodeType type)
+{
+    long ccode;
+    time_t date;
+
+    if ((ccode = GetDateArg(session, keyString, &date)) == STATUS_CONTINUE) {
+        return(SearchNodeCreate(node, type, (uint64_t)date));
+    }
+    return(ccode);
+}
+
+__inline static long
+SearchNodeCreateSize(SearchNode **node, ImapSession *session, char **keyString, SearchNodeType type)
+{
+    long ccode;
+    unsigned long size;
+
+    if ((ccode = GetNumericArg(session, keyString, &size)) == STATUS_CONTINUE) {
+        return(SearchNodeCreate(node, type, (uint64_t)size));
+    }
+    return(ccode);
 }
 
+/* search nodes end */
+
 
 /* key handlers begin */
 
 static long
-SearchKeyHandlerAll(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerAll(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(STATUS_CONTINUE);
+    return(SearchNodeCreate(node, SEARCH_NODE_ALL, 0));
 }
 
 static long
-SearchKeyHandlerAnswered(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerAnswered(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SearchRemainingMatches(session, key, SearchRemainingMatchFlag, NULL, (void *)STORE_MSG_FLAG_ANSWERED));
+    return(SearchNodeCreateFlag(node, STORE_MSG_FLAG_ANSWERED, TRUE));
 }
 
 static long
-SearchKeyHandlerBcc(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerBcc(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
     long ccode;
     char *utf8SearchString;
@@ -665,77 +713,70 @@ SearchKeyHandlerBcc(ImapSession *session, char **keyString, SearchKey *key)
     if ((ccode = GetSearchStringArg(session, key, keyString, &utf8SearchString)) == STATUS_CONTINUE) {
         MemFree(utf8SearchString);
         /* The bcc field does not exist to search */
-        return(FullListNoMatch(key));
+        return(SearchNodeCreate(node, SEARCH_NODE_NONE, 0));
     }
     return(ccode);
 }
 
 static long
-SearchKeyHandlerBefore(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerBefore(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    time_t date;
-    long ccode;
-        
-    if ((ccode = GetDateArg(session, keyString, &date)) == STATUS_CONTINUE) {
-        ccode = SearchRemainingMatches(session, key, SearchRemainingMatchBefore, NULL, &date);
-    }
-    return(ccode);
+    return(SearchNodeCreateDate(node, session, keyString, SEARCH_NODE_BEFORE));
 }
 
-
 static long
-SearchKeyHandlerBody(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerBody(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SubStringSearch(session, keyString, key, "BODY"));
+    return(SearchNodeCreateText(node, session, keyString, key, "BODY"));
 }
 
 static long
-SearchKeyHandlerCc(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerCc(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SubStringSearch(session, keyString, key, "HEADER CC"));
+    return(SearchNodeCreateText(node, session, keyString, key, "HEADER CC"));
 }
 
 static long
-SearchKeyHandlerDeleted(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerDeleted(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SearchRemainingMatches(session, key, SearchRemainingMatchFlag, NULL, (void *)STORE_MSG_FLAG_DELETED));
+    return(SearchNodeCreateFlag(node, STORE_MSG_FLAG_DELETED, TRUE));
 }
 
 static long
-SearchKeyHandlerDraft(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerDraft(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SearchRemainingMatches(session, key, SearchRemainingMatchFlag, NULL, (void *)STORE_MSG_FLAG_DRAFT));
+    return(SearchNodeCreateFlag(node, STORE_MSG_FLAG_DRAFT, TRUE));
 }
 
 static long
-SearchKeyHandlerFlagged(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerFlagged(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SearchRemainingMatches(session, key, SearchRemainingMatchFlag, NULL, (void *)STORE_MSG_FLAG_FLAGGED));
+    return(SearchNodeCreateFlag(node, STORE_MSG_FLAG_FLAGGED, TRUE));
 }
 
 static long
-SearchKeyHandlerFrom(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerFrom(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SubStringSearch(session, keyString, key, "HEADER FROM"));
+    return(SearchNodeCreateText(node, session, keyString, key, "HEADER FROM"));
 }
 
 static long
-SearchKeyHandlerHeader(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerHeader(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
     long ccode;
     unsigned char *headerName;
-    char substring[SEARCH_MAX_UTF8_STRING];
+    char subcommand[SEARCH_MAX_SUBCOMMAND];
 
     if((ccode = GrabArgumentEx(session, (unsigned char **)keyString, &headerName, TRUE)) == STATUS_CONTINUE) {
-        snprintf(substring, sizeof(substring), "HEADER %s", headerName);
+        snprintf(subcommand, sizeof(subcommand), "HEADER %s", headerName);
         MemFree(headerName);
-        return(SubStringSearch(session, keyString, key, substring));
+        return(SearchNodeCreateText(node, session, keyString, key, subcommand));
     }
     return(ccode);
 }
 
 static long
-SearchKeyHandlerKeyword(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerKeyword(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
     long ccode;
     char *utf8SearchString;
@@ -743,220 +784,203 @@ SearchKeyHandlerKeyword(ImapSession *session, char **keyString, SearchKey *key)
     if ((ccode = GetSearchStringArg(session, key, keyString, &utf8SearchString)) == STATUS_CONTINUE) {
         MemFree(utf8SearchString);
         /* this implementation does not support keywords so no message will match */
-        return(FullListNoMatch(key));
+        return(SearchNodeCreate(node, SEARCH_NODE_NONE, 0));
     }
     return(ccode);
 }
 
 static long
-SearchKeyHandlerLarger(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerLarger(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    unsigned long size;
-    long ccode;
-        
-    if ((ccode = GetNumericArg(session, keyString, &size)) == STATUS_CONTINUE) {
-        ccode = SearchRemainingMatches(session, key, SearchRemainingMatchLarger, NULL, (void *)size);
-    }
-    return(ccode);
+    return(SearchNodeCreateSize(node, session, keyString, SEARCH_NODE_LARGER));
 }
 
 static long
-SearchKeyHandlerNew(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerModseq(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SearchRemainingMatches(session, key, SearchRemainingMatchNew, NULL, NULL));
+    char *ptr;
+    uint64_t modseq;
+
+    /* there is only one modseq per message, so the entry name and type are skipped */
+    if (**keyString == '"') {
+        if (((ptr = strchr(*keyString + 1, '"')) == NULL) || (ptr[1] != ' ') || ((ptr = strchr(ptr + 2, ' ')) == NULL)) {
+            return(STATUS_INVALID_ARGUMENT);
+        }
+        *keyString = ptr + 1;
+    }
+
+    if (!isdigit(**keyString)) {
+        return(STATUS_INVALID_ARGUMENT);
+    }
+
+    modseq = strtoull(*keyString, keyString, 10);
+    key->modseq = TRUE;
+    session->client.enabled |= IMAP_ENABLED_CONDSTORE;
+    return(SearchNodeCreate(node, SEARCH_NODE_MODSEQ, modseq));
 }
 
 static long
-SearchKeyHandlerNot(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerNew(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
     long ccode;
-    SearchKey newKey;
+    SearchNode *recent;
+    SearchNode *unseen;
 
-    if ((ccode = SearchKeyObjectDuplicate(key, &newKey)) == STATUS_CONTINUE) {
-        if ((ccode = SearchHandleKey(session, keyString, &newKey)) == STATUS_CONTINUE) {
-            MarkMatches(key, &newKey);
-            MarkedMatchesRemove(key);
+    if ((ccode = SearchNodeCreateFlag(&recent, STORE_MSG_FLAG_RECENT, TRUE)) == STATUS_CONTINUE) {
+        if ((ccode = SearchNodeCreateFlag(&unseen, STORE_MSG_FLAG_SEEN, FALSE)) == STATUS_CONTINUE) {
+            return(SearchNodeJoin(node, SEARCH_NODE_AND, recent, unseen));
         }
-        SearchKeyObjectFree(&newKey);
+        SearchNodeFree(recent);
     }
     return(ccode);
 }
 
 static long
-SearchKeyHandlerOld(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerNot(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SearchRemainingMatches(session, key, SearchRemainingMatchFlagNot, NULL, (void *)STORE_MSG_FLAG_RECENT));
-}
-
-static long
-SearchKeyHandlerOn(ImapSession *session, char **keyString, SearchKey *key)
-{
-    time_t date;
     long ccode;
-        
-    if ((ccode = GetDateArg(session, keyString, &date)) == STATUS_CONTINUE) {
-        ccode = SearchRemainingMatches(session, key, SearchRemainingMatchOn, NULL, &date);
+    SearchNode *child;
+
+    if ((ccode = SearchHandleKey(session, keyString, key, &child)) == STATUS_CONTINUE) {
+        return(SearchNodeJoin(node, SEARCH_NODE_NOT, child, NULL));
     }
     return(ccode);
 }
 
 static long
-SearchKeyHandlerOr(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerOld(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    long ccode;
-    SearchKey leftKey;
-    SearchKey rightKey;
+    return(SearchNodeCreateFlag(node, STORE_MSG_FLAG_RECENT, FALSE));
+}
 
-    if ((ccode = SearchKeyObjectDuplicate(key, &leftKey)) == STATUS_CONTINUE) {
-        if ((ccode = SearchHandleKey(session, keyString, &leftKey)) == STATUS_CONTINUE) {
+static long
+SearchKeyHandlerOn(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
+{
+    return(SearchNodeCreateDate(node, session, keyString, SEARCH_NODE_ON));
+}
 
-            ccode = STATUS_INVALID_ARGUMENT; 
-            if (**keyString == ' ') {
-                (*keyString)++;
-                if ((ccode = SearchKeyObjectDuplicate(key, &rightKey)) == STATUS_CONTINUE) {
-                    if ((ccode = SearchHandleKey(session, keyString, &rightKey)) == STATUS_CONTINUE) {
-                        MarkMatches(key, &leftKey);
-                        MarkMatches(key, &rightKey);
-                        MarkedMatchesPreserve(key);
-                    }
-                    SearchKeyObjectFree(&rightKey);
-                }
+static long
+SearchKeyHandlerOr(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
+{
+    long ccode;
+    SearchNode *left;
+    SearchNode *right;
+
+    if ((ccode = SearchHandleKey(session, keyString, key, &left)) == STATUS_CONTINUE) {
+        ccode = STATUS_INVALID_ARGUMENT; 
+        if (**keyString == ' ') {
+            (*keyString)++;
+            if ((ccode = SearchHandleKey(session, keyString, key, &right)) == STATUS_CONTINUE) {
+                return(SearchNodeJoin(node, SEARCH_NODE_OR, left, right));
             }
         }
-        SearchKeyObjectFree(&leftKey);
+        SearchNodeFree(left);
     }
     return(ccode);
 }
 
 static long
-SearchKeyHandlerRecent(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerRecent(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SearchRemainingMatches(session, key, SearchRemainingMatchFlag, NULL, (void *)STORE_MSG_FLAG_RECENT));
+    return(SearchNodeCreateFlag(node, STORE_MSG_FLAG_RECENT, TRUE));
 }
 
 static long
-SearchKeyHandlerSeen(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerSeen(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SearchRemainingMatches(session, key, SearchRemainingMatchFlag, NULL, (void *)STORE_MSG_FLAG_SEEN));
+    return(SearchNodeCreateFlag(node, STORE_MSG_FLAG_SEEN, TRUE));
 }
 
 static long
-SearchKeyHandlerSentBefore(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerSentBefore(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    time_t date;
-    long ccode;
-        
-    if ((ccode = GetDateArg(session, keyString, &date)) == STATUS_CONTINUE) {
-        ccode = SearchRemainingMatches(session, key, SearchRemainingMatchSentBefore, NULL, &date);
-    }
-    return(ccode);
+    return(SearchNodeCreateDate(node, session, keyString, SEARCH_NODE_SENTBEFORE));
 }
 
 static long
-SearchKeyHandlerSentOn(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerSentOn(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    time_t date;
-    long ccode;
-        
-    if ((ccode = GetDateArg(session, keyString, &date)) == STATUS_CONTINUE) {
-        ccode = SearchRemainingMatches(session, key, SearchRemainingMatchSentOn, NULL, &date);
-    }
-    return(ccode);
+    return(SearchNodeCreateDate(node, session, keyString, SEARCH_NODE_SENTON));
 }
 
 static long
-SearchKeyHandlerSentSince(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerSentSince(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    time_t date;
-    long ccode;
-        
-    if ((ccode = GetDateArg(session, keyString, &date)) == STATUS_CONTINUE) {
-        ccode = SearchRemainingMatches(session, key, SearchRemainingMatchSentSince, NULL, &date);
-    }
-    return(ccode);
+    return(SearchNodeCreateDate(node, session, keyString, SEARCH_NODE_SENTSINCE));
 }
 
 static long
-SearchKeyHandlerSince(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerSince(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    time_t date;
-    long ccode;
-        
-    if ((ccode = GetDateArg(session, keyString, &date)) == STATUS_CONTINUE) {
-        ccode = SearchRemainingMatches(session, key, SearchRemainingMatchSince, NULL, &date);
-    }
-    return(ccode);
+    return(SearchNodeCreateDate(node, session, keyString, SEARCH_NODE_SINCE));
 }
 
 static long
-SearchKeyHandlerSmaller(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerSmaller(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    unsigned long size;
-    long ccode;
-        
-    if ((ccode = GetNumericArg(session, keyString, &size)) == STATUS_CONTINUE) {
-        ccode = SearchRemainingMatches(session, key, SearchRemainingMatchSmaller, NULL, (void *)size);
-    }
-    return(ccode);
+    return(SearchNodeCreateSize(node, session, keyString, SEARCH_NODE_SMALLER));
 }
 
 static long
-SearchKeyHandlerSubject(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerSubject(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SubStringSearch(session, keyString, key, "HEADER SUBJECT"));
+    return(SearchNodeCreateText(node, session, keyString, key, "HEADER SUBJECT"));
 }
 
 static long
-SearchKeyHandlerText(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerText(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SubStringSearch(session, keyString, key, "TEXT"));
+    return(SearchNodeCreateText(node, session, keyString, key, "TEXT"));
 }
 
 static long
-SearchKeyHandlerTo(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerTo(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SubStringSearch(session, keyString, key, "HEADER TO"));
+    return(SearchNodeCreateText(node, session, keyString, key, "HEADER TO"));
 }
 
 static long
-SearchKeyHandlerUid(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerUid(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
     long ccode;
     long *messageSet;
 
     if ((ccode = GetMessageSetArg(session, keyString, &messageSet)) == STATUS_CONTINUE) {
-        ccode = MessageSetAnd(session, key, messageSet);
+        if ((ccode = SearchNodeCreate(node, SEARCH_NODE_SET, 0)) == STATUS_CONTINUE) {
+            (*node)->messageSet = messageSet;
+            return(STATUS_CONTINUE);
+        }
         MemFree(messageSet);
     }
     return(ccode);
 }
 
 static long
-SearchKeyHandlerUnanswered(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerUnanswered(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SearchRemainingMatches(session, key, SearchRemainingMatchFlagNot, NULL, (void *)STORE_MSG_FLAG_ANSWERED));
+    return(SearchNodeCreateFlag(node, STORE_MSG_FLAG_ANSWERED, FALSE));
 }
 
 static long
-SearchKeyHandlerUndeleted(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerUndeleted(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SearchRemainingMatches(session, key, SearchRemainingMatchFlagNot, NULL, (void *)STORE_MSG_FLAG_DELETED));
+    return(SearchNodeCreateFlag(node, STORE_MSG_FLAG_DELETED, FALSE));
 }
 
 static long
-SearchKeyHandlerUndraft(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerUndraft(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SearchRemainingMatches(session, key, SearchRemainingMatchFlagNot, NULL, (void *)STORE_MSG_FLAG_DRAFT));
+    return(SearchNodeCreateFlag(node, STORE_MSG_FLAG_DRAFT, FALSE));
 }
 
 static long
-SearchKeyHandlerUnflagged(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerUnflagged(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SearchRemainingMatches(session, key, SearchRemainingMatchFlagNot, NULL, (void *)STORE_MSG_FLAG_FLAGGED));
+    return(SearchNodeCreateFlag(node, STORE_MSG_FLAG_FLAGGED, FALSE));
 }
 
 static long
-SearchKeyHandlerUnkeyword(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerUnkeyword(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
     long ccode;
     char *utf8SearchString;
@@ -964,15 +988,15 @@ SearchKeyHandlerUnkeyword(ImapSession *session, char **keyString, SearchKey *key
     if ((ccode = GetSearchStringArg(session, key, keyString, &utf8SearchString)) == STATUS_CONTINUE) {
         MemFree(utf8SearchString);
         /* this implementation does not support keywords so all  messages will match */
-        return(STATUS_CONTINUE);
+        return(SearchNodeCreate(node, SEARCH_NODE_ALL, 0));
     }
     return(ccode);
 }
 
 static long
-SearchKeyHandlerUnseen(ImapSession *session, char **keyString, SearchKey *key)
+SearchKeyHandlerUnseen(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
-    return(SearchRemainingMatches(session, key, SearchRemainingMatchFlagNot, NULL, (void *)STORE_MSG_FLAG_SEEN));
+    return(SearchNodeCreateFlag(node, STORE_MSG_FLAG_SEEN, FALSE));
 }
 
 /* key handlers end */
@@ -991,6 +1015,7 @@ static SearchKeyInfo SearchKeyList[] = {
     {"HEADER ", sizeof("HEADER ") - 1, SearchKeyHandlerHeader},
     {"KEYWORD ", sizeof("KEYWORD ") - 1, SearchKeyHandlerKeyword},
     {"LARGER ", sizeof("LARGER ") - 1, SearchKeyHandlerLarger},
+    {"MODSEQ ", sizeof("MODSEQ ") - 1, SearchKeyHandlerModseq},
     {"NEW", sizeof("NEW") - 1, SearchKeyHandlerNew},
     {"NOT ", sizeof("NOT ") - 1, SearchKeyHandlerNot},
     {"OLD", sizeof("OLD") - 1, SearchKeyHandlerOld},
@@ -1017,29 +1042,35 @@ static SearchKeyInfo SearchKeyList[] = {
 };
 
 long
-SearchHandleKey(ImapSession *session, char **keyString, SearchKey *key)
+SearchHandleKey(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
     long keyId;
 
     if (**keyString != '(') {
         if ((keyId = BongoKeywordBegins(SearchKeyIndex, *keyString)) != -1) {
             *keyString += SearchKeyList[keyId].nameLen;
-            return(SearchKeyList[keyId].handler(session, (void *)keyString, key));
+            return(SearchKeyList[keyId].handler(session, (void *)keyString, key, node));
         }
         return(STATUS_INVALID_ARGUMENT);
     }
 
     (*keyString)++;
-    return(SearchHandleSubKey(session, keyString, key));
+    return(SearchHandleSubKey(session, keyString, key, node));
 }
 
 static long
-SearchHandleSubKey(ImapSession *session, char **keyString, SearchKey *key)
+SearchHandleSubKey(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
     long ccode;
+    SearchNode *list = NULL;
+    SearchNode *next;
 
     for(;;) {
-        if ((ccode = SearchHandleKey(session, keyString, key)) == STATUS_CONTINUE) {
+        if ((ccode = SearchHandleKey(session, keyString, key, &next)) == STATUS_CONTINUE) {
+            if ((ccode = SearchNodeAddToList(&list, next)) != STATUS_CONTINUE) {
+                return(ccode);
+            }
+
             if (**keyString == ' ') {
                 (*keyString)++;
                 continue;
@@ -1047,41 +1078,576 @@ SearchHandleSubKey(ImapSession *session, char **keyString, SearchKey *key)
 
             if (**keyString == ')') {
                 (*keyString)++;
+                *node = list;
                 return(STATUS_CONTINUE);
             }
                     
-            return(STATUS_INVALID_ARGUMENT);
+            ccode = STATUS_INVALID_ARGUMENT;
         }
+        SearchNodeFree(list);
         return(ccode);
     }
 }
 
 
 static long
-SearchHandleTopKey(ImapSession *session, char **keyString, SearchKey *key)
+SearchHandleTopKey(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node)
 {
     long ccode;
+    SearchNode *list = NULL;
+    SearchNode *next;
 
     for(;;) {
-        if ((ccode = SearchHandleKey(session, keyString, key)) == STATUS_CONTINUE) {
+        if ((ccode = SearchHandleKey(session, keyString, key, &next)) == STATUS_CONTINUE) {
+            if ((ccode = SearchNodeAddToList(&list, next)) != STATUS_CONTINUE) {
+                return(ccode);
+            }
+
             if (**keyString == ' ') {
                 (*keyString)++;
                 continue;
             }
 
             if (!**keyString) {
+                *node = list;
                 return(STATUS_CONTINUE);
             }
                     
-            return(STATUS_INVALID_ARGUMENT);
+            ccode = STATUS_INVALID_ARGUMENT;
         }
+        SearchNodeFree(list);
         return(ccode);
     }
 }
 
+/* Evaluate the search here, narrowing down the match list a key at a */
+/* time.  Only used when the store can't answer the search itself. */
+static long
+SearchNodeEvaluate(ImapSession *session, SearchNode *node, SearchKey *key)
+{
+    long ccode;
+    unsigned long value = (unsigned long)node->value;
+    SearchKey leftKey;
+    SearchKey rightKey;
+    long *messageSet;
+
+    switch (node->type) {
+    case SEARCH_NODE_ALL:
+        return(STATUS_CONTINUE);
+
+    case SEARCH_NODE_NONE:
+        key->matchList[0] = -1;
+        return(STATUS_CONTINUE);
+
+    case SEARCH_NODE_AND:
+        if ((ccode = SearchNodeEvaluate(session, node->left, key)) == STATUS_CONTINUE) {
+            ccode = SearchNodeEvaluate(session, node->right, key);
+        }
+        return(ccode);
+
+    case SEARCH_NODE_OR:
+        if ((ccode = SearchKeyObjectDuplicate(key, &leftKey)) == STATUS_CONTINUE) {
+            if ((ccode = SearchNodeEvaluate(session, node->left, &leftKey)) == STATUS_CONTINUE) {
+                if ((ccode = SearchKeyObjectDuplicate(key, &rightKey)) == STATUS_CONTINUE) {
+                    if ((ccode = SearchNodeEvaluate(session, node->right, &rightKey)) == STATUS_CONTINUE) {
+                        MarkMatches(key, &leftKey);
+                        MarkMatches(key, &rightKey);
+                        MarkedMatchesPreserve(key);
+                    }
+                    SearchKeyObjectFree(&rightKey);
+                }
+            }
+            SearchKeyObjectFree(&leftKey);
+        }
+        return(ccode);
+
+    case SEARCH_NODE_NOT:
+        if ((ccode = SearchKeyObjectDuplicate(key, &leftKey)) == STATUS_CONTINUE) {
+            if ((ccode = SearchNodeEvaluate(session, node->left, &leftKey)) == STATUS_CONTINUE) {
+                MarkMatches(key, &leftKey);
+                MarkedMatchesRemove(key);
+            }
+            SearchKeyObjectFree(&leftKey);
+        }
+        return(ccode);
+
+    case SEARCH_NODE_FLAG:
+        return(SearchRemainingMatches(session, key, SearchRemainingMatchFlag, NULL, (void *)value));
+
+    case SEARCH_NODE_BEFORE:
+        return(SearchRemainingMatches(session, key, SearchRemainingMatchBefore, NULL, &value));
+
+    case SEARCH_NODE_ON:
+        return(SearchRemainingMatches(session, key, SearchRemainingMatchOn, NULL, &value));
+
+    case SEARCH_NODE_SINCE:
+        return(SearchRemainingMatches(session, key, SearchRemainingMatchSince, NULL, &value));
+
+    case SEARCH_NODE_SENTBEFORE:
+        return(SearchRemainingMatches(session, key, SearchRemainingMatchSentBefore, NULL, &value));
+
+    case SEARCH_NODE_SENTON:
+        return(SearchRemainingMatches(session, key, SearchRemainingMatchSentOn, NULL, &value));
+
+    case SEARCH_NODE_SENTSINCE:
+        return(SearchRemainingMatches(session, key, SearchRemainingMatchSentSince, NULL, &value));
+
+    case SEARCH_NODE_LARGER:
+        return(SearchRemainingMatches(session, key, SearchRemainingMatchLarger, NULL, (void *)value));
+
+    case SEARCH_NODE_SMALLER:
+        return(SearchRemainingMatches(session, key, SearchRemainingMatchSmaller, NULL, (void *)value));
+
+    case SEARCH_NODE_MODSEQ:
+        return(SearchRemainingMatches(session, key, SearchRemainingMatchModseq, NULL, &node->value));
+
+    case SEARCH_NODE_SET:
+        return(MessageSetAnd(session, key, node->messageSet));
+
+    case SEARCH_NODE_TEXT:
+        if ((messageSet = MemMalloc0(sizeof(long) * session->folder.selected.messageCount)) != NULL) {
+            if ((ccode = FullListSubstringSearch(session, node->string, node->subcommand, messageSet)) == STATUS_CONTINUE) {
+                ccode = MessageSetAnd(session, key, messageSet);
+            }
+            MemFree(messageSet);
+            return(ccode);
+        }
+        return(STATUS_MEMORY_ERROR);
+    }
+
+    return(STATUS_BUG);
+}
+
+/* query translation begin */
+
+/* The search is sent to the store in its query language, in prefix form: */
+/* e.g. UNSEEN SINCE 1-Feb-2010 becomes */
+/* "& = ~ nmap.flags 2 0 > nmap.lastmodified 1264982399" */
+
+__inline static BOOL
+SearchQueryAppend(SearchQuery *query, unsigned long ops, const char *text)
+{
+    unsigned long len = strlen(text);
+
+    query->ops += ops;
+    if ((query->ops > SEARCH_MAX_QUERY_OPS) || (query->used + len + 2 > sizeof(query->buffer))) {
+        return(FALSE);
+    }
+
+    if (query->used) {
+        query->buffer[query->used++] = ' ';
+    }
+    memcpy(query->buffer + query->used, text, len + 1);
+    query->used += len;
+    return(TRUE);
+}
+
+/* the query language has no >=, and its numbers can't be negative */
+__inline static BOOL
+SearchQueryAtLeast(SearchQuery *query, const char *property, uint64_t value)
+{
+    char term[128];
+
+    if (value == 0) {
+        return(SearchQueryAppend(query, 1, "= 1 1"));
+    }
+    snprintf(term, sizeof(term), "> %s %llu", property, (unsigned long long)(value - 1));
+    return(SearchQueryAppend(query, 1, term));
+}
+
+__inline static BOOL
+SearchQueryDate(SearchQuery *query, const char *property, SearchNodeType type, uint64_t date)
+{
+    char term[128];
+
+    switch (type) {
+    case SEARCH_NODE_BEFORE:
+        snprintf(term, sizeof(term), "< %s %llu", property, (unsigned long long)date);
+        return(SearchQueryAppend(query, 1, term));
+
+    case SEARCH_NODE_SINCE:
+        return(SearchQueryAtLeast(query, property, date));
+
+    default:
+        snprintf(term, sizeof(term), "< %s %llu", property, (unsigned long long)(date + (60 * 60 * 24)));
+        return(SearchQueryAppend(query, 1, "&") && SearchQueryAtLeast(query, property, date) && SearchQueryAppend(query, 1, term));
+    }
+}
+
+/* Sent dates are compared in the message's own timezone (rfc3501), which */
+/* the store's utc times have lost.  Mail sent well clear of the date is */
+/* certain either way; mail with no sent date in the store is left out. */
+#define SEARCH_SENT_SLACK (2 * 60 * 60 * 24)
+
+__inline static BOOL
+SearchQuerySentBefore(SearchQuery *query, uint64_t date)
+{
+    char term[128];
+
+    if (date <= SEARCH_SENT_SLACK) {
+        return(SearchQueryAppend(query, 1, "= 1 0"));
+    }
+    snprintf(term, sizeof(term), "& > nmap.mail.sent 0 < nmap.mail.sent %llu", (unsigned long long)(date - SEARCH_SENT_SLACK));
+    return(SearchQueryAppend(query, 3, term));
+}
+
+__inline static BOOL
+SearchQuerySentSince(SearchQuery *query, uint64_t date)
+{
+    return(SearchQueryAtLeast(query, "nmap.mail.sent", date + SEARCH_SENT_SLACK));
+}
+
+/* the runs of messages in the set, as ranges of their uids */
+__inline static BOOL
+SearchQueryMessageSet(ImapSession *session, SearchQuery *query, long *messageSet)
+{
+    MessageInformation *message = session->folder.selected.message;
+    unsigned long messageCount = session->folder.selected.messageCount;
+    unsigned long runs = 0;
+    unsigned long i;
+    unsigned long first;
+    char term[128];
+
+    for (i = 0; i < messageCount; i++) {
+        if (messageSet[i] && ((i == 0) || !messageSet[i - 1])) {
+            runs++;
+        }
+    }
+
+    if (runs == 0) {
+        return(SearchQueryAppend(query, 1, "= 1 0"));
+    }
+
+    for (i = 0; i < messageCount; i++) {
+        if (!messageSet[i]) {
+            continue;
+        }
+
+        first = i;
+        while ((i + 1 < messageCount) && messageSet[i + 1]) {
+            i++;
+        }
+
+        if (--runs && !SearchQueryAppend(query, 1, "|")) {
+            return(FALSE);
+        }
+
+        if (first == i) {
+            snprintf(term, sizeof(term), "= nmap.mail.imapuid %lu", (unsigned long)message[i].uid);
+            if (!SearchQueryAppend(query, 1, term)) {
+                return(FALSE);
+            }
+            continue;
+        }
+
+        snprintf(term, sizeof(term), "& > nmap.mail.imapuid %lu < nmap.mail.imapuid %lu", 
+                 (unsigned long)message[first].uid - 1, (unsigned long)message[i].uid + 1);
+        if (!SearchQueryAppend(query, 3, term)) {
+            return(FALSE);
+        }
+    }
+    return(TRUE);
+}
+
+/* Translate the search into a store query.  Properties which can be empty */
+/* in the store make NOT unreliable there, so they are left to us under it. */
+static BOOL
+SearchQueryFromNode(ImapSession *session, SearchNode *node, SearchQuery *query, BOOL negated)
+{
+    char term[128];
+
+    switch (node->type) {
+    case SEARCH_NODE_ALL:
+        return(SearchQueryAppend(query, 1, "= 1 1"));
+
+    case SEARCH_NODE_NONE:
+        return(SearchQueryAppend(query, 1, "= 1 0"));
+
+    case SEARCH_NODE_AND:
+        return(SearchQueryAppend(query, 1, "&") && SearchQueryFromNode(session, node->left, query, negated) && SearchQueryFromNode(session, node->right, query, negated));
+
+    case SEARCH_NODE_OR:
+        return(SearchQueryAppend(query, 1, "|") && SearchQueryFromNode(session, node->left, query, negated) && SearchQueryFromNode(session, node->right, query, negated));
+
+    case SEARCH_NODE_NOT:
+        return(SearchQueryAppend(query, 1, "=") && SearchQueryFromNode(session, node->left, query, !negated) && SearchQueryAppend(query, 0, "0"));
+
+    case SEARCH_NODE_FLAG:
+        if (node->value == STORE_MSG_FLAG_RECENT) {
+            /* recent is ours rather than the store's */
+            return(SearchQueryAtLeast(query, "nmap.mail.imapuid", session->folder.selected.info->uidRecent));
+        }
+        snprintf(term, sizeof(term), "~ nmap.flags %lu", (unsigned long)node->value);
+        return(SearchQueryAppend(query, 1, term));
+
+    case SEARCH_NODE_BEFORE:
+    case SEARCH_NODE_ON:
+    case SEARCH_NODE_SINCE:
+        return(SearchQueryDate(query, "nmap.lastmodified", node->type, node->value));
+
+    case SEARCH_NODE_SENTBEFORE:
+    case SEARCH_NODE_SENTON:
+    case SEARCH_NODE_SENTSINCE:
+        /* these are resolved into sets before we get here, unless the */
+        /* store couldn't help */
+        return(FALSE);
+
+    case SEARCH_NODE_LARGER:
+        snprintf(term, sizeof(term), "> nmap.length %llu", (unsigned long long)node->value);
+        return(SearchQueryAppend(query, 1, term));
+
+    case SEARCH_NODE_SMALLER:
+        snprintf(term, sizeof(term), "< nmap.length %llu", (unsigned long long)node->value);
+        return(SearchQueryAppend(query, 1, term));
+
+    case SEARCH_NODE_MODSEQ:
+        /* imap modseqs are one more than the store's, which is unset until */
+        /* the document first changes */
+        if (node->value <= 1) {
+            return(SearchQueryAppend(query, 1, "= 1 1"));
+        }
+        return(!negated && SearchQueryAtLeast(query, "nmap.modseq", node->value - 1));
+
+    case SEARCH_NODE_SET:
+        return(SearchQueryMessageSet(session, query, node->messageSet));
+
+    case SEARCH_NODE_TEXT:
+        /* these are resolved into sets before we get here */
+        return(FALSE);
+    }
+
+    return(FALSE);
+}
+
+/* Mark the messages matching the query.  The store answers with sets of */
+/* uids; answered is FALSE when it couldn't. */
+static long
+SearchStoreQuerySet(ImapSession *session, SearchQuery *query, long *messageSet, BOOL *answered)
+{
+    MessageInformation *message = session->folder.selected.message;
+    unsigned long messageCount = session->folder.selected.messageCount;
+    unsigned long start;
+    unsigned long end;
+    unsigned long i;
+    char *ptr;
+    long ccode;
+
+    *answered = FALSE;
+
+    if (NMAPSendCommandF(session->store.conn, "SEARCH %llx QUERY \"%s\"\r\n", session->folder.selected.info->guid, query->buffer) != -1) {
+        for (;;) {
+            ccode = NMAPReadResponse(session->store.conn, session->store.response, sizeof(session->store.response), TRUE);
+            if (ccode == 2001) {
+                /* uids which aren't in our view of the folder are left out */
+                ptr = session->store.response;
+                while (ParseUidSetRange(&ptr, UID_HIGHEST, &start, &end)) {
+                    for (i = MessageListFindUid(message, messageCount, start); (i < messageCount) && (message[i].uid <= end); i++) {
+                        messageSet[i] = 1;
+                    }
+                }
+                continue;
+            }
+            break;
+        }
+
+        if (ccode == 1000) {
+            *answered = TRUE;
+            return(STATUS_CONTINUE);
+        }
+        if ((ccode > 999) && (ccode < 10000)) {
+            /* the store can't do it; leave it to the caller */
+            return(STATUS_CONTINUE);
+        }
+    }
+    return(STATUS_NMAP_COMM_ERROR);
+}
+
+/* Ask the store for the messages matching the query, and narrow the */
+/* matches down to them. */
+static long
+SearchStoreQuery(ImapSession *session, SearchQuery *query, SearchKey *key, BOOL *answered)
+{
+    long *messageSet;
+    long ccode;
+
+    if ((messageSet = MemMalloc0(sizeof(long) * session->folder.selected.messageCount)) == NULL) {
+        *answered = FALSE;
+        return(STATUS_MEMORY_ERROR);
+    }
+
+    if (((ccode = SearchStoreQuerySet(session, query, messageSet, answered)) == STATUS_CONTINUE) && *answered) {
+        ccode = MessageSetAnd(session, key, messageSet);
+    }
+
+    MemFree(messageSet);
+    return(ccode);
+}
+
+/* Text keys are substring matches (rfc3501), which the store's query */
+/* language can't express.  Its collection SEARCH can, narrowing things */
+/* down with the full-text index first, so each text key is asked about */
+/* up front and becomes the set of messages it matched; the rest of the */
+/* search can then still go to the store as one query. */
+static long
+SearchNodeResolveText(ImapSession *session, SearchNode *node)
+{
+    long ccode;
+    long *messageSet;
+
+    if (!node) {
+        return(STATUS_CONTINUE);
+    }
+
+    if (node->type == SEARCH_NODE_TEXT) {
+        if ((messageSet = MemMalloc0(sizeof(long) * session->folder.selected.messageCount)) == NULL) {
+            return(STATUS_MEMORY_ERROR);
+        }
+        if ((ccode = FullListSubstringSearch(session, node->string, node->subcommand, messageSet)) != STATUS_CONTINUE) {
+            MemFree(messageSet);
+            return(ccode);
+        }
+        MemFree(node->string);
+        node->string = NULL;
+        node->messageSet = messageSet;
+        node->type = SEARCH_NODE_SET;
+        return(STATUS_CONTINUE);
+    }
+
+    if ((ccode = SearchNodeResolveText(session, node->left)) == STATUS_CONTINUE) {
+        ccode = SearchNodeResolveText(session, node->right);
+    }
+    return(ccode);
+}
+
+/* The store can say which mail is certainly sent before or since a date, */
+/* and which certainly isn't; the few messages between are read here. */
+/* Each sent date key becomes the set of messages it matched, as text */
+/* keys do.  If the store can't help, it is left to be evaluated here. */
+static long
+SearchNodeResolveSent(ImapSession *session, SearchNode *node)
+{
+    MessageInformation *message = session->folder.selected.message;
+    unsigned long messageCount = session->folder.selected.messageCount;
+    unsigned long value;
+    unsigned long i;
+    SearchRemainingMatch match;
+    SearchQuery in;
+    SearchQuery out;
+    BOOL answered = TRUE;
+    BOOL found;
+    long *inSet;
+    long *outSet;
+    long ccode = STATUS_CONTINUE;
+
+    if (!node) {
+        return(STATUS_CONTINUE);
+    }
+
+    memset(&in, 0, sizeof(SearchQuery));
+    memset(&out, 0, sizeof(SearchQuery));
+
+    switch (node->type) {
+    case SEARCH_NODE_SENTBEFORE:
+        match = SearchRemainingMatchSentBefore;
+        SearchQuerySentBefore(&in, node->value);
+        SearchQuerySentSince(&out, node->value);
+        break;
+
+    case SEARCH_NODE_SENTSINCE:
+        match = SearchRemainingMatchSentSince;
+        SearchQuerySentSince(&in, node->value);
+        SearchQuerySentBefore(&out, node->value);
+        break;
+
+    case SEARCH_NODE_SENTON:
+        /* a day is narrower than the slack, so only what's outside it */
+        /* is certain */
+        match = SearchRemainingMatchSentOn;
+        SearchQueryAppend(&out, 1, "|");
+        SearchQuerySentBefore(&out, node->value);
+        SearchQuerySentSince(&out, node->value + (60 * 60 * 24));
+        break;
+
+    default:
+        if ((ccode = SearchNodeResolveSent(session, node->left)) == STATUS_CONTINUE) {
+            ccode = SearchNodeResolveSent(session, node->right);
+        }
+        return(ccode);
+    }
+
+    if ((inSet = MemMalloc0(sizeof(long) * messageCount)) == NULL) {
+        return(STATUS_MEMORY_ERROR);
+    }
+    if ((outSet = MemMalloc0(sizeof(long) * messageCount)) == NULL) {
+        MemFree(inSet);
+        return(STATUS_MEMORY_ERROR);
+    }
+
+    if (in.used) {
+        ccode = SearchStoreQuerySet(session, &in, inSet, &answered);
+    }
+    if ((ccode == STATUS_CONTINUE) && answered) {
+        ccode = SearchStoreQuerySet(session, &out, outSet, &answered);
+    }
+
+    value = (unsigned long)node->value;
+    for (i = 0; (i < messageCount) && (ccode == STATUS_CONTINUE) && answered; i++) {
+        if (!inSet[i] && !outSet[i]) {
+            if ((ccode = match(session, &message[i], NULL, &value, &found)) == STATUS_CONTINUE) {
+                inSet[i] = found;
+            }
+        }
+    }
+
+    MemFree(outSet);
+    if ((ccode != STATUS_CONTINUE) || !answered) {
+        MemFree(inSet);
+        return(ccode);
+    }
+
+    node->messageSet = inSet;
+    node->type = SEARCH_NODE_SET;
+    return(STATUS_CONTINUE);
+}
+
+/* query translation end */
+
+static long
+SearchNodeRun(ImapSession *session, SearchNode *node, SearchKey *key)
+{
+    long ccode;
+    SearchQuery query;
+    BOOL answered = FALSE;
+
+    if (session->folder.selected.messageCount == 0) {
+        return(STATUS_CONTINUE);
+    }
+
+    if ((ccode = SearchNodeResolveText(session, node)) != STATUS_CONTINUE) {
+        return(ccode);
+    }
+
+    if ((ccode = SearchNodeResolveSent(session, node)) != STATUS_CONTINUE) {
+        return(ccode);
+    }
+
+    memset(&query, 0, sizeof(SearchQuery));
+    if (SearchQueryFromNode(session, node, &query, FALSE)) {
+        if ((ccode = SearchStoreQuery(session, &query, key, &answered)) != STATUS_CONTINUE) {
+            return(ccode);
+        }
+    }
+
+    if (!answered) {
+        return(SearchNodeEvaluate(session, node, key));
+    }
+    return(STATUS_CONTINUE);
+}
+
 __inline static long
-SearchSendResults(ImapSession *session, long *matches, BOOL byUid)
+SearchSendResults(ImapSession *session, long *matches, BOOL byUid, BOOL modseq)
 {
+    uint64_t highestModseq = 0;
     MessageInformation *message = NULL;
     if (byUid) {
         message = &session->folder.selected.message[0];
@@ -1094,6 +1660,10 @@ SearchSendResults(ImapSession *session, long *matches, BOOL byUid)
 
         for (;;) {
             if (matches[i] != -1) {
+                if (session->folder.selected.message[matches[i]].modseq > highestModseq) {
+                    highestModseq = session->folder.selected.message[matches[i]].modseq;
+                }
+
                 if (byUid) {
                     if (ConnWriteF(session->client.conn, " %lu", (unsigned long)message[matches[i]].uid) != -1) {
                         i++;
@@ -1111,6 +1681,13 @@ SearchSendResults(ImapSession *session, long *matches, BOOL byUid)
             break;
         }
 
+        /* the highest modseq of the messages found (rfc4551) */
+        if (modseq && highestModseq) {
+            if (ConnWriteF(session->client.conn, " (MODSEQ %llu)", (unsigned long long)highestModseq) == -1) {
+                return(STATUS_ABORT);
+            }
+        }
+
         if (ConnWrite(session->client.conn, "\r\n", strlen("\r\n")) != -1) {
             return(STATUS_CONTINUE);
         }
@@ -1119,6 +1696,151 @@ SearchSendResults(ImapSession *session, long *matches, BOOL byUid)
 }
 
 
+/* the matches as a compact set, e.g. "2:4,7,9:12" (rfc4731) */
+__inline static long
+SearchSendSet(ImapSession *session, long *matches, BOOL byUid)
+{
+    MessageInformation *message = &session->folder.selected.message[0];
+    unsigned long i = 0;
+    unsigned long first;
+    unsigned long last;
+    unsigned long next;
+    char *separator = "";
+
+    while (matches[i] != -1) {
+        first = byUid ? (unsigned long)message[matches[i]].uid : (unsigned long)matches[i] + 1;
+        last = first;
+        for (i++; matches[i] != -1; i++) {
+            next = byUid ? (unsigned long)message[matches[i]].uid : (unsigned long)matches[i] + 1;
+            if (next != last + 1) {
+                break;
+            }
+            last = next;
+        }
+
+        if (((first == last) ? ConnWriteF(session->client.conn, "%s%lu", separator, first) : ConnWriteF(session->client.conn, "%s%lu:%lu", separator, first, last)) == -1) {
+            return(STATUS_ABORT);
+        }
+        separator = ",";
+    }
+    return(STATUS_CONTINUE);
+}
+
+/* ESEARCH response with what was asked for in RETURN (rfc4731) */
+__inline static long
+SearchSendExtendedResults(ImapSession *session, long *matches, BOOL byUid, BOOL modseq, unsigned long returns)
+{
+    MessageInformation *message = &session->folder.selected.message[0];
+    uint64_t highestModseq = 0;
+    unsigned long count = 0;
+    unsigned long i;
+
+    while (matches[count] != -1) {
+        count++;
+    }
+
+    if (ConnWriteF(session->client.conn, "* ESEARCH (TAG \"%s\")%s", session->command.tag, byUid ? " UID" : "") == -1) {
+        return(STATUS_ABORT);
+    }
+
+    if (count > 0) {
+        if (returns & SEARCH_RETURN_MIN) {
+            if (ConnWriteF(session->client.conn, " MIN %lu", byUid ? (unsigned long)message[matches[0]].uid : (unsigned long)matches[0] + 1) == -1) {
+                return(STATUS_ABORT);
+            }
+        }
+
+        if (returns & SEARCH_RETURN_MAX) {
+            if (ConnWriteF(session->client.conn, " MAX %lu", byUid ? (unsigned long)message[matches[count - 1]].uid : (unsigned long)matches[count - 1] + 1) == -1) {
+                return(STATUS_ABORT);
+            }
+        }
+    }
+
+    if (returns & SEARCH_RETURN_COUNT) {
+        if (ConnWriteF(session->client.conn, " COUNT %lu", count) == -1) {
+            return(STATUS_ABORT);
+        }
+    }
+
+    if ((count > 0) && (returns & SEARCH_RETURN_ALL)) {
+        if ((ConnWrite(session->client.conn, " ALL ", strlen(" ALL ")) == -1) || (SearchSendSet(session, matches, byUid) != STATUS_CONTINUE)) {
+            return(STATUS_ABORT);
+        }
+    }
+
+    /* the highest modseq of the messages returned (rfc4551) */
+    if (modseq && (count > 0)) {
+        if (returns & (SEARCH_RETURN_ALL | SEARCH_RETURN_COUNT)) {
+            for (i = 0; i < count; i++) {
+                if (message[matches[i]].modseq > highestModseq) {
+                    highestModseq = message[matches[i]].modseq;
+                }
+            }
+        } else {
+            if (returns & SEARCH_RETURN_MIN) {
+                highestModseq = message[matches[0]].modseq;
+            }
+            if ((returns & SEARCH_RETURN_MAX) && (message[matches[count - 1]].modseq > highestModseq)) {
+                highestModseq = message[matches[count - 1]].modseq;
+            }
+        }
+
+        if (ConnWriteF(session->client.conn, " MODSEQ %llu", (unsigned long long)highestModseq) == -1) {
+            return(STATUS_ABORT);
+        }
+    }
+
+    if (ConnWrite(session->client.conn, "\r\n", strlen("\r\n")) != -1) {
+        return(STATUS_CONTINUE);
+    }
+    return(STATUS_ABORT);
+}
+
+/* RETURN (<options>) ahead of the search keys asks for an ESEARCH response */
+/* instead; an empty list means ALL (rfc4731) */
+__inline static long
+SearchParseReturn(char **parameters, unsigned long *returns)
+{
+    char *ptr = *parameters + strlen("RETURN (");
+
+    *returns = 0;
+    while (*ptr != ')') {
+        if (XplStrNCaseCmp(ptr, "MIN", strlen("MIN")) == 0) {
+            *returns |= SEARCH_RETURN_MIN;
+            ptr += strlen("MIN");
+        } else if (XplStrNCaseCmp(ptr, "MAX", strlen("MAX")) == 0) {
+            *returns |= SEARCH_RETURN_MAX;
+            ptr += strlen("MAX");
+        } else if (XplStrNCaseCmp(ptr, "COUNT", strlen("COUNT")) == 0) {
+            *returns |= SEARCH_RETURN_COUNT;
+            ptr += strlen("COUNT");
+        } else if (XplStrNCaseCmp(ptr, "ALL", strlen("ALL")) == 0) {
+            *returns |= SEARCH_RETURN_ALL;
+            ptr += strlen("ALL");
+        } else {
+            return(STATUS_INVALID_ARGUMENT);
+        }
+
+        if (*ptr == ' ') {
+            ptr++;
+        } else if (*ptr != ')') {
+            return(STATUS_INVALID_ARGUMENT);
+        }
+    }
+
+    if (*returns == 0) {
+        *returns = SEARCH_RETURN_ALL;
+    }
+
+    if (ptr[1] != ' ') {
+        return(STATUS_INVALID_ARGUMENT);
+    }
+    *parameters = ptr + 2;
+    return(STATUS_CONTINUE);
+}
+
+
 static long
 SearchHandleCommand(ImapSession *session, char *parameters, BOOL byUid)
 {
@@ -1126,10 +1848,18 @@ SearchHandleCommand(ImapSession *session, char *parameters, BOOL byUid)
     char *ptr = parameters;
     char *charsetPtr;
     SearchKey key;
+    SearchNode *node;
+    unsigned long returns = 0;
 
     if ((ccode = CheckState(session, STATE_SELECTED)) == STATUS_CONTINUE) {
         /* rfc 2180 discourages purge notifications during the search command */
         if ((ccode = EventsSend(session, STORE_EVENT_NEW | STORE_EVENT_FLAG)) == STATUS_CONTINUE) {
+            if (XplStrNCaseCmp(ptr, "RETURN (", strlen("RETURN (")) == 0) {
+                if ((ccode = SearchParseReturn(&ptr, &returns)) != STATUS_CONTINUE) {
+                    return(ccode);
+                }
+            }
+
             if (XplStrNCaseCmp(ptr, "CHARSET ", strlen("CHARSET ")) != 0) {
                 ccode = SearchKeyObjectCreate(&key, "utf-8", session->folder.selected.messageCount);
                 /* the spec says us-ascii should be the default, */
@@ -1149,8 +1879,15 @@ SearchHandleCommand(ImapSession *session, char *parameters, BOOL byUid)
             }
 
             if (ccode == STATUS_CONTINUE) {
-                if ((ccode = SearchHandleTopKey(session, &ptr, &key)) == STATUS_CONTINUE) {
-                    ccode = SearchSendResults(session, key.matchList, byUid);
+                if ((ccode = SearchHandleTopKey(session, &ptr, &key, &node)) == STATUS_CONTINUE) {
+                    if ((ccode = SearchNodeRun(session, node, &key)) == STATUS_CONTINUE) {
+                        if (returns) {
+                            ccode = SearchSendExtendedResults(session, key.matchList, byUid, key.modseq, returns);
+                        } else {
+                            ccode = SearchSendResults(session, key.matchList, byUid, key.modseq);
+                        }
+                    }
+                    SearchNodeFree(node);
                 }
                 SearchKeyObjectFree(&key);
             }
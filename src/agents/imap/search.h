@@ -25,15 +25,63 @@
 #define SEARCH_MAX_DATE_STRING 512
 #define SEARCH_MAX_CHARSET 20
 
+#define SEARCH_MAX_SUBCOMMAND 128
+
+/* limits of what the store will take as one query */
+#define SEARCH_MAX_QUERY 900
+#define SEARCH_MAX_QUERY_OPS 50
+
+/* what ESEARCH should return (rfc4731) */
+#define SEARCH_RETURN_MIN (1 << 0)
+#define SEARCH_RETURN_MAX (1 << 1)
+#define SEARCH_RETURN_COUNT (1 << 2)
+#define SEARCH_RETURN_ALL (1 << 3)
+
 typedef struct _SearchKey {
     long *matchList;
     unsigned long messageCount;
     char charset[SEARCH_MAX_CHARSET];
     BongoStream *stream;
-    BOOL matchDropped;
+    BOOL modseq;                                            /* MODSEQ was searched on (rfc4551) */
 } SearchKey;
 
-typedef long (* SearchKeyHandler)(ImapSession *session, char **keyString, SearchKey *key);
+typedef enum {
+    SEARCH_NODE_ALL,
+    SEARCH_NODE_NONE,
+    SEARCH_NODE_AND,
+    SEARCH_NODE_OR,
+    SEARCH_NODE_NOT,
+    SEARCH_NODE_FLAG,
+    SEARCH_NODE_BEFORE,
+    SEARCH_NODE_ON,
+    SEARCH_NODE_SINCE,
+    SEARCH_NODE_SENTBEFORE,
+    SEARCH_NODE_SENTON,
+    SEARCH_NODE_SENTSINCE,
+    SEARCH_NODE_LARGER,
+    SEARCH_NODE_SMALLER,
+    SEARCH_NODE_MODSEQ,
+    SEARCH_NODE_SET,
+    SEARCH_NODE_TEXT
+} SearchNodeType;
+
+typedef struct _SearchNode {
+    SearchNodeType type;
+    struct _SearchNode *left;                               /* and, or, not                     */
+    struct _SearchNode *right;                              /* and, or                          */
+    uint64_t value;                                         /* flag, date, size or modseq       */
+    long *messageSet;                                       /* set, by sequence number          */
+    char *string;                                           /* text, in utf-8                   */
+    char subcommand[SEARCH_MAX_SUBCOMMAND];                 /* text, as the store searches it   */
+} SearchNode;
+
+typedef struct {
+    char buffer[SEARCH_MAX_QUERY];
+    unsigned long used;
+    unsigned long ops;
+} SearchQuery;
+
+typedef long (* SearchKeyHandler)(ImapSession *session, char **keyString, SearchKey *key, SearchNode **node);
 
 typedef struct {
     char *name;
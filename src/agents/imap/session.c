@@ -296,3 +296,35 @@ ImapCommandStartTls(void *param)
 
 
 }
+
+int
+ImapCommandCompress(void *param)
+{
+    ImapSession *session = (ImapSession *)param;
+    char *ptr;
+
+    if (CheckState(session, STATE_AUTH) == STATUS_CONTINUE) {
+        ptr = session->command.buffer + strlen("COMPRESS");
+        if ((*ptr == ' ') && (XplStrCaseCmp(ptr + 1, "DEFLATE") == 0)) {
+            if (!session->client.conn->compress.enable) {
+                /* refuse while the reply can still go out as a plain NO */
+                if (ConnCompressAvailable()) {
+                    /* the OK is the last response sent uncompressed (rfc4978) */
+                    if ((ConnWriteF(session->client.conn, "%s OK DEFLATE active\r\n", session->command.tag) != -1) && (ConnCompress(session->client.conn) != -1)) {
+                        return(STATUS_CONTINUE);
+                    }
+
+                    return(STATUS_ABORT);
+                }
+
+                return(SendError(session->client.conn, session->command.tag, "COMPRESS", STATUS_MEMORY_ERROR));
+            }
+
+            return(SendError(session->client.conn, session->command.tag, "COMPRESS", STATUS_COMPRESSION_ACTIVE));
+        }
+
+        return(SendError(session->client.conn, session->command.tag, "COMPRESS", STATUS_INVALID_ARGUMENT));
+    }
+
+    return(SendError(session->client.conn, session->command.tag, "COMPRESS", STATUS_INVALID_STATE));
+}
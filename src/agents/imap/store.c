@@ -95,21 +95,37 @@ CommandStoreCleanup()
 }
 
 __inline static long
-DoStoreForMessage(ImapSession *session, MessageInformation *message, unsigned long messageId, char *actionString, unsigned long flags, BOOL silent, BOOL byUid)
+DoStoreForMessage(ImapSession *session, MessageInformation *message, unsigned long messageId, char *actionString, unsigned long flags, BOOL silent, BOOL byUid, StoreConditional *conditional)
 {
     long ccode;
 
-    if ((ccode = StoreMessageFlag(session->store.conn, message->guid, actionString, flags, &(message->flags))) == STATUS_CONTINUE) {
-        if (!silent) {
-            ccode = SendFetchFlag(session->client.conn, messageId, message->flags, byUid ? message->uid: 0);
+    if (!conditional->requested) {
+        ccode = StoreMessageFlag(session->store.conn, message->guid, actionString, flags, &(message->flags), NULL, &(message->modseq));
+    } else if (message->modseq > conditional->unchangedSince) {
+        ccode = STATUS_MESSAGE_MODIFIED;
+    } else {
+        /* the store checks again, in case the message changed since we last heard */
+        ccode = StoreMessageFlag(session->store.conn, message->guid, actionString, flags, &(message->flags), &(conditional->unchangedSince), &(message->modseq));
+    }
+
+    if (ccode == STATUS_CONTINUE) {
+        /* a conditional store reports the new modseq even when silent */
+        if (!silent || conditional->requested) {
+            ccode = SendFetchFlag(session->client.conn, messageId, message->flags, byUid ? message->uid: 0, (session->client.enabled & IMAP_ENABLED_CONDSTORE) ? message->modseq : 0);
         }
+        return(ccode);
+    }
+
+    if (ccode == STATUS_MESSAGE_MODIFIED) {
+        BongoStringBuilderAppendF(&(conditional->modified), "%s%lu", conditional->modified.len ? "," : "", byUid ? (unsigned long)message->uid : messageId + 1);
+        return(STATUS_CONTINUE);
     }
     return(ccode);
 }
 
 
 __inline static long
-DoStoreForMessageRange(ImapSession *session, MessageInformation *message, unsigned long rangeStart, unsigned long rangeCount, char *actionString, unsigned long flags, BOOL silent, BOOL byUid, BOOL *purgedMessage)
+DoStoreForMessageRange(ImapSession *session, MessageInformation *message, unsigned long rangeStart, unsigned long rangeCount, char *actionString, unsigned long flags, BOOL silent, BOOL byUid, StoreConditional *conditional, BOOL *purgedMessage)
 {
     unsigned long messageId;
     unsigned long count;
@@ -120,7 +136,7 @@ DoStoreForMessageRange(ImapSession *session, MessageInformation *message, unsign
 
     for (;;) {
         if (!(message->flags & STORE_MSG_FLAG_PURGED)) {
-            if ((ccode = DoStoreForMessage(session, message, messageId, actionString, flags, silent, byUid)) == STATUS_CONTINUE) {
+            if ((ccode = DoStoreForMessage(session, message, messageId, actionString, flags, silent, byUid, conditional)) == STATUS_CONTINUE) {
                 count--;
                 if (count > 0) {
                     message++;
@@ -145,7 +161,7 @@ DoStoreForMessageRange(ImapSession *session, MessageInformation *message, unsign
 }
 
 __inline static long
-DoStoreForMessageSet(ImapSession *session, char *messageSet, unsigned long Flags, BOOL Silent, BOOL ByUID, char *actionString, MessageInformation *message, unsigned long messageCount, BOOL *purgedMessage)
+DoStoreForMessageSet(ImapSession *session, char *messageSet, unsigned long Flags, BOOL Silent, BOOL ByUID, char *actionString, MessageInformation *message, unsigned long messageCount, StoreConditional *conditional, BOOL *purgedMessage)
 {
     char *nextRange;
     unsigned long rangeStart;
@@ -156,7 +172,7 @@ DoStoreForMessageSet(ImapSession *session, char *messageSet, unsigned long Flags
 
     do {
         if ((ccode = GetMessageRange(message, messageCount, &(nextRange), &rangeStart, &rangeEnd, ByUID)) == STATUS_CONTINUE) {
-            if ((ccode = DoStoreForMessageRange(session, &(message[rangeStart]), rangeStart, rangeEnd - rangeStart + 1, actionString, Flags, Silent, ByUID, purgedMessage)) == STATUS_CONTINUE) {
+            if ((ccode = DoStoreForMessageRange(session, &(message[rangeStart]), rangeStart, rangeEnd - rangeStart + 1, actionString, Flags, Silent, ByUID, conditional, purgedMessage)) == STATUS_CONTINUE) {
                 continue;
             }
         }
@@ -169,8 +185,30 @@ DoStoreForMessageSet(ImapSession *session, char *messageSet, unsigned long Flags
     return(STATUS_CONTINUE);
 }
 
+/* the store modifier is " (UNCHANGEDSINCE <modseq>)" (rfc4551) */
+__inline static long
+ParseStoreModifiers(ImapSession *session, unsigned char **ptr, StoreConditional *conditional)
+{
+    char *end;
+
+    if (XplStrNCaseCmp(*ptr, " (", 2) != 0) {
+        return(STATUS_CONTINUE);
+    }
+
+    if (XplStrNCaseCmp(*ptr, " (UNCHANGEDSINCE ", strlen(" (UNCHANGEDSINCE ")) == 0) {
+        conditional->unchangedSince = strtoull(*ptr + strlen(" (UNCHANGEDSINCE "), &end, 10);
+        if (*end == ')') {
+            conditional->requested = TRUE;
+            session->client.enabled |= IMAP_ENABLED_CONDSTORE;
+            *ptr = end + 1;
+            return(STATUS_CONTINUE);
+        }
+    }
+    return(STATUS_INVALID_ARGUMENT);
+}
+
 __inline static long
-HandleStore(ImapSession *session, BOOL ByUID, BOOL *purgedMessage)
+HandleStore(ImapSession *session, BOOL ByUID, StoreConditional *conditional, BOOL *purgedMessage)
 {
     unsigned char *messageSet;
     long ccode;
@@ -187,12 +225,12 @@ HandleStore(ImapSession *session, BOOL ByUID, BOOL *purgedMessage)
             if (!session->folder.selected.readOnly) {
                 ptr = session->command.buffer + 5;
                 if ((ccode = GrabArgument(session, &ptr, &messageSet)) == STATUS_CONTINUE) {
-                    if ((ccode = GrabArgument(session, &ptr, &type)) == STATUS_CONTINUE) {
+                    if (((ccode = ParseStoreModifiers(session, &ptr, conditional)) == STATUS_CONTINUE) && ((ccode = GrabArgument(session, &ptr, &type)) == STATUS_CONTINUE)) {
                         if ((ccode = GrabArgument(session, &ptr, &flagString)) == STATUS_CONTINUE) {
                             if ((ccode = ParseStoreFlags(flagString, &flags)) == STATUS_CONTINUE) {
                                 ccode = STATUS_INVALID_ARGUMENT;
                                 if ((keywordId = BongoKeywordBegins(Imap.command.store.typeIndex, type)) != -1) {
-                                    ccode = DoStoreForMessageSet(session, messageSet, flags, StoreCommandTypes[keywordId].silent, ByUID, StoreCommandTypes[keywordId].nmapCommand, session->folder.selected.message, session->folder.selected.messageCount, purgedMessage);
+                                    ccode = DoStoreForMessageSet(session, messageSet, flags, StoreCommandTypes[keywordId].silent, ByUID, StoreCommandTypes[keywordId].nmapCommand, session->folder.selected.message, session->folder.selected.messageCount, conditional, purgedMessage);
                                 }
                             }
                             MemFree(flagString);
@@ -207,23 +245,48 @@ HandleStore(ImapSession *session, BOOL ByUID, BOOL *purgedMessage)
     return(ccode);
 }
 
+__inline static long
+SendStoreOk(ImapSession *session, char *command, StoreConditional *conditional)
+{
+    long ccode;
+
+    if (conditional->modified.len) {
+        ccode = ConnWriteF(session->client.conn, "%s OK [MODIFIED %s] %s completed\r\n", session->command.tag, conditional->modified.value, command);
+    } else {
+        ccode = ConnWriteF(session->client.conn, "%s OK %s completed\r\n", session->command.tag, command);
+    }
+
+    BongoStringBuilderDestroy(&(conditional->modified));
+    if (ccode != -1) {
+        return(STATUS_CONTINUE);
+    }
+    return(STATUS_ABORT);
+}
+
 int
 ImapCommandStore(void *param)
 {
     long ccode;
     ImapSession *session = (ImapSession *)param;
     BOOL purgedMessage = FALSE;
+    StoreConditional conditional;
+
+    memset(&conditional, 0, sizeof(StoreConditional));
+    if (BongoStringBuilderInit(&(conditional.modified))) {
+        return(SendError(session->client.conn, session->command.tag, "STORE", STATUS_MEMORY_ERROR));
+    }
 
     StartBusy(session, "* OK - Store");
 
-    if ((ccode = HandleStore(session, FALSE, &purgedMessage)) == STATUS_CONTINUE) {
+    if ((ccode = HandleStore(session, FALSE, &conditional, &purgedMessage)) == STATUS_CONTINUE) {
         if (!purgedMessage) {
             StopBusy(session);
-            return(SendOk(session, "STORE"));
+            return(SendStoreOk(session, "STORE", &conditional));
         }
         ccode = STATUS_REQUESTED_MESSAGE_NO_LONGER_EXISTS;
     }
     StopBusy(session);
+    BongoStringBuilderDestroy(&(conditional.modified));
     return(SendError(session->client.conn, session->command.tag, "STORE", ccode));
 }
 
@@ -233,17 +296,24 @@ ImapCommandUidStore(void *param)
     long ccode;
     ImapSession *session = (ImapSession *)param;
     BOOL purgedMessage = FALSE;
+    StoreConditional conditional;
+
+    memset(&conditional, 0, sizeof(StoreConditional));
+    if (BongoStringBuilderInit(&(conditional.modified))) {
+        return(SendError(session->client.conn, session->command.tag, "UID STORE", STATUS_MEMORY_ERROR));
+    }
     
     StartBusy(session, "* OK - UID Store");
     
     memmove(session->command.buffer, session->command.buffer + strlen("UID "), strlen(session->command.buffer + strlen("UID ")) + 1);
-    if ((ccode = HandleStore(session, TRUE, &purgedMessage)) == STATUS_CONTINUE) {
+    if ((ccode = HandleStore(session, TRUE, &conditional, &purgedMessage)) == STATUS_CONTINUE) {
         if (!purgedMessage) {
             StopBusy(session);
-            return(SendOk(session, "UID STORE"));
+            return(SendStoreOk(session, "UID STORE", &conditional));
         }
         ccode = STATUS_REQUESTED_MESSAGE_NO_LONGER_EXISTS;
     }
     StopBusy(session);
+    BongoStringBuilderDestroy(&(conditional.modified));
     return(SendError(session->client.conn, session->command.tag, "UID STORE", ccode));
 }
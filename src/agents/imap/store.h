@@ -33,5 +33,11 @@ typedef struct {
     BOOL silent;
 } StoreCommandType;
 
+typedef struct {
+    BOOL requested;                                         /* UNCHANGEDSINCE was given (rfc4551) */
+    uint64_t unchangedSince;
+    BongoStringBuilder modified;                            /* messages that failed the test    */
+} StoreConditional;
+
 unsigned long ParseStoreFlags(unsigned char *command, unsigned long *returnFlags);
 
@@ -34,6 +34,8 @@
 
 #define PUSHCLIENTALLOC 20
 #define REMOTENMAP_ALLOC_STEPS 10
+#define LOCALBATCH_ALLOC_STEPS 64
+#define LOCALBATCH_MAX 1000 /* most targets the store takes in one DELIVER */
 #define MAX_PUSHCLIENTS_ERRORS 25
 
 #if defined(SOLARIS) || defined(S390RH)
@@ -58,6 +60,24 @@ typedef struct _NMAPConnections {
     NMAPConnection *connections;
 } NMAPConnections;
 
+/* Local mail recipients of a queue entry, so that all those on the same
+   store can be handed over with one DELIVER rather than one WRITE each */
+typedef struct _LocalRecipient {
+    unsigned long line;         /* which line of the control file it's from */
+    unsigned char recipient[MAXEMAILNAMESIZE + 1];
+    unsigned char *mailbox;
+    struct sockaddr_in store;
+    BOOL batched;               /* it's been put in a DELIVER */
+    int status;                 /* 0 until the store has said how it went */
+} LocalRecipient;
+
+typedef struct _LocalRecipients {
+    long used;
+    long allocated;
+
+    LocalRecipient *recipients;
+} LocalRecipients;
+
 /* Globals */
 MessageQueue Queue = { 0, };
 int FindQueue(const void *i, const void *node);
@@ -496,6 +516,215 @@ DeliverToStore(NMAPConnections *list,
 	}
 }
 
+static void
+CollectLocalRecipients(FILE *fh, LocalRecipients *batch)
+{
+    unsigned char line[CONN_BUFSIZE + 1];
+    unsigned char *mailbox;
+    unsigned char *ptr;
+    unsigned long lineNumber = 0;
+    LocalRecipient *recip;
+    void *temp;
+    int i;
+
+    while (!feof(fh) && !ferror(fh)) {
+        if (!fgets(line, CONN_BUFSIZE, fh)) {
+            continue;
+        }
+        lineNumber++;
+        CHOP_NEWLINE(line);
+
+        if ((line[0] != QUEUE_RECIP_LOCAL) && (line[0] != QUEUE_RECIP_MBOX_LOCAL)) {
+            continue;
+        }
+
+        /* LRecip ORecip flags, or MRecip ORecip flags MBox MsgFlags */
+        mailbox = "INBOX";
+        if (line[0] == QUEUE_RECIP_MBOX_LOCAL) {
+            for (i = 0, ptr = line; *ptr != '\0'; ptr++) {
+                if ((*ptr == ' ') && (++i == 3)) {
+                    mailbox = ptr + 1;
+                    if ((ptr = strchr(mailbox, ' ')) != NULL) {
+                        *ptr = '\0';
+                    }
+                    break;
+                }
+            }
+        }
+
+        if ((ptr = strchr(line + 1, ' ')) != NULL) {
+            *ptr = '\0';
+        }
+        if (MsgAuthFindUser(line + 1) != 0) {
+            continue;
+        }
+
+        if ((batch->used + 1) > batch->allocated) {
+            temp = MemRealloc(batch->recipients, (batch->allocated + LOCALBATCH_ALLOC_STEPS) * sizeof(LocalRecipient));
+            if (!temp) {
+                break;
+            }
+
+            batch->recipients = (LocalRecipient *)temp;
+            batch->allocated += LOCALBATCH_ALLOC_STEPS;
+        }
+
+        recip = &batch->recipients[batch->used];
+        recip->mailbox = MemStrdup(mailbox);
+        if (!recip->mailbox) {
+            break;
+        }
+        recip->line = lineNumber;
+        strncpy(recip->recipient, line + 1, MAXEMAILNAMESIZE);
+        recip->recipient[MAXEMAILNAMESIZE] = '\0';
+        MsgAuthGetUserStore(recip->recipient, &recip->store);
+        recip->batched = FALSE;
+        recip->status = 0;
+        batch->used++;
+    }
+
+    fseek(fh, 0, SEEK_SET);
+}
+
+static void
+FreeLocalRecipients(LocalRecipients *batch)
+{
+    long index;
+
+    for (index = 0; index < batch->used; index++) {
+        MemFree(batch->recipients[index].mailbox);
+    }
+
+    if (batch->recipients) {
+        MemFree(batch->recipients);
+    }
+}
+
+/* Send the message to several recipients on one store with a single
+   DELIVER, recording how it went for each of them. Anyone the store
+   doesn't answer for is left with a status of 0. */
+static void
+DeliverBatchToStore(NMAPConnections *list, 
+                    LocalRecipient **recips, 
+                    long count, 
+                    FILE *fh, 
+                    unsigned long size)
+{
+    NMAPConnection *nmap = NULL;
+    int ccode = 0;
+    unsigned char line[CONN_BUFSIZE + 1];
+    unsigned char *ptr;
+    long index;
+    BOOL new;
+
+    if ((ccode = GetNMAPConnection(list, &recips[0]->store, &nmap, &new)) < 0) {
+        return;
+    }
+    if (nmap->error) return;
+
+    ccode = NMAPSendCommandF(nmap->conn, "DELIVER 2 %lu\r\n", size);
+    ccode = NMAPReadAnswer(nmap->conn, line, CONN_BUFSIZE, TRUE);
+    if (ccode != 2002) {
+        if (ccode < 0) nmap->error = TRUE;
+        return;
+    }
+
+    // tell the store where it's going: "<store> <collection>" lines
+    for (index = 0; index < count; index++) {
+        ccode = ConnWriteF(nmap->conn, "%s /mail/%s\r\n", recips[index]->recipient, recips[index]->mailbox);
+    }
+    ccode = ConnWrite(nmap->conn, "\r\n", 2);
+    ccode = ConnFlush(nmap->conn);
+    ccode = NMAPReadAnswer(nmap->conn, line, CONN_BUFSIZE, TRUE);
+    if (ccode != 2002) {
+        if (ccode < 0) nmap->error = TRUE;
+        return;
+    }
+
+    // now send the email, just the once
+    fseek(fh, 0, SEEK_SET);
+    ccode = ConnWriteFile(nmap->conn, fh);
+    ccode = ConnFlush(nmap->conn);
+
+    // "<target> 1000 <guid>" or "<target> <error>" for each recipient
+    while ((ccode = NMAPReadAnswer(nmap->conn, line, CONN_BUFSIZE, TRUE)) == 2001) {
+        index = strtol((char *)line, (char **)&ptr, 10);
+        if ((index < 0) || (index >= count)) {
+            continue;
+        }
+
+        switch (atoi(ptr)) {
+            case 1000:
+                recips[index]->status = DELIVER_SUCCESS;
+                break;
+            case 4100:
+                recips[index]->status = DELIVER_USER_UNKNOWN;
+                break;
+            case 5220:
+                recips[index]->status = DELIVER_QUOTA_EXCEEDED;
+                break;
+            default:
+                recips[index]->status = DELIVER_TRY_LATER;
+                break;
+        }
+    }
+    if (ccode < 0) {
+        // we don't know where the conversation got to
+        nmap->error = TRUE;
+    }
+}
+
+static void
+DeliverToLocalRecipients(NMAPConnections *list, LocalRecipients *batch, FILE *fh, unsigned long size)
+{
+    LocalRecipient **group;
+    LocalRecipient *recip;
+    long count;
+    long left;
+    long i;
+    long j;
+
+    group = MemMalloc(LOCALBATCH_MAX * sizeof(LocalRecipient *));
+    if (!group) {
+        return;
+    }
+
+    for (i = 0; i < batch->used; i++) {
+        if (batch->recipients[i].batched) {
+            continue;
+        }
+
+        /* everyone else we haven't sent yet with the same store */
+        count = 0;
+        for (j = i; (j < batch->used) && (count < LOCALBATCH_MAX); j++) {
+            recip = &batch->recipients[j];
+            if (!recip->batched && 
+                (recip->store.sin_addr.s_addr == batch->recipients[i].store.sin_addr.s_addr) && 
+                (recip->store.sin_port == batch->recipients[i].store.sin_port)) {
+                recip->batched = TRUE;
+                group[count++] = recip;
+            }
+        }
+
+        Log(LOG_DEBUG, "Delivering to %ld recipients on store host %s", count, LOGIP(batch->recipients[i].store));
+        DeliverBatchToStore(list, group, count, fh, size);
+
+        /* those the store didn't answer for are left at 0, and get
+           delivered one at a time instead */
+        for (j = 0, left = 0; j < count; j++) {
+            if (group[j]->status == 0) {
+                left++;
+            }
+        }
+        if (left) {
+            Log(LOG_NOTICE, "Batch delivery to store host %s failed for %ld of %ld recipients, delivering them singly",
+                LOGIP(batch->recipients[i].store), left, count);
+        }
+    }
+
+    MemFree(group);
+}
+
 static void 
 EndStoreDelivery(NMAPConnections *list)
 {
@@ -949,6 +1178,9 @@ StartOver:
             unsigned char messageID[MAXEMAILNAMESIZE + 1];
             char dataFilename[XPL_MAX_PATH];
             NMAPConnections list = { 0, };
+            LocalRecipients localRecipients = { 0, };
+            unsigned long lineNumber = 0;
+            long localIndex = 0;
 
             data = NULL;
             saddr.sin_addr.s_addr = 0;
@@ -990,8 +1222,20 @@ StartOver:
                 return(TRUE);
             }
 
+            /* hand the message to each store once for all its local recipients */
+            CollectLocalRecipients(fh, &localRecipients);
+            if (localRecipients.used) {
+                sprintf(path, "%s/d%s.msg", Conf.spoolPath, entry);
+                FOPEN_CHECK(data, path, "rb");
+                if (data) {
+                    DeliverToLocalRecipients(&list, &localRecipients, data, dSize);
+                    fseek(data, 0, SEEK_SET);
+                }
+            }
+
             while (!feof(fh) && !ferror(fh)) {
                 if (fgets(line, CONN_BUFSIZE, fh)) {
+                    lineNumber++;
                     CHOP_NEWLINE(line);
 
                     mailbox = "INBOX";
@@ -1165,8 +1409,18 @@ StartOver:
                                     *ptr2 = ' ';
                             }
 
+                            /* skip over local recipients we haven't batched up */
+                            while ((localIndex < localRecipients.used) && (localRecipients.recipients[localIndex].line < lineNumber)) {
+                                localIndex++;
+                            }
+
                             /* Attempt delivery, check if local or remote */
-                            if (MsgAuthFindUser(recipient) == 0) {
+                            if ((localIndex < localRecipients.used) && 
+                                (localRecipients.recipients[localIndex].line == lineNumber) && 
+                                (localRecipients.recipients[localIndex].status != 0)) {
+                                /* already sent to the store along with the others */
+                                status = localRecipients.recipients[localIndex].status;
+                            } else if (MsgAuthFindUser(recipient) == 0) {
                                 MsgAuthGetUserStore(recipient, &siaddr);
                                 Log(LOG_DEBUG, "Deliver to store entry %s in queue %d for host %s", entry, queue, LOGIP(siaddr));
                                 status = DeliverToStore(&list, &siaddr, NMAP_DOCTYPE_MAIL, sender, authenticatedSender, dataFilename, data, dSize, recipient, mailbox, messageFlags);
@@ -1313,6 +1567,7 @@ StartOver:
                 EndStoreDelivery(&list);
                 memset(&list, 0, sizeof(NMAPConnections));
             }
+            FreeLocalRecipients(&localRecipients);
             FCLOSE_CHECK(newFH);
             FCLOSE_CHECK(fh);
             if (bounce) {
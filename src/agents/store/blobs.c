@@ -0,0 +1,340 @@
+/** \file
+ * Single-instance storage for documents delivered to many places at once.
+ *
+ * When DELIVER puts the same message into lots of collections, rather
+ * than writing a copy for each one we keep one copy in a shared blob
+ * area, named after a hash of its content, and hard link each new
+ * document to it. The blob area lives under the store root, so it's
+ * always on the same filesystem as the stores themselves.
+ *
+ * Nothing in the store changes a document file in place (REPLACE renames
+ * a new file over the old one), so sharing the inode is safe. A blob's
+ * link count tells us whether anything still refers to it: once only
+ * the blob area's own link is left, the content can go. Deleting a
+ * document tidies up its blob straight away; anything missed that way,
+ * say because a whole collection went, is caught by a periodic sweep.
+ */
+
+#include <config.h>
+#include <xpl.h>
+#include <xplhash.h>
+#include <memmgr.h>
+
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include "stored.h"
+
+static struct {
+	XplMutex	lock;
+	char		dir[XPL_MAX_PATH + 1];
+	BOOL		running;
+} BlobStore;
+
+/** \internal
+ * Work out where the blob for a given content hash lives.
+ */
+static void
+BlobPath(const char *hash, char *dest, size_t size)
+{
+	snprintf(dest, size, "%s/%.2s/%s", BlobStore.dir, hash, hash + 2);
+	dest[size-1] = '\0';
+}
+
+/** \internal
+ * Hash the content of a file.
+ * \param	path	File to hash
+ * \param	hash	Output buffer of at least XPLHASH_SHA1_LENGTH bytes
+ * \return	0 on success, -1 if the file couldn't be read
+ */
+static int
+BlobHashFile(const char *path, char *hash)
+{
+	xpl_hash_context context;
+	char buffer[4096];
+	size_t count;
+	FILE *fh;
+	int result;
+
+	fh = fopen(path, "r");
+	if (!fh) return -1;
+
+	XplHashNew(&context, XPLHASH_SHA1);
+	while ((count = fread(buffer, 1, sizeof(buffer), fh)) > 0) {
+		XplHashWrite(&context, buffer, count);
+	}
+	result = ferror(fh) ? -1 : 0;
+	fclose(fh);
+
+	// always finish, so the context is freed
+	XplHashFinal(&context, XPLHASH_LOWERCASE, hash, XPLHASH_SHA1_LENGTH);
+
+	return result;
+}
+
+/** \internal
+ * Remove a blob if nothing but the blob area refers to it any more, and
+ * it's been left alone long enough that nobody can be about to link to it.
+ * \return	TRUE if it was removed
+ */
+static BOOL
+BlobCollect(const char *path, time_t now, int grace)
+{
+	struct stat sb;
+
+	if (stat(path, &sb) || !S_ISREG(sb.st_mode)) {
+		return FALSE;
+	}
+	if (sb.st_nlink > 1 || now - sb.st_mtime < grace) {
+		return FALSE;
+	}
+	if (unlink(path)) {
+		return FALSE;
+	}
+
+	XplMutexLock(BlobStore.lock);
+	StoreAgent.store.blobStats.collected++;
+	XplMutexUnlock(BlobStore.lock);
+	return TRUE;
+}
+
+/** \internal
+ * Remove everything in one directory of the blob area which is no
+ * longer needed.
+ */
+static void
+BlobCollectDirectory(const char *dir, time_t now)
+{
+	char path[XPL_MAX_PATH + 1];
+	struct dirent *entry;
+	DIR *dh;
+
+	dh = opendir(dir);
+	if (!dh) return;
+
+	while ((entry = readdir(dh)) != NULL) {
+		if (entry->d_name[0] == '.') continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		path[sizeof(path)-1] = '\0';
+		BlobCollect(path, now, StoreAgent.store.blobGracePeriod);
+	}
+
+	closedir(dh);
+}
+
+/**
+ * Sweep the whole blob area, removing blobs nothing refers to and any
+ * temporary files left behind by a crash.
+ */
+void
+BlobStoreCollect(void)
+{
+	char path[XPL_MAX_PATH + 1];
+	struct dirent *entry;
+	time_t now = time(NULL);
+	DIR *dh;
+
+	if (!BlobStore.running) return;
+
+	dh = opendir(BlobStore.dir);
+	if (!dh) return;
+
+	while ((entry = readdir(dh)) != NULL) {
+		if (entry->d_name[0] == '.') continue;
+
+		snprintf(path, sizeof(path), "%s/%s", BlobStore.dir, entry->d_name);
+		path[sizeof(path)-1] = '\0';
+		BlobCollectDirectory(path, now);
+	}
+
+	closedir(dh);
+}
+
+/**
+ * Set up the blob area, if single-instance storage has been configured.
+ * \return	0 on success, -1 on failure
+ */
+int
+BlobStoreInit(void)
+{
+	char path[XPL_MAX_PATH + 1];
+
+	BlobStore.running = FALSE;
+
+	if (!StoreAgent.store.singleInstance) {
+		return 0;
+	}
+
+	snprintf(BlobStore.dir, sizeof(BlobStore.dir), "%s/.blobs", StoreAgent.store.rootDir);
+	snprintf(path, sizeof(path), "%s/tmp", BlobStore.dir);
+	MsgMakePath(path);
+	if (access(path, W_OK)) {
+		Log(LOG_ERROR, "Couldn't create blob area %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	XplMutexInit(BlobStore.lock);
+	BlobStore.running = TRUE;
+
+	return 0;
+}
+
+void
+BlobStoreShutdown(void)
+{
+	if (!BlobStore.running) {
+		return;
+	}
+
+	BlobStore.running = FALSE;
+	XplMutexDestroy(BlobStore.lock);
+}
+
+/**
+ * Make up a name for a temporary file on the same filesystem as the blob
+ * area, so that it can be added with BlobStoreAdd().
+ * \return	0 on success, -1 if single-instance storage isn't enabled or
+ *		no file could be made
+ */
+int
+BlobStoreTempFile(char *dest, size_t size)
+{
+	int fd;
+
+	if (!BlobStore.running) {
+		return -1;
+	}
+
+	snprintf(dest, size, "%s/tmp/XXXXXXXX", BlobStore.dir);
+	dest[size-1] = '\0';
+	fd = mkstemp(dest);
+	if (fd == -1) {
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/**
+ * Put the content of a file into the blob area, unless an identical blob
+ * is already there.
+ * \param	path	A file made with BlobStoreTempFile(); it's left in place
+ * \param	blob	Output buffer for the path of the blob to link to
+ * \param	size	Size of the output buffer
+ * \return	0 on success, -1 on failure
+ */
+int
+BlobStoreAdd(const char *path, char *blob, size_t size)
+{
+	char hash[XPLHASH_SHA1_LENGTH];
+	char dir[XPL_MAX_PATH + 1];
+
+	if (!BlobStore.running || BlobHashFile(path, hash)) {
+		return -1;
+	}
+
+	BlobPath(hash, blob, size);
+	if (link(path, blob) == 0) {
+		XplMutexLock(BlobStore.lock);
+		StoreAgent.store.blobStats.stored++;
+		XplMutexUnlock(BlobStore.lock);
+		return 0;
+	}
+
+	if (errno == ENOENT) {
+		// first blob with this prefix
+		snprintf(dir, sizeof(dir), "%s/%.2s", BlobStore.dir, hash);
+		XplMakeDir(dir);
+		if (link(path, blob) == 0) {
+			XplMutexLock(BlobStore.lock);
+			StoreAgent.store.blobStats.stored++;
+			XplMutexUnlock(BlobStore.lock);
+			return 0;
+		}
+	}
+
+	if (errno == EEXIST) {
+		// we've seen this before; keep it from being collected while
+		// we're linking to it
+		utime(blob, NULL);
+		return 0;
+	}
+
+	return -1;
+}
+
+/**
+ * Make a document share the content of a blob.
+ * \return	0 on success, -1 if the caller needs to write its own copy
+ */
+int
+BlobStoreLink(const char *blob, const char *path)
+{
+	if (link(blob, path)) {
+		// EMLINK if the blob is very popular indeed
+		return -1;
+	}
+
+	XplMutexLock(BlobStore.lock);
+	StoreAgent.store.blobStats.links++;
+	XplMutexUnlock(BlobStore.lock);
+	return 0;
+}
+
+/**
+ * Remove a document's content, and the blob it shares that content with
+ * if nothing else now needs it.
+ * \return	the result of unlinking the document
+ */
+int
+BlobStoreUnlink(const char *path)
+{
+	char hash[XPLHASH_SHA1_LENGTH];
+	char blob[XPL_MAX_PATH + 1];
+	struct stat sb, bsb;
+
+	// only worth looking if it could be the last link besides a blob's
+	if (!BlobStore.running || stat(path, &sb) || sb.st_nlink != 2 ||
+	    BlobHashFile(path, hash))
+	{
+		return unlink(path);
+	}
+
+	BlobPath(hash, blob, sizeof(blob));
+	if (stat(blob, &bsb) || bsb.st_ino != sb.st_ino || bsb.st_dev != sb.st_dev) {
+		return unlink(path);
+	}
+
+	if (unlink(path)) {
+		return -1;
+	}
+	BlobCollect(blob, time(NULL), 0);
+	return 0;
+}
+
+/**
+ * Write out the single-instance storage counters as 2001 lines, for the
+ * STATS command.
+ */
+CCode
+BlobStoreWriteStats(StoreClient *client)
+{
+	uint64_t stored = 0, links = 0, collected = 0;
+
+	if (BlobStore.running) {
+		XplMutexLock(BlobStore.lock);
+		stored = StoreAgent.store.blobStats.stored;
+		links = StoreAgent.store.blobStats.links;
+		collected = StoreAgent.store.blobStats.collected;
+		XplMutexUnlock(BlobStore.lock);
+	}
+
+	return ConnWriteF(client->conn,
+		"2001 blobs.stored " FMT_UINT64_DEC "\r\n"
+		"2001 blobs.links " FMT_UINT64_DEC "\r\n"
+		"2001 blobs.collected " FMT_UINT64_DEC "\r\n",
+		stored, links, collected);
+}
@@ -29,78 +29,339 @@
 #include "messages.h"
 #include "object-model.h"
 #include "calendar.h"
+#include "object-queries.h"
 
 
+#define EVENT_DAY_SECONDS (60 * 60 * 24)
+
+typedef struct {
+    uint64_t guid;
+    uint64_t horizon;
+} EventHorizon;
+
+/** \internal
+ * Does any part of this event repeat? If so, there's no end to its
+ * occurrences, and we can only index them up to some horizon.
+ */
+static BOOL
+EventRecurs(BongoCalObject *cal)
+{
+    GArray *instances = BongoCalObjectGetInstances(cal);
+    unsigned int i;
+
+    for (i = 0; i < instances->len; i++) {
+        if (BongoCalInstanceHasRecurrences(g_array_index(instances, BongoCalInstance *, i))) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/** \internal
+ * Expand an event's recurrences, and add the occurrences starting in 
+ * [from, to) to the occurrence index. Times are UTC seconds.
+ * \return	0 on success, -1 on db error
+ */
+static int
+EventIndexOccurrences(StoreClient *client, uint64_t guid, BongoCalObject *cal,
+                      uint64_t from, uint64_t to)
+{
+    MsgSQLStatement stmt;
+    GArray *occs;
+    unsigned int i;
+    int result = 0;
+
+    occs = g_array_sized_new(FALSE, FALSE, sizeof(BongoCalOccurrence), 16);
+    BongoCalObjectCollect(cal, 
+                          BongoCalTimeNewFromUint64(from, FALSE, NULL),
+                          BongoCalTimeNewFromUint64(to, FALSE, NULL),
+                          NULL, TRUE, occs);
+
+    memset(&stmt, 0, sizeof(MsgSQLStatement));
+    if (MsgSQLPrepareCached(client->storedb, 
+            "INSERT INTO eventoccurrence (guid, start, end, span) VALUES (?1, ?2, ?3, ?4);",
+            &stmt) == NULL) 
+    {
+        result = -1;
+        goto finish;
+    }
+
+    for (i = 0; i < occs->len; i++) {
+        BongoCalOccurrence occ = g_array_index(occs, BongoCalOccurrence, i);
+        uint64_t start = BongoCalTimeAsUint64(occ.start);
+        uint64_t end = BongoCalTimeAsUint64(occ.end);
+
+        // we're given anything which overlaps the window, but an 
+        // occurrence which started before it was already indexed last time
+        if (start < from || start >= to) continue;
+        if (end < start) end = start;
+
+        MsgSQLBindInt64(&stmt, 1, guid);
+        MsgSQLBindInt64(&stmt, 2, start);
+        MsgSQLBindInt64(&stmt, 3, end);
+        MsgSQLBindInt64(&stmt, 4, end - start);
+        if (MsgSQLExecute(client->storedb, &stmt)) {
+            result = -1;
+            break;
+        }
+        MsgSQLEndStatement(&stmt);
+    }
+
+finish:
+    MsgSQLFinalize(&stmt);
+    g_array_free(occs, TRUE);
+    return result;
+}
+
+/** \internal
+ * Replace the index entries for an event: its summary row in 
+ * eventdocument, and its occurrences up to the horizon.
+ * \return	0 on success, -1 on db error
+ */
+static int
+EventIndex(StoreClient *client, StoreObject *event, BongoCalObject *cal)
+{
+    MsgSQLStatement stmt;
+    uint64_t start, end, horizon = 0, until;
+
+    start = BongoCalTimeAsUint64(BongoCalObjectGetStart(cal));
+    end = BongoCalTimeAsUint64(BongoCalObjectGetEnd(cal));
+    if (end < start) end = start;
+
+    // a one-off event is indexed completely; a recurring one as far as
+    // the horizon, which EVENTS moves on if it's asked to look further
+    until = end + 1;
+    if (EventRecurs(cal)) {
+        horizon = time(NULL) + (uint64_t)StoreAgent.store.eventHorizonDays * EVENT_DAY_SECONDS;
+        if (horizon > until) until = horizon;
+        horizon = until;
+    }
+
+    memset(&stmt, 0, sizeof(MsgSQLStatement));
+    if (MsgSQLBeginTransaction(client->storedb)) {
+        return -1;
+    }
+
+    if (SOQuery_RemoveEventByGUID(client, event->guid)) goto abort;
+
+    if (MsgSQLPrepareCached(client->storedb, 
+            "INSERT INTO eventdocument (guid, uid, summary, location, stamp, start, end, horizon) "
+            "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8);", &stmt) == NULL) 
+    {
+        goto abort;
+    }
+    MsgSQLBindInt64(&stmt, 1, event->guid);
+    MsgSQLBindString(&stmt, 2, BongoCalObjectGetUid(cal), TRUE);
+    MsgSQLBindString(&stmt, 3, BongoCalObjectGetSummary(cal), TRUE);
+    MsgSQLBindString(&stmt, 4, BongoCalObjectGetLocation(cal), TRUE);
+    MsgSQLBindString(&stmt, 5, BongoCalObjectGetStamp(cal), TRUE);
+    MsgSQLBindInt64(&stmt, 6, start);
+    MsgSQLBindInt64(&stmt, 7, end);
+    MsgSQLBindInt64(&stmt, 8, horizon);
+    if (MsgSQLExecute(client->storedb, &stmt)) goto abort;
+    MsgSQLFinalize(&stmt);
+
+    if (EventIndexOccurrences(client, event->guid, cal, 0, until)) goto abort;
+
+    if (MsgSQLCommitTransaction(client->storedb)) goto abort;
+    return 0;
+
+abort:
+    MsgSQLFinalize(&stmt);
+    MsgSQLAbortTransaction(client->storedb);
+    return -1;
+}
+
+/** \internal
+ * Load and parse an event document.
+ * \return	the parsed event, or NULL if it isn't a valid one
+ */
+static BongoCalObject *
+EventLoad(StoreClient *client, StoreObject *event)
+{
+    BongoJsonNode *node = NULL;
+    BongoCalObject *cal;
+
+    if (GetJson(client, event, &node, NULL) != BONGO_JSON_OK) {
+        return NULL;
+    }
+    if (node->type != BONGO_JSON_OBJECT) {
+        BongoJsonNodeFree(node);
+        return NULL;
+    }
+
+    cal = BongoCalObjectNew(BongoJsonNodeAsObject(node));
+
+    /* Don't need the node anymore */
+    BongoJsonNodeFreeSteal(node);
+
+    return cal;
+}
+
 // this is called on any event which is saved to the store
 const char *
 StoreProcessIncomingEvent(StoreClient *client,
                           StoreObject *event,
                           uint64_t linkGuid)
 {
-    BongoJsonNode *node = NULL;
-    BongoCalObject *cal = NULL;
-    //BongoCalTime start;
-    //BongoCalTime end;
+    BongoCalObject *cal;
+    const char *result = NULL;
 
 	if (linkGuid) {
 		// FIXME: Link this event into a calendar
 	}
 
-    /* FIXME */
+    cal = EventLoad(client, event);
+    if (!cal) {
+        return MSG4226BADEVENT;
+    }
 
-    if (GetJson(client, event, &node, NULL) != BONGO_JSON_OK)
-        goto parse_error;
+    if (EventIndex(client, event, cal)) {
+        result = MSG5005DBLIBERR;
+    }
 
-    if (node->type != BONGO_JSON_OBJECT)
-        goto parse_error;
-    
-    cal = BongoCalObjectNew(BongoJsonNodeAsObject(node));
+	StoreObjectSave(client, event); // FIXME: is this necessary?
+	BongoCalObjectFree(cal, TRUE);
+    return result;
+}
 
-    /* Don't need the node anymore */
-    BongoJsonNodeFreeSteal(node);
+/**
+ * Make sure the occurrence index covers every recurring event up to a
+ * given time, expanding events further where their horizon falls short.
+ * The horizon only ever moves out as far as eventHorizonLimitDays from
+ * now; beyond that, EVENTS doesn't see recurring events' occurrences.
+ * \param	client	Store client we're operating for
+ * \param	until	UTC time the index should reach
+ * \return	0 on success, -1 on db error
+ */
+int
+StoreEventsExtendHorizon(StoreClient *client, uint64_t until)
+{
+    MsgSQLStatement stmt, update;
+    GArray *pending;
+    uint64_t limit;
+    unsigned int i;
+    int status, result = 0;
 
-    //start = BongoCalObjectGetStart(cal);
-    //end = BongoCalObjectGetEnd(cal);
-    BongoCalObjectGetStart(cal);
-    BongoCalObjectGetEnd(cal);
-
-    /* Force to real times
-    start.isDate = FALSE;
-    end.isDate = FALSE;
-    */
-
-    /*
-     * FIXME: need to get these event-specific properties from the object
-     *
-    BongoCalTimeToIcal(start, info->data.event.start, sizeof(info->data.event.start));
-    BongoCalTimeToIcal(end, info->data.event.end, sizeof(info->data.event.end));    
-    
-    info->data.event.summary = BongoCalObjectGetSummary(cal);
-    info->data.event.location = BongoCalObjectGetLocation(cal);
-    info->data.event.uid = BongoCalObjectGetUid(cal);
-    info->data.event.stamp = BongoCalObjectGetStamp(cal);
-
-    if (DStoreSetEvent(client->handle, info) ||
-        DStoreSetDocInfo(client->handle, info)) 
+    limit = time(NULL) + (uint64_t)StoreAgent.store.eventHorizonLimitDays * EVENT_DAY_SECONDS;
+    if (until > limit) until = limit;
+
+    pending = g_array_new(FALSE, FALSE, sizeof(EventHorizon));
+    memset(&stmt, 0, sizeof(MsgSQLStatement));
+    memset(&update, 0, sizeof(MsgSQLStatement));
+
+    // find out what needs doing first, so we aren't reading and writing
+    // the same table at once
+    if (MsgSQLPrepareCached(client->storedb, 
+            "SELECT guid, horizon FROM eventdocument WHERE horizon > 0 AND horizon < ?1;", 
+            &stmt) == NULL) 
     {
+        result = -1;
+        goto finish;
+    }
+    MsgSQLBindInt64(&stmt, 1, until);
+    while ((status = MsgSQLResults(client->storedb, &stmt)) > 0) {
+        EventHorizon entry;
+
+        entry.guid = MsgSQLResultInt64(&stmt, 0);
+        entry.horizon = MsgSQLResultInt64(&stmt, 1);
+        g_array_append_val(pending, entry);
+    }
+    MsgSQLFinalize(&stmt);
+    if (status < 0) {
+        result = -1;
+        goto finish;
+    }
+
+    for (i = 0; i < pending->len; i++) {
+        EventHorizon *entry = &g_array_index(pending, EventHorizon, i);
+        StoreObject event;
+        BongoCalObject *cal;
+
+        if (StoreObjectFind(client, entry->guid, &event)) continue;
+        cal = EventLoad(client, &event);
+        if (!cal) continue;
+
+        if (MsgSQLBeginTransaction(client->storedb)) {
+            BongoCalObjectFree(cal, TRUE);
+            result = -1;
+            break;
+        }
+        if (EventIndexOccurrences(client, entry->guid, cal, entry->horizon, until) == 0 &&
+            MsgSQLPrepareCached(client->storedb, 
+                "UPDATE eventdocument SET horizon = ?1 WHERE guid = ?2;", &update) != NULL) 
+        {
+            MsgSQLBindInt64(&update, 1, until);
+            MsgSQLBindInt64(&update, 2, entry->guid);
+            status = MsgSQLExecute(client->storedb, &update);
+        } else {
+            status = -1;
+        }
+        MsgSQLFinalize(&update);
+
+        if (status || MsgSQLCommitTransaction(client->storedb)) {
+            MsgSQLAbortTransaction(client->storedb);
+            result = -1;
+        }
         BongoCalObjectFree(cal, TRUE);
-        return MSG5005DBLIBERR;
     }
-	*/
-	
-	StoreObjectSave(client, event); // FIXME: is this necessary?
-	BongoCalObjectFree(cal, TRUE);
-    return NULL;
 
-parse_error:
-    if (node) {
-        BongoJsonNodeFree(node);
+finish:
+    g_array_free(pending, TRUE);
+    return result;
+}
+
+/**
+ * Index every event in the store from scratch, for stores which had
+ * events before the occurrence index existed. Events which can't be
+ * parsed are left out, as they would be if they were saved now.
+ * \param	client	Store client we're operating for
+ * \return	0 on success, -1 on db error
+ */
+int
+StoreEventsReindex(StoreClient *client)
+{
+    MsgSQLStatement stmt;
+    GArray *pending;
+    unsigned int i;
+    int status, result = 0;
+
+    pending = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+    memset(&stmt, 0, sizeof(MsgSQLStatement));
+
+    if (MsgSQLPrepare(client->storedb, 
+            "SELECT guid FROM storeobject WHERE type = ?1;", &stmt) == NULL) 
+    {
+        result = -1;
+        goto finish;
     }
-    if (cal) {
+    MsgSQLBindInt(&stmt, 1, STORE_DOCTYPE_EVENT);
+    while ((status = MsgSQLResults(client->storedb, &stmt)) > 0) {
+        uint64_t guid = MsgSQLResultInt64(&stmt, 0);
+
+        g_array_append_val(pending, guid);
+    }
+    MsgSQLFinalize(&stmt);
+    if (status < 0) {
+        result = -1;
+        goto finish;
+    }
+
+    for (i = 0; i < pending->len && result == 0; i++) {
+        StoreObject event;
+        BongoCalObject *cal;
+
+        if (StoreObjectFind(client, g_array_index(pending, uint64_t, i), &event)) continue;
+        cal = EventLoad(client, &event);
+        if (!cal) continue;
+
+        result = EventIndex(client, &event, cal);
         BongoCalObjectFree(cal, TRUE);
     }
 
-    return MSG4226BADEVENT;
+finish:
+    g_array_free(pending, TRUE);
+    return result;
 }
 
 #if 0
@@ -28,6 +28,10 @@ XPL_BEGIN_C_LINKAGE
 
 const char * StoreProcessIncomingEvent(StoreClient *client, StoreObject *event, uint64_t linkGuid);
 
+int StoreEventsExtendHorizon(StoreClient *client, uint64_t until);
+
+int StoreEventsReindex(StoreClient *client);
+
 CCode StoreSetAlarm(StoreClient *client, StoreObject *event, const char *alarmtext);
 
 XPL_END_C_LINKAGE
@@ -0,0 +1,298 @@
+/** \file
+ * A durable log of what changed in each collection, for incremental sync.
+ *
+ * Every collection has a modification sequence number (modseq) which goes
+ * up by one whenever something in it is saved, flagged, moved or removed.
+ * The change log keeps one row per document in the collection, saying at
+ * which modseq it last changed and how, so a client which remembers the
+ * modseq it last saw can ask for just the changes since then rather than
+ * LISTing the whole collection again. A move shows up as a deletion from
+ * one collection and a new document in the other.
+ *
+ * Rows for removed documents (tombstones) would otherwise pile up, so they
+ * are compacted away once they're old enough. The collection's floor
+ * records the newest modseq forgotten that way: clients which last synced
+ * before it have to start again from a LIST.
+ *
+ * The log is written in the same transaction as the change itself, so it
+ * can't disagree with the storeobject table.
+ */
+
+#include <config.h>
+#include <xpl.h>
+#include <memmgr.h>
+#include <msgapi.h>
+
+#include "stored.h"
+
+/** \internal
+ * Work out what sort of change saving an object is, given what's in the
+ * store at the moment.
+ * \return	a mask of STORE_WATCH_EVENT_MODIFIED and STORE_WATCH_EVENT_FLAGS
+ */
+static int
+ChangeLogKind(const StoreObject *old, const StoreObject *object)
+{
+	int kind = 0;
+
+	if (old->flags != object->flags) {
+		kind |= STORE_WATCH_EVENT_FLAGS;
+	}
+	if (old->size != object->size || old->time_modified != object->time_modified ||
+	    old->imap_uid != object->imap_uid || strcmp(old->filename, object->filename))
+	{
+		kind |= STORE_WATCH_EVENT_MODIFIED;
+	}
+
+	// saved without any visible change; say so anyway, the caller meant it
+	return kind ? kind : STORE_WATCH_EVENT_MODIFIED;
+}
+
+/**
+ * Note a change to a document in a collection, giving it the collection's
+ * next modseq. Call within a transaction.
+ * \param	client		Store client we're operating for
+ * \param	collection	GUID of the collection the change happened in
+ * \param	guid		GUID of the document which changed
+ * \param	kind		STORE_WATCH_EVENT_* mask saying what happened
+ * \return	0 on success, -2 on failure
+ */
+int
+ChangeLogRecord(StoreClient *client, uint64_t collection, uint64_t guid, int kind)
+{
+	MsgSQLStatement stmt;
+	int status;
+
+	// stubs still being created, and the root, aren't in any collection
+	if (collection == 0 || collection == (uint64_t)-1) {
+		return 0;
+	}
+
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	if (MsgSQLPrepareCached(client->storedb, "INSERT OR IGNORE INTO modseq (collection_guid) VALUES (?1);", &stmt) == NULL) goto abort;
+	MsgSQLBindInt64(&stmt, 1, collection);
+	status = MsgSQLExecute(client->storedb, &stmt);
+	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+
+	if (MsgSQLPrepareCached(client->storedb, "UPDATE modseq SET modseq = modseq + 1 WHERE collection_guid = ?1;", &stmt) == NULL) goto abort;
+	MsgSQLBindInt64(&stmt, 1, collection);
+	status = MsgSQLExecute(client->storedb, &stmt);
+	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+
+	// a client which missed earlier changes to the document needs to
+	// hear about those too, unless the document went away in between
+	if (MsgSQLPrepareCached(client->storedb, "INSERT OR REPLACE INTO changelog (collection_guid, guid, modseq, kind, time) "
+	    "SELECT ?1, ?2, m.modseq, CASE WHEN ?3 = ?4 THEN ?3 ELSE ?3 | IFNULL((SELECT c.kind FROM changelog c "
+	    "WHERE c.collection_guid = ?1 AND c.guid = ?2 AND c.kind != ?4), 0) END, ?5 "
+	    "FROM modseq m WHERE m.collection_guid = ?1;", &stmt) == NULL) goto abort;
+	MsgSQLBindInt64(&stmt, 1, collection);
+	MsgSQLBindInt64(&stmt, 2, guid);
+	MsgSQLBindInt(&stmt, 3, kind);
+	MsgSQLBindInt(&stmt, 4, STORE_WATCH_EVENT_DELETED);
+	MsgSQLBindInt64(&stmt, 5, time(NULL));
+	status = MsgSQLExecute(client->storedb, &stmt);
+	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+
+	return 0;
+
+abort:
+	MsgSQLFinalize(&stmt);
+	return -2;
+}
+
+/**
+ * Note that an object is about to be saved, working out from the copy in
+ * the store whether it's new to its collection, has moved, or has just
+ * been changed. Call within the transaction which saves it.
+ * \param	old	The object as it is in the store now
+ * \param	object	The object about to be saved
+ * \return	0 on success, -2 on failure
+ */
+int
+ChangeLogSave(StoreClient *client, const StoreObject *old, StoreObject *object)
+{
+	if (old->collection_guid != object->collection_guid) {
+		if (ChangeLogRecord(client, old->collection_guid, object->guid, STORE_WATCH_EVENT_DELETED)) {
+			return -2;
+		}
+		return ChangeLogRecord(client, object->collection_guid, object->guid, STORE_WATCH_EVENT_NEW);
+	}
+
+	return ChangeLogRecord(client, object->collection_guid, object->guid, ChangeLogKind(old, object));
+}
+
+/**
+ * Forget the change log of a collection which is being removed. Call
+ * within a transaction.
+ * \return	0 on success, -2 on failure
+ */
+int
+ChangeLogForget(StoreClient *client, uint64_t collection)
+{
+	MsgSQLStatement stmt;
+	int status;
+
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	if (MsgSQLPrepareCached(client->storedb, "DELETE FROM changelog WHERE collection_guid = ?1;", &stmt) == NULL) goto abort;
+	MsgSQLBindInt64(&stmt, 1, collection);
+	status = MsgSQLExecute(client->storedb, &stmt);
+	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+
+	if (MsgSQLPrepareCached(client->storedb, "DELETE FROM modseq WHERE collection_guid = ?1;", &stmt) == NULL) goto abort;
+	MsgSQLBindInt64(&stmt, 1, collection);
+	status = MsgSQLExecute(client->storedb, &stmt);
+	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+
+	return 0;
+
+abort:
+	MsgSQLFinalize(&stmt);
+	return -2;
+}
+
+/**
+ * Find out where a collection's change log has got to.
+ * \param	modseq	Output for the collection's current modseq
+ * \param	floor	Output for the oldest modseq changes can be asked for since
+ * \return	0 on success, -2 on failure
+ */
+int
+ChangeLogGetModseq(StoreClient *client, uint64_t collection, uint64_t *modseq, uint64_t *floor)
+{
+	MsgSQLStatement stmt;
+	int result;
+
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	if (MsgSQLPrepareCached(client->storedb, "SELECT modseq, floor FROM modseq WHERE collection_guid = ?1;", &stmt) == NULL) {
+		return -2;
+	}
+	MsgSQLBindInt64(&stmt, 1, collection);
+
+	// collections nothing has happened in yet have no row
+	*modseq = *floor = 0;
+	result = MsgSQLResults(client->storedb, &stmt);
+	if (result > 0) {
+		*modseq = MsgSQLResultInt64(&stmt, 0);
+		*floor = MsgSQLResultInt64(&stmt, 1);
+	}
+	MsgSQLFinalize(&stmt);
+
+	return (result < 0) ? -2 : 0;
+}
+
+/**
+ * Find out at which modseq a document last changed in its collection.
+ * \param	modseq	Output for the document's modseq; 0 if it hasn't changed
+ *			since the collection's change log began
+ * \return	0 on success, -2 on failure
+ */
+int
+ChangeLogGetDocumentModseq(StoreClient *client, uint64_t collection, uint64_t guid, uint64_t *modseq)
+{
+	MsgSQLStatement stmt;
+	int result;
+
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	if (MsgSQLPrepareCached(client->storedb, "SELECT modseq FROM changelog WHERE collection_guid = ?1 AND guid = ?2;", &stmt) == NULL) {
+		return -2;
+	}
+	MsgSQLBindInt64(&stmt, 1, collection);
+	MsgSQLBindInt64(&stmt, 2, guid);
+
+	*modseq = 0;
+	result = MsgSQLResults(client->storedb, &stmt);
+	if (result > 0) {
+		*modseq = MsgSQLResultInt64(&stmt, 0);
+	}
+	MsgSQLFinalize(&stmt);
+
+	return (result < 0) ? -2 : 0;
+}
+
+/**
+ * Write out a 2001 line for each document in a collection which changed
+ * after a given modseq, oldest change first:
+ * "2001 <guid> <modseq> <kind> <imap uid> <flags>". The uid and flags are
+ * those the document has now, and are 0 for documents which have gone.
+ * \return	the result of the last write, or -2 on database failure
+ */
+CCode
+ChangeLogWrite(StoreClient *client, StoreObject *collection, uint64_t since)
+{
+	MsgSQLStatement stmt;
+	CCode ccode = 0;
+	int result = 0;
+
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	if (MsgSQLPrepareCached(client->storedb, "SELECT c.guid, c.modseq, c.kind, IFNULL(so.imap_uid, 0), IFNULL(so.flags, 0) "
+	    "FROM changelog c LEFT JOIN storeobject so ON so.guid = c.guid AND so.collection_guid = c.collection_guid "
+	    "WHERE c.collection_guid = ?1 AND c.modseq > ?2 ORDER BY c.modseq;", &stmt) == NULL) {
+		return -2;
+	}
+	MsgSQLBindInt64(&stmt, 1, collection->guid);
+	MsgSQLBindInt64(&stmt, 2, since);
+
+	while (ccode >= 0 && (result = MsgSQLResults(client->storedb, &stmt)) > 0) {
+		ccode = ConnWriteF(client->conn, "2001 " GUID_FMT " " FMT_UINT64_DEC " %d %d %d\r\n",
+			MsgSQLResultInt64(&stmt, 0), MsgSQLResultInt64(&stmt, 1),
+			MsgSQLResultInt(&stmt, 2), MsgSQLResultInt(&stmt, 3),
+			MsgSQLResultInt(&stmt, 4));
+	}
+	MsgSQLFinalize(&stmt);
+
+	return (ccode >= 0 && result < 0) ? -2 : ccode;
+}
+
+/**
+ * Drop the tombstones of documents removed longer ago than the configured
+ * retention period from a store's change log, raising each collection's
+ * floor past them. Runs on the database pool's maintenance thread, so
+ * takes its own transaction and leaves the handle's statement cache alone.
+ * \return	0 on success, -1 on failure
+ */
+int
+ChangeLogCompact(MsgSQLHandle *handle)
+{
+	MsgSQLStatement stmt;
+	uint64_t before;
+	int status;
+
+	if (StoreAgent.store.changeLogRetention <= 0) {
+		return 0;
+	}
+	before = time(NULL) - StoreAgent.store.changeLogRetention;
+
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	if (MsgSQLBeginTransaction(handle)) {
+		return -1;
+	}
+
+	if (MsgSQLPrepare(handle, "UPDATE modseq SET floor = MAX(floor, (SELECT MAX(c.modseq) FROM changelog c "
+	    "WHERE c.collection_guid = modseq.collection_guid AND c.kind = ?1 AND c.time < ?2)) "
+	    "WHERE collection_guid IN (SELECT collection_guid FROM changelog WHERE kind = ?1 AND time < ?2);", &stmt) == NULL) goto abort;
+	MsgSQLBindInt(&stmt, 1, STORE_WATCH_EVENT_DELETED);
+	MsgSQLBindInt64(&stmt, 2, before);
+	status = MsgSQLExecute(handle, &stmt);
+	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+
+	if (MsgSQLPrepare(handle, "DELETE FROM changelog WHERE kind = ?1 AND time < ?2;", &stmt) == NULL) goto abort;
+	MsgSQLBindInt(&stmt, 1, STORE_WATCH_EVENT_DELETED);
+	MsgSQLBindInt64(&stmt, 2, before);
+	status = MsgSQLExecute(handle, &stmt);
+	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+
+	if (MsgSQLCommitTransaction(handle)) goto abort;
+	return 0;
+
+abort:
+	MsgSQLFinalize(&stmt);
+	MsgSQLAbortTransaction(handle);
+	return -1;
+}
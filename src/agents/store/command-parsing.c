@@ -200,6 +200,40 @@ ParseInt(StoreClient *client, const char const *token, int *out)
 }
 
 
+/* [-]date, [-]uid, [-]size or [-]guid: the orders we can sort a LIST in
+   on the server, and carry on from a given document. Mail can also be
+   sorted by [-]sent, [-]subject or [-]from, but not carried on from;
+   those orders list only the mail in a collection. */
+CCode
+ParseListOrder(StoreClient *client, char *token, const char **propOut, BOOL *ascendingOut)
+{
+	*ascendingOut = TRUE;
+	if ('-' == *token) {
+		*ascendingOut = FALSE;
+		token++;
+	}
+
+	if (!strcmp(token, "date")) {
+		*propOut = "nmap.created";
+	} else if (!strcmp(token, "uid")) {
+		*propOut = "nmap.mail.imapuid";
+	} else if (!strcmp(token, "size")) {
+		*propOut = "nmap.length";
+	} else if (!strcmp(token, "guid")) {
+		*propOut = "nmap.guid";
+	} else if (!strcmp(token, "sent")) {
+		*propOut = "nmap.mail.sent";
+	} else if (!strcmp(token, "subject")) {
+		*propOut = "nmap.mail.subject";
+	} else if (!strcmp(token, "from")) {
+		*propOut = "nmap.mail.senders";
+	} else {
+		return ConnWriteStr(client->conn, MSG3022BADSYNTAX);
+	}
+	return TOKEN_OK;
+}
+
+
 CCode
 ParseStreamLength(StoreClient *client, char *token, int *out) 
 {
@@ -584,6 +618,46 @@ ParsePropList(StoreClient *client,
 }
 
 
+CCode
+ParseDocumentList(StoreClient *client,
+                  char *token,
+                  uint64_t *guids,
+                  int *lengths,
+                  int size,
+                  int *count)
+{
+	/* <documentlist> ::= (<documentlist> ',') <guid> ('/' <length>) */
+
+	int i;
+	char *p = token;
+	char *q;
+	CCode ccode = TOKEN_OK;
+
+	for (i = 0; i < size && p && TOKEN_OK == ccode; i++) {
+		lengths[i] = 0;
+		p = strchr(token, ',');
+		if (p) {
+			*p = 0;
+		}
+		q = strchr(token, '/');
+		if (q) {
+			ccode = ParseInt(client, q + 1, &lengths[i]);
+			if (TOKEN_OK != ccode) {
+				return ccode;
+			}
+			*q = 0;
+		}
+		ccode = ParseGUID(client, token, &guids[i]);
+		token = p + 1;
+	}
+	if (p && TOKEN_OK == ccode) {
+		return ConnWriteStr(client->conn, MSG3010BADARGC);
+	}
+	*count = i;
+	return ccode;
+}
+
+
 CCode
 ParseHeaderList(StoreClient *client, 
                 char *token,
@@ -21,6 +21,7 @@ CCode	ParseDateTimeToUint64(StoreClient *client, char *token, uint64_t *timeOut)
 CCode	ParseDateTimeToString(StoreClient *client, char *token, char *buffer, int buflen);
 CCode	ParseDateRange(StoreClient *client, char *token, char *startOut, char *endOut);
 CCode	ParseFlag(StoreClient *client, char *token, int *valueOut, int *actionOut);
+CCode	ParseListOrder(StoreClient *client, char *token, const char **propOut, BOOL *ascendingOut);
 
 // parse simple types and return complex data
 CCode	ParseCollection(StoreClient *client, char *token, StoreObject *collection);
@@ -33,6 +34,7 @@ CCode	ParsePropName(StoreClient *client, char *token, StorePropInfo *prop);
 CCode	ParsePropList(StoreClient *client, char *token, StorePropInfo * props, int propcount, int *count, int requireLengths);
 CCode	ParsePrivilege(StoreClient *client, const char const *token, StorePrivilege *priv);
 CCode	ParsePrincipal(StoreClient *client, const char const *token, StorePrincipalType *type);
+CCode	ParseDocumentList(StoreClient *client, char *token, uint64_t *guids, int *lengths, int size, int *count);
 CCode	ParseHeaderList(StoreClient *client, char *token, StoreHeaderInfo *headers, int size, int *count);
 CCode	ParseStoreName(StoreClient *client, char *token);
 CCode	ParseUserName(StoreClient *client, char *token);
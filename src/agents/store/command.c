@@ -114,6 +114,7 @@ StoreSetupCommands()
         BongoHashtablePutNoReplace(CommandTable, "USER", (void *) STORE_COMMAND_USER) ||
         
         /* collection commands */
+        BongoHashtablePutNoReplace(CommandTable, "CHANGES", (void *) STORE_COMMAND_CHANGES) ||
         BongoHashtablePutNoReplace(CommandTable, "COLLECTIONS", 
                          (void *) STORE_COMMAND_COLLECTIONS) ||
         BongoHashtablePutNoReplace(CommandTable, "CREATE", (void *) STORE_COMMAND_CREATE) ||
@@ -123,12 +124,15 @@ StoreSetupCommands()
         BongoHashtablePutNoReplace(CommandTable, "RENAME", (void *) STORE_COMMAND_RENAME) ||
         BongoHashtablePutNoReplace(CommandTable, "REMOVE", (void *) STORE_COMMAND_REMOVE) ||
         BongoHashtablePutNoReplace(CommandTable, "SEARCH", (void *) STORE_COMMAND_SEARCH) ||
+        BongoHashtablePutNoReplace(CommandTable, "STATUS", (void *) STORE_COMMAND_STATUS) ||
         BongoHashtablePutNoReplace(CommandTable, "WATCH", (void *) STORE_COMMAND_WATCH) ||
+        BongoHashtablePutNoReplace(CommandTable, "IDLE", (void *) STORE_COMMAND_IDLE) ||
         BongoHashtablePutNoReplace(CommandTable, "REPAIR", (void *) STORE_COMMAND_REPAIR) ||
 
         /* document commands */
         BongoHashtablePutNoReplace(CommandTable, "COPY", (void *) STORE_COMMAND_COPY) ||
         BongoHashtablePutNoReplace(CommandTable, "DELETE", (void *) STORE_COMMAND_DELETE) ||
+        BongoHashtablePutNoReplace(CommandTable, "DETAILS", (void *) STORE_COMMAND_DETAILS) ||
         BongoHashtablePutNoReplace(CommandTable, "FLAG", (void *) STORE_COMMAND_FLAG) ||
         BongoHashtablePutNoReplace(CommandTable, "INFO", (void *) STORE_COMMAND_INFO) ||
         BongoHashtablePutNoReplace(CommandTable, "LINK", (void *) STORE_COMMAND_LINK) ||
@@ -153,6 +157,9 @@ StoreSetupCommands()
         /* index commands */
         BongoHashtablePutNoReplace(CommandTable, "ISEARCH", (void *) STORE_COMMAND_ISEARCH) ||
 
+        /* delivery commands */
+        BongoHashtablePutNoReplace(CommandTable, "DELIVER", (void *) STORE_COMMAND_DELIVER) ||
+
         /* calendar commands */
         BongoHashtablePutNoReplace(CommandTable, "CALENDARS", 
                          (void *) STORE_COMMAND_CALENDARS) ||
@@ -165,6 +172,7 @@ StoreSetupCommands()
         /* other */
         BongoHashtablePutNoReplace(CommandTable, "ACL", (void *) STORE_COMMAND_ACL) ||
         BongoHashtablePutNoReplace(CommandTable, "NOOP", (void *) STORE_COMMAND_NOOP) || 
+        BongoHashtablePutNoReplace(CommandTable, "STATS", (void *) STORE_COMMAND_STATS) || 
         BongoHashtablePutNoReplace(CommandTable, "TIMEOUT", (void *) STORE_COMMAND_TIMEOUT) || 
 
         /* debugging commands */
@@ -238,6 +246,7 @@ RequireIdentity(StoreClient *client)
 #define TOK_ARR_SZ 10
 #define PROP_ARR_SZ 10
 #define HDR_ARR_SZ 10
+#define DOC_ARR_SZ 64
 
 CCode
 StoreCommandLoop(StoreClient *client)
@@ -305,8 +314,11 @@ StoreCommandLoop(StoreClient *client)
             StorePropInfo props[PROP_ARR_SZ];
             StoreHeaderInfo hdrs[HDR_ARR_SZ];
             int hdrcnt;
+            uint64_t docs[DOC_ARR_SZ];
+            int lengths[DOC_ARR_SZ];
             char dt_start[BONGO_CAL_TIME_BUFSIZE];
             char dt_end[BONGO_CAL_TIME_BUFSIZE];
+            StoreListOptions listopts;
 
         case STORE_COMMAND_NULL:
             ccode = ConnWriteStr(client->conn, MSG3000UNKNOWN);
@@ -500,6 +512,23 @@ StoreCommandLoop(StoreClient *client)
             }
             break;
 
+        case STORE_COMMAND_CHANGES:
+            /* CHANGES <collection> [<modseq>] */
+
+            if (TOKEN_OK == (ccode = RequireStore(client)) &&
+                TOKEN_OK == (ccode = CheckTokC(client, n, 2, 3)) &&
+                TOKEN_OK == (ccode = ParseCollection(client, tokens[1], &object)))
+            {
+                ulong = 0;
+                if (3 == n) {
+                    ccode = ParseUnsignedLong(client, tokens[2], &ulong);
+                }
+                if (TOKEN_OK == ccode) {
+                    ccode = StoreCommandCHANGES(client, &object, 3 == n, (uint64_t) ulong);
+                }
+            }
+            break;
+
         case STORE_COMMAND_COLLECTIONS:
             /* COLLECTIONS [<collection>] */
 
@@ -665,6 +694,73 @@ StoreCommandLoop(StoreClient *client)
             }
             break;
 
+        case STORE_COMMAND_DELIVER:
+            /* DELIVER <type> <length> [T<timeCreated>] [Z<flags>]
+               followed by "<store> <collection>" lines and an empty line.
+               Leaves no store selected.
+             */
+
+            if (TOKEN_OK != (ccode = RequireManager(client)) ||
+                TOKEN_OK != (ccode = CheckTokC(client, n, 3, 5)) ||
+                TOKEN_OK != (ccode = ParseDocType(client, tokens[1], &doctype)) ||
+                TOKEN_OK != (ccode = ParseStreamLength(client, tokens[2], &int1)))
+            {
+                break;
+            }
+
+            timestamp = 0;
+            ulong = 0; /* addflags */
+
+            for (i = 3; i < n; i++) {
+                if ('T' == *tokens[i] && !timestamp) {
+                    ccode = ParseDateTimeToUint64(client, 1 + tokens[i], &timestamp); 
+                } else if ('Z' == *tokens[i] && !ulong) {
+                    ccode = ParseUnsignedLong(client, tokens[i] + 1, &ulong);
+                } else {
+                    ccode = ConnWriteStr(client->conn, MSG3022BADSYNTAX);
+                }
+                if (TOKEN_OK != ccode) {
+                    break;
+                }
+            }
+            if (TOKEN_OK != ccode) {
+                break;
+            }
+
+            ccode = StoreCommandDELIVER(client, doctype, int1, (uint32_t) ulong, 
+                                        timestamp);
+            break;
+
+        case STORE_COMMAND_DETAILS:
+            /* DETAILS <guid>[/<headerlength>][,<guid>[/<headerlength>]...] [H] [M] */
+
+            if (TOKEN_OK != (ccode = RequireStore(client)) ||
+                TOKEN_OK != (ccode = CheckTokC(client, n, 2, 4)) ||
+                TOKEN_OK != (ccode = ParseDocumentList(client, tokens[1], docs, lengths, 
+                                                       DOC_ARR_SZ, &int3)))
+            {
+                break;
+            }
+
+            int1 = 0; /* headers */
+            int2 = 0; /* mime reports */
+            for (i = 2; i < n; i++) {
+                if ('H' == *tokens[i] && !int1 && !tokens[i][1]) {
+                    int1 = 1;
+                } else if ('M' == *tokens[i] && !int2 && !tokens[i][1]) {
+                    int2 = 1;
+                } else {
+                    ccode = ConnWriteStr(client->conn, MSG3022BADSYNTAX);
+                    break;
+                }
+            }
+            if (TOKEN_OK != ccode) {
+                break;
+            }
+
+            ccode = StoreCommandDETAILS(client, docs, lengths, int3, int1, int2);
+            break;
+
         case STORE_COMMAND_EVENTS:
             /* EVENTS [D<daterange>] [C<calendar> | U<uid>] 
                [F<mask>] [Q<query>] [P<proplist>] */
@@ -721,17 +817,33 @@ StoreCommandLoop(StoreClient *client)
             break;
 
         case STORE_COMMAND_FLAG:
-            /* FLAG <document> [[+ | -]<value>] */
+            /* FLAG <document> [[+ | -]<value> [<modseq>]]
+               with a modseq, the change is only made if the document
+               hasn't changed since then */
 
             int2 = STORE_FLAG_SHOW;             
             guid = 0;
+            ulong = 0;
             if (TOKEN_OK == (ccode = RequireStore(client)) &&
-                TOKEN_OK == (ccode = CheckTokC(client, n, 2, 3)) &&
+                TOKEN_OK == (ccode = CheckTokC(client, n, 2, 4)) &&
                 TOKEN_OK == (ccode = ParseDocument(client, tokens[1], &object)) &&
-                (n < 3 || TOKEN_OK == (ccode = ParseFlag(client, tokens[2], &int1, &int2)))) 
+                (n < 3 || TOKEN_OK == (ccode = ParseFlag(client, tokens[2], &int1, &int2))) &&
+                (n < 4 || TOKEN_OK == (ccode = ParseUnsignedLong(client, tokens[3], &ulong)))) 
                 
             {
-                ccode = StoreCommandFLAG(client, &object, int1, int2);
+                ccode = StoreCommandFLAG(client, &object, int1, int2, 4 == n, (uint64_t) ulong);
+            }
+            break;
+
+        case STORE_COMMAND_IDLE:
+            /* IDLE 
+               events for the watched collection are sent as they happen,
+               until the client sends DONE */
+
+            if (TOKEN_OK == (ccode = RequireStore(client)) &&
+                TOKEN_OK == (ccode = CheckTokC(client, n, 1, 1)))
+            {
+                ccode = StoreCommandIDLE(client);
             }
             break;
 
@@ -828,10 +940,11 @@ StoreCommandLoop(StoreClient *client)
             break; 
 
         case STORE_COMMAND_LIST:
-            /* LIST <collection> [Rxx-xx] [P<proplist>] [M<flags mask>] [F<flags>] [Q<query>] */
+            /* LIST <collection> [Rxx-xx] [P<proplist>] [M<flags mask>] [F<flags>] [Q<query>]
+                                 [O[-]<order>] [A<after document>] [C<fieldlist>] */
 
             if (TOKEN_OK != (ccode = RequireStore(client)) ||
-                TOKEN_OK != (ccode = CheckTokC(client, n, 2, 6)) ||
+                TOKEN_OK != (ccode = CheckTokC(client, n, 2, 9)) ||
                 TOKEN_OK != (ccode = ParseCollection(client, tokens[1], &object))) 
             {
                 break;
@@ -842,6 +955,7 @@ StoreCommandLoop(StoreClient *client)
             ulong = 0;  /* flags mask */
             ulong2 = 0; /* flags */
             query = NULL; /* query */
+            memset(&listopts, 0, sizeof(StoreListOptions));
             for (i = 2; TOKEN_OK == ccode && i < n; i++) {
                 if ('R' == *tokens[i] && -1 == int1) {
                     ccode = ParseRange(client, tokens[i] + 1, &int1, &int2);
@@ -855,6 +969,15 @@ StoreCommandLoop(StoreClient *client)
                 } else if ('Q' == *tokens[i]) {
                     query = tokens[i] + 1;
                     ccode = TOKEN_OK;
+                } else if ('O' == *tokens[i] && NULL == listopts.order_prop) {
+                    ccode = ParseListOrder(client, tokens[i] + 1, 
+                                           &listopts.order_prop, &listopts.ascending);
+                } else if ('A' == *tokens[i] && NULL == listopts.after) {
+                    ccode = ParseDocument(client, tokens[i] + 1, &collection);
+                    listopts.after = &collection;
+                } else if ('C' == *tokens[i] && NULL == listopts.fields) {
+                    listopts.fields = tokens[i] + 1;
+                    ccode = TOKEN_OK;
                 } else {
                     ccode = ConnWriteStr(client->conn, MSG3022BADSYNTAX);
                 }
@@ -866,7 +989,7 @@ StoreCommandLoop(StoreClient *client)
             
             ccode = StoreCommandLIST(client, &object, int1, int2, 
                                      (uint32_t) ulong, (uint32_t) ulong2, 
-                                     props, int3, query);
+                                     props, int3, query, &listopts);
             break;            
 
         case STORE_COMMAND_MAILINGLISTS:
@@ -1024,13 +1147,12 @@ StoreCommandLoop(StoreClient *client)
         case STORE_COMMAND_REINDEX:
             /* REINDEX [<document>] */
             
-            guid = 0;
             if (TOKEN_OK == (ccode = RequireStore(client)) &&
                 TOKEN_OK == (ccode = CheckTokC(client, n, 1, 2)) &&
                 (n < 2 || 
                  TOKEN_OK == (ccode = ParseDocument(client, tokens[1], &object))))
             {
-                ccode = StoreCommandREINDEX(client, &object);
+                ccode = StoreCommandREINDEX(client, (n < 2) ? NULL : &object);
             }
             break;
 
@@ -1113,6 +1235,7 @@ StoreCommandLoop(StoreClient *client)
                SEARCH <document or collection> BODY <query>
                SEARCH <document or collection> HEADER <header> <query>
                SEARCH <document or collection> HEADERS <query>
+               SEARCH <collection> QUERY <query>
             */
 
             if (TOKEN_OK != (ccode = RequireStore(client)) ||
@@ -1141,6 +1264,9 @@ StoreCommandLoop(StoreClient *client)
                 } else if (0 == XplStrCaseCmp(tokens[2], "HEADERS")) {
                     search.type = STORE_SEARCH_HEADERS;
                     search.query = tokens[3];
+                } else if (0 == XplStrCaseCmp(tokens[2], "QUERY")) {
+                    search.type = STORE_SEARCH_QUERY;
+                    search.query = tokens[3];
                 } else {
                     ccode = ConnWriteStr(client->conn, MSG3000UNKNOWN);
                     break;
@@ -1155,6 +1281,27 @@ StoreCommandLoop(StoreClient *client)
             exit(0);
             break;
         
+        case STORE_COMMAND_STATS:
+            /* STATS */
+
+            if (TOKEN_OK == (ccode = RequireManager(client)) &&
+                TOKEN_OK == (ccode = CheckTokC(client, n, 1, 1)))
+            {
+                ccode = StoreCommandSTATS(client);
+            }
+            break;
+
+        case STORE_COMMAND_STATUS:
+            /* STATUS <collection> */
+
+            if (TOKEN_OK == (ccode = RequireStore(client)) &&
+                TOKEN_OK == (ccode = CheckTokC(client, n, 2, 2)) &&
+                TOKEN_OK == (ccode = ParseCollection(client, tokens[1], &object)))
+            {
+                ccode = StoreCommandSTATUS(client, &object);
+            }
+            break;
+
         case STORE_COMMAND_STORES:
             if (TOKEN_OK == (ccode = RequireIdentity(client))) {
                 ccode = StoreCommandSTORES(client);
@@ -1330,7 +1477,9 @@ StoreCommandLoop(StoreClient *client)
             break;
         }
 
-        if (ccode >= 0) {
+        // if the client has already sent more commands, let the replies
+        // build up and go out together once we've caught up with it
+        if (ccode >= 0 && !ConnLinePending(client->conn)) {
             ccode = ConnFlush(client->conn);
         }
     
@@ -1476,7 +1625,78 @@ StoreCommandCALENDARS(StoreClient *client, unsigned long mask,
 	if (ccode) return ConnWriteStr(client->conn, MSG4240NOPERMISSION);
 	
 	return StoreObjectIterCollectionContents(client, &calendar_collection, -1, 
-		-1, 0, 0, props, propcount, "= nmap.type 6", NULL, FALSE);
+		-1, 0, 0, props, propcount, "= nmap.type 6", NULL, NULL, FALSE);
+}
+
+// list what changed in a collection since the client last looked; without
+// a modseq, just say where the collection has got to
+// [LOCKING] Changes(X) => RoLock(X)
+CCode
+StoreCommandCHANGES(StoreClient *client, StoreObject *collection,
+                    BOOL list, uint64_t since)
+{
+	uint64_t modseq, floor;
+	CCode ccode;
+
+	ccode = StoreObjectCheckAuthorization(client, collection, STORE_PRIV_LIST);
+	if (ccode) return ConnWriteStr(client->conn, MSG4240NOPERMISSION);
+
+	// nothing can be written to the collection while we read its log
+	if (! LogicalLockGain(client, collection, LLOCK_READONLY, "StoreCommandCHANGES"))
+		return ConnWriteStr(client->conn, MSG4120BOXLOCKED);
+
+	if (ChangeLogGetModseq(client, collection->guid, &modseq, &floor)) {
+		ccode = ConnWriteStr(client->conn, MSG5005DBLIBERR);
+		goto finish;
+	}
+
+	if (list) {
+		if (since < floor || since > modseq) {
+			ccode = ConnWriteStr(client->conn, MSG4263CHANGESGONE);
+			goto finish;
+		}
+		ccode = ChangeLogWrite(client, collection, since);
+		if (ccode == -2) {
+			ccode = ConnWriteStr(client->conn, MSG5005DBLIBERR);
+			goto finish;
+		}
+		if (ccode < 0) goto finish;
+	}
+
+	ccode = ConnWriteF(client->conn, "1000 " FMT_UINT64_DEC "\r\n", modseq);
+
+finish:
+	LogicalLockRelease(client, collection, LLOCK_READONLY, "StoreCommandCHANGES");
+	return ccode;
+}
+
+// say how much is in a collection, from the totals the object model
+// keeps, so pollers needn't LIST it:
+// "1000 <documents> <unseen> <deleted> <bytes>"
+// [LOCKING] Status(X) => RoLock(X)
+CCode
+StoreCommandSTATUS(StoreClient *client, StoreObject *collection)
+{
+	CollectionCounts counts;
+	CCode ccode;
+
+	ccode = StoreObjectCheckAuthorization(client, collection, STORE_PRIV_LIST);
+	if (ccode) return ConnWriteStr(client->conn, MSG4240NOPERMISSION);
+
+	if (! LogicalLockGain(client, collection, LLOCK_READONLY, "StoreCommandSTATUS"))
+		return ConnWriteStr(client->conn, MSG4120BOXLOCKED);
+
+	ccode = CollectionCountsGet(client, collection->guid, &counts);
+
+	LogicalLockRelease(client, collection, LLOCK_READONLY, "StoreCommandSTATUS");
+
+	if (ccode) {
+		return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+	}
+
+	return ConnWriteF(client->conn, "1000 " FMT_UINT64_DEC " " FMT_UINT64_DEC " "
+		FMT_UINT64_DEC " " FMT_UINT64_DEC "\r\n",
+		counts.messages, counts.unseen, counts.deleted, counts.bytes);
 }
 
 // list the collections who are subcollections of container
@@ -1526,6 +1746,7 @@ StoreCommandCONVERSATIONS(StoreClient *client, const char *source, const char *q
 {
 	int ccode;
 	StoreObject conversation_collection;
+	StoreListOptions options;
 	BOOL show_total;
 	
 	UNUSED_PARAMETER_REFACTOR(headers);
@@ -1543,8 +1764,14 @@ StoreCommandCONVERSATIONS(StoreClient *client, const char *source, const char *q
 	
 	show_total = (displayTotal == 0)? FALSE : TRUE;
 	
+	// newest activity first; the conversation date index gives us a
+	// page of these without looking at the rest
+	memset(&options, 0, sizeof(StoreListOptions));
+	options.order_prop = "nmap.conversation.date";
+	options.ascending = FALSE;
 	return StoreObjectIterCollectionContents(client, &conversation_collection, start, 
-		end, flagsmask, flags, props, propcount, NULL, query, show_total);
+		end, flagsmask, flags, props, propcount, NULL, query, 
+		&options, show_total);
 }
 
 // [LOCKING] Copy(X to Y) => RoLock(X), RwLock(Y)
@@ -1565,13 +1792,14 @@ StoreCommandCOPY(StoreClient *client, StoreObject *object, StoreObject *collecti
 	// check the parameters are ok and the document exists   
 	if (STORE_IS_FOLDER(object->type)) return ConnWriteStr(client->conn, MSG3015BADDOCTYPE);
 	
-	// take a RO lock on the source to ensure it doesn't change while we copy it
-	if (! LogicalLockGain(client, object, LLOCK_READONLY, "StoreCommandCopy"))
-		return ConnWriteStr(client->conn, MSG4120BOXLOCKED);
-
-	/* xLock is set */
+	// take a RO lock on the source to ensure it doesn't change while we copy it,
+	// and a RW lock on the collection we're copying into
 	xLock = LLOCK_READONLY;
 	xObject = object;
+	yLock = LLOCK_READWRITE;
+	yObject = collection;
+	if (! LogicalLockGainPair(client, xObject, &xLock, yObject, &yLock, "StoreCommandCOPY"))
+		return ConnWriteStr(client->conn, MSG4120BOXLOCKED);
 	
 	// check authorization on the parent collection
 	ccode = StoreObjectCheckAuthorization(client, collection, STORE_PRIV_BIND | STORE_PRIV_READ);
@@ -1623,17 +1851,7 @@ StoreCommandCOPY(StoreClient *client, StoreObject *object, StoreObject *collecti
 	}
 	unlink(srcpath);
 	
-	// update metadata, at this point we need our RW-lock  this is the y lock
-	// FIXME:  We do store level locking so skip this....
-	/*
-	 if (! LogicalLockGain(client, collection, LLOCK_READWRITE, "StoreCommandCOPY")) {
-		ccode = ConnWriteStr(client->conn, MSG4120BOXLOCKED);
-		goto finish;
-	}
-	yLock = LLOCK_READWRITE;
-	yObject = collection;
-	*/
-
+	// update metadata
 	newobject.collection_guid = collection->guid;
 	newobject.time_created = newobject.time_modified = time(NULL);
 	
@@ -1644,9 +1862,8 @@ StoreCommandCOPY(StoreClient *client, StoreObject *object, StoreObject *collecti
 	StoreObjectUpdateImapUID(client, &newobject);
 	
 	/* release the [xy]locks */
-	//FIXME: Store level lock!!
-	//LogicalLockRelease(client, yObject, yLock, "StoreCommandCOPY");
-	LogicalLockRelease(client, xObject, xLock, "StoreCommandCOPY");
+	if (yLock != LLOCK_NONE) LogicalLockRelease(client, yObject, yLock, "StoreCommandCOPY");
+	if (xLock != LLOCK_NONE) LogicalLockRelease(client, xObject, xLock, "StoreCommandCOPY");
 	xLock = yLock = LLOCK_NONE;
 	
 	++client->stats.insertions;
@@ -1862,7 +2079,7 @@ StoreCommandDELETE(StoreClient *client, StoreObject *object)
 	
 	// Remove the file content from the filesystem
 	FindPathToDocument(client, object->collection_guid, object->guid, path, sizeof(path));
-	if (unlink(path) != 0) {
+	if (BlobStoreUnlink(path) != 0) {
 		ccode = ConnWriteStr(client->conn, MSG4228CANTWRITEMBOX);
 		goto finish;
 	}
@@ -1878,183 +2095,873 @@ finish:
 	return ccode;
 }
 
-CCode 
-StoreCommandEVENTS(StoreClient *client, 
-                   char *startUTC, char *endUTC, 
-                   StoreObject *calendar, 
-                   unsigned int mask,
-                   char *uid,
-                   const char *query,
-                   int start, int end,
-                   StorePropInfo *props, int propcount)
+// most targets a single DELIVER will accept
+#define DELIVER_MAX_TARGETS 1000
+
+typedef struct {
+	char *store;
+	char *collection;
+	BOOL done;
+	const char *result;	// error message, or NULL if it was delivered
+	char *staged;		// its own copy of the document, already on disk
+	StoreObject document;
+} DeliverTarget;
+
+/** \internal
+ * Copy the document received by DELIVER into place for one of its targets.
+ * \param	now	Sync the copy straight away, rather than leaving it to
+ *			the next group commit
+ */
+static int
+DeliverCopyFile(const char *from, const char *to, BOOL now)
 {
-	// pretend we have no events for now.
-	UNUSED_PARAMETER_REFACTOR(client);
-	UNUSED_PARAMETER_REFACTOR(startUTC);
-	UNUSED_PARAMETER_REFACTOR(endUTC);
-	UNUSED_PARAMETER_REFACTOR(calendar);
-	UNUSED_PARAMETER_REFACTOR(mask);
-	UNUSED_PARAMETER_REFACTOR(uid);
-	UNUSED_PARAMETER_REFACTOR(query);
-	UNUSED_PARAMETER_REFACTOR(start);
-	UNUSED_PARAMETER_REFACTOR(end);
-	UNUSED_PARAMETER_REFACTOR(props);
-	UNUSED_PARAMETER_REFACTOR(propcount);
-	
-	return ConnWriteStr(client->conn, MSG1000OK);
-/*
-    CCode ccode = 0;
-
-    // FIXME - need to handle STORE_PRIV_READ_BUSY (bug 174023) 
+	FILE *in, *out;
+	char buffer[4096];
+	size_t count;
+	int result = -1;
+
+	in = fopen(from, "r");
+	if (!in) return -1;
+
+	out = fopen(to, "w");
+	if (out) {
+		while ((count = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+			if (fwrite(buffer, 1, count, out) != count) break;
+		}
+		if (!ferror(in) && !ferror(out) && 
+		    !(now ? (fflush(out) || fsync(fileno(out))) : GroupCommitFlush(out))) {
+			result = 0;
+		}
+		if (fclose(out)) result = -1;
+	}
+	fclose(in);
 
-    if (calendar) {
-        ccode = StoreCheckAuthorization(client, calendar, 
-                                        STORE_PRIV_LIST);
-        if (ccode) {
-            return ccode;
-        }
-    }
+	return result;
+}
 
-    if (query) {
-        IndexHandle *index;
-        uint64_t *guids = NULL;
-        uint64_t *guidsptr = NULL;
-        char newQuery[CONN_BUFSIZE + 64];
-        int total;
-        int i;
-        DStoreDocInfo *info;
-        int checkauth = !calendar && !IsOwnStoreSelected(client);
-        
-        snprintf(newQuery, sizeof(newQuery) - 1, "(nmap.type:event) AND (%s)", query);
+/** \internal
+ * Put a copy of the document into one target's collection. The caller
+ * holds the store lock and has a transaction open.
+ * \param	spool	The document as received
+ * \param	blob	Shared copy of the document to link to, or NULL
+ * \return	NULL on success, otherwise the error to report for this target
+ */
+static const char *
+DeliverDocument(StoreClient *client, DeliverTarget *target, const char *spool,
+                const char *blob, int doctype, uint64_t size, uint32_t addflags, 
+                uint64_t timestamp)
+{
+	StoreObject collection;
+	char path[XPL_MAX_PATH+1];
+	char tmppath[XPL_MAX_PATH+1];
+	int ccode;
 
-        index = IndexOpen(client);
-        if (!index) {
-            return ConnWriteStr(client->conn, MSG4120INDEXLOCKED);
-        }
-        guids = IndexSearch(index, newQuery, TRUE, TRUE, 
-                            -1, -1, NULL, &total, INDEX_SORT_DATE_DESC);
-        IndexClose(index);
+	ccode = StoreObjectFindByFilename(client, target->collection, &collection);
+	if (ccode == -1 || (ccode == 0 && !STORE_IS_FOLDER(collection.type))) {
+		return MSG4224NOCOLLECTION;
+	} else if (ccode != 0) {
+		return MSG5005DBLIBERR;
+	}
 
-        if (!guids) {
-            return ConnWriteStr(client->conn, MSG5007INDEXLIBERR);
-        }
-        
-        // FIXME: This is a big allocation 
-        info = BONGO_MEMSTACK_ALLOC(&client->memstack, total * sizeof(DStoreDocInfo));
-
-        for (guidsptr = guids, i = 0; *guidsptr; ++guidsptr) {
-            switch (DStoreGetDocInfoGuid(client->handle, *guidsptr, &info[i])) {
-            case 1:
-                if (checkauth && 
-                    StoreCheckAuthorizationQuiet(client, info, STORE_PRIV_READ)) 
-                {
-                    --total;
-                    continue;
-                }
-                i++;
-                break;
-            case 0:
-                --total;
-                continue;
-            case -1:
-                MemFree(guids);
-                return ConnWriteStr(client->conn, MSG5005DBLIBERR);
-            }
-        }
+	memset(&target->document, 0, sizeof(StoreObject));
+	target->document.type = doctype;
 
-        MemFree(guids);
+	if (StoreObjectCreate(client, &target->document))
+		return MSG5005DBLIBERR;
 
-        if (-1 == start) {
-            start = 0;
-            end = total;
-        }
+	FindPathToDocument(client, collection.guid, target->document.guid, path, sizeof(path));
+	if (target->staged) {
+		if (link(target->staged, path) != 0) {
+			StoreObjectRemove(client, &target->document);
+			return MSG4224CANTWRITE;
+		}
+	} else if (!blob || BlobStoreLink(blob, path)) {
+		// this one gets a copy of its own, which has to be on disk
+		// before the database refers to it
+		MaildirTempDocument(client, collection.guid, tmppath, sizeof(tmppath));
+		if (DeliverCopyFile(spool, tmppath, TRUE) || link(tmppath, path) != 0) {
+			unlink(tmppath);
+			StoreObjectRemove(client, &target->document);
+			return MSG4224CANTWRITE;
+		}
+		unlink(tmppath);
+	}
 
-        for (i = start; i < end && i < total && -1 != ccode; i++) {
-            ccode = ShowDocumentInfo(client, &info[i], props, propcount);
-        }
-        
-        if (-1 != ccode) {
-            ccode = ConnWriteStr(client->conn, MSG1000OK);
-        }
-    } else {
-        DStoreStmt *stmt;
-        AuthFilterStruct f;
+	target->document.size = size;
+	target->document.time_created = timestamp;
+	target->document.time_modified = timestamp;
+	target->document.flags = addflags;
 
-        stmt = DStoreFindEvents(client->handle, 
-                                startUTC, endUTC,
-                                calendar ? calendar->guid : 0,
-                                mask, uid);
-        
-        if (!stmt) {
-            return ConnWriteStr(client->conn, MSG5005DBLIBERR);
-        }
-        
-        if (!calendar && !IsOwnStoreSelected(client)) {
-            f.client = client;
-            f.neededPrivileges = STORE_PRIV_READ;
-            DStoreInfoStmtAddFilter(stmt, AuthFilter, &f);
-        }
+	StoreProcessDocument(client, &target->document, path);
 
-        ccode = ShowStmtDocuments(client, stmt, props, propcount);
+	target->document.collection_guid = collection.guid;
+	StoreObjectFixUpFilename(&collection, &target->document);
+	StoreObjectUpdateImapUID(client, &target->document);
 
-        DStoreStmtEnd(client->handle, stmt);
-    }
+	if (StoreObjectSave(client, &target->document)) {
+		StoreObjectRemove(client, &target->document);
+		unlink(path);
+		return MSG5005DBLIBERR;
+	}
 
-    return 0;
-    */
+	return NULL;
 }
 
-// [LOCKING] Flag(X) => RwLock(X)
-CCode
-StoreCommandFLAG(StoreClient *client, StoreObject *object, uint32_t change, int mode)
+/** \internal
+ * Make each target in the same store as targets[first] its own copy of
+ * the document, unless they can share the blob, and get them all on disk
+ * at once before the store is locked. Anything which goes wrong with a
+ * target here is found again, and reported, by DeliverDocument().
+ * \return	0 on success, -1 if the copies couldn't be made durable
+ */
+static int
+DeliverStage(StoreClient *client, DeliverTarget *targets, int count, int first,
+             const char *spool, const char *blob)
 {
-	uint32_t old_flags;
-	int ccode;
-	
-	CHECK_NOT_READONLY(client)
-	
-	if (mode == STORE_FLAG_SHOW) {
-		ccode = StoreObjectCheckAuthorization(client, object, STORE_PRIV_READ_PROPS);
-		if (ccode) return ConnWriteStr(client->conn, MSG4240NOPERMISSION);
-		
-		return ConnWriteF(client->conn, "1000 %u %u\r\n", object->flags, object->flags);
-	}
-	
-	// just handle ADD / REMOVE / REPLACE now
-	old_flags = object->flags;
-	if (mode == STORE_FLAG_ADD) 	object->flags |= change;
-	if (mode == STORE_FLAG_REMOVE)	object->flags &= ~change;
-	if (mode == STORE_FLAG_REPLACE)	object->flags = change;
-	
-	ccode = StoreObjectCheckAuthorization(client, object, STORE_PRIV_WRITE_PROPS);
-	if (ccode) return ConnWriteStr(client->conn, MSG4240NOPERMISSION);
-	
-	// FIXME: need to propogate changes on mail documents to conversations?
-	// if so, this may also change our locking requirements since we'd also
-	// need to lock the conversation.
-	if (object->type == STORE_DOCTYPE_MAIL) {
-		
-	}
-	
-	// save the changes
-	LogicalLockGain(client, object, LLOCK_READWRITE, "StoreCommandFLAG");
-	if (StoreObjectSave(client, object) != 0) {
-		LogicalLockRelease(client, object, LLOCK_READWRITE, "StoreCommandFLAG");
-		Log(LOG_ERROR, "FLAG: Unable to save updated store object");
-		return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+	char *store = targets[first].store;
+	StoreObject collection;
+	char tmppath[XPL_MAX_PATH+1];
+	BOOL staged = FALSE;
+	int i;
+
+	// the blob is on disk already
+	if (blob) return 0;
+
+	for (i = first; i < count; i++) {
+		if (strcmp(targets[i].store, store)) continue;
+
+		if (StoreObjectFindByFilename(client, targets[i].collection, &collection) ||
+		    !STORE_IS_FOLDER(collection.type) ||
+		    MaildirTempDocument(client, collection.guid, tmppath, sizeof(tmppath))) 
+		{
+			continue;
+		}
+		if (DeliverCopyFile(spool, tmppath, FALSE)) {
+			unlink(tmppath);
+			continue;
+		}
+		targets[i].staged = MemStrdup(tmppath);
+		staged = TRUE;
 	}
-	LogicalLockRelease(client, object, LLOCK_READWRITE, "StoreCommandFLAG");
-	
-	++client->stats.updates;
-	StoreWatcherEvent(client, object, STORE_WATCH_EVENT_FLAGS);
 
-	return ConnWriteF(client->conn, "1000 %u %u\r\n", old_flags, object->flags);
+	return (staged && GroupCommitWait(NULL)) ? -1 : 0;
 }
 
-// [LOCKING] Info(X) => RoLock(X)
-CCode
-StoreCommandINFO(StoreClient *client, StoreObject *object,
-                 StorePropInfo *props, int propcount)
+/** \internal
+ * Deliver to every target in the same store as targets[first], taking
+ * the store lock once and writing all the new documents in one transaction.
+ */
+// [LOCKING] Deliver(S) => RwLock(S)
+static void
+DeliverStoreGroup(StoreClient *client, DeliverTarget *targets, int count, int first,
+                  const char *spool, const char *blob, int doctype, uint64_t size, 
+                  uint32_t addflags, uint64_t timestamp)
+{
+	char *store = targets[first].store;
+	const char *failed = NULL;
+	char path[XPL_MAX_PATH+1];
+	int i;
+
+	for (i = first; i < count; i++) {
+		if (!strcmp(targets[i].store, store)) {
+			targets[i].done = TRUE;
+		}
+	}
+
+	if (strncmp(store, "_system", 7) && 0 != MsgAuthFindUser(store)) {
+		failed = MSG4100STORENOTFOUND;
+	} else if (SelectStore(client, store)) {
+		failed = MSG4224BADSTORE;
+	} else if (DeliverStage(client, targets, count, first, spool, blob)) {
+		failed = MSG4224CANTWRITE;
+	} else if (! LogicalLockGain(client, NULL, LLOCK_READWRITE, "StoreCommandDELIVER")) {
+		failed = MSG4120BOXLOCKED;
+	} else if (MsgSQLBeginTransaction(client->storedb)) {
+		LogicalLockRelease(client, NULL, LLOCK_READWRITE, "StoreCommandDELIVER");
+		failed = MSG5005DBLIBERR;
+	}
+
+	for (i = first; i < count; i++) {
+		if (strcmp(targets[i].store, store)) continue;
+
+		if (failed) {
+			targets[i].result = failed;
+		} else {
+			targets[i].result = DeliverDocument(client, &targets[i], spool, blob,
+			                                    doctype, size, addflags, timestamp);
+		}
+	}
+
+	if (!failed) {
+		// the new files are on disk already, so nobody waits on a sync
+		// while we hold the lock
+		if (MsgSQLCommitTransaction(client->storedb)) {
+			MsgSQLAbortTransaction(client->storedb);
+			failed = MSG5005DBLIBERR;
+		}
+		LogicalLockRelease(client, NULL, LLOCK_READWRITE, "StoreCommandDELIVER");
+
+		// but don't acknowledge until the new entries are on disk too
+		if (!failed && GroupCommitWait(NULL)) {
+			failed = MSG5005DBLIBERR;
+		}
+	}
+
+	for (i = first; i < count; i++) {
+		if (strcmp(targets[i].store, store)) continue;
+
+		if (targets[i].staged) {
+			unlink(targets[i].staged);
+			MemFree(targets[i].staged);
+			targets[i].staged = NULL;
+		}
+		if (targets[i].result) continue;
+
+		if (failed) {
+			FindPathToDocument(client, targets[i].document.collection_guid, 
+			                   targets[i].document.guid, path, sizeof(path));
+			unlink(path);
+			targets[i].result = failed;
+		} else {
+			++client->stats.insertions;
+			StoreWatcherEvent(client, &targets[i].document, STORE_WATCH_EVENT_NEW);
+		}
+	}
+}
+
+// Deliver one document to many collections, possibly in many stores. 
+// The document is only sent once; each store gets one lock and one
+// transaction for all of its copies.
+CCode
+StoreCommandDELIVER(StoreClient *client, int doctype, uint64_t size,
+                    uint32_t addflags, uint64_t timestamp)
+{
+	CCode ccode;
+	DeliverTarget *targets;
+	char spool[XPL_MAX_PATH+1];
+	char blob[XPL_MAX_PATH+1];
+	BOOL shared = FALSE;
+	uint64_t tmpsize;
+	BOOL badline = FALSE;
+	char *ptr;
+	int count = 0;
+	int fd;
+	int i;
+
+	CHECK_NOT_READONLY(client)
+
+	if (STORE_IS_FOLDER(doctype) || STORE_IS_CONVERSATION(doctype)) {
+		return ConnWriteStr(client->conn, MSG3015BADDOCTYPE);
+	}
+
+	targets = MemMalloc0(sizeof(DeliverTarget) * DELIVER_MAX_TARGETS);
+	if (!targets) {
+		return ConnWriteStr(client->conn, MSG5230NOMEMORYERR);
+	}
+
+	// find out where it's going
+	ccode = ConnWriteStr(client->conn, "2002 Send targets.\r\n");
+	if (-1 != ccode) ccode = ConnFlush(client->conn);
+
+	while (-1 != ccode) {
+		ccode = ConnReadAnswer(client->conn, client->buffer, CONN_BUFSIZE);
+		if (-1 == ccode || ccode >= CONN_BUFSIZE) {
+			ccode = -1;
+			break;
+		}
+		if ('\0' == client->buffer[0]) {
+			break;
+		}
+
+		// "<store> <collection>"
+		ptr = strchr(client->buffer, ' ');
+		if (count == DELIVER_MAX_TARGETS || !ptr || ptr[1] != '/' ||
+		    ptr - client->buffer >= STORE_MAX_STORENAME) 
+		{
+			// keep reading so we stay in step with the client
+			badline = TRUE;
+			continue;
+		}
+		*ptr++ = '\0';
+		for (i = 0; client->buffer[i]; i++) {
+			client->buffer[i] = tolower(client->buffer[i]);
+		}
+
+		targets[count].store = MemStrdup(client->buffer);
+		targets[count].collection = MemStrdup(ptr);
+		count++;
+	}
+	if (-1 == ccode) {
+		goto finish;
+	}
+	if (badline || count == 0) {
+		ccode = ConnWriteStr(client->conn, MSG3022BADSYNTAX);
+		goto finish;
+	}
+
+	// the document itself only comes over once, whatever the number of
+	// targets; if there are several, they can share one copy on disk too
+	if (count == 1 || BlobStoreTempFile(spool, sizeof(spool))) {
+		snprintf(spool, sizeof(spool), "%s/deliverXXXXXX", StoreAgent.store.spoolDir);
+		spool[sizeof(spool)-1] = '\0';
+		fd = mkstemp(spool);
+		if (fd == -1) {
+			ccode = ConnWriteStr(client->conn, MSG5202TMPWRITEERR);
+			goto finish;
+		}
+		close(fd);
+	} else {
+		shared = TRUE;
+	}
+
+	tmpsize = size;
+	ccode = ReceiveToFile(client, spool, &tmpsize);
+	if (ccode) {
+		unlink(spool);
+		goto finish;
+	}
+
+	if (shared && BlobStoreAdd(spool, blob, sizeof(blob))) {
+		shared = FALSE;
+	}
+
+	if (timestamp == 0) timestamp = time(NULL);
+
+	for (i = 0; i < count; i++) {
+		if (!targets[i].done) {
+			DeliverStoreGroup(client, targets, count, i, spool, 
+			                  shared ? blob : NULL, doctype, tmpsize,
+			                  addflags, timestamp);
+		}
+	}
+	UnselectStore(client);
+	unlink(spool);
+
+	// "2001 <target> 1000 <guid>" or "2001 <target> <error>"
+	for (i = 0; i < count && -1 != ccode; i++) {
+		if (targets[i].result) {
+			ccode = ConnWriteF(client->conn, "2001 %d %s", i, targets[i].result);
+		} else {
+			ccode = ConnWriteF(client->conn, "2001 %d 1000 " GUID_FMT "\r\n", 
+			                   i, targets[i].document.guid);
+		}
+	}
+	if (-1 != ccode) {
+		ccode = ConnWriteStr(client->conn, MSG1000OK);
+	}
+
+finish:
+	for (i = 0; i < count; i++) {
+		MemFree(targets[i].store);
+		MemFree(targets[i].collection);
+	}
+	MemFree(targets);
+
+	return ccode;
+}
+
+/** \internal
+ * Write out one of the properties asked for by EVENTS. The start and end
+ * of a recurring event are those of its first occurrence in the range.
+ */
+static CCode
+ShowEventProperty(StoreClient *client, StoreObject *event, StorePropInfo *prop,
+                  uint64_t occStart, uint64_t occEnd)
+{
+	MsgSQLStatement stmt;
+	char value[XPL_MAX_PATH + 1];
+	char query[100];
+	char *result = NULL;
+	const char *column = NULL;
+
+	switch (prop->type) {
+	case STORE_PROP_EVENT_START:
+	case STORE_PROP_EVENT_END:
+		BongoCalTimeToIcal(BongoCalTimeNewFromUint64(
+			(prop->type == STORE_PROP_EVENT_START) ? occStart : occEnd, FALSE, NULL),
+			value, sizeof(value));
+		StoreOutputProperty(client, prop->type, prop->name, value);
+		return 0;
+	case STORE_PROP_EVENT_UID:
+		column = "uid";
+		break;
+	case STORE_PROP_EVENT_SUMMARY:
+		column = "summary";
+		break;
+	case STORE_PROP_EVENT_LOCATION:
+		column = "location";
+		break;
+	case STORE_PROP_EVENT_STAMP:
+		column = "stamp";
+		break;
+	case STORE_PROP_GUID:
+		snprintf(value, sizeof(value), GUID_FMT, event->guid);
+		StoreOutputProperty(client, prop->type, prop->name, value);
+		return 0;
+	case STORE_PROP_COLLECTION:
+		snprintf(value, sizeof(value), GUID_FMT, event->collection_guid);
+		StoreOutputProperty(client, prop->type, prop->name, value);
+		return 0;
+	case STORE_PROP_TYPE:
+		snprintf(value, sizeof(value), "%d", event->type);
+		StoreOutputProperty(client, prop->type, prop->name, value);
+		return 0;
+	case STORE_PROP_FLAGS:
+		snprintf(value, sizeof(value), "%d", event->flags);
+		StoreOutputProperty(client, prop->type, prop->name, value);
+		return 0;
+	case STORE_PROP_LENGTH:
+		snprintf(value, sizeof(value), FMT_UINT64_DEC, event->size);
+		StoreOutputProperty(client, prop->type, prop->name, value);
+		return 0;
+	case STORE_PROP_CREATED:
+		snprintf(value, sizeof(value), "%d", event->time_created);
+		StoreOutputProperty(client, prop->type, prop->name, value);
+		return 0;
+	case STORE_PROP_LASTMODIFIED:
+		snprintf(value, sizeof(value), "%d", event->time_modified);
+		StoreOutputProperty(client, prop->type, prop->name, value);
+		return 0;
+	case STORE_PROP_NAME:
+		StoreOutputProperty(client, prop->type, prop->name, event->filename);
+		return 0;
+	case STORE_PROP_EXTERNAL:
+		if (!strcmp(prop->name, "nmap.document")) {
+			return ShowDocumentBody(client, event, -1, 0);
+		}
+		break;
+	default:
+		break;
+	}
+
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	if (column) {
+		snprintf(query, sizeof(query), "SELECT %s FROM eventdocument WHERE guid = ?1;", column);
+	} else if (prop->type == STORE_PROP_EXTERNAL) {
+		snprintf(query, sizeof(query), "SELECT value FROM properties WHERE guid = ?1 AND name = ?2;");
+	} else {
+		snprintf(query, sizeof(query), "SELECT value FROM properties WHERE guid = ?1 AND intprop = ?2;");
+	}
+
+	if (MsgSQLPrepareCached(client->storedb, query, &stmt) == NULL) {
+		return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+	}
+	MsgSQLBindInt64(&stmt, 1, event->guid);
+	if (!column) {
+		if (prop->type == STORE_PROP_EXTERNAL) {
+			MsgSQLBindString(&stmt, 2, prop->name, FALSE);
+		} else {
+			MsgSQLBindInt(&stmt, 2, prop->type);
+		}
+	}
+
+	if (MsgSQLResults(client->storedb, &stmt) > 0) {
+		MsgSQLResultTextPtr(&stmt, 0, &result);
+	}
+	StoreOutputProperty(client, prop->type, prop->name, result);
+	MsgSQLFinalize(&stmt);
+
+	return 0;
+}
+
+// Write one document's part of a DETAILS reply: a "2001 <guid> <status>
+// <length>" line, then (if status is 0) <length> bytes of header and the
+// MIME report. Problems with the document only show up in its status so
+// the rest of the batch can still be sent.
+// [LOCKING] RoLock(X)
+static CCode
+ShowDocumentDetails(StoreClient *client, uint64_t guid, int headerLength, 
+                    BOOL header, BOOL mime)
+{
+	CCode ccode = 0;
+	StoreObject document;
+	MimeReport *report = NULL;
+	char path[XPL_MAX_PATH + 1];
+	FILE *fh = NULL;
+	uint64_t length = 0;
+	int status = 0;
+
+	switch (StoreObjectFind(client, guid, &document)) {
+	case 0:
+		break;
+	case -1:
+		return ConnWriteF(client->conn, "2001 " GUID_FMT " 4220 0\r\n", guid);
+	default:
+		return ConnWriteF(client->conn, "2001 " GUID_FMT " 5005 0\r\n", guid);
+	}
+
+	if (StoreObjectCheckAuthorization(client, &document, STORE_PRIV_READ)) {
+		return ConnWriteF(client->conn, "2001 " GUID_FMT " 4240 0\r\n", guid);
+	}
+	if (STORE_IS_FOLDER(document.type)) {
+		return ConnWriteF(client->conn, "2001 " GUID_FMT " 3015 0\r\n", guid);
+	}
+	if (STORE_IS_DBONLY(document.type)) {
+		return ConnWriteF(client->conn, "2001 " GUID_FMT " 3016 0\r\n", guid);
+	}
+
+	if (! LogicalLockGain(client, &document, LLOCK_READONLY, "StoreCommandDETAILS"))
+		return ConnWriteF(client->conn, "2001 " GUID_FMT " 4120 0\r\n", guid);
+
+	if (mime) {
+		switch (MimeGetInfo(client, &document, &report)) {
+		case 1:
+			break;
+		case -1:
+			status = 5005;
+			break;
+		case -2:
+			status = 4120;
+			break;
+		case -3:
+			status = 4220;
+			break;
+		case -4:
+			status = 4224;
+			break;
+		default:
+			status = 5004;
+			break;
+		}
+		if (status) goto finish;
+	}
+
+	if (header) {
+		FindPathToDocument(client, document.collection_guid, document.guid, path, sizeof(path));
+		fh = fopen(path, "rb");
+		if (!fh) {
+			status = 4224;
+			goto finish;
+		}
+
+		// like READ, a length of 0 means the whole document
+		length = document.size;
+		if (headerLength > 0 && (uint64_t)headerLength < length) {
+			length = headerLength;
+		}
+	}
+
+finish:
+	if (status) {
+		ccode = ConnWriteF(client->conn, "2001 " GUID_FMT " %d 0\r\n", guid, status);
+	} else {
+		ccode = ConnWriteF(client->conn, "2001 " GUID_FMT " 0 %lu\r\n", guid, 
+		                   (unsigned long) length);
+		if (-1 != ccode && fh) {
+			ccode = ConnWriteFromFile(client->conn, fh, length);
+			if (-1 != ccode) {
+				ccode = ConnWriteStr(client->conn, "\r\n");
+			}
+		}
+		if (-1 != ccode && report) {
+			ccode = MimeReportSend(client, report);
+		}
+	}
+
+	if (fh) {
+		fclose(fh);
+	}
+	if (report) {
+		MimeReportFree(report);
+	}
+	LogicalLockRelease(client, &document, LLOCK_READONLY, "StoreCommandDETAILS");
+
+	return ccode;
+}
+
+// Send the headers and/or MIME reports of a list of documents in one
+// reply, so clients (e.g., the IMAP agent's FETCH) don't need a round
+// trip per document.
+CCode
+StoreCommandDETAILS(StoreClient *client, uint64_t *guids, int *lengths, int count,
+                    BOOL header, BOOL mime)
+{
+	CCode ccode = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		ccode = ShowDocumentDetails(client, guids[i], lengths[i], header, mime);
+		if (-1 == ccode) {
+			return ccode;
+		}
+	}
+
+	return ConnWriteStr(client->conn, MSG1000OK);
+}
+
+// how many event occurrences EVENTS gathers up at a time
+#define EVENTS_ALLOC_STEPS 256
+
+// occurrences at least this long are looked up by length rather than
+// by when they start; there are few of them
+#define EVENTS_LONG_SPAN (60 * 60 * 24)
+
+typedef struct {
+	uint64_t guid;
+	uint64_t start;
+	uint64_t end;
+} EventOccurrence;
+
+static int
+EventOccurrenceCompare(const void *a, const void *b)
+{
+	const EventOccurrence *x = a, *y = b;
+
+	if (x->guid != y->guid) return (x->guid < y->guid) ? -1 : 1;
+	if (x->start != y->start) return (x->start < y->start) ? -1 : 1;
+	return 0;
+}
+
+/**
+ * List the events with an occurrence in a date range. Occurrences come
+ * from the index kept up to date as events are saved (see calendar.c),
+ * so this doesn't need to open any event which isn't in the range.
+ * The matches are gathered up before anything is written, so a slow
+ * client doesn't hold up writers to the store.
+ */
+CCode 
+StoreCommandEVENTS(StoreClient *client, 
+                   char *startUTC, char *endUTC, 
+                   StoreObject *calendar, 
+                   unsigned int mask,
+                   char *uid,
+                   const char *query,
+                   int start, int end,
+                   StorePropInfo *props, int propcount)
+{
+	MsgSQLStatement stmt;
+	StoreObject event;
+	char filters[512];
+	char sql[2048];
+	char buffer[2 * sizeof(event.filename) + 1];
+	char *ptr, *filename;
+	uint64_t rangeStart, rangeEnd;
+	EventOccurrence *found = NULL, *more;
+	size_t used = 0, allocated = 0, j, k;
+	BOOL checkauth;
+	int status = 0, i;
+	int count = 0;
+	CCode ccode = 0;
+
+	// FIXME - need to handle STORE_PRIV_READ_BUSY (bug 174023) 
+
+	if (query) {
+		// the old Lucene index which answered these is long gone
+		return ConnWriteStr(client->conn, MSG4244NOTSUPPORTED);
+	}
+
+	if (calendar && StoreObjectCheckAuthorization(client, calendar, STORE_PRIV_LIST)) {
+		return ConnWriteStr(client->conn, MSG4240NOPERMISSION);
+	}
+	checkauth = !calendar && !IsOwnStoreSelected(client);
+
+	rangeStart = BongoCalTimeUtcAsUint64(BongoCalTimeParseIcal(startUTC));
+	rangeEnd = BongoCalTimeUtcAsUint64(BongoCalTimeParseIcal(endUTC));
+
+	// recurring events are only indexed so far ahead; catch them up if
+	// we're being asked about a time beyond that
+	if (!client->readonly && StoreEventsExtendHorizon(client, rangeEnd)) {
+		return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+	}
+
+	// an occurrence overlaps the range if it starts before the range ends
+	// and finishes after the range starts. A short one can't start long
+	// before the range, so the start index finds those; the long ones
+	// are found by their length. Each occurrence is then checked against
+	// the calendar, rather than everything in the calendar being read.
+	snprintf(filters, sizeof(filters), "%s%s%s",
+		calendar ? " AND (so.collection_guid = ?3 OR EXISTS "
+		           "(SELECT 1 FROM links WHERE doc_guid = ?3 AND related_guid = so.guid))" : "",
+		uid ? " AND o.guid IN (SELECT guid FROM eventdocument WHERE uid = ?4)" : "",
+		(mask != UINT_MAX) ? " AND (so.flags & ?5) != 0" : "");
+	snprintf(sql, sizeof(sql), 
+		"SELECT o.guid, o.start, o.end FROM eventoccurrence o "
+		"INNER JOIN storeobject so ON so.guid = o.guid "
+		"WHERE o.span < %d AND o.start < ?2 AND o.start > ?1 - %d "
+		"AND (o.end > ?1 OR o.start >= ?1)%s "
+		"UNION ALL "
+		"SELECT o.guid, o.start, o.end FROM eventoccurrence o "
+		"INNER JOIN storeobject so ON so.guid = o.guid "
+		"WHERE o.span >= %d AND o.start < ?2 "
+		"AND (o.end > ?1 OR o.start >= ?1)%s;",
+		EVENTS_LONG_SPAN, EVENTS_LONG_SPAN, filters, EVENTS_LONG_SPAN, filters);
+
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	if (MsgSQLBeginTransaction(client->storedb)) {
+		return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+	}
+
+	if (MsgSQLPrepareCached(client->storedb, sql, &stmt) == NULL) goto abort;
+	MsgSQLBindInt64(&stmt, 1, rangeStart);
+	MsgSQLBindInt64(&stmt, 2, rangeEnd);
+	if (calendar) MsgSQLBindInt64(&stmt, 3, calendar->guid);
+	if (uid) MsgSQLBindString(&stmt, 4, uid, FALSE);
+	if (mask != UINT_MAX) MsgSQLBindInt64(&stmt, 5, mask);
+
+	while ((status = MsgSQLResults(client->storedb, &stmt)) > 0) {
+		if (used == allocated) {
+			more = MemRealloc(found, (allocated + EVENTS_ALLOC_STEPS) * sizeof(EventOccurrence));
+			if (!more) goto abort;
+			found = more;
+			allocated += EVENTS_ALLOC_STEPS;
+		}
+		found[used].guid = MsgSQLResultInt64(&stmt, 0);
+		found[used].start = MsgSQLResultInt64(&stmt, 1);
+		found[used].end = MsgSQLResultInt64(&stmt, 2);
+		used++;
+	}
+	if (status < 0) goto abort;
+
+	MsgSQLFinalize(&stmt);
+	if (MsgSQLCommitTransaction(client->storedb)) goto abort;
+
+	// only the first occurrence of each event in the range counts
+	if (used > 0) {
+		qsort(found, used, sizeof(EventOccurrence), EventOccurrenceCompare);
+		for (j = 1, k = 1; j < used; j++) {
+			if (found[j].guid != found[k - 1].guid) found[k++] = found[j];
+		}
+		used = k;
+	}
+
+	for (j = 0; ccode != -1 && j < used; j++) {
+		if (StoreObjectFind(client, found[j].guid, &event)) continue;
+		if (checkauth && StoreObjectCheckAuthorization(client, &event, STORE_PRIV_READ)) continue;
+
+		if (start != -1) {
+			count++;
+			if (count <= start) continue;
+			if (count > end) break;
+		}
+
+		filename = event.filename;
+		for (ptr = buffer; *filename; ++filename, ++ptr) {
+			if (isspace(*filename)) *ptr++ = '\\';
+			*ptr = *filename;
+		}
+		*ptr = 0;
+
+		ccode = ConnWriteF(client->conn, 
+			"2001 " GUID_FMT " %d %d %08x %d " FMT_UINT64_DEC " %s\r\n", 
+			event.guid, event.type, event.flags, 
+			event.imap_uid, event.time_modified, event.size, buffer);
+
+		for (i = 0; ccode != -1 && i < propcount; i++) {
+			ccode = ShowEventProperty(client, &event, &props[i],
+				found[j].start, found[j].end);
+		}
+	}
+	if (found) MemFree(found);
+
+	if (ccode == -1) return ccode;
+	return ConnWriteStr(client->conn, MSG1000OK);
+
+abort:
+	MsgSQLFinalize(&stmt);
+	MsgSQLAbortTransaction(client->storedb);
+	if (found) MemFree(found);
+	return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+}
+
+// [LOCKING] Flag(X) => RwLock(X)
+CCode
+StoreCommandFLAG(StoreClient *client, StoreObject *object, uint32_t change, int mode,
+                 BOOL conditional, uint64_t unchangedsince)
+{
+	uint32_t old_flags;
+	uint64_t modseq;
+	int ccode;
+	
+	CHECK_NOT_READONLY(client)
+	
+	if (mode == STORE_FLAG_SHOW) {
+		ccode = StoreObjectCheckAuthorization(client, object, STORE_PRIV_READ_PROPS);
+		if (ccode) return ConnWriteStr(client->conn, MSG4240NOPERMISSION);
+		
+		if (ChangeLogGetDocumentModseq(client, object->collection_guid, object->guid, &modseq))
+			return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+		
+		return ConnWriteF(client->conn, "1000 %u %u " FMT_UINT64_DEC "\r\n", 
+			object->flags, object->flags, modseq);
+	}
+	
+	// just handle ADD / REMOVE / REPLACE now
+	old_flags = object->flags;
+	if (mode == STORE_FLAG_ADD) 	object->flags |= change;
+	if (mode == STORE_FLAG_REMOVE)	object->flags &= ~change;
+	if (mode == STORE_FLAG_REPLACE)	object->flags = change;
+	
+	ccode = StoreObjectCheckAuthorization(client, object, STORE_PRIV_WRITE_PROPS);
+	if (ccode) return ConnWriteStr(client->conn, MSG4240NOPERMISSION);
+	
+	// FIXME: need to propogate changes on mail documents to conversations?
+	// if so, this may also change our locking requirements since we'd also
+	// need to lock the conversation.
+	if (object->type == STORE_DOCTYPE_MAIL) {
+		
+	}
+	
+	// save the changes
+	LogicalLockGain(client, object, LLOCK_READWRITE, "StoreCommandFLAG");
+	if (conditional) {
+		// don't overwrite a change the client hasn't seen
+		if (ChangeLogGetDocumentModseq(client, object->collection_guid, object->guid, &modseq)) {
+			LogicalLockRelease(client, object, LLOCK_READWRITE, "StoreCommandFLAG");
+			return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+		}
+		if (modseq > unchangedsince) {
+			LogicalLockRelease(client, object, LLOCK_READWRITE, "StoreCommandFLAG");
+			return ConnWriteStr(client->conn, MSG4264CHANGED);
+		}
+	}
+	if (StoreObjectSave(client, object) != 0) {
+		LogicalLockRelease(client, object, LLOCK_READWRITE, "StoreCommandFLAG");
+		Log(LOG_ERROR, "FLAG: Unable to save updated store object");
+		return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+	}
+	// the change is made; if we can't say at which modseq, say 0
+	if (ChangeLogGetDocumentModseq(client, object->collection_guid, object->guid, &modseq)) {
+		modseq = 0;
+	}
+	LogicalLockRelease(client, object, LLOCK_READWRITE, "StoreCommandFLAG");
+	
+	++client->stats.updates;
+	StoreWatcherEvent(client, object, STORE_WATCH_EVENT_FLAGS);
+
+	return ConnWriteF(client->conn, "1000 %u %u " FMT_UINT64_DEC "\r\n", 
+		old_flags, object->flags, modseq);
+}
+
+// Lets a client wait for changes to the collection it is watching
+// without polling us; see StoreWatcherIdle().
+CCode
+StoreCommandIDLE(StoreClient *client)
+{
+	CCode ccode;
+
+	ccode = StoreWatcherIdle(client);
+	if (-1 == ccode) {
+		return ccode;
+	}
+	if (BONGO_AGENT_STATE_RUNNING != StoreAgent.agent.state) {
+		return ConnWriteStr(client->conn, MSG1000OK);
+	}
+
+	ccode = ConnReadAnswer(client->conn, client->buffer, CONN_BUFSIZE);
+	if (-1 == ccode || ccode >= CONN_BUFSIZE) {
+		return -1;
+	}
+	if (XplStrCaseCmp(client->buffer, "DONE")) {
+		return ConnWriteStr(client->conn, MSG3022BADSYNTAX);
+	}
+
+	return ConnWriteStr(client->conn, MSG1000OK);
+}
+
+// [LOCKING] Info(X) => RoLock(X)
+CCode
+StoreCommandINFO(StoreClient *client, StoreObject *object,
+                 StorePropInfo *props, int propcount)
 {
 	CCode ret;
 	if (! LogicalLockGain(client, object, LLOCK_READONLY, "StoreCommandINFO"))
@@ -2123,7 +3030,7 @@ StoreCommandLIST(StoreClient *client,
                  int start, int end, 
                  uint32_t flagsmask, uint32_t flags,
                  StorePropInfo *props, int propcount,
-                 const char *query)
+                 const char *query, StoreListOptions *options)
 {
 	int ccode;
 	
@@ -2131,12 +3038,16 @@ StoreCommandLIST(StoreClient *client,
 	ccode = StoreObjectCheckAuthorization(client, collection, STORE_PRIV_LIST);
 	if (ccode) return ConnWriteStr(client->conn, MSG4240NOPERMISSION);
 	
+	// we can only carry on from something which was in the listing
+	if (options->after && options->after->collection_guid != collection->guid)
+		return ConnWriteStr(client->conn, MSG4220NOGUID);
+	
 	// grab a read-only lock to ensure consistency
 	if (! LogicalLockGain(client, collection, LLOCK_READONLY, "StoreCommandLIST")) 
 		return ConnWriteStr(client->conn, MSG4120BOXLOCKED);
 	
 	ccode = StoreObjectIterCollectionContents(client, collection, start, 
-		end, flagsmask, flags, props, propcount, NULL, query, FALSE);
+		end, flagsmask, flags, props, propcount, NULL, query, options, FALSE);
 	
 	// release the lock
 	LogicalLockRelease(client, collection, LLOCK_READONLY, "StoreCommandLIST");
@@ -2154,29 +3065,19 @@ StoreCommandLINK(StoreClient *client, StoreObject *document, StoreObject *relate
 	CHECK_NOT_READONLY(client)
 	
 	// grab the pair of locks we need
-	// FIXME: we need to check first this will not deadlock?
-	if (! LogicalLockGain(client, related, LLOCK_READONLY, "StoreCommandLINK"))
-		return ConnWriteStr(client->conn, MSG4120BOXLOCKED);
 	xLock = LLOCK_READONLY;
 	xObject = related;
-
-	UNUSED_PARAMETER(yObject);
-	/* FIXME: Store level locks!
-	if (! LogicalLockGain(client, document, LLOCK_READWRITE, "StoreCommandLINK")) {
-		LogicalLockRelease(client, xObject, xLock, "StoreCommandLINK");
-		return ConnWriteStr(client->conn, MSG4120BOXLOCKED);
-	}
 	yLock = LLOCK_READWRITE;
 	yObject = document;
-	*/
+	if (! LogicalLockGainPair(client, xObject, &xLock, yObject, &yLock, "StoreCommandLINK"))
+		return ConnWriteStr(client->conn, MSG4120BOXLOCKED);
 	
 	// link the documents together
 	ret = StoreObjectLink(client, document, related);
 	
 	// release our locks
-	// FIXME: store level locks
-	LogicalLockRelease(client, xObject, xLock, "StoreCommandLINK");
-	//LogicalLockRelease(client, yObject, yLock, "StoreCommandLINK");
+	if (yLock != LLOCK_NONE) LogicalLockRelease(client, yObject, yLock, "StoreCommandLINK");
+	if (xLock != LLOCK_NONE) LogicalLockRelease(client, xObject, xLock, "StoreCommandLINK");
 	xLock = yLock = LLOCK_NONE;
 	
 	if (ret == 0) {
@@ -2355,22 +3256,15 @@ StoreCommandMOVE(StoreClient *client, StoreObject *object,
 		goto finish;
 	}
 	
-	// grab the locks that we need to do the move
-	// FIXME: both RW locks, real chance of deadlock here.
-	if (! LogicalLockGain(client, &source_collection, LLOCK_READWRITE, "StoreCommandMOVE")) {
-		return ConnWriteStr(client->conn, MSG4120BOXLOCKED);
-	}
+	// grab the locks that we need to do the move; the pair are taken in
+	// a fixed order, so a MOVE the other way can't deadlock with us
 	xObject = &source_collection;
 	xLock = LLOCK_READWRITE;
-
-	/* FIXME: store level locks!
-	if (! LogicalLockGain(client, destination_collection, LLOCK_READWRITE, "StoreCommandMOVE")) {
-		LogicalLockRelease(client, xObject, xLock, "StoreCommandMOVE");
-		return ConnWriteStr(client->conn, MSG4120BOXLOCKED);
-	}
 	yObject = destination_collection;
 	yLock = LLOCK_READWRITE;
-	*/
+	if (! LogicalLockGainPair(client, xObject, &xLock, yObject, &yLock, "StoreCommandMOVE")) {
+		return ConnWriteStr(client->conn, MSG4120BOXLOCKED);
+	}
 	
 	// copy the original object so we can fire events on it later
 	memcpy(&original, object, sizeof(StoreObject));
@@ -2416,13 +3310,22 @@ StoreCommandMOVE(StoreClient *client, StoreObject *object,
 		goto finish;
 	}
 	
-	// save our changes
-	StoreObjectSave(client, object);
+	// save our changes; if we can't, the row still points at the old
+	// collection, so put the content back where it will be looked for
+	if (StoreObjectSave(client, object)) {
+		Log(LOG_ERROR, "MOVE: Unable to save " GUID_FMT ", moving content back", original.guid);
+		FindPathToDocument(client, original.collection_guid, original.guid, src_path, sizeof(src_path));
+		if (link(dst_path, src_path) == 0) {
+			unlink(dst_path);
+		}
+		memcpy(object, &original, sizeof(StoreObject));
+		ccode = ConnWriteStr(client->conn, MSG5005DBLIBERR);
+		goto finish;
+	}
 	
 	// unlock the collections
-	// FIXME: Store level locks
-	LogicalLockRelease(client, xObject, xLock, "StoreCommandMOVE");
-	//LogicalLockRelease(client, yObject, yLock, "StoreCommandMOVE");
+	if (yLock != LLOCK_NONE) LogicalLockRelease(client, yObject, yLock, "StoreCommandMOVE");
+	if (xLock != LLOCK_NONE) LogicalLockRelease(client, xObject, xLock, "StoreCommandMOVE");
 	xLock = yLock = LLOCK_NONE;
 	
 	// fire off any events
@@ -2564,15 +3467,77 @@ StoreCommandREAD(StoreClient *client, StoreObject *object,
 }
 
 
+// Rebuild the cached MIME structure of a document. Without a document,
+// fill in the cache for every mail in the store which doesn't have one
+// yet (e.g., stores created before the cache existed).
+// [LOCKING] Reindex(X) => RoLock(X)
 CCode 
 StoreCommandREINDEX(StoreClient *client, StoreObject *document)
 {
-	// want to re-do this completely.
+	StoreObject object;
+	MimeReport *report;
+	int result;
+	
 	CHECK_NOT_READONLY(client)
 	
-	UNUSED_PARAMETER_REFACTOR(document);
+	if (document != NULL) {
+		if (document->type != STORE_DOCTYPE_MAIL) 
+			return ConnWriteStr(client->conn, MSG3015BADDOCTYPE);
+		
+		if (StoreObjectCheckAuthorization(client, document, STORE_PRIV_READ))
+			return ConnWriteStr(client->conn, MSG4240NOPERMISSION);
+		
+		if (! LogicalLockGain(client, document, LLOCK_READONLY, "StoreCommandREINDEX"))
+			return ConnWriteStr(client->conn, MSG4120BOXLOCKED);
+		
+		result = MimeCacheDocument(client, document, NULL);
+		if (result == 0)
+			result = SearchIndexDocument(client, document, NULL);
+		
+		LogicalLockRelease(client, document, LLOCK_READONLY, "StoreCommandREINDEX");
+		
+		switch (result) {
+			case 0:
+				return ConnWriteStr(client->conn, MSG1000OK);
+			case -4:
+				return ConnWriteStr(client->conn, MSG4224CANTREAD);
+			case -5:
+				return ConnWriteStr(client->conn, MSG5004INTERNALERR);
+			default:
+				return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+		}
+	}
+	
+	object.guid = 0;
+	while ((result = StoreObjectFindNext(client, object.guid + 1, &object)) == 0) {
+		if (object.type != STORE_DOCTYPE_MAIL) continue;
+		
+		if (! LogicalLockGain(client, &object, LLOCK_READONLY, "StoreCommandREINDEX")) {
+			ConnWriteF(client->conn, "2011 %s\r\n", object.filename);
+			continue;
+		}
+		
+		// this only parses the document if it isn't already cached
+		report = NULL;
+		if (MimeGetInfo(client, &object, &report) == 1) {
+			MimeReportFree(report);
+			result = SearchIndexDocument(client, &object, NULL);
+		} else {
+			result = -5;
+		}
+		if (result != 0) {
+			ConnWriteF(client->conn, "2011 %s\r\n", object.filename);
+		}
+		
+		LogicalLockRelease(client, &object, LLOCK_READONLY, "StoreCommandREINDEX");
+	}
 	
-	return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+	if (result == -1) {
+		// ran out of documents
+		return ConnWriteStr(client->conn, MSG1000OK);
+	} else {
+		return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+	}
 }
 
 // FIXME: doesn't handle following errors
@@ -2650,7 +3615,8 @@ ReceiveToFile(StoreClient *client, const char *path, uint64_t *size)
 	}
 	*size = receive_size;
 	
-	ccode = fsync(fileno(fh));
+	// the content must be on disk before anything refers to it
+	ccode = GroupCommitWait(fh);
 	if (ccode) {
 		ccode = ConnWriteStr(client->conn, MSG4228CANTWRITEMBOX);
 		fclose(fh);
@@ -2726,6 +3692,15 @@ StoreCommandREPLACE(StoreClient *client, StoreObject *object, int size, uint64_t
 	xLock = LLOCK_READWRITE;
 	xObject = object;
 	
+	// update the version if required
+	if ((version > 0) && (version != object->version)) {
+		object->version = version;
+	}
+	
+	// the old MIME structure no longer applies; processing the new
+	// content will cache it again.
+	StoreObjectRemoveMimeReport(client, object);
+	
 	StoreObjectUpdateImapUID(client, object);
 	StoreProcessDocument(client, object, tmppath);
 	
@@ -2741,10 +3716,6 @@ StoreCommandREPLACE(StoreClient *client, StoreObject *object, int size, uint64_t
 		}
 	}
 	
-	// update the version if required
-	if ((version > 0) && (version != object->version)) {
-		object->version = version;
-	}
 	// update other metadata
 	StoreObjectUpdateModifiedTime(object);
 	
@@ -2755,6 +3726,10 @@ StoreCommandREPLACE(StoreClient *client, StoreObject *object, int size, uint64_t
 	
 	LogicalLockRelease(client, xObject, xLock, "StoreCommandREPLACE");
 	
+	if (GroupCommitWait(NULL)) {
+		return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+	}
+	
 	// now we're done, do watcher events
 	++client->stats.updates;
 	StoreWatcherEvent(client, object, STORE_WATCH_EVENT_MODIFIED);
@@ -2927,6 +3902,24 @@ StoreCommandSTORE(StoreClient *client, char *user)
 	}
 }
 
+// report agent-wide counters as "2001 <name> <value>" lines
+CCode
+StoreCommandSTATS(StoreClient *client)
+{
+	CCode ccode;
+
+	ccode = LogicalLockWriteStats(client);
+	if (ccode != -1) ccode = DBPoolWriteStats(client);
+	if (ccode != -1) ccode = GroupCommitWriteStats(client);
+	if (ccode != -1) ccode = BlobStoreWriteStats(client);
+	if (ccode != -1) ccode = MaintenanceWriteStats(client);
+	if (ccode != -1) ccode = StoreWatcherWriteStats(client);
+	if (ccode != -1) ccode = ParserPoolWriteStats(client);
+	if (ccode != -1) ccode = ConnWriteStr(client->conn, MSG1000OK);
+
+	return ccode;
+}
+
 CCode
 StoreCommandTIMEOUT(StoreClient *client, int lockTimeoutMs)
 {
@@ -3103,6 +4096,11 @@ StoreCommandWRITE(StoreClient *client,
 	}
 	LogicalLockRelease(client, collection, LLOCK_READWRITE, "StoreCommandWRITE");
 	
+	// don't acknowledge until the new entry is on disk too
+	if (GroupCommitWait(NULL)) {
+		return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+	}
+	
 	// announce its creation
 	++client->stats.insertions;
 	StoreWatcherEvent(client, &newdocument, STORE_WATCH_EVENT_NEW);
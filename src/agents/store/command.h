@@ -45,6 +45,7 @@ typedef enum {
     STORE_COMMAND_USER,
 
     /* collection commands */
+    STORE_COMMAND_CHANGES,
     STORE_COMMAND_COLLECTIONS,
     STORE_COMMAND_CREATE,
     STORE_COMMAND_LIST,
@@ -55,10 +56,12 @@ typedef enum {
     STORE_COMMAND_SEARCH,
     STORE_COMMAND_STATUS,
     STORE_COMMAND_WATCH,
+    STORE_COMMAND_IDLE,
 
     /* document commands */
     STORE_COMMAND_COPY,
     STORE_COMMAND_DELETE,
+    STORE_COMMAND_DETAILS,
     STORE_COMMAND_FLAG,
     STORE_COMMAND_INFO,
     STORE_COMMAND_LINK,
@@ -96,6 +99,7 @@ typedef enum {
     /* misc. commands */
     STORE_COMMAND_ACL, /* GRANT and DENY */
     STORE_COMMAND_NOOP,
+    STORE_COMMAND_STATS,
     STORE_COMMAND_TIMEOUT,
 
     /* debugging commands */
@@ -117,6 +121,7 @@ typedef struct {
         STORE_SEARCH_TEXT,
         STORE_SEARCH_HEADER,
         STORE_SEARCH_HEADERS,
+        STORE_SEARCH_QUERY,
     } type;
     
     char *header;
@@ -137,6 +142,9 @@ CCode StoreCommandAUTHUSER(StoreClient *client,
 CCode StoreCommandCALENDARS(StoreClient *client, unsigned long mask,
                             StorePropInfo *props, int propcount);
 
+CCode StoreCommandCHANGES(StoreClient *client, StoreObject *collection,
+                          BOOL list, uint64_t since);
+
 CCode StoreCommandCOLLECTIONS(StoreClient *client, StoreObject *container);
 
 CCode StoreCommandCONVERSATION(StoreClient *client, StoreObject *conversation,
@@ -162,15 +170,21 @@ CCode StoreCommandCREATE(StoreClient *client, char *collection, uint64_t guid);
 
 CCode StoreCommandDELETE(StoreClient *client, StoreObject *object);
 
-CCode StoreCommandDELIVER(StoreClient *client, char *sender, char *authSender,
-                          char *filename, size_t bytes);
+CCode StoreCommandDELIVER(StoreClient *client, int doctype, uint64_t size,
+                          uint32_t addflags, uint64_t timestamp);
+
+CCode StoreCommandDETAILS(StoreClient *client, uint64_t *guids, int *lengths, int count,
+                          BOOL header, BOOL mime);
 
 CCode StoreCommandEVENTS(StoreClient *client, char *startUTC, char *endUTC, 
                          StoreObject *calendar, unsigned int mask, char *uid,
                          const char *query, int start, int end,
                          StorePropInfo *props, int propcount);
 
-CCode StoreCommandFLAG(StoreClient *client, StoreObject *object, uint32_t change, int mode);
+CCode StoreCommandFLAG(StoreClient *client, StoreObject *object, uint32_t change, int mode,
+                       BOOL conditional, uint64_t unchangedsince);
+
+CCode StoreCommandIDLE(StoreClient *client);
 
 CCode StoreCommandINFO(StoreClient *client, StoreObject *object,
                        StorePropInfo *props, int propcount);
@@ -188,7 +202,8 @@ CCode StoreCommandLINKS(StoreClient *client, BOOL reverse, StoreObject *document
 CCode StoreCommandLIST(StoreClient *client, 
                        StoreObject *collection, int start, int end, 
                        uint32_t flagsmask, uint32_t flags,
-                       StorePropInfo *props, int propcount, const char *query);
+                       StorePropInfo *props, int propcount, const char *query,
+                       StoreListOptions *options);
 
 CCode StoreCommandMAILINGLISTS(StoreClient *client, char *source);
 
@@ -243,6 +258,10 @@ CCode StoreCommandRESET(StoreClient *client);
 
 CCode StoreCommandSEARCH(StoreClient *client, uint64_t guid, StoreSearchInfo *query);
 
+CCode StoreCommandSTATS(StoreClient *client);
+
+CCode StoreCommandSTATUS(StoreClient *client, StoreObject *collection);
+
 CCode StoreCommandSTORES(StoreClient *client);
 
 CCode StoreCommandSTORE(StoreClient *client, char *user);
@@ -41,9 +41,39 @@ StoreAgentReadConfiguration(BOOL *recover)
 
     StoreAgent.store.incomingQueueBytes = 1024 * 1024;
     StoreAgent.store.lockTimeoutMs = 10000;
+    StoreAgent.store.lockPerCollection = FALSE;
+    StoreAgent.store.groupCommit = FALSE;
+    StoreAgent.store.groupCommitWindowMs = 3;
+    StoreAgent.store.singleInstance = TRUE;
+    StoreAgent.store.blobGracePeriod = 600;
+    StoreAgent.store.blobCollectInterval = 3600;
+    StoreAgent.store.eventHorizonDays = 365;
+    StoreAgent.store.eventHorizonLimitDays = 3650;
+    StoreAgent.store.changeLogRetention = 30 * 24 * 60 * 60;
+    StoreAgent.store.changeLogCompactInterval = 3600;
     
     /* FIXME: tweak this */
     StoreAgent.dbpool.capacity = 64;
+    StoreAgent.dbpool.idleTimeout = 600;
+    StoreAgent.dbpool.checkpointInterval = 60;
+    StoreAgent.dbpool.tuning.wal = TRUE;
+    StoreAgent.dbpool.tuning.cacheSizeKB = 4096;
+    StoreAgent.dbpool.tuning.mmapSize = 16 * 1024 * 1024;
+    StoreAgent.dbpool.tuning.statementCacheSize = 32;
+
+    // background upkeep of every store; see maintenance.c
+    StoreAgent.maintenance.interval = 24 * 60 * 60;
+    StoreAgent.maintenance.iops = 200;
+    StoreAgent.maintenance.bandwidthKB = 4096;
+    StoreAgent.maintenance.gracePeriod = 24 * 60 * 60;
+    StoreAgent.maintenance.vacuumFreePercent = 20;
+
+    // mail parsing processes
+    StoreAgent.parser.poolSize = 4;
+    StoreAgent.parser.queueDepth = 64;
+    StoreAgent.parser.jobTimeout = 30;
+    // counts what the store had mapped when the worker was forked, too
+    StoreAgent.parser.memoryLimit = 0;
 
     // this is apparently a hack. Perhaps this should be configurable?
     StoreAgent.server.maxClients = 1024;
@@ -19,541 +19,373 @@
  * </Novell-copyright>
  ****************************************************************************/
 
+/** \file
+ * Threading new mail into conversations.
+ *
+ * Each mail's Message-ID is recorded in the threading index along with the
+ * conversation it went into, as are the message-ids it refers to in its
+ * In-Reply-To and References headers. A new mail then finds its
+ * conversation with a single indexed lookup of the ids it mentions and its
+ * own (a reply may have arrived before the mail it replies to). Mail which
+ * refers to nothing we know of falls back to a recently active
+ * conversation with the same normalized subject, found by subject hash.
+ */
+
 #include <config.h>
 
 #include <xpl.h>
+#include <memmgr.h>
 #include <bongoutil.h>
-#include <assert.h>
-#include <connio.h>
 
 #include "stored.h"
 #include "messages.h"
+#include "object-model.h"
 
 #include "conversations.h"
 
-/* Conversations become invalid after five days */
+/* Conversations can only be joined by subject for five days */
 #define CONVERSATION_AGE (60 * 60 * 24 * 5)
 
+/* How many of the most recent References we look up */
+#define CONVERSATION_MAX_REFERENCES 16
+
 static char *stripPrefixes[] = {
     "re:",
     "SV:",
     "fwd:",
+    "fw:",
+    "aw:",
     "r:",
 };
 
+/** \internal
+ * Reduce a subject to the part which stays the same across a conversation:
+ * reply and forward markers and [list] tags are removed from the front,
+ * and runs of whitespace become single spaces.
+ * \return	the normalized subject, which the caller frees
+ */
 static char *
 NormalizeSubject(const char *subject)
 {
+    const char *ptr = subject;
     char *ret;
-    char *p;
-    
-    ret = MemStrdup(subject);
-    for (p = ret; *p != '\0'; p++) {
-        if (isspace(*p)) {
-            char *p1;
-            for (p1 = p; *p1 != '\0'; p1++) {
-                *p1 = *(p1 + 1);
-            }
-        }
-    }
-
-    return ret;
-}
-
-static char *
-DisplaySubject(const char *subject)
-{
-    char *newSubject;
-    const char *ptr;
-    char *ptr2;
-    int length;
+    char *out;
     BOOL done;
 
-    newSubject = MemStrdup(subject);
-    length = strlen(newSubject);
-    
-    ptr = subject;
-
     do {
-        done = TRUE;
+        unsigned int i;
 
-        if ((*ptr == '[') && (newSubject[length - 1] == ']')) {
-            /* Remove enclosing brackets */
-            newSubject[--length] = '\0';
-            ptr++;
-            done = FALSE;
-        } else if (*ptr == '[') {
-            /* Remove bracketed prefixes (like mailing list names) */
-            int depth = 0;
-            do {
-                if (*ptr == '[') {
-                    depth++;
-                } else if (*ptr == ']') {
-                    depth--;
-                }
-                ptr++;
-            } while (*ptr && (depth > 0));
-            done = FALSE;
-        } else if (isspace(*ptr)) {
+        done = TRUE;
+        while (isspace((unsigned char)*ptr)) {
             ptr++;
+        }
+
+        if (*ptr == '[' && strchr(ptr, ']')) {
+            ptr = strchr(ptr, ']') + 1;
             done = FALSE;
-        } else {
-            unsigned int i;
-            for (i = 0; i < (sizeof(stripPrefixes) / sizeof(char *)); i++) {
-                char *prefix = stripPrefixes[i];
-                int length = strlen(prefix);
-                if (!XplStrNCaseCmp(ptr, prefix, length)) {
-                    ptr += strlen(prefix);
-                    done = FALSE;
-                }
+            continue;
+        }
+
+        for (i = 0; i < (sizeof(stripPrefixes) / sizeof(char *)); i++) {
+            size_t length = strlen(stripPrefixes[i]);
+            if (!XplStrNCaseCmp(ptr, stripPrefixes[i], length)) {
+                ptr += length;
+                done = FALSE;
+                break;
             }
         }
-    } while (!done && *ptr != '\0');
+    } while (!done);
+
+    ret = MemMalloc(strlen(ptr) + 1);
+    if (!ret) {
+        return NULL;
+    }
 
-    memmove(newSubject, ptr, strlen(ptr) + 1);
-    for (ptr2 = newSubject; *ptr2 != '\0'; ptr2++) {
-        if (*ptr2 == '\t') {
-            *ptr2 = ' ';
+    for (out = ret; *ptr != '\0'; ptr++) {
+        if (!isspace((unsigned char)*ptr)) {
+            *out++ = *ptr;
+        } else if (out > ret && out[-1] != ' ') {
+            *out++ = ' ';
         }
     }
+    if (out > ret && out[-1] == ' ') {
+        out--;
+    }
+    *out = '\0';
 
-    return newSubject;
+    return ret;
 }
 
+/** \internal
+ * Pick the message-ids out of an In-Reply-To or References header, without
+ * their angle brackets. If there are more than will fit, the last ones are
+ * kept, as those are the closest relatives. The header is modified.
+ * \return	the number of ids found
+ */
 static int
-CreateConversation(DStoreHandle *handle,
-                   const char *normalizedSubject,
-                   const char *displaySubject,
-                   DStoreDocInfo *conversation)
-{   
-    int ccode;
-    // FIXME
-    
-    // create a new StoreObject for this conversation
-    
-    // set "bongo.conversation.subject" property?
-    
-    return 0;
-    /*
-    memset(conversation, 0, sizeof(DStoreDocInfo));
-     
-    conversation->guid = 0;
-    conversation->type = STORE_DOCTYPE_CONVERSATION;
-    conversation->collection = STORE_CONVERSATIONS_GUID;
+ParseMessageIds(char *header, char **ids, int max)
+{
+    char *ptr = header;
+    char *end;
+    int count = 0;
+
+    while ((ptr = strchr(ptr, '<')) != NULL) {
+        end = strchr(++ptr, '>');
+        if (!end) {
+            break;
+        }
+        *end = '\0';
 
-    conversation->data.conversation.subject = 
-        BongoMemStackPushStr(DStoreGetMemStack(handle), normalizedSubject);
-    if (!conversation->data.conversation.subject) {
-        return -1;
+        if (end > ptr) {
+            if (count == max) {
+                memmove(ids, ids + 1, (max - 1) * sizeof(char *));
+                count--;
+            }
+            ids[count++] = ptr;
+        }
+        ptr = end + 1;
     }
 
-    strncpy(conversation->filename, STORE_CONVERSATIONS_COLLECTION "/",
-            sizeof(conversation->filename));
-
-    ccode = DStoreSetDocInfo(handle, conversation);
-    if (ccode != 0) {
-        return ccode;
-    }
-    
-    return DStoreSetPropertySimple(handle, conversation->guid, 
-                                   "bongo.conversation.subject", displaySubject);
-	*/
+    return count;
 }
 
-
-/* recompute merge metadata from the given mail into conversation metadata */
-
-#if 0
-int
-ConversationUpdateWithNewMail(DStoreHandle *handle,
-                              DStoreDocInfo *conversation,
-                              DStoreDocInfo *mail)
+/** \internal
+ * Find the conversation any of the given message-ids was threaded into.
+ * \return	the conversation's guid, 0 if there isn't one, or -1 on error
+ */
+static int64_t
+FindThreadByIds(StoreClient *client, char **ids, int count)
 {
-    ++conversation->data.conversation.numDocs;
-
-    conversation->data.conversation.sources |= CONVERSATION_SOURCE_ALL;
-
-    /* 'All are...' sources */                
-    if (!(mail->flags & STORE_MSG_FLAG_DELETED)) {
-        conversation->flags &= ~STORE_MSG_FLAG_DELETED;
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_TRASH;
-    }
-    
-    if (!(mail->flags & STORE_MSG_FLAG_JUNK)) {
-        conversation->flags &= ~STORE_MSG_FLAG_JUNK;
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_JUNK;
-    }
-
-    /* 'Any are...' sources */
-    if (mail->collection == STORE_MAIL_INBOX_GUID) {
-        conversation->data.conversation.sources |= CONVERSATION_SOURCE_INBOX;
+    MsgSQLStatement stmt;
+    char query[256 + (CONVERSATION_MAX_REFERENCES + 1) * 5];
+    char *ptr;
+    int64_t result = 0;
+    int status;
+    int i;
+
+    if (count == 0) {
+        return 0;
     }
 
-    if (mail->flags & STORE_MSG_FLAG_DRAFT) {
-        conversation->data.conversation.sources |= CONVERSATION_SOURCE_DRAFTS;
-    }
-    
-    if (mail->flags & STORE_MSG_FLAG_SENT) {
-        conversation->data.conversation.sources |= CONVERSATION_SOURCE_SENT;
-    }
-    
-    if (!(mail->flags & STORE_MSG_FLAG_SEEN)) {
-        conversation->flags &= ~STORE_MSG_FLAG_SEEN;
-        conversation->data.conversation.numUnread++;
-    }
-    
-    if (!conversation->data.conversation.lastMessageDate || 
-        (mail->data.mail.sent > conversation->data.conversation.lastMessageDate &&
-         !(STORE_MSG_FLAG_DRAFT & mail->flags) && 
-         !(STORE_MSG_FLAG_SENT & mail->flags)))
-    {
-        conversation->data.conversation.lastMessageDate = mail->data.mail.sent;
+    // the storeobject join skips any conversation which has since gone
+    ptr = query + snprintf(query, sizeof(query),
+        "SELECT t.conversation_guid FROM threadindex t "
+        "INNER JOIN storeobject so ON so.guid = t.conversation_guid "
+        "WHERE t.messageid IN (?1");
+    for (i = 1; i < count; i++) {
+        ptr += sprintf(ptr, ", ?%d", i + 1);
     }
+    strcpy(ptr, ") LIMIT 1;");
 
-    /* Clear out mutually exclusive sources */
-    if (conversation->data.conversation.sources & CONVERSATION_SOURCE_TRASH) {
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_ALL;
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_INBOX;
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_STARRED;
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_SENT;
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_DRAFTS;
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_JUNK;
+    memset(&stmt, 0, sizeof(MsgSQLStatement));
+    if (MsgSQLPrepareCached(client->storedb, query, &stmt) == NULL) {
+        return -1;
     }
-    if (conversation->data.conversation.sources & CONVERSATION_SOURCE_JUNK) {
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_ALL;
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_INBOX;
+    for (i = 0; i < count; i++) {
+        MsgSQLBindString(&stmt, i + 1, ids[i], FALSE);
     }
 
-    {
-        BongoStringBuilder sb;
-        char *p;
-        char *pend;
-        char *q;
-        char *qend;
-        int dirty = 0;
-        char tmp;
-
-        if (BongoStringBuilderInit(&sb)) {
-            return -1;
-        }
-        
-        if (-1 == DStoreGetPropertySBAppend(handle, conversation->guid, "bongo.from",
-                                            &sb))
-        {
-            return -1;
-        }
-
-#define NEXTSENDER(_ptr, _endptr)                 \
-        _endptr = strchr(_ptr, '\n');             \
-        if (!_endptr) {                           \
-            BongoStringBuilderDestroy(&sb);        \
-            return -1;                            \
-        }                                         \
-        *_endptr = 0;
-        
-        for (p = mail->data.mail.from;
-             p && *p;
-             *pend = '\n', p = pend + 1)
-        {
-            NEXTSENDER(p, pend);
-
-            for (q = sb.value;
-                 q && *q;
-                 *qend = '\n', q = qend + 1)
-            {
-                NEXTSENDER(q, qend);
-
-                if (!strcmp(p, q)) {
-                    *qend = '\n';
-                    goto skip;
-                }
-            }
-
-            *pend = '\n';
-            tmp = pend[1];
-            pend[1] = 0;
-            BongoStringBuilderAppend(&sb, p);
-            pend[1] = tmp;
-            ++dirty;
-        skip:
-            ;
-        }
-
-        if (dirty && 
-            DStoreSetPropertySimple(handle, conversation->guid, 
-                                    "bongo.from", sb.value)) 
-        {
-            BongoStringBuilderDestroy(&sb);
-            return -1;
-        }
-
-        BongoStringBuilderDestroy(&sb);
-
-#undef NEXTSENDER
+    status = MsgSQLResults(client->storedb, &stmt);
+    if (status > 0) {
+        result = MsgSQLResultInt64(&stmt, 0);
+    } else if (status < 0) {
+        result = -1;
     }
+    MsgSQLFinalize(&stmt);
 
-    return DStoreSetDocInfo(handle, conversation);
+    return result;
 }
-#endif
 
-// update a conversation when a member has a new flag set.
 /** \internal
- * Update a conversation when flags are changed on a member mail
- * \bug Doesn't work for 'all are' flags, only 'any are': STORE_MSG_FLAG_DELETED, ..JUNK
+ * Make a new, empty conversation.
+ * \return	0 on success, -1 on failure
  */
-// to fix the 'all are' bugs, we want a counter like .numUnread so that we don't need
-// to walk the list of all conversation members again, which is slow.
-int
-UpdateConversationMemberNewFlag(DStoreHandle *handle,
-                                DStoreDocInfo *conversation,
-                                uint32_t old_flags,
-                                uint32_t new_flags)
+static int
+CreateConversation(StoreClient *client, StoreConversationData *data,
+                   StoreObject *conversation)
 {
-	if (new_flags & STORE_MSG_FLAG_DRAFT) {
-		conversation->data.conversation.sources |= CONVERSATION_SOURCE_DRAFTS;
-	}
-
-	if (new_flags & STORE_MSG_FLAG_SENT) {
-		conversation->data.conversation.sources |= CONVERSATION_SOURCE_SENT;
-	}
-
-	if ((old_flags & STORE_MSG_FLAG_SEEN) && !(new_flags & STORE_MSG_FLAG_SEEN)) {
-		// new mail is marked as unread
-		if (conversation->data.conversation.numUnread == 0)
-			conversation->flags |= STORE_MSG_FLAG_SEEN;
-		
-		conversation->data.conversation.numUnread++;
-	}
-	
-	if (!(old_flags & STORE_MSG_FLAG_SEEN) && (new_flags & STORE_MSG_FLAG_SEEN)) {
-		// new mail is marked as read
-		conversation->data.conversation.numUnread--;
-		
-		if (conversation->data.conversation.numUnread == 0)
-			conversation->flags &= ~STORE_MSG_FLAG_SEEN;
-	}
-
-	return DStoreSetDocInfo(handle, conversation);
-}
-
-
-/* recompute metadata from scratch for the given conversation */
+    StoreObject collection;
 
-int 
-UpdateConversationMetadata(DStoreHandle *handle,
-                           DStoreDocInfo *conversation)
-{
-    DStoreStmt *stmt;
-    DStoreDocInfo info;
-    int dcode = 0;
-    int numDocs;
-    BongoStringBuilder sb;
-    int cnt = 0;
-
-    stmt = DStoreFindConversationMembers(handle, conversation->guid);
-    if (!stmt) {
+    if (StoreObjectFind(client, STORE_CONVERSATIONS_GUID, &collection)) {
         return -1;
     }
 
-    conversation->data.conversation.numUnread = 0;
-    conversation->data.conversation.lastMessageDate = 0;
-    conversation->data.conversation.numDocs = 0;
-
-    /* Assume it's deleted and read unless a non-deleted or seen message is found */
-    conversation->flags |= (STORE_MSG_FLAG_DELETED | STORE_MSG_FLAG_SEEN | STORE_MSG_FLAG_JUNK);
-
-    /* For 'all are...' sources, assume they are unless we find otherwise */
-    /* For 'any are...' sources, assume they aren't */
-    /* Assume it's in All unless it ends up in junk or trash */
-    conversation->data.conversation.sources = CONVERSATION_SOURCE_TRASH | CONVERSATION_SOURCE_JUNK | CONVERSATION_SOURCE_ALL;
-
-    if (conversation->flags & STORE_DOCUMENT_FLAG_STARS) {
-        conversation->data.conversation.sources |= CONVERSATION_SOURCE_STARRED;
-    } else {
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_STARRED;
+    memset(conversation, 0, sizeof(StoreObject));
+    conversation->type = STORE_DOCTYPE_CONVERSATION;
+    if (StoreObjectCreate(client, conversation) != 0) {
+        return -1;
     }
 
-    numDocs = 0;
-    do {
-        dcode = DStoreInfoStmtStep(handle, stmt, &info);
-        
-        if (dcode == 1 && info.type == STORE_DOCTYPE_MAIL) {
-            numDocs++;
-            
-            /* 'All are...' sources */                
-            if (!(info.flags & STORE_MSG_FLAG_DELETED)) {
-                conversation->flags &= ~STORE_MSG_FLAG_DELETED;
-                conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_TRASH;
-            }
-
-            if (!(info.flags & STORE_MSG_FLAG_JUNK)) {
-                conversation->flags &= ~STORE_MSG_FLAG_JUNK;
-                conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_JUNK;
-            }
-
-            /* 'Any are...' sources */
-            if (info.collection == STORE_MAIL_INBOX_GUID) {
-                conversation->data.conversation.sources |= CONVERSATION_SOURCE_INBOX;
-            }
+    data->guid = conversation->guid;
+    data->sources = 0;
+    if (StoreObjectSaveConversation(client, data)) {
+        return -1;
+    }
 
-            if (info.flags & STORE_MSG_FLAG_DRAFT) {
-                conversation->data.conversation.sources |= CONVERSATION_SOURCE_DRAFTS;
-            }
+    // save setting collection_guid til last, so that the new convo
+    // 'appears' atomically
+    conversation->collection_guid = STORE_CONVERSATIONS_GUID;
+    StoreObjectFixUpFilename(&collection, conversation);
+    return StoreObjectSave(client, conversation) ? -1 : 0;
+}
 
-            if (info.flags & STORE_MSG_FLAG_SENT) {
-                conversation->data.conversation.sources |= CONVERSATION_SOURCE_SENT;
-            }
+/** \internal
+ * Record a mail, and the mail it refers to, in the threading index.
+ * \return	0 on success, -1 on failure
+ */
+static int
+RecordThread(StoreClient *client, uint64_t conversation, StoreObject *mail,
+             const char *messageid, char **refs, int refcount)
+{
+    MsgSQLStatement stmt;
+    int result = -1;
+    int i;
 
-            if (!(info.flags & STORE_MSG_FLAG_SEEN)) {
-                conversation->flags &= ~STORE_MSG_FLAG_SEEN;
-                conversation->data.conversation.numUnread++;
-            }
+    memset(&stmt, 0, sizeof(MsgSQLStatement));
 
-            if (!conversation->data.conversation.lastMessageDate || 
-                (info.data.mail.sent > conversation->data.conversation.lastMessageDate
-                 && !(STORE_MSG_FLAG_DRAFT & info.flags)
-                 && !(STORE_MSG_FLAG_SENT & info.flags)))
-            {
-                conversation->data.conversation.lastMessageDate = info.data.mail.sent;
-            }
+    if (messageid) {
+        if (MsgSQLPrepareCached(client->storedb,
+                "INSERT OR REPLACE INTO threadindex (messageid, conversation_guid, guid, parent) "
+                "VALUES (?1, ?2, ?3, ?4);", &stmt) == NULL)
+        {
+            goto finish;
         }
-    } while (dcode == 1);
-
-    /* Clear out mutually exclusive sources */
-    if (conversation->data.conversation.sources & CONVERSATION_SOURCE_TRASH) {
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_ALL;
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_INBOX;
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_STARRED;
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_SENT;
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_DRAFTS;
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_JUNK;
-    }
-    if (conversation->data.conversation.sources & CONVERSATION_SOURCE_JUNK) {
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_ALL;
-        conversation->data.conversation.sources &= ~CONVERSATION_SOURCE_INBOX;
+        MsgSQLBindString(&stmt, 1, messageid, FALSE);
+        MsgSQLBindInt64(&stmt, 2, conversation);
+        MsgSQLBindInt64(&stmt, 3, mail->guid);
+        MsgSQLBindString(&stmt, 4, refcount ? refs[refcount - 1] : NULL, TRUE);
+        if (MsgSQLExecute(client->storedb, &stmt)) {
+            goto finish;
+        }
+        MsgSQLFinalize(&stmt);
     }
 
-    DStoreStmtEnd(handle, stmt);
-
-    if (dcode != 0) {
-        return dcode;
+    // mail we haven't seen yet gets a placeholder, so that it joins this
+    // conversation when it does arrive
+    if (MsgSQLPrepareCached(client->storedb,
+            "INSERT OR IGNORE INTO threadindex (messageid, conversation_guid) VALUES (?1, ?2);",
+            &stmt) == NULL)
+    {
+        goto finish;
     }
-    if (numDocs == 0) {
-        return DStoreDeleteDocInfo(handle, conversation->guid);
-    } else {
-        conversation->data.conversation.numDocs = numDocs;
+    for (i = 0; i < refcount; i++) {
+        MsgSQLBindString(&stmt, 1, refs[i], FALSE);
+        MsgSQLBindInt64(&stmt, 2, conversation);
+        if (MsgSQLExecute(client->storedb, &stmt)) {
+            goto finish;
+        }
+        MsgSQLEndStatement(&stmt);
     }
 
-    if (BongoStringBuilderInit(&sb)) {
-        return -1;
+    // the conversation has seen some activity
+    MsgSQLFinalize(&stmt);
+    if (MsgSQLPrepareCached(client->storedb,
+            "UPDATE conversation SET date = ?2 WHERE guid = ?1 AND date < ?2;", &stmt) == NULL)
+    {
+        goto finish;
     }
-
-    stmt = DStoreFindConversationSenders(handle, conversation->guid);
-    if (!stmt) {
-        return -1;
+    MsgSQLBindInt64(&stmt, 1, conversation);
+    MsgSQLBindInt(&stmt, 2, mail->time_created);
+    if (MsgSQLExecute(client->storedb, &stmt) == 0) {
+        result = 0;
     }
 
-    do {
-        const char *str;
-
-        dcode = DStoreStrStmtStep(handle, stmt, &str);
-        if (1 == dcode) {
-            BongoStringBuilderAppend(&sb, str);
-        }
-        ++cnt;
-    } while (1 == dcode);
-
-    DStoreStmtEnd(handle, stmt);
+finish:
+    MsgSQLFinalize(&stmt);
+    return result;
+}
 
-    if (dcode) {
-        BongoStringBuilderDestroy(&sb);
-        return dcode;
+/**
+ * Put a newly delivered mail into a conversation, creating one if it 
+ * doesn't belong to any existing conversation.
+ * \param	client	Store client we're operating for
+ * \param	mail	The new mail
+ * \param	headers	The mail's threading headers; any of them may be NULL
+ * \return	0 on success, -1 on failure
+ */
+int
+ConversationThreadMail(StoreClient *client, StoreObject *mail, 
+                       ConversationHeaders *headers)
+{
+    StoreConversationData data;
+    StoreObject conversation;
+    char *ids[CONVERSATION_MAX_REFERENCES + 1];
+    char *references = NULL;
+    char *inreplyto = NULL;
+    int64_t found;
+    int refcount = 0;
+    int result = -1;
+
+    memset(&data, 0, sizeof(StoreConversationData));
+    memset(&conversation, 0, sizeof(StoreObject));
+
+    // the parent is whatever was mentioned last
+    if (headers->references) {
+        references = MemStrdup(headers->references);
+        refcount = ParseMessageIds(references, ids, CONVERSATION_MAX_REFERENCES);
     }
+    if (headers->inreplyto) {
+        char *parent;
 
-    if (DStoreSetPropertySimple(handle, conversation->guid, "bongo.from", sb.value)) {
-        BongoStringBuilderDestroy(&sb);
-        return -1;
+        inreplyto = MemStrdup(headers->inreplyto);
+        if (ParseMessageIds(inreplyto, &parent, 1) == 1 &&
+            (refcount == 0 || strcmp(ids[refcount - 1], parent))) 
+        {
+            if (refcount == CONVERSATION_MAX_REFERENCES) {
+                memmove(ids, ids + 1, (refcount - 1) * sizeof(char *));
+                refcount--;
+            }
+            ids[refcount++] = parent;
+        }
     }
 
-    BongoStringBuilderDestroy(&sb);
-         
-    return DStoreSetDocInfo(handle, conversation);
-}
-
-
-int 
-GetConversation(DStoreHandle *handle,
-                DStoreDocInfo *info,
-                DStoreDocInfo *conversationOut)
-{
-    char *displaySubject;
-    char *normalizedSubject;
-    int32_t modifiedAfter;
-    int dcode;
+    data.subject = NormalizeSubject(headers->subject ? headers->subject : "");
+    if (!data.subject) {
+        goto finish;
+    }
 
-    displaySubject = DisplaySubject(info->data.mail.subject ? info->data.mail.subject : "(no subject)");
-    normalizedSubject = NormalizeSubject(displaySubject);
+    MsgSQLBeginTransaction(client->storedb);
 
-    if (info->data.mail.sent > CONVERSATION_AGE) {
-        modifiedAfter = info->data.mail.sent - CONVERSATION_AGE;
-    } else {
-        modifiedAfter = 0;
+    // look ourselves up too, in case a reply got here first
+    if (headers->messageid) {
+        ids[refcount] = (char *)headers->messageid;
     }
-/*
-    dcode = DStoreGetConversation(handle, 
-                                  normalizedSubject, 
-                                  modifiedAfter, 
-                                  conversationOut);
-*
-    
-    if (dcode < 0) {
-        goto done;
+    found = FindThreadByIds(client, ids, refcount + (headers->messageid ? 1 : 0));
+    if (found < 0) {
+        goto abort;
     }
-    if (dcode == 0) {
-        /* Didn't find a conversation, create a new one */
-        dcode = CreateConversation(handle, 
-                                   normalizedSubject, 
-                                   displaySubject,
-                                   conversationOut);
-        if (dcode < 0) {
-            goto done;
-        }
+
+    if (found > 0) {
+        conversation.guid = found;
     } else {
-        dcode = 0;
+        data.date = (mail->time_created > CONVERSATION_AGE) ? 
+            mail->time_created - CONVERSATION_AGE : 0;
+        if (data.subject[0] == '\0' || 
+            StoreObjectFindConversation(client, &data, &conversation) != 0) 
+        {
+            data.date = mail->time_created;
+            if (CreateConversation(client, &data, &conversation)) {
+                goto abort;
+            }
+        }
     }
-    
-    info->conversation = conversationOut->guid;
-    
-done :
-    MemFree(normalizedSubject);
-    MemFree(displaySubject);
-    return dcode;
-}
 
-void
-GetConversationSourceMask(const char *sourceName,
-                          uint32_t *required)
-{
-    if (!sourceName) {
-        *required = 0;
-        return;
+    if (RecordThread(client, conversation.guid, mail, headers->messageid, ids, refcount) ||
+        StoreObjectLink(client, &conversation, mail) ||
+        MsgSQLCommitTransaction(client->storedb)) 
+    {
+        goto abort;
     }
 
-    if (!XplStrCaseCmp(sourceName, "all")) {
-        *required = CONVERSATION_SOURCE_ALL;
-    } else if (!XplStrCaseCmp(sourceName, "inbox")) {
-        *required = CONVERSATION_SOURCE_INBOX;
-    } else if (!XplStrCaseCmp(sourceName, "starred")) {
-        *required = CONVERSATION_SOURCE_STARRED;
-    } else if (!XplStrCaseCmp(sourceName, "sent")) {
-        *required = CONVERSATION_SOURCE_SENT;
-    } else if (!XplStrCaseCmp(sourceName, "drafts")) {
-        *required = CONVERSATION_SOURCE_DRAFTS;
-    } else if (!XplStrCaseCmp(sourceName, "junk")) {
-        *required = CONVERSATION_SOURCE_JUNK;
-    } else if (!XplStrCaseCmp(sourceName, "trash")) {
-        *required = CONVERSATION_SOURCE_TRASH;
-    } else {
-        *required = 0;
-    }
+    result = 0;
+    goto finish;
+
+abort:
+    MsgSQLAbortTransaction(client->storedb);
+
+finish:
+    if (data.subject) MemFree(data.subject);
+    if (references) MemFree(references);
+    if (inreplyto) MemFree(inreplyto);
+    return result;
 }
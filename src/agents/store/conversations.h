@@ -22,31 +22,23 @@
 #ifndef CONVERSATIONS_H_
 #define CONVERSATIONS_H_
 
-XPL_BEGIN_C_LINKAGE
-
-#include "mail.h"
-
-/* Find or create a conversation and set the info's "conversation" 
- * variable */
+#include "stored.h"
 
-int GetConversation(DStoreHandle *handle,
-                    DStoreDocInfo *info,
-                    DStoreDocInfo *conversationOut);
-
-int UpdateConversationMemberNewFlag(DStoreHandle *handle,
-                                DStoreDocInfo *conversation,
-                                uint32_t old_flags,
-                                uint32_t new_flags);
+XPL_BEGIN_C_LINKAGE
 
-int UpdateConversationMetadata(DStoreHandle *handle,
-                               DStoreDocInfo *conversation);
+/* The headers of a new mail which decide its conversation */
+typedef struct {
+    const char *subject;
+    const char *messageid;
+    const char *inreplyto;
+    const char *references;
+} ConversationHeaders;
 
-int ConversationUpdateWithNewMail(DStoreHandle *handle,
-                                  DStoreDocInfo *conversation,
-                                  DStoreDocInfo *mail);
+/* Find or create a conversation for a new mail, and link the mail to it */
 
-void GetConversationSourceMask(const char *sourceName,
-                               uint32_t *required);
+int ConversationThreadMail(StoreClient *client, 
+                           StoreObject *mail,
+                           ConversationHeaders *headers);
 
 XPL_END_C_LINKAGE
                           
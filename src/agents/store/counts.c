@@ -0,0 +1,212 @@
+/** \file
+ * Running totals of what's in each collection: how many documents, how
+ * many of those are unseen or marked deleted, and how many bytes they
+ * take up.
+ *
+ * These are what IMAP STATUS, POP STAT and quota checks want to know, and
+ * counting them afresh means reading every row in the collection. Instead
+ * the object model adjusts the totals in the same transaction as each
+ * save or removal, so reading them is a single row lookup which can't
+ * disagree with the storeobject table. Collections themselves aren't
+ * counted in their parent's totals.
+ */
+
+#include <config.h>
+#include <xpl.h>
+#include <memmgr.h>
+#include <msgapi.h>
+
+#include "stored.h"
+
+/** \internal
+ * Work out what a document adds to the totals of the collection it's in.
+ */
+static void
+CollectionCountsOf(const StoreObject *object, CollectionCounts *counts)
+{
+	memset(counts, 0, sizeof(CollectionCounts));
+
+	// stubs still being created, and the root, aren't in any collection
+	if (object->collection_guid == 0 || object->collection_guid == (uint64_t)-1 ||
+	    STORE_IS_FOLDER(object->type))
+	{
+		return;
+	}
+
+	counts->messages = 1;
+	counts->unseen = (object->flags & STORE_MSG_FLAG_SEEN) ? 0 : 1;
+	counts->deleted = (object->flags & STORE_MSG_FLAG_DELETED) ? 1 : 0;
+	counts->bytes = object->size;
+}
+
+/** \internal
+ * Add to (or take away from) a collection's totals. Call within a
+ * transaction.
+ * \param	sign	1 to add the counts, -1 to take them away
+ * \return	0 on success, -2 on failure
+ */
+static int
+CollectionCountsAdjust(StoreClient *client, uint64_t collection, const CollectionCounts *counts, int sign)
+{
+	MsgSQLStatement stmt;
+	int status;
+
+	if (counts->messages == 0) {
+		return 0;
+	}
+
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	if (MsgSQLPrepareCached(client->storedb, "INSERT OR IGNORE INTO collectioncounts (collection_guid) VALUES (?1);", &stmt) == NULL) goto abort;
+	MsgSQLBindInt64(&stmt, 1, collection);
+	status = MsgSQLExecute(client->storedb, &stmt);
+	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+
+	if (MsgSQLPrepareCached(client->storedb, "UPDATE collectioncounts SET messages = messages + ?2, "
+	    "unseen = unseen + ?3, deleted = deleted + ?4, bytes = bytes + ?5 WHERE collection_guid = ?1;", &stmt) == NULL) goto abort;
+	MsgSQLBindInt64(&stmt, 1, collection);
+	MsgSQLBindInt(&stmt, 2, sign * (int)counts->messages);
+	MsgSQLBindInt(&stmt, 3, sign * (int)counts->unseen);
+	MsgSQLBindInt(&stmt, 4, sign * (int)counts->deleted);
+	MsgSQLBindInt64(&stmt, 5, (uint64_t)(sign * (int64_t)counts->bytes));
+	status = MsgSQLExecute(client->storedb, &stmt);
+	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+
+	return 0;
+
+abort:
+	MsgSQLFinalize(&stmt);
+	return -2;
+}
+
+/**
+ * Move an object's contribution to the totals from what it was in the
+ * store to what it's about to be saved as. Call within the transaction
+ * which saves it.
+ * \param	old	The object as it is in the store now
+ * \param	object	The object about to be saved
+ * \return	0 on success, -2 on failure
+ */
+int
+CollectionCountsSave(StoreClient *client, const StoreObject *old, const StoreObject *object)
+{
+	CollectionCounts before, after;
+
+	CollectionCountsOf(old, &before);
+	CollectionCountsOf(object, &after);
+
+	if (old->collection_guid == object->collection_guid &&
+	    !memcmp(&before, &after, sizeof(CollectionCounts)))
+	{
+		// the usual case when only other flags or properties change
+		return 0;
+	}
+
+	if (CollectionCountsAdjust(client, old->collection_guid, &before, -1)) {
+		return -2;
+	}
+	return CollectionCountsAdjust(client, object->collection_guid, &after, 1);
+}
+
+/**
+ * Take a document being removed out of its collection's totals. Call
+ * within the transaction which removes it.
+ * \return	0 on success, -2 on failure
+ */
+int
+CollectionCountsRemove(StoreClient *client, const StoreObject *object)
+{
+	CollectionCounts counts;
+
+	CollectionCountsOf(object, &counts);
+	return CollectionCountsAdjust(client, object->collection_guid, &counts, -1);
+}
+
+/**
+ * Forget the totals of a collection which is being removed. Call within
+ * a transaction.
+ * \return	0 on success, -2 on failure
+ */
+int
+CollectionCountsForget(StoreClient *client, uint64_t collection)
+{
+	MsgSQLStatement stmt;
+	int status;
+
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	if (MsgSQLPrepareCached(client->storedb, "DELETE FROM collectioncounts WHERE collection_guid = ?1;", &stmt) == NULL) {
+		return -2;
+	}
+	MsgSQLBindInt64(&stmt, 1, collection);
+	status = MsgSQLExecute(client->storedb, &stmt);
+	MsgSQLFinalize(&stmt);
+
+	return status ? -2 : 0;
+}
+
+/**
+ * Find out a collection's totals.
+ * \param	counts	Output for the totals; all zero for an empty collection
+ * \return	0 on success, -2 on failure
+ */
+int
+CollectionCountsGet(StoreClient *client, uint64_t collection, CollectionCounts *counts)
+{
+	MsgSQLStatement stmt;
+	int result;
+
+	memset(counts, 0, sizeof(CollectionCounts));
+
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	if (MsgSQLPrepareCached(client->storedb, "SELECT messages, unseen, deleted, bytes "
+	    "FROM collectioncounts WHERE collection_guid = ?1;", &stmt) == NULL) {
+		return -2;
+	}
+	MsgSQLBindInt64(&stmt, 1, collection);
+
+	result = MsgSQLResults(client->storedb, &stmt);
+	if (result > 0) {
+		counts->messages = MsgSQLResultInt64(&stmt, 0);
+		counts->unseen = MsgSQLResultInt64(&stmt, 1);
+		counts->deleted = MsgSQLResultInt64(&stmt, 2);
+		counts->bytes = MsgSQLResultInt64(&stmt, 3);
+	}
+	MsgSQLFinalize(&stmt);
+
+	return (result < 0) ? -2 : 0;
+}
+
+/**
+ * Work out every collection's totals from scratch, e.g. when upgrading a
+ * store which didn't keep them. Call within a transaction.
+ * \return	0 on success, -2 on failure
+ */
+int
+CollectionCountsRebuild(StoreClient *client)
+{
+	MsgSQLStatement stmt;
+	int status;
+
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	if (MsgSQLPrepare(client->storedb, "DELETE FROM collectioncounts;", &stmt) == NULL) goto abort;
+	status = MsgSQLExecute(client->storedb, &stmt);
+	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+
+	if (MsgSQLPrepare(client->storedb, "INSERT INTO collectioncounts (collection_guid, messages, unseen, deleted, bytes) "
+	    "SELECT collection_guid, COUNT(*), SUM((flags & ?1) = 0), SUM((flags & ?2) != 0), SUM(size) "
+	    "FROM storeobject WHERE collection_guid > 0 AND (type & ?3) = 0 GROUP BY collection_guid;", &stmt) == NULL) goto abort;
+	MsgSQLBindInt(&stmt, 1, STORE_MSG_FLAG_SEEN);
+	MsgSQLBindInt(&stmt, 2, STORE_MSG_FLAG_DELETED);
+	MsgSQLBindInt(&stmt, 3, STORE_DOCTYPE_FOLDER);
+	status = MsgSQLExecute(client->storedb, &stmt);
+	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+
+	return 0;
+
+abort:
+	MsgSQLFinalize(&stmt);
+	return -2;
+}
@@ -29,25 +29,113 @@
 typedef struct _DBPoolEntry {
 	// name of the store this handle is for
 	char *user;
-	// a handle to SQLite
+	// a handle to SQLite; NULL while the store is still being opened
 	MsgSQLHandle *handle;
 	// how many people are currently using this handle
 	int clients;
 	// when this handle was last given up
 	uint64_t lastAccessTime;
+	// clients waiting for the first one to finish opening the store
+	int waiters;
+	XplSemaphore ready;
+	// the open failed; the entry is no longer in the pool
+	BOOL failed;
+	// least recently used list, most recent at the head
+	struct _DBPoolEntry *prev;
+	struct _DBPoolEntry *next;
 } DBPoolEntry;
 
+// all protected by StoreAgent.dbpool.lock
+static DBPoolEntry *lru_head = NULL;
+static DBPoolEntry *lru_tail = NULL;
+
 static void
 DBPoolEntryDelete(DBPoolEntry *entry)
 {
+	if (entry->handle) {
+		MsgSQLClose(entry->handle);
+	}
+	XplCloseLocalSemaphore(entry->ready);
 	MemFree(entry->user);
 	MemFree(entry);
 }
 
+static void
+DBPoolUnlink(DBPoolEntry *entry)
+{
+	if (entry->prev) entry->prev->next = entry->next;
+	else lru_head = entry->next;
+	if (entry->next) entry->next->prev = entry->prev;
+	else lru_tail = entry->prev;
+	entry->prev = entry->next = NULL;
+}
+
+static void
+DBPoolLinkHead(DBPoolEntry *entry)
+{
+	entry->prev = NULL;
+	entry->next = lru_head;
+	if (lru_head) lru_head->prev = entry;
+	lru_head = entry;
+	if (!lru_tail) lru_tail = entry;
+}
+
+/** \internal
+ * Take unused handles out of the pool: anything idle for longer than
+ * the idle timeout, and then the least recently used handles until we're
+ * back within capacity. Handles in use are never taken. Must be called
+ * with the pool locked; the removed entries are returned as a list (linked
+ * through 'next') so they can be closed once the lock is dropped.
+ */
+static DBPoolEntry *
+DBPoolReapLocked(uint64_t now)
+{
+	DBPoolEntry *entry, *prev;
+	DBPoolEntry *reaped = NULL;
+	int count;
+
+	count = BongoHashTableCount(StoreAgent.dbpool.entries);
+
+	// walk from the least recently used end
+	for (entry = lru_tail; entry != NULL; entry = prev) {
+		prev = entry->prev;
+
+		if (entry->clients > 0 || entry->handle == NULL) {
+			continue;
+		}
+		if (count <= StoreAgent.dbpool.capacity &&
+		    entry->lastAccessTime + StoreAgent.dbpool.idleTimeout > now) {
+			// this and everything after it is recent enough
+			break;
+		}
+
+		BongoHashtableRemoveFull(StoreAgent.dbpool.entries, entry->user, TRUE, FALSE);
+		DBPoolUnlink(entry);
+		entry->next = reaped;
+		reaped = entry;
+		count--;
+		StoreAgent.dbpool.stats.evictions++;
+	}
+
+	return reaped;
+}
+
+static void
+DBPoolCloseList(DBPoolEntry *list)
+{
+	DBPoolEntry *next;
+
+	for (; list != NULL; list = next) {
+		next = list->next;
+		DBPoolEntryDelete(list);
+	}
+}
+
 int
 DBPoolInit()
 {
-	StoreAgent.dbpool.entries = BongoCreateStringHashTable(64);
+	StoreAgent.dbpool.entries = BongoHashtableCreateFull(64,
+		(HashFunction)BongoStringHash, (CompareFunction)strcmp, MemFree, NULL);
 	if (!StoreAgent.dbpool.entries) {
 		return -1;
 	}
@@ -56,98 +144,314 @@ DBPoolInit()
 	return 0;
 }
 
+/**
+ * Close any handles which have been idle for too long, or which are
+ * pushing the pool over capacity. This happens anyway as stores are
+ * opened and closed, but can also be called periodically so that idle
+ * handles don't hang about on a quiet server.
+ */
+void
+DBPoolReap(void)
+{
+	DBPoolEntry *reaped;
+
+	XplMutexLock(StoreAgent.dbpool.lock);
+	reaped = DBPoolReapLocked(time(NULL));
+	XplMutexUnlock(StoreAgent.dbpool.lock);
+
+	DBPoolCloseList(reaped);
+}
+
+/** \internal
+ * Do something to every open handle. Each entry is held as if by a client
+ * while we work on it, so it can't be reaped from under us, and the pool
+ * isn't locked while the work itself runs.
+ */
+static void
+DBPoolForEach(int (*visit)(MsgSQLHandle *handle))
+{
+	DBPoolEntry **entries;
+	DBPoolEntry *entry;
+	DBPoolEntry *reaped;
+	int count = 0, i;
+
+	XplMutexLock(StoreAgent.dbpool.lock);
+	entries = MemMalloc(sizeof(DBPoolEntry *) * (BongoHashTableCount(StoreAgent.dbpool.entries) + 1));
+	for (entry = lru_head; entries && entry != NULL; entry = entry->next) {
+		if (entry->handle != NULL) {
+			entry->clients++;
+			entries[count++] = entry;
+		}
+	}
+	XplMutexUnlock(StoreAgent.dbpool.lock);
+
+	if (!entries) return;
+
+	for (i = 0; i < count; i++) {
+		visit(entries[i]->handle);
+	}
+
+	XplMutexLock(StoreAgent.dbpool.lock);
+	for (i = 0; i < count; i++) {
+		entries[i]->clients--;
+	}
+	reaped = DBPoolReapLocked(time(NULL));
+	XplMutexUnlock(StoreAgent.dbpool.lock);
+
+	DBPoolCloseList(reaped);
+	MemFree(entries);
+}
+
+/**
+ * Checkpoint the write-ahead log of every open handle.
+ */
+void
+DBPoolCheckpoint(void)
+{
+	DBPoolForEach(MsgSQLCheckpoint);
+
+	XplMutexLock(StoreAgent.dbpool.lock);
+	StoreAgent.dbpool.stats.checkpoints++;
+	XplMutexUnlock(StoreAgent.dbpool.lock);
+}
+
+/**
+ * Compact the change log of every open store. Stores which aren't open
+ * can't have gained anything to compact since they were last closed.
+ */
+void
+DBPoolCompactChangeLogs(void)
+{
+	DBPoolForEach(ChangeLogCompact);
+}
+
+/**
+ * Find out how many clients are using a store's handle right now.
+ * \return	The number of clients, 0 if the store isn't open
+ */
+int
+DBPoolClients(const char *user)
+{
+	DBPoolEntry *entry;
+	int clients = 0;
+
+	XplMutexLock(StoreAgent.dbpool.lock);
+	entry = BongoHashtableGet(StoreAgent.dbpool.entries, user);
+	if (entry) {
+		clients = entry->clients;
+	}
+	XplMutexUnlock(StoreAgent.dbpool.lock);
+
+	return clients;
+}
+
+/**
+ * Close every handle in the pool which isn't in use. Called at shutdown,
+ * so that SQLite gets the chance to tidy up after itself.
+ */
+void
+DBPoolShutdown(void)
+{
+	DBPoolEntry *entry, *next;
+
+	XplMutexLock(StoreAgent.dbpool.lock);
+	for (entry = lru_head; entry != NULL; entry = next) {
+		next = entry->next;
+		if (entry->clients > 0 || entry->handle == NULL) {
+			Log(LOG_ERROR, "Store %s still in use at shutdown", entry->user);
+			continue;
+		}
+		BongoHashtableRemoveFull(StoreAgent.dbpool.entries, entry->user, TRUE, FALSE);
+		DBPoolUnlink(entry);
+		DBPoolEntryDelete(entry);
+	}
+	XplMutexUnlock(StoreAgent.dbpool.lock);
+}
+
+/**
+ * Write out the pool's counters as 2001 lines, for the STATS command.
+ */
+CCode
+DBPoolWriteStats(StoreClient *client)
+{
+	uint64_t hits, misses, evictions, checkpoints;
+	uint64_t stmt_hits = 0, stmt_misses = 0;
+	uint64_t h, m;
+	DBPoolEntry *entry;
+	int open;
+
+	XplMutexLock(StoreAgent.dbpool.lock);
+	for (entry = lru_head; entry != NULL; entry = entry->next) {
+		if (entry->handle) {
+			MsgSQLStatementCacheStats(entry->handle, &h, &m);
+			stmt_hits += h;
+			stmt_misses += m;
+		}
+	}
+	hits = StoreAgent.dbpool.stats.hits;
+	misses = StoreAgent.dbpool.stats.misses;
+	evictions = StoreAgent.dbpool.stats.evictions;
+	checkpoints = StoreAgent.dbpool.stats.checkpoints;
+	open = BongoHashTableCount(StoreAgent.dbpool.entries);
+	XplMutexUnlock(StoreAgent.dbpool.lock);
+
+	return ConnWriteF(client->conn,
+		"2001 dbpool.open %d\r\n"
+		"2001 dbpool.hits " FMT_UINT64_DEC "\r\n"
+		"2001 dbpool.misses " FMT_UINT64_DEC "\r\n"
+		"2001 dbpool.evictions " FMT_UINT64_DEC "\r\n"
+		"2001 dbpool.checkpoints " FMT_UINT64_DEC "\r\n"
+		"2001 sql.stmtcache.hits " FMT_UINT64_DEC "\r\n"
+		"2001 sql.stmtcache.misses " FMT_UINT64_DEC "\r\n",
+		open, hits, misses, evictions, checkpoints, stmt_hits, stmt_misses);
+}
+
 /**
  * Open the Store database for this user. Updates the storedb handle of
  * the StoreClient to contain an SQLite handle to the Store.
  * \param	client	storeclient we're working for
  * \param	user	name of the store (usually, the username)
- * \return	0 on success, error codes otherwise
+ * \return	0 on success, 1 if the client asked for STORE_CLIENT_FLAG_IDLE_ONLY
+ *		and someone else has the store open, error codes otherwise
  */
 int
 StoreDBOpen(StoreClient *client, const char *user)
 {
 	char path[XPL_MAX_PATH +1];
 	DBPoolEntry *entry = NULL;
+	DBPoolEntry *reaped = NULL;
+	MsgSQLHandle *handle;
 
 	// try to find the handle in the pool - first, lock the pool
 	XplMutexLock(StoreAgent.dbpool.lock); 
-	{
-		// find the entry
-		entry = (DBPoolEntry *)
-			BongoHashtableGet(StoreAgent.dbpool.entries, user);
-		
-		if (entry == NULL) {
-			// no such entry, need to create one - we
-			// do it here while locked
-			entry = MemNew0(DBPoolEntry, 1);
-			entry->user = MemStrdup(user);
-			entry->clients = 0;
-			
-			if (BongoHashtablePutNoReplace(StoreAgent.dbpool.entries, MemStrdup(user), (void *)entry)) {
-				// couldn't insert the new entry for whatever reason :(
-				DBPoolEntryDelete(entry);
-				goto db_fail;
-			}
-			
-			// this bit is slow, but I can't think how we could
-			// do this outside the dbpool.lock without being racy :(
-			snprintf(path, XPL_MAX_PATH, "%s/%s/store.db", StoreAgent.store.rootDir, user);
-			entry->handle = MsgSQLOpen(path, &client->memstack, 3000);
-			if (entry->handle == NULL) {
-				BongoHashtableRemove(StoreAgent.dbpool.entries, (void *)user);
-				DBPoolEntryDelete(entry);
-				goto db_fail;
-			}
+	
+	// find the entry
+	entry = (DBPoolEntry *)
+		BongoHashtableGet(StoreAgent.dbpool.entries, user);
+	
+	if (entry != NULL) {
+		if (entry->clients > 0 && (client->flags & STORE_CLIENT_FLAG_IDLE_ONLY)) {
+			XplMutexUnlock(StoreAgent.dbpool.lock);
+			return 1;
 		}
 		entry->clients++;
+		DBPoolUnlink(entry);
+		DBPoolLinkHead(entry);
+		StoreAgent.dbpool.stats.hits++;
+
+		if (entry->handle == NULL) {
+			// someone else is opening this store; wait for them
+			entry->waiters++;
+			XplMutexUnlock(StoreAgent.dbpool.lock);
+			XplWaitOnLocalSemaphore(entry->ready);
+			XplMutexLock(StoreAgent.dbpool.lock);
+
+			if (entry->failed) {
+				goto open_failed;
+			}
+		}
+		XplMutexUnlock(StoreAgent.dbpool.lock);
+
+		client->storedb = entry->handle;
+		return 0;
+	}
+
+	// no such entry, need to create one. We put it in the pool
+	// straight away, so that anyone else wanting this store waits
+	// for us rather than opening it a second time.
+	entry = MemNew0(DBPoolEntry, 1);
+	entry->user = MemStrdup(user);
+	entry->clients = 1;
+	XplOpenLocalSemaphore(entry->ready, 0);
+	
+	if (BongoHashtablePutNoReplace(StoreAgent.dbpool.entries, MemStrdup(user), (void *)entry)) {
+		// couldn't insert the new entry for whatever reason :(
+		XplMutexUnlock(StoreAgent.dbpool.lock);
+		DBPoolEntryDelete(entry);
+		return -1;
+	}
+	DBPoolLinkHead(entry);
+	StoreAgent.dbpool.stats.misses++;
+	
+	// make room for the new handle if we can
+	reaped = DBPoolReapLocked(time(NULL));
+	XplMutexUnlock(StoreAgent.dbpool.lock);
+
+	DBPoolCloseList(reaped);
+
+	// this bit is slow, so it's done without holding up the pool
+	snprintf(path, XPL_MAX_PATH, "%s/%s/store.db", StoreAgent.store.rootDir, user);
+	handle = MsgSQLOpen(path, &client->memstack, 3000);
+	if (handle && MsgSQLTune(handle, &StoreAgent.dbpool.tuning)) {
+		// not fatal; we're just slower than we'd like
+		Log(LOG_WARNING, "Couldn't apply database settings for store %s", user);
+	}
+
+	XplMutexLock(StoreAgent.dbpool.lock);
+	entry->handle = handle;
+	if (handle == NULL) {
+		// take it out so the next client tries again
+		entry->failed = TRUE;
+		BongoHashtableRemoveFull(StoreAgent.dbpool.entries, user, TRUE, FALSE);
+		DBPoolUnlink(entry);
+	}
+	for (; entry->waiters > 0; entry->waiters--) {
+		XplSignalLocalSemaphore(entry->ready);
+	}
+	if (handle == NULL) {
+		goto open_failed;
 	}
-	// unlock the pool on success
 	XplMutexUnlock(StoreAgent.dbpool.lock);
 	
 	client->storedb = entry->handle;
 	
 	return 0;
 
-db_fail:
-	// unlock the pool on failure
+open_failed:
+	// the last one out gets rid of the failed entry
+	entry->clients--;
+	if (entry->clients > 0) {
+		entry = NULL;
+	}
 	XplMutexUnlock(StoreAgent.dbpool.lock);
+
+	if (entry) {
+		DBPoolEntryDelete(entry);
+	}
 	return -1;
 }
 
 void
 StoreDBClose(StoreClient *client)
 {
+	DBPoolEntry *entry = NULL;
+	DBPoolEntry *reaped = NULL;
+
 	if ((client == NULL) || (client->storedb == NULL) || (client->storeName == NULL)) {
 		// no store open; nothing to close?
 		return;
 	}
 	
 	XplMutexLock(StoreAgent.dbpool.lock); 
-	{
-		DBPoolEntry *entry = NULL;
-		
-		// find the entry
-		entry = (DBPoolEntry *)
-			BongoHashtableGet(StoreAgent.dbpool.entries, client->storeName);
-		
-		if (entry == NULL) 
-			// very odd error; shouldn't happen
-			goto unlock;
-		
+	
+	// find the entry
+	entry = (DBPoolEntry *)
+		BongoHashtableGet(StoreAgent.dbpool.entries, client->storeName);
+	
+	if (entry != NULL) {
 		entry->clients--;
 		if (entry->clients < 0) entry->clients = 0;
 		entry->lastAccessTime = time(NULL);
-		
-		// FIXME: perhaps we want some kind of reaping system in here.
-		// Want to remove entries with lastAccessTime set in the past (10mn?)
-		// and where clients == 0.
-		/*
-		if (client->storedb != NULL) {
-			MsgSQLClose(client->storedb);
-			client->storedb = NULL;
-		}
-		*/
+		DBPoolUnlink(entry);
+		DBPoolLinkHead(entry);
+
+		// the handle stays open for the next client, unless the pool
+		// is now over capacity or other handles have gone stale
+		reaped = DBPoolReapLocked(entry->lastAccessTime);
 	}
-unlock:
+	// else, very odd error; shouldn't happen
+
 	XplMutexUnlock(StoreAgent.dbpool.lock);
+
+	DBPoolCloseList(reaped);
 }
@@ -0,0 +1,217 @@
+/** \file
+ * Group commit: sharing the cost of making writes durable.
+ *
+ * Normally each WRITE fsync()s its document before linking it into the
+ * maildir, and SQLite syncs its own commit. When lots of mail arrives at
+ * once, that makes delivery rate a function of disk flush latency.
+ *
+ * With group commit turned on, writers instead call GroupCommitWait()
+ * at the points where they need everything they've written so far to be
+ * on disk. The first writer to arrive waits for a short window so that
+ * others can join it, and then syncs the filesystem the store lives on
+ * once for the whole batch. Everyone in the batch is woken with the
+ * result. Because the store databases run in WAL mode with
+ * synchronous=NORMAL, the same sync also makes their commits durable.
+ */
+
+#include <config.h>
+#include <xpl.h>
+#include <memmgr.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "stored.h"
+
+typedef struct {
+	XplSemaphore	done;
+	// writers which haven't been told the result yet, including the leader
+	int		refs;
+	int		result;
+} CommitBatch;
+
+static struct {
+	XplMutex	lock;
+	// the batch new writers join; NULL if nobody is waiting
+	CommitBatch *	forming;
+	// a descriptor on the store's filesystem, for syncfs()
+	int		fd;
+	BOOL		running;
+} GroupCommit;
+
+/**
+ * Set up group commit, if it's been configured.
+ * \return	0 on success, -1 on failure
+ */
+int
+GroupCommitInit(void)
+{
+	GroupCommit.forming = NULL;
+	GroupCommit.running = FALSE;
+	GroupCommit.fd = -1;
+
+	if (!StoreAgent.store.groupCommit) {
+		return 0;
+	}
+
+	GroupCommit.fd = open(StoreAgent.store.rootDir, O_RDONLY);
+	if (GroupCommit.fd == -1) {
+		Log(LOG_ERROR, "Couldn't open %s for group commit: %s",
+		    StoreAgent.store.rootDir, strerror(errno));
+		return -1;
+	}
+
+	XplMutexInit(GroupCommit.lock);
+	GroupCommit.running = TRUE;
+
+	return 0;
+}
+
+void
+GroupCommitShutdown(void)
+{
+	if (!GroupCommit.running) {
+		return;
+	}
+
+	GroupCommit.running = FALSE;
+	close(GroupCommit.fd);
+	XplMutexDestroy(GroupCommit.lock);
+}
+
+/** \internal
+ * Actually flush the store's filesystem to disk.
+ */
+static int
+GroupCommitSync(void)
+{
+#ifdef HAVE_SYNCFS
+	return syncfs(GroupCommit.fd);
+#else
+	// no way to sync just the one filesystem here; this is
+	// heavier, but still only happens once per batch
+	sync();
+	return 0;
+#endif
+}
+
+/**
+ * Wait until everything this thread has written so far is on disk,
+ * sharing the sync with any other writers which arrive in the meantime.
+ * \param	fh	The file just written, if any. It's flushed to the
+ *			kernel, and synced on its own if group commit is off.
+ * \return	0 on success, -1 if the data may not be durable
+ */
+int
+GroupCommitWait(FILE *fh)
+{
+	CommitBatch *batch;
+	BOOL leader = FALSE;
+	int result;
+
+	if (fh && fflush(fh)) {
+		return -1;
+	}
+
+	if (!GroupCommit.running) {
+		// each writer looks after itself
+		return fh ? fsync(fileno(fh)) : 0;
+	}
+
+	XplMutexLock(GroupCommit.lock);
+	batch = GroupCommit.forming;
+	if (batch == NULL) {
+		batch = MemMalloc0(sizeof(CommitBatch));
+		if (!batch) {
+			XplMutexUnlock(GroupCommit.lock);
+			return fh ? fsync(fileno(fh)) : -1;
+		}
+		XplOpenLocalSemaphore(batch->done, 0);
+		GroupCommit.forming = batch;
+		leader = TRUE;
+	}
+	batch->refs++;
+	XplMutexUnlock(GroupCommit.lock);
+
+	if (leader) {
+		// give others the chance to join us
+		if (StoreAgent.store.groupCommitWindowMs > 0) {
+			XplDelay(StoreAgent.store.groupCommitWindowMs);
+		}
+
+		// anyone arriving from now on starts a new batch, as we can't
+		// be sure the sync will include what they wrote
+		XplMutexLock(GroupCommit.lock);
+		GroupCommit.forming = NULL;
+		XplMutexUnlock(GroupCommit.lock);
+
+		batch->result = GroupCommitSync();
+		if (batch->result) {
+			Log(LOG_ERROR, "Group commit sync failed: %s", strerror(errno));
+		}
+
+		XplMutexLock(GroupCommit.lock);
+		StoreAgent.store.groupCommitStats.batches++;
+		StoreAgent.store.groupCommitStats.writers += batch->refs;
+		for (result = 1; result < batch->refs; result++) {
+			XplSignalLocalSemaphore(batch->done);
+		}
+		XplMutexUnlock(GroupCommit.lock);
+	} else {
+		XplWaitOnLocalSemaphore(batch->done);
+	}
+
+	// the last one out tidies up
+	XplMutexLock(GroupCommit.lock);
+	result = batch->result;
+	if (--batch->refs > 0) {
+		batch = NULL;
+	}
+	XplMutexUnlock(GroupCommit.lock);
+
+	if (batch) {
+		XplCloseLocalSemaphore(batch->done);
+		MemFree(batch);
+	}
+
+	return result ? -1 : 0;
+}
+
+/**
+ * Get a file that's one of several being written on to its way to disk.
+ * With group commit on this just hands it to the kernel, and a later
+ * GroupCommitWait() makes it durable along with everything else;
+ * otherwise it's synced straight away.
+ * \param	fh	The file just written
+ * \return	0 on success, -1 on failure
+ */
+int
+GroupCommitFlush(FILE *fh)
+{
+	if (fflush(fh)) {
+		return -1;
+	}
+
+	return GroupCommit.running ? 0 : fsync(fileno(fh));
+}
+
+/**
+ * Write out the group commit counters as 2001 lines, for the STATS command.
+ */
+CCode
+GroupCommitWriteStats(StoreClient *client)
+{
+	uint64_t batches = 0, writers = 0;
+
+	if (GroupCommit.running) {
+		XplMutexLock(GroupCommit.lock);
+		batches = StoreAgent.store.groupCommitStats.batches;
+		writers = StoreAgent.store.groupCommitStats.writers;
+		XplMutexUnlock(GroupCommit.lock);
+	}
+
+	return ConnWriteF(client->conn,
+		"2001 groupcommit.batches " FMT_UINT64_DEC "\r\n"
+		"2001 groupcommit.writers " FMT_UINT64_DEC "\r\n",
+		batches, writers);
+}
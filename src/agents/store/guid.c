@@ -19,6 +19,21 @@
  * </Novell-copyright>
  ****************************************************************************/
 
+/** \file
+ * Process-wide unique ids.
+ *
+ * An id is a prefix fixed when the store starts, followed by a 64-bit
+ * sequence number. The prefix starts with the startup time, so ids from
+ * a later run sort after those from an earlier one, and goes on with a
+ * hash of the host, so different hosts don't clash.
+ *
+ * Handing out the sequence numbers takes a single atomic add rather than
+ * a lock. Clients take a block of them at a time, so that most ids are
+ * allocated without touching anything shared: each client's ids go up,
+ * and are unique across the process, but ids given to different clients
+ * at about the same time aren't ordered against each other.
+ */
+
 #include <config.h>
 #include <xpl.h>
 
@@ -30,9 +45,18 @@
 #include <sys/sysinfo.h>
 #endif
 
-void GuidReset(void) {
+#define GUID_BLOCK_SIZE 1024
+
+/**
+ * Pick the prefix for this run and start the sequence again. Call once,
+ * before anything is allocated.
+ */
+void
+GuidReset(void)
+{
 	char name[256 + 1];
 	char salt[32];
+	char hash[XPLHASH_SHA1_LENGTH];
 #ifdef HAVE_KSTAT_H
 	kstat_t *ksp;
 	kstat_ctl_t *kc;
@@ -80,61 +104,54 @@ void GuidReset(void) {
 	XplHashWrite(&context, name, sizeof(name) - 1);
 #endif
 
-	XplHashFinal(&context, XPLHASH_UPPERCASE, StoreAgent.guid.next,
-		XPLHASH_SHA1_LENGTH);
-	
-	memset(StoreAgent.guid.next + NMAP_GUID_PREFIX_LENGTH, '0',
-		NMAP_GUID_SUFFIX_LENGTH);
+	XplHashFinal(&context, XPLHASH_UPPERCASE, hash, XPLHASH_SHA1_LENGTH);
+	hash[XPLHASH_SHA1_LENGTH - 1] = '\0';
 
-	return;
+	// microseconds since the epoch, then some of the hash
+	snprintf(StoreAgent.guid.prefix, sizeof(StoreAgent.guid.prefix), "%016llX%.8s",
+		(unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec, hash);
+	XplSafeWrite(StoreAgent.guid.next, 0);
 }
 
-void 
-GuidAlloc(unsigned char *guid)
+/** \internal
+ * Write out the id with a given sequence number.
+ */
+static void
+GuidFormat(uint64_t sequence, unsigned char *guid)
 {
-    int i;
-    char c;
-    char *ptr;
-
-    if (guid) {
-        XplWaitOnLocalSemaphore(StoreAgent.guid.semaphore);
-
-        memcpy(guid, StoreAgent.guid.next, NMAP_GUID_LENGTH);
-
-        ptr = StoreAgent.guid.next + NMAP_GUID_PREFIX_LENGTH + NMAP_GUID_SUFFIX_LENGTH - 1;
-        for (i = 0; i < NMAP_GUID_SUFFIX_LENGTH; i++) {
-            c = *ptr + 1;
-            if (c < ':') {
-                *ptr = c; /* '0' through '9' */
-                break;
-            } else if (c != ':') {
-                if (c < 'G') {
-                    *ptr = c; /* 'B' through 'F' */
-                    break;
-                }
-
-                *ptr = '0';
-                ptr--;
-                continue;
-            }
+	char buffer[NMAP_GUID_LENGTH + 1];
 
-            *ptr = 'A';
-            break;
-        }
-
-        if (i < NMAP_GUID_SUFFIX_LENGTH) {
-            XplSignalLocalSemaphore(StoreAgent.guid.semaphore);
-
-            return;
-        }
+	snprintf(buffer, sizeof(buffer), "%s%016llX%06llX", StoreAgent.guid.prefix,
+		(unsigned long long)(sequence >> 24), (unsigned long long)(sequence & 0xFFFFFF));
+	memcpy(guid, buffer, NMAP_GUID_LENGTH);
+}
 
-        GuidReset();
-        memcpy(guid, StoreAgent.guid.next, NMAP_GUID_LENGTH);
+/**
+ * Allocate a new id.
+ * \param	client	Client the id is for, which keeps a block of ids to
+ *			hand out without going back to the shared counter;
+ *			may be NULL
+ * \param	guid	Output for the id: NMAP_GUID_LENGTH characters, not
+ *			nul-terminated
+ */
+void 
+GuidAlloc(StoreClient *client, unsigned char *guid)
+{
+	uint64_t sequence;
 
-        XplSignalLocalSemaphore(StoreAgent.guid.semaphore);
+	if (!guid) {
+		return;
+	}
 
-        return;
-    }
+	if (client == NULL) {
+		sequence = XplSafeFetchAdd64(StoreAgent.guid.next, 1);
+	} else {
+		if (client->guids.next == client->guids.end) {
+			client->guids.next = XplSafeFetchAdd64(StoreAgent.guid.next, GUID_BLOCK_SIZE);
+			client->guids.end = client->guids.next + GUID_BLOCK_SIZE;
+		}
+		sequence = client->guids.next++;
+	}
 
-    return;
+	GuidFormat(sequence, guid);
 }
@@ -1,12 +1,20 @@
 /* Internal Store-level locking
  * This provides read-only (shared) and read-write (exclusive) locking
  * at a logical level within the store.
- * 
+ *
  * Locks are held on the internal path within the store, e.g. on /mail,
  * rather than on GUIDs. This allows locks to conflict with each other,
  * e.g. /mail/INBOX cannot be taken if /mail is locked, and vice-versa
- * 
+ *
  * Where locks are not immediately available the request is then queued.
+ * The queue is strictly first-come first-served, so a steady stream of
+ * readers can't starve out a writer.
+ *
+ * By default the whole store is one lock. If per-collection locking is
+ * turned on, a lock on an object also takes "intention" locks on each
+ * of the collections above it, so that a lock on /mail still conflicts
+ * with a lock on /mail/INBOX/foo, but two writers in different
+ * collections can go ahead at the same time.
  */
 
 #include <config.h>
@@ -15,26 +23,59 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <sys/time.h>
 
 #include "stored.h"
 
-static XplMutex logicallock_global;
-static GHashTable *storelocks_global;
+typedef enum {
+	LMODE_IS,	// intend to read something below this
+	LMODE_IX,	// intend to write something below this
+	LMODE_S,	// shared (read-only)
+	LMODE_X,	// exclusive (read-write)
+	LMODE_COUNT
+} LockMode;
+
+// can a lock in mode [held] be held at the same time as one in [wanted]?
+static const BOOL lock_compatible[LMODE_COUNT][LMODE_COUNT] = {
+	/*          IS     IX     S      X     */
+	/* IS */ { TRUE,  TRUE,  TRUE,  FALSE },
+	/* IX */ { TRUE,  TRUE,  FALSE, FALSE },
+	/* S  */ { TRUE,  FALSE, TRUE,  FALSE },
+	/* X  */ { FALSE, FALSE, FALSE, FALSE },
+};
+
+typedef struct _LockWaiter {
+	XplSemaphore		signal;
+	LockMode		mode;
+	struct _LockWaiter *	next;
+} LockWaiter;
 
 typedef struct {
-	char *		store;
-	XplMutex	lock;
-	XplThreadID	thread;
-	LogicalLockType	type;
+	char *		name;
+	int		held[LMODE_COUNT];
+	// holders plus waiters; the node goes away when this hits zero
+	int		refs;
+	LockWaiter *	head;
+	LockWaiter *	tail;
 } StoreLock;
 
-/* FIXME: do i need to worry about the mutex being locked? */
+// all of the above is protected by this; it's only held briefly
+static XplMutex logicallock_global;
+static GHashTable *storelocks_global;
+
+// wait time histograms, also protected by logicallock_global
+static const unsigned long lock_wait_buckets[LLOCK_WAIT_BUCKETS - 1] =
+	{ 1, 10, 100, 1000, 10000 };
+static uint64_t lock_waits[2][LLOCK_WAIT_BUCKETS];
+static uint64_t lock_wait_total_ms[2];
+
+#define LLOCK_MAX_DEPTH 16
+
 void
 pvt_MemFree(void *data) {
 	StoreLock *sl=data;
 
-	XplMutexDestroy(sl->lock);
-	MemFree(sl->store);
+	MemFree(sl->name);
 	MemFree(data);
 }
 
@@ -47,95 +88,414 @@ LogicalLockInit()
 	storelocks_global = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, pvt_MemFree);
 }
 
-/* Acquire the desired logical lock. 
- * TODO: what if we already hold an equivalent lock? promotion / etc.?
- * Return 0 on failure
- */
-int
-LogicalLockGain(StoreClient *client, StoreObject *object, LogicalLockType type, const char *location)
+/* can the lock be granted in this mode right now? */
+static BOOL
+LockGrantable(StoreLock *sl, LockMode mode)
+{
+	int i;
+
+	for (i = 0; i < LMODE_COUNT; i++) {
+		if (sl->held[i] > 0 && !lock_compatible[i][mode]) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* hand the lock to as many waiters at the head of the queue as we can */
+static void
+LockWakeWaiters(StoreLock *sl)
+{
+	LockWaiter *w;
+
+	while ((w = sl->head) != NULL && LockGrantable(sl, w->mode)) {
+		sl->head = w->next;
+		if (sl->head == NULL) sl->tail = NULL;
+		sl->held[w->mode]++;
+		XplSignalLocalSemaphore(w->signal);
+	}
+}
+
+/* Take one node of a lock, waiting our turn if needed.
+ * Must be called with logicallock_global held; it may be dropped
+ * and re-taken while we wait.
+ * Returns 0 on failure */
+static int
+LockNodeAcquire(const char *name, LockMode mode)
 {
-	/* this has to be on the heap since it has to be valid across threads */
 	StoreLock *sl;
-	gpointer orig_key;
-	gpointer sl_tmp;
+	LockWaiter waiter;
 
-	UNUSED_PARAMETER(location);
-	UNUSED_PARAMETER(object);
+	sl = g_hash_table_lookup(storelocks_global, name);
+	if (!sl) {
+		sl = MemMalloc0(sizeof(StoreLock));
+		if (!sl) return 0;
+		sl->name = MemStrdup(name);
+		g_hash_table_insert(storelocks_global, sl->name, sl);
+	}
+	sl->refs++;
+
+	// only jump in if nobody is queued in front of us
+	if (sl->head == NULL && LockGrantable(sl, mode)) {
+		sl->held[mode]++;
+		return 1;
+	}
 
-	Log(LOG_DEBUG, "%lu asking for lock on %s in %s", XplGetThreadID(), client->storeName, location);
+	XplOpenLocalSemaphore(waiter.signal, 0);
+	waiter.mode = mode;
+	waiter.next = NULL;
+	if (sl->tail) {
+		sl->tail->next = &waiter;
+	} else {
+		sl->head = &waiter;
+	}
+	sl->tail = &waiter;
 
+	XplMutexUnlock(logicallock_global);
+	XplWaitOnLocalSemaphore(waiter.signal);
 	XplMutexLock(logicallock_global);
-	if (!g_hash_table_lookup_extended(storelocks_global, client->storeName, &orig_key, &sl_tmp)) {
-		/* it must not exist, create it first.  i can lock it too since this is new. */
-		sl = MemMalloc(sizeof(StoreLock));
-		if (!sl) {
-			XplMutexUnlock(logicallock_global);
-			return 0;
-		}
-		XplMutexInit(sl->lock);
-		XplMutexLock(sl->lock);
-		sl->thread=XplGetThreadID();
-		sl->store=MemStrdup(client->storeName);
-		sl->type=type;
 
-		g_hash_table_insert(storelocks_global, sl->store, sl);
+	XplCloseLocalSemaphore(waiter.signal);
+	return 1;
+}
 
-		/* unlock the global */
-		XplMutexUnlock(logicallock_global);
+/* Take another hold on a node we already hold in a mode at least as
+ * strong as this one. That's compatible with everyone else holding it,
+ * so it's granted straight away rather than queueing behind ourselves.
+ * Must be called with logicallock_global held */
+static void
+LockNodeReenter(const char *name, LockMode mode)
+{
+	StoreLock *sl;
+
+	sl = g_hash_table_lookup(storelocks_global, name);
+	sl->refs++;
+	sl->held[mode]++;
+}
+
+/* Must be called with logicallock_global held */
+static void
+LockNodeRelease(const char *name, LockMode mode, const char *location)
+{
+	StoreLock *sl;
+
+	sl = g_hash_table_lookup(storelocks_global, name);
+	if (!sl || sl->held[mode] <= 0) {
+		Log(LOG_ERROR, "Release of lock %s which isn't held, in %s", name, location);
+		return;
+	}
+
+	sl->held[mode]--;
+	sl->refs--;
+
+	if (sl->refs == 0) {
+		g_hash_table_remove(storelocks_global, name);
 	} else {
-		sl=(StoreLock *)sl_tmp;
+		LockWakeWaiters(sl);
+	}
+}
 
-		/* unlock the global so we don't deadlock */
-		XplMutexUnlock(logicallock_global);
+/* Work out the lock nodes for this object. These are all prefixes of
+ * one name, so we just record where each one ends, top-most first.
+ * Returns the number of nodes */
+static int
+LockNodeNames(StoreClient *client, StoreObject *object, char *name, size_t size, int *ends)
+{
+	char *p;
+	int depth = 0;
+	int base;
+
+	base = snprintf(name, size, "%s", client->storeName);
+	ends[depth++] = base;
+
+	if (!StoreAgent.store.lockPerCollection || object == NULL ||
+	    object->filename[0] != '/' || object->filename[1] == '\0') {
+		// store-wide lock
+		return depth;
+	}
+
+	snprintf(name + base, size - base, "%s", object->filename);
+	for (p = name + base + 1; depth < LLOCK_MAX_DEPTH; p++) {
+		if (*p == '/' || *p == '\0') {
+			ends[depth++] = p - name;
+			if (*p == '\0') break;
+		}
+	}
 
-		XplMutexLock(sl->lock);
-		sl->thread = XplGetThreadID();
-		sl->type = type;
+	return depth;
+}
+
+static void
+LockRecordWait(LogicalLockType type, struct timeval *start)
+{
+	struct timeval end;
+	unsigned long ms;
+	int kind = (type == LLOCK_READWRITE) ? 1 : 0;
+	int i;
+
+	gettimeofday(&end, NULL);
+	ms = ((end.tv_sec - start->tv_sec) * 1000) + ((end.tv_usec - start->tv_usec) / 1000);
 
-		/* note: the store name is already set.  we don't need to re-set it */
+	for (i = 0; i < LLOCK_WAIT_BUCKETS - 1; i++) {
+		if (ms < lock_wait_buckets[i]) break;
 	}
+	lock_waits[kind][i]++;
+	lock_wait_total_ms[kind] += ms;
+}
+
+/* Take the nodes of a path from the given one down, the last in mode and
+ * the ones above it in intent. On failure, those taken are given back.
+ * Must be called with logicallock_global held.
+ * Returns 0 on failure */
+static int
+LockPathAcquire(char *name, int *ends, int from, int depth, LockMode mode, LockMode intent, const char *location)
+{
+	int i;
+	char c;
 
-	Log(LOG_DEBUG, "%lu gained lock on %s in %s", XplGetThreadID(), client->storeName, location);
+	// always lock from the top down, so two lockers can't deadlock
+	for (i = from; i < depth; i++) {
+		c = name[ends[i]];
+		name[ends[i]] = '\0';
+		if (!LockNodeAcquire(name, (i == depth - 1) ? mode : intent)) {
+			// back out what we have so far
+			while (--i >= from) {
+				name[ends[i]] = '\0';
+				LockNodeRelease(name, intent, location);
+			}
+			return 0;
+		}
+		name[ends[i]] = c;
+	}
 	return 1;
 }
 
-void
-printfunc(gpointer key, gpointer value, gpointer user_data) {
-	StoreLock *sl=value;
+/* Give back the nodes of a path from the given one down, bottom up.
+ * Must be called with logicallock_global held */
+static void
+LockPathRelease(char *name, int *ends, int from, int depth, LockMode mode, LockMode intent, const char *location)
+{
+	int i;
 
-	Log(LOG_DEBUG, "lock table: LOCK on %s by %lu (%s)", key, sl->thread, (char *)user_data);
+	// we shorten the name as we go
+	for (i = depth - 1; i >= from; i--) {
+		name[ends[i]] = '\0';
+		LockNodeRelease(name, (i == depth - 1) ? mode : intent, location);
+	}
+}
+
+/* Acquire the desired logical lock.
+ * TODO: what if we already hold an equivalent lock? promotion / etc.?
+ * Return 0 on failure
+ */
+int
+LogicalLockGain(StoreClient *client, StoreObject *object, LogicalLockType type, const char *location)
+{
+	char name[XPL_MAX_PATH + 1];
+	int ends[LLOCK_MAX_DEPTH];
+	struct timeval start;
+	LockMode mode, intent;
+	int depth;
+
+	mode = (type == LLOCK_READWRITE) ? LMODE_X : LMODE_S;
+	intent = (type == LLOCK_READWRITE) ? LMODE_IX : LMODE_IS;
+
+	depth = LockNodeNames(client, object, name, sizeof(name), ends);
+
+	Log(LOG_DEBUG, "%lu asking for lock on %s in %s", XplGetThreadID(), name, location);
+	gettimeofday(&start, NULL);
+
+	XplMutexLock(logicallock_global);
+	if (!LockPathAcquire(name, ends, 0, depth, mode, intent, location)) {
+		XplMutexUnlock(logicallock_global);
+		return 0;
+	}
+	LockRecordWait(type, &start);
+	XplMutexUnlock(logicallock_global);
+
+	Log(LOG_DEBUG, "%lu gained lock on %s in %s", XplGetThreadID(), name, location);
+	return 1;
 }
 
 /* Free the desired logical lock.
  * One way or another, this function must succeed!
- * It's not an error to call this on an object already unlocked?
+ * The object must have the same filename as when the lock was gained.
  */
 void
 LogicalLockRelease(StoreClient *client, StoreObject *object, LogicalLockType type, const char *location)
 {
-	StoreLock *sl;
-	gpointer orig_key;
-	gpointer sl_tmp;
+	char name[XPL_MAX_PATH + 1];
+	int ends[LLOCK_MAX_DEPTH];
+	LockMode mode, intent;
+	int depth;
+
+	mode = (type == LLOCK_READWRITE) ? LMODE_X : LMODE_S;
+	intent = (type == LLOCK_READWRITE) ? LMODE_IX : LMODE_IS;
 
-	UNUSED_PARAMETER(object);
-	UNUSED_PARAMETER(type);
+	depth = LockNodeNames(client, object, name, sizeof(name), ends);
+
+	Log(LOG_DEBUG, "%lu releasing lock on %s in %s", XplGetThreadID(), name, location);
 
-	Log(LOG_DEBUG, "%lu asking to unlock %s in %s", XplGetThreadID(), client->storeName, location);
 	XplMutexLock(logicallock_global);
+	LockPathRelease(name, ends, 0, depth, mode, intent, location);
+	XplMutexUnlock(logicallock_global);
+}
+
+/* Compare two lock names a path component at a time, so that
+ * everything under /a sorts together, before /a-b and /b */
+static int
+LockNameCompare(const char *a, const char *b)
+{
+	for (; *a && *a == *b; a++, b++) ;
 
-	if (g_hash_table_lookup_extended(storelocks_global, client->storeName, &orig_key, &sl_tmp)) {
-		sl=(StoreLock *)sl_tmp;
+	if (*a == *b) return 0;
+	if (*a == '\0') return -1;
+	if (*b == '\0') return 1;
+	if (*a == '/') return -1;
+	if (*b == '/') return 1;
+	return (unsigned char)*a - (unsigned char)*b;
+}
 
-		sl->thread = 0;
-		sl->type = LLOCK_NONE;
-		XplMutexUnlock(sl->lock);
-		Log(LOG_DEBUG, "%lu released lock on %s in %s", XplGetThreadID(), client->storeName, location);
+/* Acquire two logical locks together, e.g. on the source and destination
+ * of a copy. They're always taken in name order, so two clients working
+ * in opposite directions can't each hold the lock the other is waiting on.
+ * The collections above both are walked just once, in the stronger
+ * intent: asking for them a second time would queue us behind anyone who
+ * arrived in between, who may well be waiting for us.
+ * If one lock sits on the path of the other (the same collection, or
+ * always when there is only the store-wide lock) we would queue up behind
+ * ourselves, so only the outer lock is taken, in the stronger mode.
+ * On return *xType and *yType say what is actually held, ready to hand
+ * to LogicalLockRelease(); either may have become LLOCK_NONE.
+ * Return 0 on failure, with neither lock held
+ */
+int
+LogicalLockGainPair(StoreClient *client, StoreObject *x, LogicalLockType *xType,
+                    StoreObject *y, LogicalLockType *yType, const char *location)
+{
+	char xname[XPL_MAX_PATH + 1], yname[XPL_MAX_PATH + 1];
+	int xends[LLOCK_MAX_DEPTH], yends[LLOCK_MAX_DEPTH];
+	int xdepth, ydepth, shared, i;
+	LockMode xmode, xintent, ymode, yintent, intent;
+	LogicalLockType strongest;
+	struct timeval start;
+	size_t xlen, ylen;
+	char c;
+
+	xdepth = LockNodeNames(client, x, xname, sizeof(xname), xends);
+	ydepth = LockNodeNames(client, y, yname, sizeof(yname), yends);
+	xlen = strlen(xname);
+	ylen = strlen(yname);
+
+	strongest = (*xType == LLOCK_READWRITE || *yType == LLOCK_READWRITE) ?
+		LLOCK_READWRITE : LLOCK_READONLY;
+
+	if (xlen <= ylen && strncmp(xname, yname, xlen) == 0 &&
+	    (yname[xlen] == '\0' || yname[xlen] == '/')) {
+		// y is x, or is inside it
+		*xType = strongest;
+		*yType = LLOCK_NONE;
+		if (LogicalLockGain(client, x, *xType, location)) return 1;
+		*xType = LLOCK_NONE;
+		return 0;
+	} else if (ylen < xlen && strncmp(xname, yname, ylen) == 0 && xname[ylen] == '/') {
+		// x is inside y
+		*xType = LLOCK_NONE;
+		*yType = strongest;
+		if (LogicalLockGain(client, y, *yType, location)) return 1;
+		*yType = LLOCK_NONE;
+		return 0;
+	}
+
+	xmode = (*xType == LLOCK_READWRITE) ? LMODE_X : LMODE_S;
+	xintent = (*xType == LLOCK_READWRITE) ? LMODE_IX : LMODE_IS;
+	ymode = (*yType == LLOCK_READWRITE) ? LMODE_X : LMODE_S;
+	yintent = (*yType == LLOCK_READWRITE) ? LMODE_IX : LMODE_IS;
+	intent = (xintent == LMODE_IX || yintent == LMODE_IX) ? LMODE_IX : LMODE_IS;
+
+	Log(LOG_DEBUG, "%lu asking for locks on %s and %s in %s", XplGetThreadID(), xname, yname, location);
+	gettimeofday(&start, NULL);
+
+	XplMutexLock(logicallock_global);
+
+	// the collections above both of them, once each; the extra hold
+	// means each lock can still be released on its own
+	for (shared = 0; shared < xdepth - 1 && shared < ydepth - 1 &&
+	     xends[shared] == yends[shared] &&
+	     strncmp(xname, yname, xends[shared]) == 0; shared++) {
+		c = xname[xends[shared]];
+		xname[xends[shared]] = '\0';
+		if (!LockNodeAcquire(xname, intent)) {
+			goto backout;
+		}
+		LockNodeReenter(xname, (intent == xintent) ? yintent : xintent);
+		xname[xends[shared]] = c;
+	}
+
+	// then the rest of each path, in name order
+	if (LockNameCompare(xname, yname) < 0) {
+		if (LockPathAcquire(xname, xends, shared, xdepth, xmode, xintent, location)) {
+			if (LockPathAcquire(yname, yends, shared, ydepth, ymode, yintent, location)) goto done;
+			LockPathRelease(xname, xends, shared, xdepth, xmode, xintent, location);
+		}
 	} else {
-		Log(LOG_DEBUG, "Release Failed for %s by %lu in %s.  Printing table", client->storeName, XplGetThreadID(), location);
-		g_hash_table_foreach(storelocks_global, printfunc, (char *)location);
+		if (LockPathAcquire(yname, yends, shared, ydepth, ymode, yintent, location)) {
+			if (LockPathAcquire(xname, xends, shared, xdepth, xmode, xintent, location)) goto done;
+			LockPathRelease(yname, yends, shared, ydepth, ymode, yintent, location);
+		}
+	}
+
+backout:
+	for (i = shared - 1; i >= 0; i--) {
+		xname[xends[i]] = '\0';
+		LockNodeRelease(xname, xintent, location);
+		LockNodeRelease(xname, yintent, location);
 	}
+	XplMutexUnlock(logicallock_global);
+
+	*xType = *yType = LLOCK_NONE;
+	return 0;
+
+done:
+	LockRecordWait(strongest, &start);
+	XplMutexUnlock(logicallock_global);
+
+	Log(LOG_DEBUG, "%lu gained locks on %s and %s in %s", XplGetThreadID(), xname, yname, location);
+	return 1;
+}
 
+/* Write out the lock wait time histograms as 2001 lines */
+CCode
+LogicalLockWriteStats(StoreClient *client)
+{
+	static const char *kinds[2] = { "read", "write" };
+	uint64_t waits[2][LLOCK_WAIT_BUCKETS];
+	uint64_t total_ms[2];
+	CCode ccode = 0;
+	int kind, i;
+
+	XplMutexLock(logicallock_global);
+	memcpy(waits, lock_waits, sizeof(waits));
+	memcpy(total_ms, lock_wait_total_ms, sizeof(total_ms));
 	XplMutexUnlock(logicallock_global);
+
+	for (kind = 0; kind < 2 && ccode != -1; kind++) {
+		for (i = 0; i < LLOCK_WAIT_BUCKETS && ccode != -1; i++) {
+			if (i < LLOCK_WAIT_BUCKETS - 1) {
+				ccode = ConnWriteF(client->conn, "2001 lock.%s.wait.lt%lums " FMT_UINT64_DEC "\r\n",
+				                   kinds[kind], lock_wait_buckets[i], waits[kind][i]);
+			} else {
+				ccode = ConnWriteF(client->conn, "2001 lock.%s.wait.ge%lums " FMT_UINT64_DEC "\r\n",
+				                   kinds[kind], lock_wait_buckets[i - 1], waits[kind][i]);
+			}
+		}
+		if (ccode != -1) {
+			ccode = ConnWriteF(client->conn, "2001 lock.%s.wait.totalms " FMT_UINT64_DEC "\r\n",
+			                   kinds[kind], total_ms[kind]);
+		}
+	}
+
+	return ccode;
 }
 
 /* Free all the store locks that are around */
@@ -4,6 +4,7 @@
 #include "stored.h"
 
 #include <unistd.h>
+#include <signal.h>
 #include <sys/wait.h>
 
 #include <glib.h>
@@ -14,6 +15,7 @@
 
 #include "mail.h"
 #include "messages.h"
+#include "conversations.h"
 
 static void
 SetDocProp(StoreClient *client, StoreObject *doc, char *pname, char *value)
@@ -38,6 +40,7 @@ struct wanted_header {
 // properties we want to look for and set automatically
 static struct wanted_header header_list[] = {
 	{ "From", "bongo.from" },
+	{ "From", "nmap.mail.senders" },
 	{ "To", "bongo.to" },
 	{ "CC", "bongo.cc" },
 	{ "Sender", "bongo.sender" },
@@ -49,216 +52,297 @@ static struct wanted_header header_list[] = {
 	{ NULL, NULL }
 };
 
-const char *
-StoreProcessIncomingMail(StoreClient *client,
-                         StoreObject *document,
-                         const char *path)
+/**
+ * Parse a mail with GMime, writing the properties we want to store
+ * for it to the given connection as "propname\1value\n" lines, followed
+ * by an empty line. This is run in a separate process from the store
+ * proper, either one of the parser pool workers or a one-off child.
+ * \param	out		Where to write the properties
+ * \param	path		Where the mail is on disk
+ * \param	guid		GUID of the document, used to invent a message-id
+ * \param	time_created	Creation time of the document, likewise
+ */
+void
+StoreMailParse(Connection *out, const char *path, uint64_t guid, uint32_t time_created)
 {
-	Connection *spipe = NULL;
-	StoreObject conversation;
-	StoreConversationData conversation_data;
 	struct wanted_header *headers = header_list;
-	char *result = NULL;
+	GMimeMessage *message;
+	GMimeParser *parser;
+	GMimeStream *stream;
 	char *header_str = NULL;
+	char prop[XPL_MAX_PATH+1];
+	time_t date;
+	int tz_offset;
+	int fd;
+
+	// open up the mail
+	fd = open(path, O_RDONLY);
+	if (fd == -1) goto finish;
 	
-	int commsPipe[2];
-	pid_t childpid;
-	char readbuffer[4096];
-	char *message_subject = NULL;
+	// the stream takes ownership of fd
+	stream = g_mime_stream_fs_new(fd);
+	parser = g_mime_parser_new_with_stream(stream);
+	g_mime_parser_set_scan_from (parser, FALSE);
+	g_object_unref(stream);
+	message = g_mime_parser_construct_message(parser);
+	g_object_unref(parser);
+	
+	if (message == NULL) {
+		// message didn't parse. 
+		goto finish;
+	}
+
+	while (headers->header != NULL) {
+		const char *value = g_mime_object_get_header(GMIME_OBJECT(message), headers->header);
+		
+		if (value != NULL) {
+			ConnWriteF(out, "%s\1%s\n", (char *)headers->propname, (char *)value);
+		}
+		
+		headers++;
+	}
 	
-	memset(&conversation_data, 0, sizeof(StoreConversationData));
-	memset(&conversation, 0, sizeof(conversation));
+	// treat message ID specially because we want to invent one if it 
+	// doesn't already exist.
+	if (! message->message_id) {
+		snprintf(prop, XPL_MAX_PATH, "%u." GUID_FMT "@%s", time_created, guid, 
+			StoreAgent.agent.officialName);
+		prop[XPL_MAX_PATH] = '\0';
+		ConnWriteF(out, "nmap.mail.messageid\1%s\n", prop);
+	} else {
+		ConnWriteF(out, "nmap.mail.messageid\1%s\n", message->message_id);
+	}
 	
-	// Parse the mail in a sub-process, as this way we can avoid being
-	// blown out of the water if we somehow segfault during processing.
-	//pipe(commsPipe);
-	socketpair(AF_UNIX, SOCK_STREAM, 0, commsPipe);
+	// the sent date is kept as a time so that mail can be sorted by it
+	g_mime_message_get_date(message, &date, &tz_offset);
+	if (date > 0) {
+		ConnWriteF(out, "nmap.mail.sent\1" FMT_UINT64_DEC "\n", (uint64_t)date);
+	}
+	
+	header_str = g_mime_object_get_headers(GMIME_OBJECT(message));
+	
+	if (header_str != NULL) {
+		ConnWriteF(out, "nmap.mail.headersize\1" FMT_UINT64_DEC "\n", 
+			(uint64_t)strlen(header_str));
+		g_free(header_str);
+	}
+
+	// workers live a long time, so we can't leak the message. This is
+	// safe now we no longer point message_id at our stack.
+	g_object_unref(message);
+
+finish:
+	// an empty line tells the store we're done with this message
+	ConnWrite(out, "\n", 1);
+}
+
+typedef struct {
+	StoreClient *client;
+	StoreObject *document;
+	char *subject;
+	char *messageid;
+	char *inreplyto;
+	char *references;
+} IncomingMailProps;
+
+static void
+IncomingMailSetProp(const char *name, const char *value, void *data)
+{
+	IncomingMailProps *props = data;
+
+	SetDocProp(props->client, props->document, (char *)name, (char *)value);
+
+	// keep hold of what we need for threading
+	if (strcmp(name, "nmap.mail.subject") == 0 && !props->subject) {
+		props->subject = MemStrdup(value);
+	} else if (strcmp(name, "nmap.mail.messageid") == 0 && !props->messageid) {
+		props->messageid = MemStrdup(value);
+	} else if (strcmp(name, "bongo.inreplyto") == 0 && !props->inreplyto) {
+		props->inreplyto = MemStrdup(value);
+	} else if (strcmp(name, "bongo.references") == 0 && !props->references) {
+		props->references = MemStrdup(value);
+	}
+}
+
+/** \internal
+ * Parse a mail in a one-off child process. This is how we parse if the
+ * parser pool is disabled or already has as much work queued as it's
+ * allowed.
+ */
+static int
+ParseInChild(StoreObject *document, const char *path, ParserPropertyFunc func, void *data)
+{
+	Connection *spipe = NULL;
+	int commsPipe[2];
+	pid_t childpid;
+	int ret = -1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, commsPipe)) {
+		return -1;
+	}
 
 	if ((childpid = fork()) == -1) {
-		goto finish;
+		close(commsPipe[0]);
+		close(commsPipe[1]);
+		return -1;
 	}
 	
 	if (childpid == 0) {
 		// this is the child process; parse the mail here.
-		GMimeMessage *message;
-		GMimeParser *parser;
-		GMimeStream *stream;
-		char outstr[1024];
-		int fd, outstr_size;
-		char prop[XPL_MAX_PATH+1];
+		Connection *cpipe;
 
 		/* close the parent side as we are the child */
 		close(commsPipe[0]);
 
-		// open up the mail
-		fd = open(path, O_RDONLY);
-		if (fd == -1) return MSG4224CANTREADMBOX;
-		
-		stream = g_mime_stream_fs_new(fd);
-		parser = g_mime_parser_new_with_stream(stream);
-		g_mime_parser_set_scan_from (parser, FALSE);
-		g_object_unref(stream);
-		message = g_mime_parser_construct_message(parser);
-		g_object_unref(parser);
-		
-		if (message == NULL) {
-			/* close our side of the pipe */
-			close(commsPipe[1]);
-
-			// message didn't parse. 
-			exit(-1);
-		}
-
-		/* create the wrapper for the child side */
-		Connection *cpipe = NULL;
 		cpipe = ConnAlloc(TRUE);
-		if (!cpipe) {
-			goto threadcleanup;
-		}
-		cpipe->socket = commsPipe[1];
-		
-		while (headers->header != NULL) {
-			const char *value = g_mime_object_get_header(GMIME_OBJECT(message), headers->header);
-			
-			if (value != NULL) {
-				outstr_size = snprintf(outstr, sizeof(outstr)-1, "%s\1%s\n", 
-					(char *)headers->propname, (char *)value);
-				ConnWrite(cpipe, outstr, outstr_size);
-			}
-			
-			headers++;
-		}
-		
-		// treat message ID specially because we want to invent one if it 
-		// doesn't already exist.
-		if (! message->message_id) {
-			snprintf(prop, XPL_MAX_PATH, "%u." GUID_FMT "@%s", document->time_created, document->guid, 
-				StoreAgent.agent.officialName);
-			prop[XPL_MAX_PATH] = '\0';
-			message->message_id = prop;
-		}
-		outstr_size = snprintf(outstr, sizeof(outstr)-1, "nmap.mail.messageid\1%s\n", 
-			message->message_id);
-		ConnWrite(cpipe, outstr, outstr_size);
-		
-		header_str = g_mime_object_get_headers(GMIME_OBJECT(message));
-		
-		if (header_str != NULL) {
-			snprintf(prop, XPL_MAX_PATH, FMT_UINT64_DEC, (uint64_t)strlen(header_str));
-			outstr_size = snprintf(outstr, sizeof(outstr)-1, "nmap.mail.headersize\1%s\n", prop);
-			ConnWrite(cpipe, outstr, outstr_size);
-			g_free(header_str);
-		}
-		
-		threadcleanup:
-
-		// all done, we can quit now
-		// FIXME: Why does this crash? : g_object_unref(message);
-		if (fd > 0) {
-			close(fd);
-		}
-
-		/* clean up */
 		if (cpipe) {
+			cpipe->socket = commsPipe[1];
+			StoreMailParse(cpipe, path, document->guid, document->time_created);
 			ConnClose(cpipe);
 			ConnFree(cpipe);
 		}
 
-		exit(0);
+		_exit(0);
 	}
 
-	waitpid(childpid, NULL, 0);
-	
-	int nbytes;
-	spipe = ConnAlloc(TRUE);
-	if (!spipe) {
-		goto finish;
-	}
-	spipe->socket = commsPipe[0];
-	
 	// from here, we're the parent - need to get the results from the
 	// child.
 	close(commsPipe[1]);
-	
-	while ((nbytes = ConnReadLine(spipe, readbuffer, sizeof(readbuffer))) > 0) {
-		char *ptr = readbuffer, *pair, *end = readbuffer+nbytes;
-
-		while (ptr <= end) {
-			if (*ptr == '\1') {
-				*ptr = '\0';
-				pair = ++ptr;
 
-				if (*(end-1) == '\n') {
-					/* shortcut the rest of the searching */
-					*(end-1) = '\0';
+	spipe = ConnAlloc(TRUE);
+	if (spipe) {
+		spipe->socket = commsPipe[0];
+		spipe->receive.timeOut = StoreAgent.parser.jobTimeout;
+		ret = ParserReadProperties(spipe, func, data);
+		ConnClose(spipe);
+		ConnFree(spipe);
+	} else {
+		close(commsPipe[0]);
+	}
 
-					SetDocProp(client, document, readbuffer, pair);
+	if (ret != 0) {
+		kill(childpid, SIGKILL);
+	}
+	waitpid(childpid, NULL, 0);
 
-					if (strcmp(readbuffer, "nmap.mail.subject") == 0) {
-						message_subject = MemStrdup(pair);
-					}
-				}
-				break;
-			}
+	return ret;
+}
 
-			ptr++;
-		}
+const char *
+StoreProcessIncomingMail(StoreClient *client,
+                         StoreObject *document,
+                         const char *path)
+{
+	ConversationHeaders headers;
+	IncomingMailProps props;
+	char *result = NULL;
+	
+	memset(&props, 0, sizeof(IncomingMailProps));
+	props.client = client;
+	props.document = document;
+	
+	// Parse the mail in a sub-process, as this way we can avoid being
+	// blown out of the water if we somehow segfault during processing.
+	if (ParserPoolParse(document, path, IncomingMailSetProp, &props) == -1) {
+		// no pooled parser to hand
+		ParseInChild(document, path, IncomingMailSetProp, &props);
 	}
 	
-	// now, see if we can find a matching conversation
-	if (message_subject) {
-		conversation_data.subject = message_subject;
-		conversation_data.date = 0; // FIXME: should be 7 days ago or similar
+	// now, put it in a conversation. Mail which didn't parse at all
+	// doesn't join one.
+	if (props.subject || props.messageid) {
+		headers.subject = props.subject;
+		headers.messageid = props.messageid;
+		headers.inreplyto = props.inreplyto;
+		headers.references = props.references;
 		
-		if (StoreObjectFindConversation(client, &conversation_data, &conversation) != 0) {
-			// need to create a conversation for this document
-			StoreObject convo_collection;
-			
-			if (StoreObjectFind(client, STORE_CONVERSATIONS_GUID, &convo_collection)) {
-				result = MSG5005DBLIBERR;
-				goto finish;
-			}
-			
-			conversation.type = STORE_DOCTYPE_CONVERSATION;
-			
-			if (StoreObjectCreate(client, &conversation) != 0) {
-				// can't create conversation
-				result = MSG5005DBLIBERR;
-				goto finish;
-			}
-			
-			conversation_data.guid = conversation.guid;
-			conversation_data.date = conversation.time_created;
-			conversation_data.sources = 0;
-			if (StoreObjectSaveConversation(client, &conversation_data)) {
-				result = MSG5005DBLIBERR;
-				goto finish;
-			}
-			
-			// save setting collection_guid til last, so that the new convo
-			// 'appears' atomically
-			conversation.collection_guid = STORE_CONVERSATIONS_GUID;
-			StoreObjectFixUpFilename(&convo_collection, &conversation);
-			if (StoreObjectSave(client, &conversation) != 0) {
-				result = MSG5005DBLIBERR;
-				goto finish;
-			}
-		}
-		// Link new mail to conversation
-		if (StoreObjectLink(client, &conversation, document)) {
-			// couldn't put the link in place, erk.
+		if (ConversationThreadMail(client, document, &headers)) {
 			result = MSG5005DBLIBERR;
-			goto finish;
 		}
 	}
 	
-finish:
-	if (message_subject) MemFree(message_subject);
-	if (spipe) {
-		ConnClose(spipe);
-		ConnFree(spipe);
-	}
+	if (props.subject) MemFree(props.subject);
+	if (props.messageid) MemFree(props.messageid);
+	if (props.inreplyto) MemFree(props.inreplyto);
+	if (props.references) MemFree(props.references);
 	
 	return result;
 }
 
+static void
+SentDateSetProp(const char *name, const char *value, void *data)
+{
+	char **sent = data;
+
+	if (strcmp(name, "nmap.mail.sent") == 0 && !*sent) {
+		*sent = MemStrdup(value);
+	}
+}
+
+/**
+ * Find the sent date of mail delivered before we kept it, by parsing it
+ * again as delivery would now. Should be called inside the upgrade's
+ * transaction. Mail with no date we can read is left at 0.
+ * \return	0 on success, -1 on failure
+ */
+int
+StoreMailFillSentDates(StoreClient *client)
+{
+	MsgSQLStatement stmt;
+	GArray *pending;
+	unsigned int i;
+	int status, result = 0;
+
+	pending = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+
+	if (MsgSQLPrepare(client->storedb, "SELECT m.guid FROM maildocument m "
+	    "INNER JOIN storeobject so ON so.guid = m.guid WHERE so.type = ?1 AND IFNULL(m.time_sent, 0) = 0;", &stmt) == NULL) {
+		result = -1;
+		goto finish;
+	}
+	MsgSQLBindInt(&stmt, 1, STORE_DOCTYPE_MAIL);
+	while ((status = MsgSQLResults(client->storedb, &stmt)) > 0) {
+		uint64_t guid = MsgSQLResultInt64(&stmt, 0);
+
+		g_array_append_val(pending, guid);
+	}
+	MsgSQLFinalize(&stmt);
+	if (status < 0) {
+		result = -1;
+		goto finish;
+	}
+
+	if (pending->len > 0) {
+		Log(LOG_INFO, "Finding the sent date of %d mails in store '%s'", pending->len, client->storeName);
+	}
+
+	for (i = 0; i < pending->len && result == 0; i++) {
+		StoreObject document;
+		char path[XPL_MAX_PATH + 1];
+		StorePropInfo info;
+		char *sent = NULL;
+
+		if (StoreObjectFind(client, g_array_index(pending, uint64_t, i), &document)) continue;
+		FindPathToDocument(client, document.collection_guid, document.guid, path, sizeof(path));
+
+		if (ParserPoolParse(&document, path, SentDateSetProp, &sent) == -1) {
+			ParseInChild(&document, path, SentDateSetProp, &sent);
+		}
+		if (!sent) continue;
+
+		info.type = STORE_PROP_NONE;
+		info.name = "nmap.mail.sent";
+		info.value = sent;
+		info.table = STORE_PROPTABLE_NONE;
+		StorePropertyFixup(&info);
+		if (StoreObjectSetProperty(client, &document, &info)) {
+			result = -1;
+		}
+		MemFree(sent);
+	}
+
+finish:
+	g_array_free(pending, TRUE);
+	return result;
+}
@@ -29,6 +29,22 @@ XPL_BEGIN_C_LINKAGE
 const char *StoreProcessIncomingMail(StoreClient *client,
                                      StoreObject *document,
                                      const char *path);
+
+void StoreMailParse(Connection *out, const char *path, uint64_t guid,
+                    uint32_t time_created);
+
+int StoreMailFillSentDates(StoreClient *client);
+
+/** parserpool.c **/
+typedef void (*ParserPropertyFunc)(const char *name, const char *value, void *data);
+
+int ParserPoolInit(void);
+void ParserPoolShutdown(void);
+int ParserPoolParse(StoreObject *document, const char *path,
+                    ParserPropertyFunc func, void *data);
+int ParserReadProperties(Connection *conn, ParserPropertyFunc func, void *data);
+CCode ParserPoolWriteStats(StoreClient *client);
+
 XPL_END_C_LINKAGE
 
 #endif
@@ -0,0 +1,765 @@
+/** \file
+ * Background upkeep of the store: one thread which runs each periodic
+ * task when it falls due.
+ *
+ * The quick tasks (checkpointing the open databases, compacting their
+ * change logs and sweeping the blob area) run every few seconds or
+ * minutes. The slow one walks every store on the server, those which
+ * have been idle longest first, and for each:
+ *
+ *  - removes temporary files left in a maildir's tmp/ by a crash
+ *  - removes content files which no document refers to any more, and
+ *    reports documents whose content file has gone missing
+ *  - gives unused database pages back to the filesystem
+ *  - refreshes the statistics SQLite plans queries with
+ *
+ * Stores which somebody has open are left until the next walk. All of
+ * this is paced by a budget of operations and bytes per second, so that
+ * a walk over a big server doesn't starve real clients of disk; while a
+ * walk waits for its budget, the quick tasks carry on as normal.
+ */
+
+#include <config.h>
+#include <xpl.h>
+#include <memmgr.h>
+#include <msgapi.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "stored.h"
+
+#define MAINTENANCE_MEMSTACKSIZE (4 * 1024)
+#define MAINTENANCE_BATCH 256
+
+typedef struct {
+	time_t		window;		// second the usage below was last decayed
+	int64_t		ops;
+	int64_t		bytes;
+} MaintenanceBudget;
+
+typedef struct {
+	const char *	name;
+	int *		interval;	// seconds between runs, 0 for none
+	void		(*run)(void);
+	BOOL		busy;
+	time_t		lastStart;
+	time_t		lastEnd;
+	uint64_t	runs;
+} MaintenanceTask;
+
+typedef struct {
+	char *		name;
+	time_t		changed;
+} MaintenanceStoreEntry;
+
+static void MaintenanceWalkStores(void);
+
+static MaintenanceTask MaintenanceTasks[] = {
+	{ "checkpoint", &StoreAgent.dbpool.checkpointInterval, DBPoolCheckpoint, FALSE, 0, 0, 0 },
+	{ "changelog", &StoreAgent.store.changeLogCompactInterval, DBPoolCompactChangeLogs, FALSE, 0, 0, 0 },
+	{ "blobs", &StoreAgent.store.blobCollectInterval, BlobStoreCollect, FALSE, 0, 0, 0 },
+	{ "stores", &StoreAgent.maintenance.interval, MaintenanceWalkStores, FALSE, 0, 0, 0 },
+	{ NULL, NULL, NULL, FALSE, 0, 0, 0 }
+};
+
+static struct {
+	XplMutex		lock;
+	/* only touched by the maintenance thread: */
+	MaintenanceBudget	budget;
+	time_t			tick;
+
+	struct {
+		/* protected by the maintenance lock: */
+		int		stores;		// in the walk under way
+		int		done;
+		int		busy;
+		char		current[XPL_MAX_PATH + 1];
+		uint64_t	pagesFreed;
+		uint64_t	rebuilds;
+		uint64_t	analyzes;
+		uint64_t	tempFiles;
+		uint64_t	orphans;
+		uint64_t	missing;
+		uint64_t	throttled;
+	} stats;
+} Maintenance;
+
+static BOOL
+MaintenanceRunning(void)
+{
+	return (BONGO_AGENT_STATE_RUNNING == StoreAgent.agent.state);
+}
+
+/** \internal
+ * Account for work done against a per-second budget. Usage left over
+ * from earlier seconds drains away at the budgeted rate, so a burst is
+ * paid for by waiting in proportion to how far over budget it went.
+ * \param	iops	Operations allowed per second, 0 for no limit
+ * \param	bps	Bytes allowed per second, 0 for no limit
+ * \return	Seconds to wait before doing any more
+ */
+static int
+MaintenanceBudgetCharge(MaintenanceBudget *budget, time_t now, int iops, int64_t bps,
+                        int ops, int64_t bytes)
+{
+	int64_t elapsed = now - budget->window;
+	int64_t wait = 0;
+
+	if (elapsed > 0) {
+		budget->ops = (iops > 0) ? budget->ops - elapsed * iops : 0;
+		budget->bytes = (bps > 0) ? budget->bytes - elapsed * bps : 0;
+		if (budget->ops < 0) budget->ops = 0;
+		if (budget->bytes < 0) budget->bytes = 0;
+		budget->window = now;
+	}
+
+	budget->ops += ops;
+	budget->bytes += bytes;
+
+	if (iops > 0 && budget->ops > iops) {
+		wait = (budget->ops - 1) / iops;
+	}
+	if (bps > 0 && budget->bytes > bps && (budget->bytes - 1) / bps > wait) {
+		wait = (budget->bytes - 1) / bps;
+	}
+	return (int)wait;
+}
+
+/** \internal
+ * Run every task which has fallen due, apart from any already running.
+ */
+static void
+MaintenanceTick(void)
+{
+	MaintenanceTask *task;
+	time_t now = time(NULL);
+
+	for (task = MaintenanceTasks; task->name != NULL; task++) {
+		if (task->busy || *task->interval <= 0 || now - task->lastStart < *task->interval) {
+			continue;
+		}
+		if (!MaintenanceRunning()) {
+			return;
+		}
+
+		XplMutexLock(Maintenance.lock);
+		task->busy = TRUE;
+		task->lastStart = now;
+		XplMutexUnlock(Maintenance.lock);
+
+		task->run();
+
+		XplMutexLock(Maintenance.lock);
+		task->busy = FALSE;
+		task->lastEnd = time(NULL);
+		task->runs++;
+		XplMutexUnlock(Maintenance.lock);
+	}
+}
+
+/** \internal
+ * Pay for some work done by a store walk, waiting if it's gone over
+ * budget. Keeps the other tasks running in the meantime.
+ * \return	0 to carry on, -1 if the agent is stopping
+ */
+static int
+MaintenanceThrottle(int ops, int64_t bytes)
+{
+	time_t now = time(NULL);
+	int wait;
+
+	wait = MaintenanceBudgetCharge(&Maintenance.budget, now, StoreAgent.maintenance.iops,
+		(int64_t)StoreAgent.maintenance.bandwidthKB * 1024, ops, bytes);
+	if (wait > 0) {
+		XplMutexLock(Maintenance.lock);
+		Maintenance.stats.throttled++;
+		XplMutexUnlock(Maintenance.lock);
+	}
+
+	for (;;) {
+		if (!MaintenanceRunning()) {
+			return -1;
+		}
+		if (now != Maintenance.tick) {
+			Maintenance.tick = now;
+			MaintenanceTick();
+		}
+		if (wait-- <= 0) {
+			return 0;
+		}
+		XplDelay(1000);
+		now = time(NULL);
+	}
+}
+
+/** \internal
+ * Count something the walk did towards its stats.
+ */
+static void
+MaintenanceCount(uint64_t *counter, uint64_t n)
+{
+	XplMutexLock(Maintenance.lock);
+	*counter += n;
+	XplMutexUnlock(Maintenance.lock);
+}
+
+/** \internal
+ * Work out which collection a maildir is for, from its name.
+ * \return	TRUE if it's a maildir
+ */
+static BOOL
+MaintenanceParseGuid(const char *name, uint64_t *guid)
+{
+	char *end;
+
+	if (strlen(name) != 16) {
+		return FALSE;
+	}
+	*guid = strtoull(name, &end, 16);
+	return (*end == '\0');
+}
+
+/** \internal
+ * How long ago a file was last written or linked into place. Renaming or
+ * linking a file doesn't touch its mtime, but does its ctime.
+ */
+static time_t
+MaintenanceFileAge(const struct stat *sb, time_t now)
+{
+	return now - ((sb->st_ctime > sb->st_mtime) ? sb->st_ctime : sb->st_mtime);
+}
+
+/** \internal
+ * Find which collection a document belongs in.
+ * \return	1 if it's in the store, 0 if not, -1 on error
+ */
+static int
+MaintenanceDocumentCollection(StoreClient *client, uint64_t guid, uint64_t *collection)
+{
+	MsgSQLStatement stmt;
+	int result;
+
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	if (MsgSQLPrepareCached(client->storedb,
+	    "SELECT collection_guid FROM storeobject WHERE guid = ?1;", &stmt) == NULL) {
+		return -1;
+	}
+	MsgSQLBindInt64(&stmt, 1, guid);
+
+	result = MsgSQLResults(client->storedb, &stmt);
+	if (result > 0) {
+		*collection = MsgSQLResultInt64(&stmt, 0);
+	}
+	MsgSQLFinalize(&stmt);
+
+	return result;
+}
+
+/** \internal
+ * Tidy up the files in one of a store's maildirs: temporary files a
+ * crash left behind, and content files for documents which have gone.
+ * Anything younger than the grace period is left alone, as it may be a
+ * document still being written.
+ * \return	0 on success, -1 if the walk should stop
+ */
+static int
+MaintenanceSweepMaildir(StoreClient *client, uint64_t collection, const char *dir)
+{
+	char path[XPL_MAX_PATH + 1];
+	struct dirent *entry;
+	struct stat sb;
+	uint64_t guid, owner;
+	time_t now = time(NULL);
+	BOOL temp;
+	DIR *dh;
+	int ret = 0;
+
+	temp = !strcmp(dir + strlen(dir) - 4, "/tmp");
+
+	dh = opendir(dir);
+	if (!dh) return 0;
+
+	while ((entry = readdir(dh)) != NULL) {
+		if (entry->d_name[0] == '.') continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		path[sizeof(path)-1] = '\0';
+
+		if (MaintenanceThrottle(1, 0)) {
+			ret = -1;
+			break;
+		}
+		if (lstat(path, &sb) || !S_ISREG(sb.st_mode) ||
+		    MaintenanceFileAge(&sb, now) < StoreAgent.maintenance.gracePeriod) {
+			continue;
+		}
+
+		if (temp) {
+			if (!unlink(path)) {
+				MaintenanceCount(&Maintenance.stats.tempFiles, 1);
+			}
+			continue;
+		}
+
+		if (!MaintenanceParseGuid(entry->d_name, &guid)) continue;
+
+		switch (MaintenanceDocumentCollection(client, guid, &owner)) {
+		case 0:
+			break;
+		case 1:
+			// a MOVE which didn't finish can leave the only copy of a
+			// document's content here, so it's not ours to remove
+			if (owner != collection) {
+				Log(LOG_WARNING, "Store %s: %s belongs to collection " GUID_FMT ", not removing it",
+					client->storeName, path, owner);
+			}
+			continue;
+		default:
+			continue;
+		}
+		if (!unlink(path)) {
+			Log(LOG_INFO, "Store %s: removed orphaned file %s", client->storeName, path);
+			MaintenanceCount(&Maintenance.stats.orphans, 1);
+		}
+	}
+
+	closedir(dh);
+	return ret;
+}
+
+/** \internal
+ * Sweep the maildirs of every collection in the open store.
+ * \return	0 on success, -1 if the walk should stop
+ */
+static int
+MaintenanceSweepFiles(StoreClient *client)
+{
+	char path[XPL_MAX_PATH + 1];
+	struct dirent *entry;
+	uint64_t collection;
+	DIR *dh;
+	int ret = 0;
+
+	dh = opendir(client->store);
+	if (!dh) return 0;
+
+	while (ret == 0 && (entry = readdir(dh)) != NULL) {
+		if (!MaintenanceParseGuid(entry->d_name, &collection)) continue;
+
+		snprintf(path, sizeof(path), "%s%s/tmp", client->store, entry->d_name);
+		path[sizeof(path)-1] = '\0';
+		ret = MaintenanceSweepMaildir(client, collection, path);
+		if (ret) break;
+
+		snprintf(path, sizeof(path), "%s%s/cur", client->store, entry->d_name);
+		path[sizeof(path)-1] = '\0';
+		ret = MaintenanceSweepMaildir(client, collection, path);
+	}
+
+	closedir(dh);
+	return ret;
+}
+
+/** \internal
+ * Look for documents whose content file has gone missing. There's no
+ * way to get the content back, so these are only reported.
+ * \return	0 on success, -1 if the walk should stop
+ */
+static int
+MaintenanceCheckFiles(StoreClient *client)
+{
+	uint64_t guids[MAINTENANCE_BATCH], collections[MAINTENANCE_BATCH];
+	char path[XPL_MAX_PATH + 1];
+	MsgSQLStatement stmt;
+	uint64_t last = 0;
+	struct stat sb;
+	int count, i;
+
+	do {
+		// a batch at a time, so no read is held open while we wait
+		memset(&stmt, 0, sizeof(MsgSQLStatement));
+		if (MsgSQLPrepareCached(client->storedb, "SELECT guid, collection_guid FROM storeobject "
+		    "WHERE guid > ?1 AND (type & ?2) = 0 AND collection_guid > 0 AND size > 0 "
+		    "ORDER BY guid LIMIT ?3;", &stmt) == NULL) {
+			return 0;
+		}
+		MsgSQLBindInt64(&stmt, 1, last);
+		MsgSQLBindInt(&stmt, 2, STORE_DOCTYPE_FOLDER);
+		MsgSQLBindInt(&stmt, 3, MAINTENANCE_BATCH);
+
+		count = 0;
+		while (count < MAINTENANCE_BATCH && MsgSQLResults(client->storedb, &stmt) > 0) {
+			guids[count] = MsgSQLResultInt64(&stmt, 0);
+			collections[count] = MsgSQLResultInt64(&stmt, 1);
+			count++;
+		}
+		MsgSQLFinalize(&stmt);
+
+		for (i = 0; i < count; i++) {
+			if (MaintenanceThrottle(1, 0)) {
+				return -1;
+			}
+			FindPathToDocument(client, collections[i], guids[i], path, sizeof(path));
+			if (stat(path, &sb) && errno == ENOENT) {
+				Log(LOG_WARNING, "Store %s: document " GUID_FMT " has no content file",
+					client->storeName, guids[i]);
+				MaintenanceCount(&Maintenance.stats.missing, 1);
+			}
+		}
+		if (count > 0) {
+			last = guids[count - 1];
+		}
+	} while (count == MAINTENANCE_BATCH);
+
+	return 0;
+}
+
+/** \internal
+ * Give the store database's unused pages back to the filesystem. Once a
+ * database is set up for it this happens a chunk at a time; before that,
+ * it has to be rebuilt, which is only worth it if a good part of the file
+ * is going spare, and is only done while nobody else has the store open.
+ * \return	0 on success, -1 if the walk should stop
+ */
+static int
+MaintenanceVacuum(StoreClient *client, const MsgSQLSpace *space)
+{
+	int64_t left = space->freePages;
+	int64_t chunk;
+
+	if (left <= 0 || space->pageCount <= 0) {
+		return 0;
+	}
+
+	if (!space->incremental) {
+		if (left * 100 / space->pageCount < StoreAgent.maintenance.vacuumFreePercent ||
+		    DBPoolClients(client->storeName) > 1) {
+			return 0;
+		}
+		if (MsgSQLVacuum(client->storedb, 0)) {
+			Log(LOG_ERROR, "Store %s: couldn't rebuild database", client->storeName);
+			return 0;
+		}
+		Log(LOG_INFO, "Store %s: rebuilt database, freeing " FMT_UINT64_DEC " pages",
+			client->storeName, (uint64_t)left);
+		MaintenanceCount(&Maintenance.stats.rebuilds, 1);
+		MaintenanceCount(&Maintenance.stats.pagesFreed, left);
+		// it's read and written out again in full
+		return MaintenanceThrottle(1, 2 * space->pageCount * space->pageSize);
+	}
+
+	// about a second's worth of bandwidth at a time
+	chunk = MAINTENANCE_BATCH;
+	if (StoreAgent.maintenance.bandwidthKB > 0 && space->pageSize > 0) {
+		chunk = (int64_t)StoreAgent.maintenance.bandwidthKB * 1024 / space->pageSize;
+		if (chunk < 1) chunk = 1;
+	}
+
+	while (left > 0) {
+		if (chunk > left) chunk = left;
+		if (MsgSQLVacuum(client->storedb, (int)chunk)) {
+			return 0;
+		}
+		left -= chunk;
+		MaintenanceCount(&Maintenance.stats.pagesFreed, chunk);
+		if (MaintenanceThrottle(1, chunk * space->pageSize)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** \internal
+ * Refresh the statistics SQLite uses to choose between indexes.
+ * \return	0 on success, -1 if the walk should stop
+ */
+static int
+MaintenanceAnalyze(StoreClient *client, const MsgSQLSpace *space)
+{
+	if (MsgSQLBeginTransaction(client->storedb)) {
+		return 0;
+	}
+	if (MsgSQLQuickExecute(client->storedb, "ANALYZE;")) {
+		MsgSQLAbortTransaction(client->storedb);
+		return 0;
+	}
+	if (MsgSQLCommitTransaction(client->storedb)) {
+		MsgSQLAbortTransaction(client->storedb);
+		return 0;
+	}
+
+	MaintenanceCount(&Maintenance.stats.analyzes, 1);
+	// reads every index
+	return MaintenanceThrottle(1, (space->pageCount - space->freePages) * space->pageSize);
+}
+
+/** \internal
+ * Do everything the walk does to a single store, unless somebody is
+ * using it; it'll be idle another time.
+ * \return	0 on success, 1 if the store is busy, -1 if the walk should stop
+ */
+static int
+MaintenanceStore(char *user)
+{
+	StoreClient *client;
+	MsgSQLSpace space;
+	int ret = 0;
+
+	client = MemNew0(StoreClient, 1);
+	if (!client) {
+		return 0;
+	}
+	client->lockTimeoutMs = StoreAgent.store.lockTimeoutMs;
+	BongoMemStackInit(&client->memstack, MAINTENANCE_MEMSTACKSIZE);
+	client->flags |= STORE_CLIENT_FLAG_IDLE_ONLY;
+
+	ret = SelectStore(client, user);
+	if (ret > 0) {
+		goto finish;
+	} else if (ret < 0) {
+		Log(LOG_ERROR, "Maintenance couldn't open store %s", user);
+		ret = 0;
+		goto finish;
+	}
+
+	ret = MaintenanceSweepFiles(client);
+	if (ret) goto finish;
+
+	ret = MaintenanceCheckFiles(client);
+	if (ret) goto finish;
+
+	if (MsgSQLGetSpace(client->storedb, &space)) goto finish;
+
+	ret = MaintenanceVacuum(client, &space);
+	if (ret) goto finish;
+
+	ret = MaintenanceAnalyze(client, &space);
+
+finish:
+	UnselectStore(client);
+	BongoMemStackDestroy(&client->memstack);
+	MemFree(client);
+	return ret;
+}
+
+/** \internal
+ * Find when a store last changed: in WAL mode, commits touch the log
+ * rather than the database itself.
+ * \return	0 if it's a store, -1 if not
+ */
+static int
+MaintenanceStoreChanged(const char *user, time_t *changed)
+{
+	char path[XPL_MAX_PATH + 1];
+	struct stat sb;
+
+	snprintf(path, sizeof(path), "%s/%s/store.db", StoreAgent.store.rootDir, user);
+	path[sizeof(path)-1] = '\0';
+	if (stat(path, &sb)) {
+		return -1;
+	}
+	*changed = sb.st_mtime;
+
+	strncat(path, "-wal", sizeof(path) - strlen(path) - 1);
+	if (!stat(path, &sb) && sb.st_mtime > *changed) {
+		*changed = sb.st_mtime;
+	}
+	return 0;
+}
+
+static int
+MaintenanceStoreCompare(const void *a, const void *b)
+{
+	const MaintenanceStoreEntry *x = a, *y = b;
+
+	if (x->changed != y->changed) {
+		return (x->changed < y->changed) ? -1 : 1;
+	}
+	return strcmp(x->name, y->name);
+}
+
+/** \internal
+ * Walk over every store on the server, those idle longest first.
+ */
+static void
+MaintenanceWalkStores(void)
+{
+	MaintenanceStoreEntry *stores = NULL, *bigger;
+	struct dirent *entry;
+	int count = 0, size = 0, i, ret;
+	time_t changed;
+	DIR *dh;
+
+	dh = opendir(StoreAgent.store.rootDir);
+	if (!dh) return;
+
+	while ((entry = readdir(dh)) != NULL) {
+		// the blob area and the like start with a dot
+		if (entry->d_name[0] == '.' || MaintenanceStoreChanged(entry->d_name, &changed)) {
+			continue;
+		}
+		if (count == size) {
+			size = size ? size * 2 : 64;
+			bigger = MemRealloc(stores, sizeof(MaintenanceStoreEntry) * size);
+			if (!bigger) break;
+			stores = bigger;
+		}
+		stores[count].name = MemStrdup(entry->d_name);
+		stores[count].changed = changed;
+		count++;
+	}
+	closedir(dh);
+
+	if (count > 0) {
+		qsort(stores, count, sizeof(MaintenanceStoreEntry), MaintenanceStoreCompare);
+	}
+
+	XplMutexLock(Maintenance.lock);
+	Maintenance.stats.stores = count;
+	Maintenance.stats.done = 0;
+	Maintenance.stats.busy = 0;
+	XplMutexUnlock(Maintenance.lock);
+
+	for (i = 0; i < count; i++) {
+		if (!MaintenanceRunning()) break;
+
+		XplMutexLock(Maintenance.lock);
+		strncpy(Maintenance.stats.current, stores[i].name, XPL_MAX_PATH);
+		XplMutexUnlock(Maintenance.lock);
+
+		ret = MaintenanceStore(stores[i].name);
+		if (ret < 0) break;
+
+		XplMutexLock(Maintenance.lock);
+		if (ret > 0) {
+			Maintenance.stats.busy++;
+		} else {
+			Maintenance.stats.done++;
+		}
+		XplMutexUnlock(Maintenance.lock);
+	}
+
+	XplMutexLock(Maintenance.lock);
+	Maintenance.stats.current[0] = '\0';
+	XplMutexUnlock(Maintenance.lock);
+
+	for (i = 0; i < count; i++) {
+		MemFree(stores[i].name);
+	}
+	if (stores) MemFree(stores);
+}
+
+static void
+MaintenanceThread(void *ignored)
+{
+	UNUSED_PARAMETER(ignored)
+
+	while (MaintenanceRunning()) {
+		XplDelay(1000);
+		Maintenance.tick = time(NULL);
+		MaintenanceTick();
+	}
+
+	XplSignalLocalSemaphore(StoreAgent.maintenance.done);
+}
+
+/**
+ * Start the background maintenance thread. Each task first runs one
+ * interval after startup.
+ * \return	0 on success, -1 on failure
+ */
+int
+MaintenanceStart(void)
+{
+	MaintenanceTask *task;
+	XplThreadID id;
+	int ccode;
+
+	memset(&Maintenance.stats, 0, sizeof(Maintenance.stats));
+	for (task = MaintenanceTasks; task->name != NULL; task++) {
+		task->lastStart = time(NULL);
+	}
+	XplMutexInit(Maintenance.lock);
+
+	XplOpenLocalSemaphore(StoreAgent.maintenance.done, 0);
+	XplBeginThread(&id, MaintenanceThread, 8192, NULL, ccode);
+	if (ccode != 0) {
+		XplCloseLocalSemaphore(StoreAgent.maintenance.done);
+		XplMutexDestroy(Maintenance.lock);
+		return -1;
+	}
+	StoreAgent.maintenance.running = TRUE;
+	return 0;
+}
+
+/**
+ * Wait for the maintenance thread to finish. It notices the agent
+ * stopping within a second, even part way through a walk.
+ */
+void
+MaintenanceShutdown(void)
+{
+	if (!StoreAgent.maintenance.running) {
+		return;
+	}
+
+	XplWaitOnLocalSemaphore(StoreAgent.maintenance.done);
+	XplCloseLocalSemaphore(StoreAgent.maintenance.done);
+	XplMutexDestroy(Maintenance.lock);
+	StoreAgent.maintenance.running = FALSE;
+}
+
+/**
+ * Write out when each task last ran and what the store walk has done,
+ * as 2001 lines for the STATS command.
+ */
+CCode
+MaintenanceWriteStats(StoreClient *client)
+{
+	MaintenanceTask *task;
+	CCode ccode = 0;
+
+	if (!StoreAgent.maintenance.running) {
+		return 0;
+	}
+
+	XplMutexLock(Maintenance.lock);
+	for (task = MaintenanceTasks; ccode != -1 && task->name != NULL; task++) {
+		ccode = ConnWriteF(client->conn,
+			"2001 maintenance.%s.runs " FMT_UINT64_DEC "\r\n"
+			"2001 maintenance.%s.running %d\r\n"
+			"2001 maintenance.%s.laststart %ld\r\n"
+			"2001 maintenance.%s.lastseconds %ld\r\n",
+			task->name, task->runs,
+			task->name, task->busy ? 1 : 0,
+			task->name, (long)task->lastStart,
+			task->name, (task->runs > 0) ? (long)(task->lastEnd - task->lastStart) : 0L);
+	}
+	if (ccode != -1) {
+		ccode = ConnWriteF(client->conn,
+			"2001 maintenance.walk.stores %d\r\n"
+			"2001 maintenance.walk.done %d\r\n"
+			"2001 maintenance.walk.busy %d\r\n"
+			"2001 maintenance.walk.current %s\r\n"
+			"2001 maintenance.pagesfreed " FMT_UINT64_DEC "\r\n"
+			"2001 maintenance.rebuilds " FMT_UINT64_DEC "\r\n"
+			"2001 maintenance.analyzes " FMT_UINT64_DEC "\r\n"
+			"2001 maintenance.tempfiles " FMT_UINT64_DEC "\r\n"
+			"2001 maintenance.orphans " FMT_UINT64_DEC "\r\n"
+			"2001 maintenance.missing " FMT_UINT64_DEC "\r\n"
+			"2001 maintenance.throttled " FMT_UINT64_DEC "\r\n",
+			Maintenance.stats.stores, Maintenance.stats.done, Maintenance.stats.busy,
+			Maintenance.stats.current[0] ? Maintenance.stats.current : "-",
+			Maintenance.stats.pagesFreed, Maintenance.stats.rebuilds,
+			Maintenance.stats.analyzes, Maintenance.stats.tempFiles,
+			Maintenance.stats.orphans, Maintenance.stats.missing,
+			Maintenance.stats.throttled);
+	}
+	XplMutexUnlock(Maintenance.lock);
+
+	return ccode;
+}
@@ -149,6 +149,8 @@
 #define MSG4260NOQENTRY "4260 No queue entry open, try QCREA\r\n"
 #define MSG4261NODOMAIN "4261 No queue entry with that domain\r\n"
 #define MSG4262NOTFOUND "4262 Field/Content not found\r\n"
+#define MSG4263CHANGESGONE "4263 Changes no longer available, LIST the collection again\r\n"
+#define MSG4264CHANGED "4264 Document has changed since that modseq\r\n"
 #define MSG4242NOTALLOWED "4242 Not allowed via FLAG\r\n"
 #define MSG4244NOTSUPPORTED "4244 Not supported\r\n"
 #define MSG5244USERLOOKUPFAILURE "5244 Failed looking up User %s\r\n"
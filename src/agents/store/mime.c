@@ -828,31 +828,118 @@ MimeParse(FILE *fh, size_t messageSize, char *line, unsigned long lineSize)
 }
 
 
+/** \internal
+ * Look for a cached MIME report for this document. Reports are only
+ * valid for the version and size of the document they were made from.
+ * \return	1 if found, 0 if not cached, -1 on db error
+ */
 static int
-MimeGetHelper(StoreClient *client, StoreObject *document, MimeReport **outReport)
+MimeCacheGet(StoreClient *client, StoreObject *document, MimeReport **outReport)
+{
+    MsgSQLStatement stmt;
+    MsgSQLStatement *ret;
+    MimeReport *report;
+    size_t len;
+    int result = 0;
+
+    memset(&stmt, 0, sizeof(MsgSQLStatement));
+
+    ret = MsgSQLPrepareCached(client->storedb, 
+        "SELECT report FROM mimereport WHERE guid=?1 AND version=?2 AND size=?3;", &stmt);
+    if (ret == NULL) {
+        return -1;
+    }
+
+    MsgSQLBindInt64(&stmt, 1, document->guid);
+    MsgSQLBindInt(&stmt, 2, document->version);
+    MsgSQLBindInt64(&stmt, 3, document->size);
+
+    if (MsgSQLResults(client->storedb, &stmt) > 0 &&
+        MsgSQLResultBlob(&stmt, 0, (void **)&report, &len) == 0) {
+        if (len >= sizeof(MimeReport) && len == report->size) {
+            MimeReportFixupInternal(report);
+            *outReport = report;
+            result = 1;
+        } else {
+            // not something we wrote; ignore it and it'll be replaced
+            MemFree(report);
+        }
+    }
+
+    MsgSQLFinalize(&stmt);
+    return result;
+}
+
+/** \internal
+ * Save a MIME report for this document, replacing any existing one.
+ * \return	0 on success, -1 on db error
+ */
+static int
+MimeCacheSet(StoreClient *client, StoreObject *document, MimeReport *report)
+{
+    MsgSQLStatement stmt;
+    MsgSQLStatement *ret;
+    int result = -1;
+
+    if (client->readonly) {
+        return 0;
+    }
+
+    // the report is stored as-is; MimeReportFixup() relocates it on load
+    MimeReportFixupInternal(report);
+
+    memset(&stmt, 0, sizeof(MsgSQLStatement));
+
+    MsgSQLBeginTransaction(client->storedb);
+
+    ret = MsgSQLPrepareCached(client->storedb, 
+        "INSERT OR REPLACE INTO mimereport (guid, version, size, report) VALUES (?1, ?2, ?3, ?4);", 
+        &stmt);
+    if (ret == NULL) {
+        goto abort;
+    }
+
+    MsgSQLBindInt64(&stmt, 1, document->guid);
+    MsgSQLBindInt(&stmt, 2, document->version);
+    MsgSQLBindInt64(&stmt, 3, document->size);
+    MsgSQLBindBlob(&stmt, 4, report, report->size);
+
+    if (MsgSQLExecute(client->storedb, &stmt)) {
+        goto abort;
+    }
+    MsgSQLFinalize(&stmt);
+
+    if (MsgSQLCommitTransaction(client->storedb)) {
+        goto abort;
+    }
+
+    return 0;
+
+abort:
+    MsgSQLFinalize(&stmt);
+    MsgSQLAbortTransaction(client->storedb);
+    return result;
+}
+
+static int
+MimeParseFile(const char *path, uint64_t size, MimeReport **outReport)
 {
-    char path[XPL_MAX_PATH + 1];
     FILE *fh = NULL;
     int result = 1;
     char buffer[CONN_BUFSIZE];
 
-    FindPathToDocument(client, document->collection_guid, document->guid, path, sizeof(path));
-
     fh = fopen(path, "rb");
     if (!fh) {
         result = -4;
         goto finish;
     }
 
-    *outReport = MimeParse(fh, document->size, buffer, sizeof(buffer));
+    *outReport = MimeParse(fh, size, buffer, sizeof(buffer));
     if (!*outReport) {
         result = -5;
         goto finish;
     }
 
-	// FIXME: cache mime information into DB?
-    // (void) DStoreSetMimeReport(client->handle, info->guid, *outReport);
-        
 finish:
     if (fh) {
         (void) fclose(fh);
@@ -861,6 +948,62 @@ finish:
     return result;
 }
 
+static int
+MimeGetHelper(StoreClient *client, StoreObject *document, MimeReport **outReport)
+{
+    char path[XPL_MAX_PATH + 1];
+    int result;
+
+    result = MimeCacheGet(client, document, outReport);
+    if (result != 0) {
+        return result;
+    }
+
+    FindPathToDocument(client, document->collection_guid, document->guid, path, sizeof(path));
+
+    result = MimeParseFile(path, document->size, outReport);
+    if (result == 1) {
+        // not fatal if this fails, we'll just parse it again next time
+        (void) MimeCacheSet(client, document, *outReport);
+    }
+
+    return result;
+}
+
+/**
+ * Parse a mail document and cache its MIME structure, so that later
+ * MIME requests don't need to read the document again. Used when mail
+ * is delivered, and to fill in the cache for existing stores.
+ * \param	client		Store client we're operating for
+ * \param	document	The document to parse
+ * \param	path		Where to find the document content; NULL 
+ *				for its usual location.
+ * \return			0 on success, -4 io err, -5 internal err, -1 db err
+ */
+int
+MimeCacheDocument(StoreClient *client, StoreObject *document, const char *path)
+{
+    char realpath[XPL_MAX_PATH + 1];
+    MimeReport *report = NULL;
+    int result;
+
+    if (path == NULL) {
+        FindPathToDocument(client, document->collection_guid, document->guid, 
+                           realpath, sizeof(realpath));
+        path = realpath;
+    }
+
+    result = MimeParseFile(path, document->size, &report);
+    if (result != 1) {
+        return result;
+    }
+
+    result = MimeCacheSet(client, document, report);
+    MimeReportFree(report);
+
+    return result;
+}
+
 
 /* returns: 0 no report available
             1 report found
@@ -875,15 +1018,5 @@ finish:
 int
 MimeGetInfo(StoreClient *client, StoreObject *document, MimeReport **outReport)
 {
-/*
-  	FIXME
-    DCode dcode;
-
-    dcode = DStoreGetMimeReport(client->handle, info->guid, outReport);
-    if (0 != dcode) {
-        return dcode;
-    }
-    */
-
     return MimeGetHelper(client, document, outReport);
 }
@@ -25,8 +25,21 @@
 #include "query-builder.h"
 #include "command-parsing.h"
 #include "messages.h"
+#include "calendar.h"
+#include "mail.h"
 
 extern const char *sql_create_store[];	// defined in sql/create-store.s.cmake
+extern const char *sql_create_store_1[];	// defined in sql/create-store-1.s.cmake
+extern const char *sql_create_store_2[];	// defined in sql/create-store-2.s.cmake
+extern const char *sql_create_store_3[];	// defined in sql/create-store-3.s.cmake
+extern const char *sql_create_store_4[];	// defined in sql/create-store-4.s.cmake
+extern const char *sql_create_store_5[];	// defined in sql/create-store-5.s.cmake
+extern const char *sql_create_store_6[];	// defined in sql/create-store-6.s.cmake
+extern const char *sql_create_store_7[];	// defined in sql/create-store-7.s.cmake
+extern const char *sql_create_store_8[];	// defined in sql/create-store-8.s.cmake
+#ifdef HAVE_SQLITE_FTS4
+extern const char *sql_create_fulltext[];	// defined in sql/create-fulltext.s.cmake
+#endif
 extern const StorePropValName StorePropTable[]; // defined in properties.c
 
 int	ACLCheckOnGUID(StoreClient *client, uint64_t guid, int prop);
@@ -109,6 +122,74 @@ StoreObjectDBCreate(StoreClient *client)
 	return 0;
 }
 
+/** \internal
+ * Fill in the indexed mail header columns for mail delivered before we
+ * kept them, from the properties set at delivery. Mail from then has no
+ * sent date until the upgrade to version 8 finds it.
+ * \return	0 on success, -1 on failure
+ */
+static int
+StoreObjectDBFillMailDocuments(StoreClient *client)
+{
+	MsgSQLStatement stmt;
+	int status;
+	
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	
+	// the sender used to only be kept under its header name
+	if (MsgSQLPrepare(client->storedb, "INSERT INTO properties (guid, intprop, name, value) "
+	    "SELECT guid, ?1, NULL, value FROM properties WHERE name = ?2;", &stmt) == NULL) goto abort;
+	MsgSQLBindInt(&stmt, 1, STORE_PROP_MAIL_SENDERS);
+	MsgSQLBindString(&stmt, 2, "bongo.from", FALSE);
+	status = MsgSQLExecute(client->storedb, &stmt);
+	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+	
+	if (MsgSQLPrepare(client->storedb, "INSERT OR IGNORE INTO maildocument (guid, subject, senders) "
+	    "SELECT so.guid, (SELECT p.value FROM properties p WHERE p.guid = so.guid AND p.intprop = ?1), "
+	    "(SELECT p.value FROM properties p WHERE p.guid = so.guid AND p.intprop = ?2) "
+	    "FROM storeobject so WHERE so.type = ?3;", &stmt) == NULL) goto abort;
+	MsgSQLBindInt(&stmt, 1, STORE_PROP_MAIL_SUBJECT);
+	MsgSQLBindInt(&stmt, 2, STORE_PROP_MAIL_SENDERS);
+	MsgSQLBindInt(&stmt, 3, STORE_DOCTYPE_MAIL);
+	status = MsgSQLExecute(client->storedb, &stmt);
+	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+	
+	return 0;
+
+abort:
+	MsgSQLFinalize(&stmt);
+	return -1;
+}
+
+/** \internal
+ * Give mail which has no indexed header columns a row of them, in the
+ * collection it's in, so that it still turns up in LISTs sorted on them.
+ * \return	0 on success, -1 on failure
+ */
+static int
+StoreObjectDBAddMailDocuments(StoreClient *client)
+{
+	MsgSQLStatement stmt;
+	int status;
+	
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	
+	if (MsgSQLPrepare(client->storedb, "INSERT OR IGNORE INTO maildocument (guid, collection_guid) "
+	    "SELECT guid, collection_guid FROM storeobject WHERE type = ?1;", &stmt) == NULL) goto abort;
+	MsgSQLBindInt(&stmt, 1, STORE_DOCTYPE_MAIL);
+	status = MsgSQLExecute(client->storedb, &stmt);
+	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+	
+	return 0;
+
+abort:
+	MsgSQLFinalize(&stmt);
+	return -1;
+}
+
 /**
  * Check the schema on the store we're opening
  * \param	client		storeclient we're using
@@ -119,7 +200,7 @@ int
 StoreObjectDBCheckSchema(StoreClient *client, BOOL new_install)
 {
 	int current_version = -1;
-	const int wanted_version = 0;
+	const int wanted_version = 8;
 	MsgSQLStatement stmt;
 	MsgSQLStatement *schema = NULL;
 	
@@ -149,9 +230,61 @@ StoreObjectDBCheckSchema(StoreClient *client, BOOL new_install)
 				goto abort;
 			// deliberate fall-through to upgrade to next version
 		case 0:
-			// current database schema
-			//if (MsgSQLQuickExecute(client->storedb, (const char*)sql_create_store_1))
-			//	goto abort;
+			// add the MIME structure cache
+			if (MsgSQLQuickExecute(client->storedb, (const char*)sql_create_store_1))
+				goto abort;
+			// deliberate fall-through to upgrade to next version
+		case 1:
+			// this once added the full-text index, which is now made
+			// below wherever SQLite can
+			if (MsgSQLQuickExecute(client->storedb, (const char*)sql_create_store_2))
+				goto abort;
+			// deliberate fall-through to upgrade to next version
+		case 2:
+			// add the calendar occurrence index, and fill it in for the
+			// events already here
+			if (MsgSQLQuickExecute(client->storedb, (const char*)sql_create_store_3))
+				goto abort;
+			if (StoreEventsReindex(client))
+				goto abort;
+			// deliberate fall-through to upgrade to next version
+		case 3:
+			// add the threading index; existing conversations keep their
+			// mail, but only new mail is threaded by reference
+			if (MsgSQLQuickExecute(client->storedb, (const char*)sql_create_store_4))
+				goto abort;
+			// deliberate fall-through to upgrade to next version
+		case 4:
+			// add the change log; collections start at modseq 0, so
+			// clients which haven't synced since then will LIST instead
+			if (MsgSQLQuickExecute(client->storedb, (const char*)sql_create_store_5))
+				goto abort;
+			// deliberate fall-through to upgrade to next version
+		case 5:
+			// index mail by the headers LIST sorts and searches on
+			if (MsgSQLQuickExecute(client->storedb, (const char*)sql_create_store_6))
+				goto abort;
+			if (StoreObjectDBFillMailDocuments(client))
+				goto abort;
+			// deliberate fall-through to upgrade to next version
+		case 6:
+			// add the collection totals, counted up from what's there
+			if (MsgSQLQuickExecute(client->storedb, (const char*)sql_create_store_7))
+				goto abort;
+			if (CollectionCountsRebuild(client))
+				goto abort;
+			// deliberate fall-through to upgrade to next version
+		case 7:
+			// index the mail headers LIST sorts on by collection, and find
+			// the sent date of mail delivered before we kept it
+			if (MsgSQLQuickExecute(client->storedb, (const char*)sql_create_store_8))
+				goto abort;
+			if (StoreObjectDBAddMailDocuments(client))
+				goto abort;
+			if (StoreMailFillSentDates(client))
+				goto abort;
+			// deliberate fall-through to upgrade to next version
+		case 8:
 			// current version, nothing to do
 			break;
 		default:
@@ -160,6 +293,13 @@ StoreObjectDBCheckSchema(StoreClient *client, BOOL new_install)
 			goto abort;
 	}
 	
+#ifdef HAVE_SQLITE_FTS4
+	// add the full-text index if the store was made without one; REINDEX
+	// fills it in for existing mail, and SEARCH reads whatever isn't in it
+	if (MsgSQLQuickExecute(client->storedb, (const char*)sql_create_fulltext))
+		goto abort;
+#endif
+	
 	if (MsgSQLCommitTransaction(client->storedb)) goto abort;
 	
 	if (current_version != wanted_version) 
@@ -254,7 +394,7 @@ StoreObjectCreate(StoreClient *client, StoreObject *object)
 	} else {
 		query = "INSERT INTO storeobject (collection_guid) VALUES (-1);";
 	}
-	ret = MsgSQLPrepare(client->storedb, query, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 	if (ret == NULL) goto abort;
 	
 	if (object->guid > 0) {
@@ -449,7 +589,7 @@ StoreObjectFindNext(StoreClient *client, uint64_t guid, StoreObject *object)
 	if (MsgSQLBeginTransaction(client->storedb)) return -2;
 	
 	memset(&stmt, 0, sizeof(MsgSQLStatement));
-	find = MsgSQLPrepare(client->storedb, "SELECT " storeobj_cols " FROM storeobject so WHERE so.guid >= ?1 LIMIT 1;", &stmt);
+	find = MsgSQLPrepareCached(client->storedb, "SELECT " storeobj_cols " FROM storeobject so WHERE so.guid >= ?1 LIMIT 1;", &stmt);
 	if (find == NULL) goto abort;
 	
 	MsgSQLBindInt64(find, 1, guid);
@@ -489,7 +629,7 @@ StoreObjectFindByFilename(StoreClient *client, const char *filename, StoreObject
 	if (MsgSQLBeginTransaction(client->storedb)) return -2;
 	
 	memset(&stmt, 0, sizeof(MsgSQLStatement));
-	find = MsgSQLPrepare(client->storedb, "SELECT " storeobj_cols " FROM storeobject so WHERE so.filename = ?1 LIMIT 1;", &stmt);
+	find = MsgSQLPrepareCached(client->storedb, "SELECT " storeobj_cols " FROM storeobject so WHERE so.filename = ?1 LIMIT 1;", &stmt);
 	if (find == NULL) goto abort;
 	
 	MsgSQLBindString(find, 1, filename, FALSE);
@@ -520,10 +660,11 @@ abort:
 }
 
 /**
- * Find the conversation for a store document
+ * Find the most recently active conversation with a given subject, 
+ * which has seen some activity since a given date
  * 
  * \param	client	Client we're performing this for
- * \param	data	Conversation we're looking for (need subject and date)
+ * \param	data	Conversation we're looking for (need normalized subject and date)
  * \param	conversation	Store object that we find
  * \return	0 on success, -1 for failure.
  */
@@ -537,13 +678,15 @@ StoreObjectFindConversation(StoreClient *client, StoreConversationData *data,
 	
 	if (MsgSQLBeginTransaction(client->storedb)) return -2;
 	
-	// FIXME: needs to take into account date.
+	// the hash gets us to the right few rows by index; the subject itself
+	// sorts out any collisions
 	memset(&stmt, 0, sizeof(MsgSQLStatement));
-	find = MsgSQLPrepare(client->storedb, "SELECT " storeobj_cols " FROM storeobject so INNER JOIN conversation c ON so.guid=c.guid WHERE c.subject=?1 LIMIT 1;", &stmt);
+	find = MsgSQLPrepareCached(client->storedb, "SELECT " storeobj_cols " FROM storeobject so INNER JOIN conversation c ON so.guid=c.guid WHERE c.subject_hash=?1 AND c.date>=?2 AND c.subject=?3 ORDER BY c.date DESC LIMIT 1;", &stmt);
 	if (find == NULL) goto abort;
 	
-	MsgSQLBindString(find, 1, data->subject, FALSE);
-	// MsgSQLBindInt64(find, 1, guid);
+	MsgSQLBindInt64(find, 1, BongoStringHash(data->subject));
+	MsgSQLBindInt(find, 2, data->date);
+	MsgSQLBindString(find, 3, data->subject, FALSE);
 	
 	result = MsgSQLResults(client->storedb, find);
 	if (result < 0) goto abort;
@@ -591,6 +734,7 @@ StoreObjectUpdateModifiedTime(StoreObject *object)
 int 
 StoreObjectSave(StoreClient *client, StoreObject *object)
 {
+	StoreObject old;
 	MsgSQLStatement stmt;
 	MsgSQLStatement *ret;
 	char *query;
@@ -605,7 +749,17 @@ StoreObjectSave(StoreClient *client, StoreObject *object)
 	query = "UPDATE storeobject SET collection_guid=?2,filename=?3,type=?4," \
 		"flags=?5,size=?6,time_modified=?7,time_created=?8,imap_uid=?9 WHERE guid=?1;";
 	
-	ret = MsgSQLPrepare(client->storedb, query, &stmt);
+	// log the change first, while the old copy is still there to compare.
+	// If there isn't one, the save will fail anyway.
+	if (StoreObjectFind(client, object->guid, &old) == 0) {
+		if (ChangeLogSave(client, &old, object)) goto abort;
+		if (CollectionCountsSave(client, &old, object)) goto abort;
+		// mail headers are sorted on within the collection they're in
+		if (object->type == STORE_DOCTYPE_MAIL && old.collection_guid != object->collection_guid &&
+		    SOQuery_SetMailCollection(client, object->guid, object->collection_guid)) goto abort;
+	}
+	
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 	if (ret == NULL) goto abort;
 	
 	MsgSQLBindInt64(&stmt, 1, object->guid);
@@ -661,8 +815,49 @@ StoreObjectRemove(StoreClient *client, StoreObject *object)
 	MsgSQLBeginTransaction(client->storedb);
 	
 	retcode = SOQuery_RemoveSOByGUID(client, object->guid);
+	if (retcode == 0 && !STORE_IS_FOLDER(object->type))
+		retcode = SOQuery_RemoveMimeReportByGUID(client, object->guid);
+#ifdef HAVE_SQLITE_FTS4
+	if (retcode == 0 && !STORE_IS_FOLDER(object->type))
+		retcode = SOQuery_RemoveFullTextByGUID(client, object->guid);
+#endif
+	if (retcode == 0 && object->type == STORE_DOCTYPE_EVENT)
+		retcode = SOQuery_RemoveEventByGUID(client, object->guid);
+	if (retcode == 0 && object->type == STORE_DOCTYPE_MAIL)
+		retcode = SOQuery_RemoveMailByGUID(client, object->guid);
+	if (retcode == 0)
+		retcode = ChangeLogRecord(client, object->collection_guid, object->guid, STORE_WATCH_EVENT_DELETED);
+	if (retcode == 0)
+		retcode = CollectionCountsRemove(client, object);
+	if (retcode == 0 && STORE_IS_FOLDER(object->type))
+		retcode = ChangeLogForget(client, object->guid);
+	if (retcode == 0 && STORE_IS_FOLDER(object->type))
+		retcode = CollectionCountsForget(client, object->guid);
+	if (retcode || MsgSQLCommitTransaction(client->storedb)) {
+		MsgSQLAbortTransaction(client->storedb);
+	}
+	
+	return retcode;
+}
+
+/**
+ * Forget the cached MIME structure of a document, e.g. because its 
+ * content is about to change.
+ * \param	client	Store client we're operating for
+ * \param	object	Document whose cached report we want to remove
+ * \return		0 on success, -2 on failure
+ */
+int
+StoreObjectRemoveMimeReport(StoreClient *client, StoreObject *object)
+{
+	int retcode;
+	
+	MsgSQLBeginTransaction(client->storedb);
+	
+	retcode = SOQuery_RemoveMimeReportByGUID(client, object->guid);
 	if (retcode || MsgSQLCommitTransaction(client->storedb)) {
 		MsgSQLAbortTransaction(client->storedb);
+		retcode = -2;
 	}
 	
 	return retcode;
@@ -675,7 +870,8 @@ StoreOutputProperty(StoreClient *client, StorePropertyType type, const char *nam
 		const char *out = value;
 		int outlen;
 		
-		if ((type == STORE_PROP_CREATED) || (type == STORE_PROP_LASTMODIFIED)) {
+		if ((type == STORE_PROP_CREATED) || (type == STORE_PROP_LASTMODIFIED) ||
+		    (type == STORE_PROP_CONVERSATION_DATE)) {
 			// need to turn an int into a date.
 			struct tm tm;
 			time_t tt;
@@ -725,6 +921,110 @@ StoreObjectIterQueryBuilderPropResult(StoreClient *client,
 	return;
 }
 
+/** \internal
+ * Write out the LIST line for a document with just the fields the client
+ * asked for.
+ */
+static void
+StoreObjectWriteListFields(StoreClient *client, QueryBuilder *builder, 
+	StoreObject *object, const char *filename)
+{
+	int i;
+	
+	ConnWriteStr(client->conn, "2001");
+	for (i = 0; i < builder->field_count; i++) {
+		switch (builder->fields[i]) {
+			case FIELD_GUID:
+				ConnWriteF(client->conn, " " GUID_FMT, object->guid);
+				break;
+			case FIELD_TYPE:
+				ConnWriteF(client->conn, " %d", object->type);
+				break;
+			case FIELD_FLAGS:
+				ConnWriteF(client->conn, " %d", object->flags);
+				break;
+			case FIELD_IMAPUID:
+				ConnWriteF(client->conn, " %08x", object->imap_uid);
+				break;
+			case FIELD_MODIFIED:
+				ConnWriteF(client->conn, " %d", object->time_modified);
+				break;
+			case FIELD_SIZE:
+				ConnWriteF(client->conn, " " FMT_UINT64_DEC, object->size);
+				break;
+			case FIELD_FILENAME:
+				ConnWriteF(client->conn, " %s", filename);
+				break;
+		}
+	}
+	ConnWriteStr(client->conn, "\r\n");
+}
+
+/** \internal
+ * Find the value a document has for one of the storeobject columns we can
+ * sort a listing by, so that we can carry on a listing from it.
+ * \return	0 on success, -1 if we can't carry on listings in that order
+ */
+static int
+StoreObjectSortValue(const StoreObject *object, const char *order_prop, uint64_t *value)
+{
+	StorePropInfo prop;
+	
+	memset(&prop, 0, sizeof(StorePropInfo));
+	prop.name = (char *)order_prop;
+	StorePropertyFixup(&prop);
+	
+	switch (prop.type) {
+		case STORE_PROP_GUID:
+			*value = object->guid;
+			return 0;
+		case STORE_PROP_CREATED:
+			*value = object->time_created;
+			return 0;
+		case STORE_PROP_LASTMODIFIED:
+			*value = object->time_modified;
+			return 0;
+		case STORE_PROP_LENGTH:
+			*value = object->size;
+			return 0;
+		case STORE_PROP_MAIL_IMAPUID:
+			*value = object->imap_uid;
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+/**
+ * Bind the parameters a QueryBuilder was given into the statement 
+ * prepared from its SQL
+ * \return	0 on success, -1 if a parameter has an unknown type
+ */
+int
+StoreObjectBindQueryParams(QueryBuilder *builder, MsgSQLStatement *stmt)
+{
+	unsigned int i;
+	
+	for (i = 0; i < builder->parameters->len; i++) {
+		QueryBuilder_Param *p = g_ptr_array_index(builder->parameters, i);
+		
+		switch (p->type) {
+			case TYPE_INT:
+				MsgSQLBindInt(stmt, p->position, p->data.d_int);
+				break;
+			case TYPE_INT64:
+				MsgSQLBindInt64(stmt, p->position, p->data.d_int64);
+				break;
+			case TYPE_TEXT:
+				MsgSQLBindString(stmt, p->position, p->data.d_text, FALSE);
+				break;
+			default:
+				return -1;
+		}
+	}
+	return 0;
+}
+
 /**
  * Run the query we've created in the QueryBuilder
  */
@@ -736,7 +1036,6 @@ StoreObjectIterQueryBuilder(StoreClient *client, QueryBuilder *builder, BOOL sho
 	MsgSQLStatement *ret;
 	StoreObject object;
 	int properties;
-	unsigned int i;
 	long int total = 0;
 	int status;
 	const char *error = MSG3010BADBQL;
@@ -758,27 +1057,11 @@ StoreObjectIterQueryBuilder(StoreClient *client, QueryBuilder *builder, BOOL sho
 	
 	MsgSQLBeginTransaction(client->storedb);
 	
-	ret = MsgSQLPrepare(client->storedb, sql, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, sql, &stmt);
 	if (ret == NULL) goto abort;
 	
 	// bind in any variables we need
-	for (i = 0; i < builder->parameters->len; i++) {
-		QueryBuilder_Param *p = g_ptr_array_index(builder->parameters, i);
-		
-		switch (p->type) {
-			case TYPE_INT:
-				MsgSQLBindInt(&stmt, p->position, p->data.d_int);
-				break;
-			case TYPE_INT64:
-				MsgSQLBindInt64(&stmt, p->position, p->data.d_int64);
-				break;
-			case TYPE_TEXT:
-				MsgSQLBindString(&stmt, p->position, p->data.d_text, FALSE);
-				break;
-			default:
-				goto abort;
-		}
-	}
+	if (StoreObjectBindQueryParams(builder, &stmt)) goto abort;
 	
 	properties = builder->properties->len;
 	
@@ -799,7 +1082,9 @@ StoreObjectIterQueryBuilder(StoreClient *client, QueryBuilder *builder, BOOL sho
 		// FIXME: do we need to check READ permission on this object?
 		
 		// output document info if wanted
-		if (builder->output_mode == MODE_LIST) {
+		if (builder->output_mode == MODE_LIST && builder->field_count > 0) {
+			StoreObjectWriteListFields(client, builder, &object, buffer);
+		} else if (builder->output_mode == MODE_LIST) {
 			//ccode = ConnWriteF(client->conn, 
 			ConnWriteF(client->conn, 
 				"2001 " GUID_FMT " %d %d %08x %d " FMT_UINT64_DEC " %s\r\n", 
@@ -839,6 +1124,7 @@ StoreObjectIterQueryBuilder(StoreClient *client, QueryBuilder *builder, BOOL sho
 	return 1000;
 
 abort:
+	MsgSQLFinalize(&stmt);
 	if (sql) {
 		MemFree(sql);
 	}
@@ -856,19 +1142,35 @@ presqlabort:
  * \param	client	Store client we're operating for
  * \param	guid	GUID of the collection we want to look in
  * \param	iterator	Iterator configuration
+ * \param	options	Order, starting point and fields of the listing, or NULL
  */
 int
 StoreObjectIterCollectionContents(StoreClient *client, StoreObject *collection, 
 	int start, int end, uint32_t flagsmask, uint32_t flags,
 	StorePropInfo *props, int propcount,
 	const char *safe_query, const char *unsafe_query,
-	BOOL show_total)
+	const StoreListOptions *options, BOOL show_total)
 {
 	QueryBuilder builder;
 	char *query;
 	char final_query[200];
+	char keyset_query[400];
+	const char *order_prop = NULL;
+	uint64_t after = 0;
 	int i;
 	
+	if (options != NULL) {
+		order_prop = options->order_prop;
+		if (options->after != NULL) {
+			// carrying on from a document needs a definite order
+			if (order_prop == NULL) order_prop = "nmap.guid";
+			if (StoreObjectSortValue(options->after, order_prop, &after)) {
+				ConnWriteStr(client->conn, MSG3022BADSYNTAX);
+				return 3022;
+			}
+		}
+	}
+	
 	if (flags > 0) {
 		if (flagsmask > 0) {
 			query = "& = nmap.collection ?1 = ?2 ~ nmap.flags ?3";
@@ -885,10 +1187,27 @@ StoreObjectIterCollectionContents(StoreClient *client, StoreObject *collection,
 		query = final_query;
 	}
 	
+	// only what sorts after the given document, going by its guid where
+	// the sort values are the same, so the index can skip to it
+	if (options != NULL && options->after != NULL) {
+		char op = options->ascending ? '>' : '<';
+		
+		snprintf(keyset_query, 399, "& %s | %c %s ?4 & = %s ?4 %c nmap.guid ?5",
+			query, op, order_prop, order_prop, op);
+		keyset_query[399] = '\0';
+		query = keyset_query;
+	}
+	
 	// no error checking here.. bad... :)
 	QueryBuilderStart(&builder);
 	
 	QueryBuilderSetOutputMode(&builder, MODE_LIST);
+	if (options != NULL && options->fields != NULL &&
+	    QueryBuilderSetOutputFields(&builder, options->fields)) {
+		QueryBuilderFinish(&builder);
+		ConnWriteStr(client->conn, MSG3022BADSYNTAX);
+		return 3022;
+	}
 	
 	QueryBuilderSetQuerySafe(&builder, query);
 	if (unsafe_query != NULL) 
@@ -901,6 +1220,10 @@ StoreObjectIterCollectionContents(StoreClient *client, StoreObject *collection,
 			QueryBuilderAddParam(&builder, 3, TYPE_INT, flagsmask, 0, NULL);
 		}
 	}
+	if (options != NULL && options->after != NULL) {
+		QueryBuilderAddParam(&builder, 4, TYPE_INT64, 0, after, NULL);
+		QueryBuilderAddParam(&builder, 5, TYPE_INT64, 0, options->after->guid, NULL);
+	}
 	
 	// FIXME: need a better internal properties model so that we can
 	// do less work when passing around property lists.
@@ -910,6 +1233,11 @@ StoreObjectIterCollectionContents(StoreClient *client, StoreObject *collection,
 		QueryBuilderAddPropertyOutput(&builder, prop->name);
 	}
 	
+	if (order_prop != NULL) {
+		QueryBuilderSetResultOrder(&builder, order_prop, 
+			options->ascending);
+	}
+	
 	// Range is [start, end] - but SQL wants [start, items to return]
 	end -= start;
 	if ((start > -1) && (end > -1)) {
@@ -1073,7 +1401,7 @@ StoreObjectIterProperties(StoreClient *client, StoreObject *document)
 	
 	memset(&stmt, 0, sizeof(MsgSQLStatement));
 	
-	ret = MsgSQLPrepare(client->storedb, query, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 	if (ret ==  NULL) goto abort;
 	
 	MsgSQLBindInt64(&stmt, 1, document->guid);
@@ -1126,7 +1454,7 @@ StoreObjectUpdateImapUID(StoreClient *client, StoreObject *object)
 	new_imapuid = ++collection.imap_uid;
 	query = "UPDATE storeobject SET imap_uid = ?1 WHERE guid IN (?2, ?3);";
 	
-	ret = MsgSQLPrepare(client->storedb, query, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 	if (ret == NULL) goto abort;
 	
 	MsgSQLBindInt(&stmt, 1, new_imapuid);
@@ -1170,7 +1498,7 @@ StoreObjectCopyInfo(StoreClient *client, StoreObject *old, StoreObject *newobj)
 
 	query = "INSERT INTO properties (guid, intprop, name, value) SELECT ?2, intprop, name, value FROM properties WHERE guid = ?1;";
 	
-	ret = MsgSQLPrepare(client->storedb, query, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 	if (ret == NULL) goto abort;
 	
 	MsgSQLBindInt64(&stmt, 1, old->guid);
@@ -1182,6 +1510,20 @@ StoreObjectCopyInfo(StoreClient *client, StoreObject *old, StoreObject *newobj)
 		goto abort;
 	}
 	
+	MsgSQLFinalize(&stmt);
+	
+	// the copy sorts and searches the same way as the original
+	query = "INSERT OR REPLACE INTO maildocument (guid, collection_guid, subject, senders, time_sent) SELECT ?2, ?3, subject, senders, time_sent FROM maildocument WHERE guid = ?1;";
+	
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
+	if (ret == NULL) goto abort;
+	
+	MsgSQLBindInt64(&stmt, 1, old->guid);
+	MsgSQLBindInt64(&stmt, 2, newobj->guid);
+	MsgSQLBindInt64(&stmt, 3, newobj->collection_guid);
+	
+	if (MsgSQLExecute(client->storedb, &stmt) != 0) goto abort;
+	
 	MsgSQLFinalize(&stmt);
 	if (MsgSQLCommitTransaction(client->storedb))
 		goto abort;
@@ -1194,6 +1536,54 @@ abort:
 	return -1;
 }
 
+/* What else the store keeps about documents and collections, by table
+ * and the column holding their guid. All of it goes when they do. */
+static const struct {
+	const char *table;
+	const char *column;
+} StoreObjectDependents[] = {
+#ifdef HAVE_SQLITE_FTS4
+	{ "fulltext", "docid" },		// so they don't turn up in searches,
+#endif
+	{ "eventoccurrence", "guid" },		// EVENTS,
+	{ "eventdocument", "guid" },
+	{ "maildocument", "guid" },		// or sorted LISTs
+	{ "changelog", "collection_guid" },	// collections have no changes left to tell of
+	{ "modseq", "collection_guid" },
+	{ "collectioncounts", "collection_guid" },
+	{ NULL, NULL }
+};
+
+/** \internal
+ * Delete the rows the tables above hold for every guid in a table of
+ * removed objects. Should be called inside the removal's transaction.
+ * \return	0 on success, -1 on failure
+ */
+static int
+StoreObjectRemoveDependentRows(StoreClient *client, const char *removed)
+{
+	MsgSQLStatement stmt;
+	char query[200];
+	int i, status;
+	
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	
+	for (i = 0; StoreObjectDependents[i].table != NULL; i++) {
+		snprintf(query, sizeof(query), "DELETE FROM %s WHERE %s IN (SELECT guid FROM %s);",
+			StoreObjectDependents[i].table, StoreObjectDependents[i].column, removed);
+		if (MsgSQLPrepare(client->storedb, query, &stmt) == NULL) return -1;
+		status = MsgSQLExecute(client->storedb, &stmt);
+		MsgSQLFinalize(&stmt);
+		if (status) {
+			Log(LOG_ERROR, "Couldn't remove %s rows for the objects in %s",
+				StoreObjectDependents[i].table, removed);
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
 int
 StoreObjectRemoveCollection(StoreClient *client, StoreObject *collection)
 {
@@ -1202,6 +1592,7 @@ StoreObjectRemoveCollection(StoreClient *client, StoreObject *collection)
 	char path[MAX_FILE_NAME+1];
 	char temp_table[50];
 	char query[200];
+	BOOL created = FALSE, transaction = FALSE;
 	int status;
 	
 	memset(&stmt, 0, sizeof(MsgSQLStatement));
@@ -1220,27 +1611,35 @@ StoreObjectRemoveCollection(StoreClient *client, StoreObject *collection)
 	snprintf(path, MAX_FILE_NAME, "%s/", collection->filename);
 	MsgSQLBindString(&stmt, 1, path, FALSE);
 	MsgSQLBindInt(&stmt, 2, strlen(path));
-	MsgSQLExecute(client->storedb, &stmt);
+	status = MsgSQLExecute(client->storedb, &stmt);
 	
 	// This 'CREATE TABLE' is done outside of the transaction, because we cannot alter
 	// the database schema within a transaction. Hopefully this isn't a race condition,
 	// because the locking at a higher level should prevent new documents being placed
 	// in collections being removed.
 	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+	created = TRUE;
 	
 	snprintf(query, 199, "DELETE %s;", clause);
 	ret = MsgSQLPrepare(client->storedb, query, &stmt);
 	if (ret == NULL) goto abort;
 	
-	MsgSQLBeginTransaction(client->storedb);
+	if (MsgSQLBeginTransaction(client->storedb)) goto abort;
+	transaction = TRUE;
 	
 	MsgSQLBindString(&stmt, 1, path, FALSE);
 	MsgSQLBindInt(&stmt, 2, strlen(path));
-	MsgSQLExecute(client->storedb, &stmt);
+	status = MsgSQLExecute(client->storedb, &stmt);
 	MsgSQLFinalize(&stmt);
+	if (status) goto abort;
+	
+	// the rest of what the store keeps about them goes at the same time
+	if (StoreObjectRemoveDependentRows(client, temp_table)) goto abort;
 	
 	if (MsgSQLCommitTransaction(client->storedb))
 		goto abort;
+	transaction = FALSE;
 	
 	// Step 2. Now any potential contents have been moved aside for now,
 	// we can delete the actual collection itself.
@@ -1278,7 +1677,14 @@ StoreObjectRemoveCollection(StoreClient *client, StoreObject *collection)
 
 abort:
 	MsgSQLFinalize(&stmt);
-	MsgSQLAbortTransaction(client->storedb);
+	if (transaction) {
+		MsgSQLAbortTransaction(client->storedb);
+	}
+	if (created) {
+		// or the next attempt to remove this collection can't make it
+		snprintf(query, 199, "DROP TABLE %s;", temp_table);
+		MsgSQLQuickExecute(client->storedb, query);
+	}
 	
 	return -1;
 }
@@ -1307,7 +1713,7 @@ StoreObjectRenameSubobjects(StoreClient *client, StoreObject *container, const c
 	// ?1 - path of container, ?2 - length of path ?1, ?3 should be ?2+1, ?4 - new path to set
 	query = "UPDATE storeobject SET filename = ?4 || substr(filename,?3,-1) WHERE substr(filename,1,?2) = ?1;";
 	
-	ret = MsgSQLPrepare(client->storedb, query, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 	if (ret == NULL) goto abort;
 	
 	pathlen = strlen(path);
@@ -1377,6 +1783,7 @@ StoreObjectSetProperty(StoreClient *client, StoreObject *object, StorePropInfo *
 		case STORE_PROP_COLLECTION:
 		case STORE_PROP_LENGTH:
 		case STORE_PROP_NAME:
+		case STORE_PROP_MODSEQ:
 			return -2;
 		
 		// time/date type properties
@@ -1443,7 +1850,7 @@ StoreObjectSetExternalProperty(StoreClient *client, StoreObject *object, StorePr
 	insquery = "INSERT INTO properties (guid, intprop, name, value) VALUES (?1, ?2, ?3, ?4);";
 	
 	// remove old property first
-	remret = MsgSQLPrepare(client->storedb, remquery, &remstmt);
+	remret = MsgSQLPrepareCached(client->storedb, remquery, &remstmt);
 	if (remret == NULL) goto abort;
 	
 	MsgSQLBindInt64(&remstmt, 1, object->guid);
@@ -1456,7 +1863,7 @@ StoreObjectSetExternalProperty(StoreClient *client, StoreObject *object, StorePr
 	if (ret != 0) goto abort;
 	
 	// insert new property
-	insret = MsgSQLPrepare(client->storedb, insquery, &insstmt);
+	insret = MsgSQLPrepareCached(client->storedb, insquery, &insstmt);
 	if (insret == NULL) goto abort;
 	
 	MsgSQLBindInt64(&insstmt, 1, object->guid);
@@ -1472,6 +1879,12 @@ StoreObjectSetExternalProperty(StoreClient *client, StoreObject *object, StorePr
 	ret = MsgSQLExecute(client->storedb, &insstmt);
 	if (ret != 0) goto abort;
 	
+	// keep the indexed copy of mail headers up to date too
+	if (prop->table == STORE_PROPTABLE_MAIL) {
+		ret = SOQuery_SetMailColumn(client, object->guid, prop->column, prop->value);
+		if (ret != 0) goto abort;
+	}
+	
 	MsgSQLFinalize(&insstmt);
 	MsgSQLFinalize(&remstmt);
 	
@@ -1515,7 +1928,7 @@ StoreObjectAddACL(StoreClient *client, StoreObject *object, StorePrincipalType p
 	// check that this doesn't already exist
 	query = "SELECT count(priv) FROM accesscontrols WHERE guid = ?1 AND priv = ?2 AND principal = ?3 AND deny = ?4 AND who = ?5;";
 	
-	ret = MsgSQLPrepare(client->storedb, query, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 	if (ret == NULL) goto abort;
 	
 	MsgSQLBindInt64(&stmt, 1, object->guid);
@@ -1535,7 +1948,7 @@ StoreObjectAddACL(StoreClient *client, StoreObject *object, StorePrincipalType p
 	// now insert the new ACL
 	query = "INSERT INTO accesscontrols (guid, priv, principal, deny, who) VALUES (?1, ?2, ?3, ?4, ?5);";
 	
-	ret = MsgSQLPrepare(client->storedb, query, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 	if (ret == NULL) goto abort;
 	
 	MsgSQLBindInt64(&stmt, 1, object->guid);
@@ -1609,7 +2022,7 @@ StoreObjectRemoveACL(StoreClient *client, StoreObject *object, StorePrincipalTyp
 	}
 	BongoStringBuilderAppend(&b, ";");
 	
-	ret = MsgSQLPrepare(client->storedb, b.value, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, b.value, &stmt);
 	if (ret == NULL) goto abort;
 	
 	MsgSQLBindInt64(&stmt, 1, object->guid);
@@ -1667,7 +2080,7 @@ StoreObjectListACL(StoreClient *client, StoreObject *object)
 	else
 		query = "SELECT guid, priv, principal, deny, who FROM accesscontrols;";
 	
-	ret = MsgSQLPrepare(client->storedb, query, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 	if (ret == NULL) goto abort;
 	
 	if (object != NULL) {
@@ -1776,7 +2189,7 @@ ACLCheckOnGUID(StoreClient *client, uint64_t guid, int prop)
 	
 	query = "SELECT priv, principal, deny, who FROM accesscontrols WHERE guid = ?1;";
 	
-	ret = MsgSQLPrepare(client->storedb, query, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 	if (ret == NULL) goto abort;
 	
 	MsgSQLBindInt64(&stmt, 1, guid);
@@ -1885,7 +2298,7 @@ StoreObjectLinkByGuids(StoreClient *client, uint64_t document, uint64_t related)
 	
 	query = "INSERT INTO links (doc_guid, related_guid) VALUES (?1, ?2);";
 	
-	ret = MsgSQLPrepare(client->storedb, query, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 	if (ret == NULL) goto abort;
 	
 	MsgSQLBindInt64(&stmt, 1, document);
@@ -1980,11 +2393,17 @@ StoreObjectUnlinkFromConversation(StoreClient *client, StoreObject *mail)
 	if (status != 0)
 		goto abort;
 	
+	// the mail's message-id stays in the threading index, so that 
+	// replies to it still find the conversation
+	status = SOQuery_ForgetThreadedMail(client, mail->guid);
+	if (status != 0)
+		goto abort;
+	
 	// find the number of other mails attached to this conversation - if
 	// the conversation is 'empty', we want to now remove it.
 	if (conversation_guid) {
 		query = "SELECT count(l.related_guid) FROM links l WHERE l.doc_guid = ?1;";
-		ret = MsgSQLPrepare(client->storedb, query, &stmt);
+		ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 		if (ret == NULL) goto abort;
 		
 		MsgSQLBindInt64(&stmt, 1, conversation_guid);
@@ -2000,6 +2419,8 @@ StoreObjectUnlinkFromConversation(StoreClient *client, StoreObject *mail)
 			// conversation now empty, so we can remove it
 			status = SOQuery_RemoveSOByGUID(client, conversation_guid);
 			if (status != 0) goto abort;
+			status = SOQuery_RemoveConversationByGUID(client, conversation_guid);
+			if (status != 0) goto abort;
 		}
 	}
 	
@@ -2059,15 +2480,16 @@ StoreObjectSaveConversation(StoreClient *client, StoreConversationData *data)
 	// create a stub entry in the database to get our guid
 	MsgSQLBeginTransaction(client->storedb);
 	
-	query = "INSERT OR REPLACE INTO conversation (guid, subject, date, sources) VALUES (?1, ?2, ?3, ?4);";
+	query = "INSERT OR REPLACE INTO conversation (guid, subject, subject_hash, date, sources) VALUES (?1, ?2, ?3, ?4, ?5);";
 	
-	ret = MsgSQLPrepare(client->storedb, query, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 	if (ret == NULL) goto abort;
 	
 	MsgSQLBindInt64(&stmt, 1, data->guid);
 	MsgSQLBindString(&stmt, 2, data->subject, FALSE);
-	MsgSQLBindInt(&stmt, 3, data->date);
-	MsgSQLBindInt(&stmt, 4, data->sources);
+	MsgSQLBindInt64(&stmt, 3, BongoStringHash(data->subject));
+	MsgSQLBindInt(&stmt, 4, data->date);
+	MsgSQLBindInt(&stmt, 5, data->sources);
 	
 	status = MsgSQLExecute(client->storedb, &stmt);
 	if (status != 0) {
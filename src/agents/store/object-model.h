@@ -21,6 +21,14 @@ typedef struct {
 	uint32_t	sources;
 } StoreConversationData;
 
+/* How a collection's contents should be listed, beyond what's in it */
+typedef struct {
+	const char *	order_prop;	// property to sort by, or NULL for any order
+	BOOL		ascending;
+	StoreObject *	after;		// only list what sorts after this, or NULL
+	const char *	fields;		// LIST fields wanted, comma separated, or NULL for all
+} StoreListOptions;
+
 typedef struct _StoreObjectPropertyIterator StoreObjectPropertyIterator;
 typedef void (*bongoPropertyIteratorCallback)(StoreClient *client, 
 	char *name, char *value, StoreObjectPropertyIterator *iterator);
@@ -61,6 +69,7 @@ int StoreObjectCreate(StoreClient *client, StoreObject *object);
 int StoreObjectSave(StoreClient *client, StoreObject *object);
 int StoreObjectSaveConversation(StoreClient *client, StoreConversationData *data);
 int StoreObjectRemove(StoreClient *client, StoreObject *object);
+int StoreObjectRemoveMimeReport(StoreClient *client, StoreObject *object);
 int StoreObjectRepair(StoreClient *client, StoreObject *object);
 
 int StoreObjectCheckAuthorization(StoreClient *client, StoreObject *object, int prop);
@@ -84,6 +93,7 @@ void StoreObjectFixUpFilename(StoreObject *container, StoreObject *object);
 void StoreObjectUpdateModifiedTime(StoreObject *object);
 
 // iterators on store contents.
+int StoreObjectBindQueryParams(QueryBuilder *builder, MsgSQLStatement *stmt);
 int StoreObjectIterQueryBuilder(StoreClient *client, QueryBuilder *builder, BOOL show_total);
 void StoreObjectIterQueryBuilderPropResult(StoreClient *client, 
 	int properties, MsgSQLStatement *stmt, QueryBuilder *builder);
@@ -92,7 +102,7 @@ int StoreObjectIterCollectionContents(StoreClient *client, StoreObject *collecti
 	int start, int end, uint32_t flagsmask, uint32_t flags,
 	StorePropInfo *props, int propcount,
 	const char *safe_query, const char *unsafe_query,
-	BOOL show_total);
+	const StoreListOptions *options, BOOL show_total);
 int StoreObjectIterSubcollections(StoreClient *client, StoreObject *container);
 int StoreObjectIterLinks(StoreClient *client, StoreObject *document, BOOL reverse);
 int StoreObjectIterConversationMails(StoreClient *client, StoreObject *conversation,
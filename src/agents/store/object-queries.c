@@ -35,7 +35,7 @@ SOQuery_RemoveSOByGUID(StoreClient *client, uint64_t guid)
 	
 	query = "DELETE FROM storeobject WHERE guid=?1;";
 	
-	ret = MsgSQLPrepare(client->storedb, query, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 	if (ret == NULL) goto end;
 	
 	MsgSQLBindInt64(&stmt, 1, guid);
@@ -48,6 +48,274 @@ end:
 	return retcode;
 }
 
+/**
+ * Remove the cached MIME structure of an object, if there is one
+ * 
+ * \param	client 	Store client we're operating for
+ * \param	guid	GUID of the object whose report we want to remove
+ * \return	0 on success, -2 on failure
+ */
+int
+SOQuery_RemoveMimeReportByGUID(StoreClient *client, uint64_t guid)
+{
+	MsgSQLStatement stmt;
+	MsgSQLStatement *ret;
+	int retcode = -2;
+	
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	
+	ret = MsgSQLPrepareCached(client->storedb, "DELETE FROM mimereport WHERE guid=?1;", &stmt);
+	if (ret == NULL) goto end;
+	
+	MsgSQLBindInt64(&stmt, 1, guid);
+	
+	if (MsgSQLExecute(client->storedb, &stmt) == 0) retcode = 0;
+	
+end:
+	MsgSQLFinalize(&stmt);
+	return retcode;
+}
+
+/**
+ * Remove an object from the full-text index, if it's in there
+ * 
+ * \param	client 	Store client we're operating for
+ * \param	guid	GUID of the object we want to remove
+ * \return	0 on success, -2 on failure
+ */
+int
+SOQuery_RemoveFullTextByGUID(StoreClient *client, uint64_t guid)
+{
+	MsgSQLStatement stmt;
+	MsgSQLStatement *ret;
+	int retcode = -2;
+	
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	
+	ret = MsgSQLPrepareCached(client->storedb, "DELETE FROM fulltext WHERE docid=?1;", &stmt);
+	if (ret == NULL) goto end;
+	
+	MsgSQLBindInt64(&stmt, 1, guid);
+	
+	if (MsgSQLExecute(client->storedb, &stmt) == 0) retcode = 0;
+	
+end:
+	MsgSQLFinalize(&stmt);
+	return retcode;
+}
+
+/**
+ * Remove an event's entries from the calendar occurrence index
+ * 
+ * \param	client 	Store client we're operating for
+ * \param	guid	GUID of the event we want to remove
+ * \return	0 on success, -2 on failure
+ */
+int
+SOQuery_RemoveEventByGUID(StoreClient *client, uint64_t guid)
+{
+	MsgSQLStatement stmt;
+	MsgSQLStatement *ret;
+	int retcode = -2;
+	
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	
+	ret = MsgSQLPrepareCached(client->storedb, "DELETE FROM eventoccurrence WHERE guid=?1;", &stmt);
+	if (ret == NULL) goto end;
+	
+	MsgSQLBindInt64(&stmt, 1, guid);
+	
+	if (MsgSQLExecute(client->storedb, &stmt)) goto end;
+	MsgSQLFinalize(&stmt);
+	
+	ret = MsgSQLPrepareCached(client->storedb, "DELETE FROM eventdocument WHERE guid=?1;", &stmt);
+	if (ret == NULL) goto end;
+	
+	MsgSQLBindInt64(&stmt, 1, guid);
+	
+	if (MsgSQLExecute(client->storedb, &stmt) == 0) retcode = 0;
+	
+end:
+	MsgSQLFinalize(&stmt);
+	return retcode;
+}
+
+/**
+ * Set one of the mail header columns we keep for sorting and searching on
+ * 
+ * \param	client 	Store client we're operating for
+ * \param	guid	GUID of the mail
+ * \param	column	maildocument column to set, from the property table
+ * \param	value	Value to set it to
+ * \return	0 on success, -2 on failure
+ */
+int
+SOQuery_SetMailColumn(StoreClient *client, uint64_t guid, const char *column, const char *value)
+{
+	MsgSQLStatement stmt;
+	MsgSQLStatement *ret;
+	char query[100];
+	int retcode = -2;
+	
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	
+	ret = MsgSQLPrepareCached(client->storedb, "INSERT OR IGNORE INTO maildocument (guid, collection_guid) "
+		"SELECT guid, collection_guid FROM storeobject WHERE guid=?1;", &stmt);
+	if (ret == NULL) goto end;
+	
+	MsgSQLBindInt64(&stmt, 1, guid);
+	
+	if (MsgSQLExecute(client->storedb, &stmt)) goto end;
+	MsgSQLFinalize(&stmt);
+	
+	// column names can't be bound, but these only come from our own table
+	snprintf(query, sizeof(query), "UPDATE maildocument SET %s=?2 WHERE guid=?1;", column);
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
+	if (ret == NULL) goto end;
+	
+	MsgSQLBindInt64(&stmt, 1, guid);
+	MsgSQLBindString(&stmt, 2, value, FALSE);
+	
+	if (MsgSQLExecute(client->storedb, &stmt) == 0) retcode = 0;
+	
+end:
+	MsgSQLFinalize(&stmt);
+	return retcode;
+}
+
+/**
+ * Keep a mail's header columns with the collection it's in, so that they
+ * can be sorted on within it, making them if it has none yet
+ * 
+ * \param	client 	Store client we're operating for
+ * \param	guid	GUID of the mail
+ * \param	collection	GUID of the collection it's now in
+ * \return	0 on success, -2 on failure
+ */
+int
+SOQuery_SetMailCollection(StoreClient *client, uint64_t guid, uint64_t collection)
+{
+	MsgSQLStatement stmt;
+	MsgSQLStatement *ret;
+	int retcode = -2;
+	
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	
+	ret = MsgSQLPrepareCached(client->storedb, "INSERT OR IGNORE INTO maildocument (guid, collection_guid) VALUES (?1, ?2);", &stmt);
+	if (ret == NULL) goto end;
+	
+	MsgSQLBindInt64(&stmt, 1, guid);
+	MsgSQLBindInt64(&stmt, 2, collection);
+	
+	if (MsgSQLExecute(client->storedb, &stmt)) goto end;
+	MsgSQLFinalize(&stmt);
+	
+	ret = MsgSQLPrepareCached(client->storedb, "UPDATE maildocument SET collection_guid=?2 WHERE guid=?1;", &stmt);
+	if (ret == NULL) goto end;
+	
+	MsgSQLBindInt64(&stmt, 1, guid);
+	MsgSQLBindInt64(&stmt, 2, collection);
+	
+	if (MsgSQLExecute(client->storedb, &stmt) == 0) retcode = 0;
+	
+end:
+	MsgSQLFinalize(&stmt);
+	return retcode;
+}
+
+/**
+ * Remove a mail's header columns, if it has any
+ * 
+ * \param	client 	Store client we're operating for
+ * \param	guid	GUID of the mail we want to remove
+ * \return	0 on success, -2 on failure
+ */
+int
+SOQuery_RemoveMailByGUID(StoreClient *client, uint64_t guid)
+{
+	MsgSQLStatement stmt;
+	MsgSQLStatement *ret;
+	int retcode = -2;
+	
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	
+	ret = MsgSQLPrepareCached(client->storedb, "DELETE FROM maildocument WHERE guid=?1;", &stmt);
+	if (ret == NULL) goto end;
+	
+	MsgSQLBindInt64(&stmt, 1, guid);
+	
+	if (MsgSQLExecute(client->storedb, &stmt) == 0) retcode = 0;
+	
+end:
+	MsgSQLFinalize(&stmt);
+	return retcode;
+}
+
+/**
+ * Remove a conversation's own data, and its entries in the threading index
+ * 
+ * \param	client 	Store client we're operating for
+ * \param	guid	GUID of the conversation we want to remove
+ * \return	0 on success, -2 on failure
+ */
+int
+SOQuery_RemoveConversationByGUID(StoreClient *client, uint64_t guid)
+{
+	MsgSQLStatement stmt;
+	MsgSQLStatement *ret;
+	int retcode = -2;
+	
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	
+	ret = MsgSQLPrepareCached(client->storedb, "DELETE FROM threadindex WHERE conversation_guid=?1;", &stmt);
+	if (ret == NULL) goto end;
+	
+	MsgSQLBindInt64(&stmt, 1, guid);
+	
+	if (MsgSQLExecute(client->storedb, &stmt)) goto end;
+	MsgSQLFinalize(&stmt);
+	
+	ret = MsgSQLPrepareCached(client->storedb, "DELETE FROM conversation WHERE guid=?1;", &stmt);
+	if (ret == NULL) goto end;
+	
+	MsgSQLBindInt64(&stmt, 1, guid);
+	
+	if (MsgSQLExecute(client->storedb, &stmt) == 0) retcode = 0;
+	
+end:
+	MsgSQLFinalize(&stmt);
+	return retcode;
+}
+
+/**
+ * Note that a mail has gone, while keeping its message-id in the threading
+ * index as a placeholder for any replies to it
+ * 
+ * \param	client 	Store client we're operating for
+ * \param	guid	GUID of the mail which has gone
+ * \return	0 on success, -2 on failure
+ */
+int
+SOQuery_ForgetThreadedMail(StoreClient *client, uint64_t guid)
+{
+	MsgSQLStatement stmt;
+	MsgSQLStatement *ret;
+	int retcode = -2;
+	
+	memset(&stmt, 0, sizeof(MsgSQLStatement));
+	
+	ret = MsgSQLPrepareCached(client->storedb, "UPDATE threadindex SET guid=0 WHERE guid=?1;", &stmt);
+	if (ret == NULL) goto end;
+	
+	MsgSQLBindInt64(&stmt, 1, guid);
+	
+	if (MsgSQLExecute(client->storedb, &stmt) == 0) retcode = 0;
+	
+end:
+	MsgSQLFinalize(&stmt);
+	return retcode;
+}
+
 /**
  * Find the related conversation GUID for a given document.
  * Only really makes sense if the GUID passed is for an email document.
@@ -68,7 +336,7 @@ SOQuery_ConversationGUIDForEmail(StoreClient *client, uint64_t guid)
 	memset(&stmt, 0, sizeof(MsgSQLStatement));
 	
 	query = "SELECT so.guid FROM links l LEFT JOIN storeobject so ON l.doc_guid = so.guid WHERE l.related_guid = ?1 AND so.collection_guid = ?2 AND so.type = 5;";
-	ret = MsgSQLPrepare(client->storedb, query, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 	if (ret == NULL) goto end;
 	
 	MsgSQLBindInt64(&stmt, 1, guid);
@@ -121,7 +389,7 @@ SOQuery_Unlink(StoreClient *client, uint64_t document, uint64_t related, BOOL an
 		query = "DELETE FROM links WHERE related_guid=?1";
 	}
 	
-	ret = MsgSQLPrepare(client->storedb, query, &stmt);
+	ret = MsgSQLPrepareCached(client->storedb, query, &stmt);
 	if (ret == NULL) goto abort;
 	
 	if (document != 0) {
@@ -2,6 +2,14 @@
 #define OBJECT_QUERIES_H
 
 int SOQuery_RemoveSOByGUID(StoreClient *client, uint64_t guid);
+int SOQuery_RemoveMimeReportByGUID(StoreClient *client, uint64_t guid);
+int SOQuery_RemoveFullTextByGUID(StoreClient *client, uint64_t guid);
+int SOQuery_RemoveEventByGUID(StoreClient *client, uint64_t guid);
+int SOQuery_RemoveMailByGUID(StoreClient *client, uint64_t guid);
+int SOQuery_SetMailColumn(StoreClient *client, uint64_t guid, const char *column, const char *value);
+int SOQuery_SetMailCollection(StoreClient *client, uint64_t guid, uint64_t collection);
+int SOQuery_RemoveConversationByGUID(StoreClient *client, uint64_t guid);
+int SOQuery_ForgetThreadedMail(StoreClient *client, uint64_t guid);
 
 int SOQuery_Unlink(StoreClient *client, uint64_t document, uint64_t related, BOOL any);
 
@@ -0,0 +1,494 @@
+/** \file
+ * A pool of long-lived mail parsing processes.
+ *
+ * Incoming mail is parsed with GMime in a separate process, so that a
+ * message which makes the parser crash can't take the whole store down
+ * with it. Forking a fresh child for every delivery is expensive though,
+ * so instead we fork a handful of workers up front and hand them jobs
+ * over a unix socket.
+ *
+ * A job is a single line: "<guid> <time_created> <path>\n". The worker
+ * replies with "propname\1value\n" lines, and a single empty line once
+ * it has finished with that message.
+ *
+ * Workers keep nothing of the store's but their socket, and run under
+ * resource limits, so a parser bug can only get at the job it was given.
+ *
+ * If a worker dies or doesn't answer within the job timeout, it's killed
+ * and a new one is forked in its place. If every worker is busy and the
+ * queue is full, the caller is expected to fall back to parsing in a
+ * one-off child process.
+ */
+
+#include <config.h>
+#include <xpl.h>
+#include <memmgr.h>
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#if defined(LINUX)
+#include <sys/prctl.h>
+#endif
+
+#include "stored.h"
+#include "mail.h"
+
+// where a worker's socket ends up, just after stdin, stdout and stderr
+#define PARSER_WORKER_FD 3
+// descriptors a worker may have open: the above, plus the message and
+// whatever GMime needs while parsing it
+#define PARSER_WORKER_MAX_FILES 16
+
+typedef struct {
+	pid_t		pid;
+	Connection *	conn;
+	BOOL		busy;
+} ParserWorker;
+
+static struct {
+	XplMutex	lock;
+	XplSemaphore	idle;
+	ParserWorker *	workers;
+	int		size;
+	BOOL		running;
+} ParserPool;
+
+/** \internal
+ * Shut a new worker off from everything else the store has. The store has
+ * given up root by the time workers are forked, so this is about what a
+ * worker inherits: every descriptor but its own socket is closed (the
+ * listener, clients, other workers, IDLE pipes...) and it can't open many
+ * more, dump core, take on new privileges, or grow past the memory limit.
+ * \param	fd	The worker's end of the socket to the store
+ * \return		Where that socket is now
+ */
+static int
+ParserWorkerSandbox(int fd)
+{
+	struct rlimit limit;
+	long max;
+	int i;
+
+	if (fd != PARSER_WORKER_FD) {
+		if (dup2(fd, PARSER_WORKER_FD) == -1) {
+			_exit(1);
+		}
+		fd = PARSER_WORKER_FD;
+	}
+	max = sysconf(_SC_OPEN_MAX);
+	if (max < 0) max = 1024;
+	for (i = PARSER_WORKER_FD + 1; i < max; i++) {
+		close(i);
+	}
+
+	limit.rlim_cur = limit.rlim_max = PARSER_WORKER_MAX_FILES;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	// a core would be full of somebody's mail
+	limit.rlim_cur = limit.rlim_max = 0;
+	setrlimit(RLIMIT_CORE, &limit);
+#if defined(RLIMIT_AS)
+	if (StoreAgent.parser.memoryLimit > 0) {
+		limit.rlim_cur = limit.rlim_max = (rlim_t)StoreAgent.parser.memoryLimit * 1024 * 1024;
+		setrlimit(RLIMIT_AS, &limit);
+	}
+#endif
+#if defined(PR_SET_NO_NEW_PRIVS)
+	prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
+#endif
+
+	return fd;
+}
+
+/** \internal
+ * Main loop of a worker process. Never returns.
+ * \param	fd	Our end of the socket to the store
+ */
+static void
+ParserWorkerMain(int fd)
+{
+	Connection *conn;
+	char line[XPL_MAX_PATH + 64];
+	int nbytes;
+
+	fd = ParserWorkerSandbox(fd);
+
+	// a crash in here should only take out this worker
+	signal(SIGSEGV, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+
+	conn = ConnAlloc(TRUE);
+	if (!conn) {
+		_exit(1);
+	}
+	conn->socket = fd;
+	// wait for jobs forever; we go away when the store closes its end
+	conn->receive.timeOut = -1;
+
+	while ((nbytes = ConnReadLine(conn, line, sizeof(line))) > 0) {
+		uint64_t guid;
+		unsigned int time_created;
+		int offset = 0;
+
+		if (line[nbytes - 1] == '\n') {
+			line[--nbytes] = '\0';
+		}
+
+		if (sscanf(line, GUID_FMT " %u %n", &guid, &time_created, &offset) < 2 ||
+		    offset == 0) {
+			// we don't understand the job, but still need to finish it
+			ConnWrite(conn, "\n", 1);
+		} else {
+			StoreMailParse(conn, line + offset, guid, time_created);
+		}
+
+		if (ConnFlush(conn) < 0) {
+			break;
+		}
+	}
+
+	ConnClose(conn);
+	ConnFree(conn);
+	_exit(0);
+}
+
+/** \internal
+ * Fork a new worker process into the given slot. Must be called with
+ * the pool lock held (or before any other thread can see the pool).
+ * \param	worker	Slot to fill
+ * \return		0 on success, -1 on failure
+ */
+static int
+ParserWorkerSpawn(ParserWorker *worker)
+{
+	int fds[2];
+	pid_t pid;
+
+	worker->pid = -1;
+	worker->conn = NULL;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+		Log(LOG_ERROR, "Couldn't create socket for mail parser: %s", strerror(errno));
+		return -1;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		Log(LOG_ERROR, "Couldn't fork mail parser: %s", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		ParserWorkerMain(fds[1]);
+	}
+
+	close(fds[1]);
+
+	worker->conn = ConnAlloc(TRUE);
+	if (!worker->conn) {
+		close(fds[0]);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	worker->conn->socket = fds[0];
+	worker->conn->receive.timeOut = StoreAgent.parser.jobTimeout;
+	worker->pid = pid;
+
+	return 0;
+}
+
+/** \internal
+ * Get rid of the process in the given slot, whatever state it's in.
+ */
+static void
+ParserWorkerKill(ParserWorker *worker)
+{
+	if (worker->conn) {
+		ConnClose(worker->conn);
+		ConnFree(worker->conn);
+		worker->conn = NULL;
+	}
+	if (worker->pid > 0) {
+		kill(worker->pid, SIGKILL);
+		waitpid(worker->pid, NULL, 0);
+		worker->pid = -1;
+	}
+}
+
+/**
+ * Start the parser worker processes. A pool size of zero disables the
+ * pool, and every message is parsed in its own child process instead.
+ * \return	0 on success, -1 if the pool couldn't be set up
+ */
+int
+ParserPoolInit(void)
+{
+	int i;
+
+	ParserPool.size = StoreAgent.parser.poolSize;
+	ParserPool.running = FALSE;
+	XplSafeWrite(StoreAgent.parser.stats.waiting, 0);
+
+	if (ParserPool.size <= 0) {
+		return 0;
+	}
+
+	ParserPool.workers = MemMalloc0(sizeof(ParserWorker) * ParserPool.size);
+	if (!ParserPool.workers) {
+		return -1;
+	}
+	XplMutexInit(ParserPool.lock);
+
+	for (i = 0; i < ParserPool.size; i++) {
+		if (ParserWorkerSpawn(&ParserPool.workers[i])) {
+			// leave it empty, it'll be retried when next checked out
+			Log(LOG_ERROR, "Couldn't start mail parser %d", i);
+		}
+	}
+
+	XplOpenLocalSemaphore(ParserPool.idle, ParserPool.size);
+	ParserPool.running = TRUE;
+
+	return 0;
+}
+
+/**
+ * Stop all the parser worker processes.
+ */
+void
+ParserPoolShutdown(void)
+{
+	int i;
+
+	if (!ParserPool.running) {
+		return;
+	}
+
+	XplMutexLock(ParserPool.lock);
+	Log(LOG_INFO, "Mail parsers: " FMT_UINT64_DEC " jobs, " FMT_UINT64_DEC " failed, "
+	    "%d restarts, %d overflows, " FMT_UINT64_DEC "us max latency",
+	    StoreAgent.parser.stats.jobs, StoreAgent.parser.stats.failures,
+	    XplSafeRead(StoreAgent.parser.stats.restarts),
+	    XplSafeRead(StoreAgent.parser.stats.overflows),
+	    StoreAgent.parser.stats.latencyMax);
+	ParserPool.running = FALSE;
+	for (i = 0; i < ParserPool.size; i++) {
+		ParserWorkerKill(&ParserPool.workers[i]);
+	}
+	XplMutexUnlock(ParserPool.lock);
+
+	XplCloseLocalSemaphore(ParserPool.idle);
+	XplMutexDestroy(ParserPool.lock);
+	MemFree(ParserPool.workers);
+	ParserPool.workers = NULL;
+}
+
+/** \internal
+ * Wait for an idle worker, and mark it as busy.
+ * \return	The worker, or NULL if the pool isn't available or the
+ *		queue is already full.
+ */
+static ParserWorker *
+ParserPoolCheckout(void)
+{
+	ParserWorker *worker = NULL;
+	int i;
+
+	if (!ParserPool.running) {
+		return NULL;
+	}
+
+	if (XplSafeRead(StoreAgent.parser.stats.waiting) >= StoreAgent.parser.queueDepth) {
+		XplSafeIncrement(StoreAgent.parser.stats.overflows);
+		return NULL;
+	}
+
+	XplSafeIncrement(StoreAgent.parser.stats.waiting);
+	XplWaitOnLocalSemaphore(ParserPool.idle);
+	XplSafeDecrement(StoreAgent.parser.stats.waiting);
+
+	XplMutexLock(ParserPool.lock);
+	for (i = 0; i < ParserPool.size; i++) {
+		if (!ParserPool.workers[i].busy) {
+			worker = &ParserPool.workers[i];
+			worker->busy = TRUE;
+			break;
+		}
+	}
+	if (worker && worker->conn == NULL) {
+		// an earlier restart failed; try again now
+		XplSafeIncrement(StoreAgent.parser.stats.restarts);
+		if (ParserWorkerSpawn(worker)) {
+			worker->busy = FALSE;
+			worker = NULL;
+		}
+	}
+	XplMutexUnlock(ParserPool.lock);
+
+	if (!worker) {
+		XplSignalLocalSemaphore(ParserPool.idle);
+	}
+
+	return worker;
+}
+
+/** \internal
+ * Give a worker back to the pool, replacing it first if it misbehaved.
+ * \param	worker	Worker to return
+ * \param	healthy	FALSE if the worker crashed, timed out or otherwise
+ *			can't be trusted to take another job
+ */
+static void
+ParserPoolCheckin(ParserWorker *worker, BOOL healthy)
+{
+	XplMutexLock(ParserPool.lock);
+	if (!healthy) {
+		Log(LOG_ERROR, "Mail parser %d failed, restarting it", (int)worker->pid);
+		ParserWorkerKill(worker);
+		XplSafeIncrement(StoreAgent.parser.stats.restarts);
+		if (ParserPool.running) {
+			ParserWorkerSpawn(worker);
+		}
+	}
+	worker->busy = FALSE;
+	XplMutexUnlock(ParserPool.lock);
+
+	XplSignalLocalSemaphore(ParserPool.idle);
+}
+
+/**
+ * Read the output of a parser, passing each property found to a callback.
+ * \param	conn	Connection to the parser
+ * \param	func	Called for each property name and value
+ * \param	data	Passed through to func
+ * \return		0 if the parser finished the message, -1 if it went
+ *			away or timed out first.
+ */
+int
+ParserReadProperties(Connection *conn, ParserPropertyFunc func, void *data)
+{
+	char readbuffer[4096];
+	int nbytes;
+
+	while ((nbytes = ConnReadLine(conn, readbuffer, sizeof(readbuffer))) > 0) {
+		char *value;
+
+		if (readbuffer[nbytes - 1] != '\n') {
+			// over-long line; drop it, and the remainder which follows
+			while ((nbytes = ConnReadLine(conn, readbuffer, sizeof(readbuffer))) > 0 &&
+			       readbuffer[nbytes - 1] != '\n') ;
+			if (nbytes <= 0) {
+				break;
+			}
+			continue;
+		}
+
+		readbuffer[--nbytes] = '\0';
+		if (nbytes == 0) {
+			// end of this message
+			return 0;
+		}
+
+		value = strchr(readbuffer, '\1');
+		if (value) {
+			*value++ = '\0';
+			func(readbuffer, value, data);
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Parse a mail using one of the pooled workers.
+ * \param	document	The document being delivered
+ * \param	path		Where the mail is on disk
+ * \param	func		Called for each property found
+ * \param	data		Passed through to func
+ * \return			0 on success, -1 if no worker was available (the
+ *				caller should parse it some other way), -2 if the
+ *				worker failed to parse the mail.
+ */
+int
+ParserPoolParse(StoreObject *document, const char *path,
+                ParserPropertyFunc func, void *data)
+{
+	ParserWorker *worker;
+	struct timeval start, end;
+	uint64_t usecs;
+	BOOL healthy = FALSE;
+
+	worker = ParserPoolCheckout();
+	if (!worker) {
+		return -1;
+	}
+
+	gettimeofday(&start, NULL);
+
+	if (ConnWriteF(worker->conn, GUID_FMT " %u %s\n", document->guid,
+	               document->time_created, path) > 0 &&
+	    ConnFlush(worker->conn) >= 0 &&
+	    ParserReadProperties(worker->conn, func, data) == 0) {
+		healthy = TRUE;
+	}
+
+	gettimeofday(&end, NULL);
+	usecs = ((uint64_t)(end.tv_sec - start.tv_sec) * 1000000) +
+		(end.tv_usec - start.tv_usec);
+
+	XplMutexLock(ParserPool.lock);
+	StoreAgent.parser.stats.jobs++;
+	StoreAgent.parser.stats.latencyTotal += usecs;
+	if (usecs > StoreAgent.parser.stats.latencyMax) {
+		StoreAgent.parser.stats.latencyMax = usecs;
+	}
+	if (!healthy) {
+		StoreAgent.parser.stats.failures++;
+	}
+	XplMutexUnlock(ParserPool.lock);
+
+	ParserPoolCheckin(worker, healthy);
+
+	return healthy ? 0 : -2;
+}
+
+/**
+ * Write out the pool's counters as 2001 lines, for the STATS command.
+ */
+CCode
+ParserPoolWriteStats(StoreClient *client)
+{
+	uint64_t jobs = 0, failures = 0, total = 0, max = 0;
+
+	// the lock only exists while the pool does
+	if (ParserPool.running) {
+		XplMutexLock(ParserPool.lock);
+		jobs = StoreAgent.parser.stats.jobs;
+		failures = StoreAgent.parser.stats.failures;
+		total = StoreAgent.parser.stats.latencyTotal;
+		max = StoreAgent.parser.stats.latencyMax;
+		XplMutexUnlock(ParserPool.lock);
+	}
+
+	return ConnWriteF(client->conn,
+		"2001 parser.workers %d\r\n"
+		"2001 parser.jobs " FMT_UINT64_DEC "\r\n"
+		"2001 parser.failures " FMT_UINT64_DEC "\r\n"
+		"2001 parser.restarts %d\r\n"
+		"2001 parser.overflows %d\r\n"
+		"2001 parser.waiting %d\r\n"
+		"2001 parser.latency.totalus " FMT_UINT64_DEC "\r\n"
+		"2001 parser.latency.maxus " FMT_UINT64_DEC "\r\n",
+		ParserPool.running ? ParserPool.size : 0, jobs, failures,
+		XplSafeRead(StoreAgent.parser.stats.restarts),
+		XplSafeRead(StoreAgent.parser.stats.overflows),
+		XplSafeRead(StoreAgent.parser.stats.waiting),
+		total, max);
+}
@@ -31,12 +31,14 @@ const StorePropValName StorePropTable[] = {
 	{ STORE_PROP_MAIL_HEADERLEN, "nmap.mail.headersize", STORE_PROPTABLE_NONE, NULL },
 	{ STORE_PROP_MAIL_MESSAGEID, "nmap.mail.messageid", STORE_PROPTABLE_NONE, NULL },
 	{ STORE_PROP_MAIL_PARENTMESSAGEID, "nmap.mail.parentmessageid", STORE_PROPTABLE_NONE, NULL },
-	{ STORE_PROP_MAIL_SENT, "nmap.mail.sent", STORE_PROPTABLE_NONE, NULL },
-	{ STORE_PROP_MAIL_SUBJECT, "nmap.mail.subject", STORE_PROPTABLE_NONE, NULL },
+	{ STORE_PROP_MAIL_SENT, "nmap.mail.sent", STORE_PROPTABLE_MAIL, "time_sent" },
+	{ STORE_PROP_MAIL_SUBJECT, "nmap.mail.subject", STORE_PROPTABLE_MAIL, "subject" },
+	{ STORE_PROP_MAIL_SENDERS, "nmap.mail.senders", STORE_PROPTABLE_MAIL, "senders" },
 	{ STORE_PROP_CONVERSATION_COUNT, "nmap.conversation.count", STORE_PROPTABLE_NONE, NULL },
-	{ STORE_PROP_CONVERSATION_DATE, "nmap.conversation.date", STORE_PROPTABLE_NONE, NULL },
-	{ STORE_PROP_CONVERSATION_SUBJECT, "nmap.conversation.subject", STORE_PROPTABLE_NONE, NULL },
+	{ STORE_PROP_CONVERSATION_DATE, "nmap.conversation.date", STORE_PROPTABLE_CONV, "date" },
+	{ STORE_PROP_CONVERSATION_SUBJECT, "nmap.conversation.subject", STORE_PROPTABLE_CONV, "subject" },
 	{ STORE_PROP_CONVERSATION_UNREAD, "nmap.conversation.unread", STORE_PROPTABLE_NONE, NULL },
+	{ STORE_PROP_MODSEQ, "nmap.modseq", STORE_PROPTABLE_CHANGELOG, "modseq" },
 	{ 0, 0, STORE_PROPTABLE_NONE, NULL }
 };
 
@@ -128,6 +130,15 @@ StorePropertyFixup(StorePropInfo *prop)
 		case STORE_PROPTABLE_SO:
 			prop->table_name = "so";
 			break;
+		case STORE_PROPTABLE_CONV:
+			prop->table_name = "c";
+			break;
+		case STORE_PROPTABLE_MAIL:
+			prop->table_name = "m";
+			break;
+		case STORE_PROPTABLE_CHANGELOG:
+			prop->table_name = "cl";
+			break;
 		default:
 			// no other tables used at this point.
 			prop->table_name = NULL;
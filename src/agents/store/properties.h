@@ -54,6 +54,9 @@ typedef enum {
 	STORE_PROP_EVENT_UID,
 	STORE_PROP_EVENT_STAMP,
 
+	// properties on changelog table
+	STORE_PROP_MODSEQ = 300,
+
 	STORE_PROP_EXTERNAL = 4096
 } StorePropertyType;
 
@@ -64,7 +67,8 @@ typedef enum {
 	STORE_PROPTABLE_SO = 1,
 	STORE_PROPTABLE_CONV = 2,
 	STORE_PROPTABLE_MAIL = 3,
-	STORE_PROPTABLE_EVENT = 4
+	STORE_PROPTABLE_EVENT = 4,
+	STORE_PROPTABLE_CHANGELOG = 5
 } StorePropertyTable;
 
 typedef struct {
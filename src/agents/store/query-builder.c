@@ -12,6 +12,7 @@
 #include "query-builder.h"
 #include "query-parser.h"
 #include "properties.h"
+#include <ctype.h>
 
 static int QueryExpressionToSQL(QueryBuilder *builder, struct expression *exp, BongoStringBuilder *sb);
 static int QueryBuilderAddProperty(QueryBuilder *builder, const char *property, BOOL output);
@@ -123,6 +124,54 @@ QueryBuilderSetOutputMode(QueryBuilder *builder, QueryBuilder_OutputMode mode)
 	return 0;
 }
 
+/**
+ * Choose which fields of each document MODE_LIST shows, so that clients
+ * which only need a few don't have to be sent the rest.
+ * \param	builder	the querybuilder we're using
+ * \param	fields	comma separated list of guid, type, flags, imapuid,
+ *			modified, size and filename, in the order wanted
+ * \return	0 on success, -1 if the list isn't understood
+ */
+int
+QueryBuilderSetOutputFields(QueryBuilder *builder, const char *fields)
+{
+	static const struct {
+		const char *name;
+		QueryBuilder_Field field;
+	} names[] = {
+		{ "guid", FIELD_GUID },
+		{ "type", FIELD_TYPE },
+		{ "flags", FIELD_FLAGS },
+		{ "imapuid", FIELD_IMAPUID },
+		{ "modified", FIELD_MODIFIED },
+		{ "size", FIELD_SIZE },
+		{ "filename", FIELD_FILENAME },
+	};
+	const char *end;
+	size_t len;
+	unsigned int i;
+	
+	builder->field_count = 0;
+	while (*fields) {
+		end = strchr(fields, ',');
+		len = end ? (size_t)(end - fields) : strlen(fields);
+		
+		for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+			if (strlen(names[i].name) == len && !strncmp(names[i].name, fields, len)) break;
+		}
+		if (i == sizeof(names) / sizeof(names[0]) || 
+		    builder->field_count == QUERY_BUILDER_MAX_FIELDS) {
+			builder->field_count = 0;
+			return -1;
+		}
+		builder->fields[builder->field_count++] = names[i].field;
+		
+		fields += len;
+		if (*fields == ',') fields++;
+	}
+	return 0;
+}
+
 /**
  * Set the range on the query in terms of where we start and finish in 
  * the results. These refer to the individual "rows" of results, where
@@ -211,6 +260,19 @@ QueryBuilderAddProperty(QueryBuilder *builder, char const *property, BOOL output
 	
 	StorePropertyFixup(newprop);
 	
+	// conversation properties live in their own table
+	if (newprop->table == STORE_PROPTABLE_CONV) {
+		builder->linkin_conversations = TRUE;
+	}
+	// and so do the mail headers we sort and search on
+	if (newprop->table == STORE_PROPTABLE_MAIL) {
+		builder->linkin_mail = TRUE;
+	}
+	// as does the last change to each document
+	if (newprop->table == STORE_PROPTABLE_CHANGELOG) {
+		builder->linkin_changelog = TRUE;
+	}
+	
 	newprop->output = output;
 	g_ptr_array_add(builder->properties, newprop);
 	return 0;
@@ -315,6 +377,7 @@ int
 QueryBuilderCreateSQL(QueryBuilder *builder, char **output)
 {
 	BongoStringBuilder b;
+	StorePropInfo order;
 	unsigned int i;
 	int ccode;
 	
@@ -334,11 +397,39 @@ QueryBuilderCreateSQL(QueryBuilder *builder, char **output)
 		QueryBuilderPropertyToColumn(builder, &b, prop);
 	}
 	
-	BongoStringBuilderAppend(&b, " FROM storeobject so");
+	// which table the results are sorted by decides how we join them
+	memset(&order, 0, sizeof(StorePropInfo));
+	if (builder->order_prop != NULL) {
+		order.name = (char *)builder->order_prop;
+		StorePropertyFixup(&order);
+	}
 	
-	// add in the tables that we need
-	if (builder->linkin_conversations) {
-		BongoStringBuilderAppend(&b, " INNER JOIN conversation c ON so.guid=c.guid");
+	if (builder->linkin_conversations && order.table == STORE_PROPTABLE_CONV) {
+		// walk the conversation index in order and look each one up,
+		// rather than sorting every conversation for one page of them
+		BongoStringBuilderAppend(&b, " FROM conversation c CROSS JOIN storeobject so ON so.guid=c.guid");
+	} else {
+		BongoStringBuilderAppend(&b, " FROM storeobject so");
+		
+		// add in the tables that we need
+		if (builder->linkin_conversations) {
+			BongoStringBuilderAppend(&b, " INNER JOIN conversation c ON so.guid=c.guid");
+		}
+	}
+	if (builder->linkin_mail) {
+		// the headers are indexed by collection, so the join says which
+		// one. Sorting by a header lists only mail, but that way the
+		// collection's index gives us the order; otherwise, not
+		// everything in a mail folder need be mail.
+		if (order.table == STORE_PROPTABLE_MAIL) {
+			BongoStringBuilderAppend(&b, " INNER JOIN maildocument m ON so.guid=m.guid AND m.collection_guid=so.collection_guid");
+		} else {
+			BongoStringBuilderAppend(&b, " LEFT JOIN maildocument m ON so.guid=m.guid AND m.collection_guid=so.collection_guid");
+		}
+	}
+	if (builder->linkin_changelog) {
+		// documents which haven't changed since the log began have no row
+		BongoStringBuilderAppend(&b, " LEFT JOIN changelog cl ON so.collection_guid=cl.collection_guid AND so.guid=cl.guid");
 	}
 	for (i=0; i < builder->links->len; i++) {
 		ExtraLink *link = g_ptr_array_index(builder->links, i);
@@ -391,15 +482,28 @@ QueryBuilderCreateSQL(QueryBuilder *builder, char **output)
 			"ASC" : "DESC";
 		
 		BongoStringBuilderAppendF(&b, " ORDER BY ");
+		memset(&prop, 0, sizeof(StorePropInfo));
 		prop.name = (char *)builder->order_prop;
 		StorePropertyFixup(&prop);
 		
-		// FIXME: do we also need the table alias here?
-		BongoStringBuilderAppendF(&b, " %s %s", prop.column, direction);
+		if (prop.table_name != NULL) {
+			BongoStringBuilderAppendF(&b, " %s.%s %s", prop.table_name, prop.column, direction);
+		} else {
+			BongoStringBuilderAppendF(&b, " %s %s", prop.column, direction);
+		}
+		
+		// break ties the same way every time, so that pages of results
+		// neither overlap nor miss anything. Each table's own guid is
+		// the last column of its sort indexes, so this costs nothing.
+		if (prop.type != STORE_PROP_GUID) {
+			BongoStringBuilderAppendF(&b, ", %s.guid %s", 
+				prop.table_name ? prop.table_name : "so", direction);
+		}
 	}
 	
-	// set any limit on the results.
-	if (builder->limit_start > 0) {
+	// set any limit on the results; a range starting at zero still
+	// wants limiting to the size of the page.
+	if ((builder->limit_start > 0) || (builder->limit_end > 0)) {
 		BongoStringBuilderAppendF(&b, " LIMIT %d, %d", 
 			builder->limit_start, builder->limit_end);
 	}
@@ -547,6 +651,62 @@ QueryExpressionToSQL(QueryBuilder *builder, struct expression *exp, BongoStringB
 	return -2;
 }
 
+// characters the full-text index's tokenizer keeps as part of a word
+#define MATCH_WORD_CHAR(c)	(isalnum(c) || (c) >= 0x80)
+
+/**
+ * Turn the text a substring search looks for into a phrase query against
+ * the full-text index, which finds at least every document the text is
+ * in, e.g. '"rep*"' for "annual rep". The text may start part way through
+ * a word, so a word it starts with is left out; it may end part way
+ * through one, so a word it ends with becomes a prefix. What the index
+ * finds still has to be read to see if the text is really there. To look
+ * in just one column, match the phrase against that column rather than
+ * the whole table; a column filter inside the query only applies to
+ * single words, not phrases.
+ * \param	text	What to look for
+ * \param	dest	Where to put the phrase
+ * \param	size	Size of dest
+ * \return	TRUE if the text had any words the index can look up, and 
+ *		they fitted; otherwise all the mail has to be read
+ */
+BOOL
+QueryBuilderMatchPhrase(const char *text, char *dest, size_t size)
+{
+	const unsigned char *ptr = (const unsigned char *)text;
+	size_t used;
+	BOOL words = FALSE;
+	
+	if (size < 4) return FALSE;
+	dest[0] = '"';
+	used = 1;
+	
+	while (MATCH_WORD_CHAR(*ptr)) ptr++;
+	
+	for (; *ptr; ptr++) {
+		if (used + 3 >= size) return FALSE;
+		
+		if (MATCH_WORD_CHAR(*ptr)) {
+			dest[used++] = *ptr;
+			words = TRUE;
+		} else if (dest[used - 1] != ' ' && dest[used - 1] != '"') {
+			dest[used++] = ' ';
+		}
+	}
+	
+	if (!words) return FALSE;
+	
+	if (dest[used - 1] == ' ') {
+		used--;
+	} else {
+		dest[used++] = '*';
+	}
+	dest[used++] = '"';
+	dest[used] = '\0';
+	
+	return TRUE;
+}
+
 #if 0
 int
 QueryBuilderTest(void)
@@ -22,6 +22,18 @@ typedef enum {
 	MODE_PROPGET
 } QueryBuilder_OutputMode;
 
+typedef enum {
+	FIELD_GUID,
+	FIELD_TYPE,
+	FIELD_FLAGS,
+	FIELD_IMAPUID,
+	FIELD_MODIFIED,
+	FIELD_SIZE,
+	FIELD_FILENAME
+} QueryBuilder_Field;
+
+#define QUERY_BUILDER_MAX_FIELDS 7
+
 typedef struct {
 	int position;
 	QueryBuilder_ParamType type;
@@ -40,6 +52,8 @@ typedef struct {
 
 typedef struct {
 	BOOL linkin_conversations;	// whether or not we want to access conv. data
+	BOOL linkin_mail;		// whether or not we want to access mail headers
+	BOOL linkin_changelog;		// whether or not we want modification sequences
 	
 	// properties we reference in the queries
 	GPtrArray *properties;		// what their names are
@@ -66,6 +80,10 @@ typedef struct {
 
 	// which information we'd want to show afterwards
 	QueryBuilder_OutputMode output_mode;
+	
+	// which document fields MODE_LIST shows, in order; none means all
+	QueryBuilder_Field fields[QUERY_BUILDER_MAX_FIELDS];
+	int field_count;
 } QueryBuilder;
 
 int	QueryBuilderStart(QueryBuilder *builder);
@@ -75,6 +93,7 @@ int	QueryBuilderSetQueryUnsafe(QueryBuilder *builder, char const *query);
 int	QueryBuilderSetResultRange(QueryBuilder *builder, int start, int end);
 int	QueryBuilderSetResultOrder(QueryBuilder *builder, char const *prop, BOOL asc);
 int	QueryBuilderSetOutputMode(QueryBuilder *builder, QueryBuilder_OutputMode mode);
+int	QueryBuilderSetOutputFields(QueryBuilder *builder, const char *fields);
 
 int	QueryBuilderAddParam(QueryBuilder *builder, int position,
 		QueryBuilder_ParamType type, int d1, uint64_t d2, char *d3);
@@ -85,4 +104,6 @@ void	QueryBuilderFinish(QueryBuilder *builder);
 
 int	QueryBuilderCreateSQL(QueryBuilder *builder, char **output);
 
+BOOL	QueryBuilderMatchPhrase(const char *text, char *dest, size_t size);
+
 #endif
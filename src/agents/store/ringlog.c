@@ -13,8 +13,8 @@ typedef struct {
 #define RINGLOG_SIZE 200
 
 static RingLogItem ringlog[RINGLOG_SIZE];
-// ringlog_pos points to the next "free" ringlog entry.
-static int ringlog_pos = 0;
+// every entry ever written is numbered; entry n goes in slot n % RINGLOG_SIZE
+static XplAtomic64 ringlog_next;
 // thread map used to translate from pthread_t to simple int
 static pthread_t ringlog_threadmap[100];
 static XplMutex ringlog_lock;
@@ -22,12 +22,13 @@ static XplMutex ringlog_lock;
 void
 RinglogInit()
 {
-	// initialise lock; this must be held to access the ringlog.
+	// initialise lock; this must be held to add threads or dump the ringlog.
 	XplMutexInit(ringlog_lock);
 	
 	// clear the ringlog and thread mapping
 	memset(ringlog, 0, sizeof(ringlog));
 	memset(ringlog_threadmap, 0, sizeof(ringlog_threadmap));
+	XplSafeWrite(ringlog_next, 0);
 }
 
 int
@@ -36,6 +37,14 @@ RinglogThreadID()
 	pthread_t self = pthread_self();
 	int thread_id = 99;
 	
+	// threads are only ever added, so we can look ourselves up unlocked
+	for (int i = 0; i < 100 && ringlog_threadmap[i]; i++) {
+		if (ringlog_threadmap[i] == self) {
+			return i;
+		}
+	}
+
+	XplMutexLock(ringlog_lock);
 	for (int i = 0; i < 100; i++) {
 		if (ringlog_threadmap[i]) {
 			if (ringlog_threadmap[i] == self) {
@@ -48,6 +57,7 @@ RinglogThreadID()
 			break;
 		}
 	}
+	XplMutexUnlock(ringlog_lock);
 	
 	return thread_id;
 }
@@ -55,24 +65,24 @@ RinglogThreadID()
 void
 Ringlog(char *message)
 {
-	XplMutexLock(ringlog_lock);
-	
-	// find the next ring log entry and write into it
-	ringlog[ringlog_pos].timestamp = time(NULL);
-	ringlog[ringlog_pos].thread_id = RinglogThreadID();
-	strncpy(ringlog[ringlog_pos].message, message, 255);
-	
-	// advance the ring pointer, and wrap around if necessary
-	ringlog_pos++;
-	if (ringlog_pos == RINGLOG_SIZE) ringlog_pos = 0;
-	
-	XplMutexUnlock(ringlog_lock);
+	RingLogItem *entry;
+
+	// this happens twice for every store command, so claim an entry
+	// without locking; an entry only gets overwritten once the ring
+	// has gone all the way round
+	entry = &ringlog[XplSafeFetchAdd64(ringlog_next, 1) % RINGLOG_SIZE];
+	entry->timestamp = time(NULL);
+	entry->thread_id = RinglogThreadID();
+	strncpy(entry->message, message, 255);
 }
 
 void
 RinglogDumpFilehandle(int fh)
 {
+	int ringlog_pos;
+
 	XplMutexLock(ringlog_lock);
+	ringlog_pos = XplSafeRead(ringlog_next) % RINGLOG_SIZE;
 	
 	for (int i = ringlog_pos; i < ringlog_pos + RINGLOG_SIZE; i++) {
 		// print the next ring log entry - wraps by cunning use of modulo
@@ -29,6 +29,39 @@
 #include "mime.h"
 #include <string.h>
 
+/* The full-text index is an FTS table in each store's database, with one
+ * row per mail document; the row's docid is the document's guid. Mail is
+ * indexed as it's delivered, so SEARCH on a collection only has to read
+ * the documents which were there before the index was (until REINDEX
+ * catches them up).
+ *
+ * SEARCH matches substrings, which the index can't answer by itself as
+ * it only knows whole words. It is asked for the mail which has the words
+ * of the query in order, which includes all the mail the query is in,
+ * and only that mail is read. So that nothing is missed, the index holds
+ * exactly the text SEARCH looks in: the headers, and the text parts.
+ */
+
+#define SEARCH_SCAN_ALLOC_STEPS 256
+
+/* the headers which get their own column in the index */
+static struct {
+    char *header;
+    char *column;
+} IndexHeaders[] = {
+    { "Subject", "subject" },
+    { "From", "sender" },
+    { "To", "recipient" },
+    { "Cc", "copied" },
+    { NULL, NULL }
+};
+
+#define INDEX_HEADER_COUNT 4
+
+/* the parts of a message whose text is searched, and indexed */
+#define SEARCH_TEXT_PART(l) \
+    (2002 == (l)->code && (l)->len > 0 && 0 == XplStrCaseCmp((l)->type, "text"))
+
 long ReadSourceFile(void *source, char *buffer, unsigned long maxRead);
 
 
@@ -41,10 +74,20 @@ ReadSourceFile(void *source, char *buffer, unsigned long maxRead)
 __inline static CCode
 ReportHit(Connection *conn, StoreObject *document)
 {
-	// FIXME: imap uids
     return ConnWriteF(conn, 
                        "2001 " GUID_FMT " %08x\r\n", 
-                       document->guid, (uint32_t) document->guid);
+                       document->guid, document->imap_uid);
+}
+
+static BOOL
+SearchHeaders(FILE *f, MimeResponseLine *message, char *header, char *substring)
+{
+    if (XplFSeek64(f, message->headerStart, SEEK_SET)) {
+        return(FALSE);
+    }
+
+    return(BongoStreamSearchRfc822Header(ReadSourceFile, (void *)f, message->headerLen, 
+                                         header, substring));
 }
 
 static CCode
@@ -52,130 +95,502 @@ SearchDocument(StoreClient *client, StoreObject *document,
                StoreSearchInfo *query, FILE *f)
 {
     CCode ccode = 0;
+    MimeReport *report = NULL;
+    BOOL found = FALSE;
+    unsigned i;
+
+    switch (MimeGetInfo(client, document, &report)) {
+    case 1:
+        break;
+    case -1:
+        return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+    case -2:
+        return ConnWriteStr(client->conn, MSG4120DBLOCKED);
+    case -3:
+        return ConnWriteF(client->conn, MSG4220NOGUID);
+    case -4:
+        return ConnWriteStr(client->conn, MSG4224CANTREAD);
+    case -5:
+    case 0:
+    default:
+        return ConnWriteStr(client->conn, MSG5004INTERNALERR);
+    }
+
+    MimeReportFixup(report);
 
     switch (query->type) {
 
     case STORE_SEARCH_TEXT: /* TEXT checks both HEADERS and BODY */
     case STORE_SEARCH_HEADERS:
-    {
-        if (XplFSeek64(f, 0, SEEK_SET)) {
-            ccode = ConnWriteStr(client->conn, MSG4224CANTREAD);
+        found = SearchHeaders(f, &report->line[0], NULL, query->query);
+        if (found || query->type == STORE_SEARCH_HEADERS) {
             break;
         }
-        /* FIXME 
-        if (BongoStreamSearchRfc822Header(ReadSourceFile, (void *)f, info->data.mail.headerSize, 
-                                 NULL, query->query))
-        {
-            ccode = ReportHit(client->conn, info);
-            break;
+        /* nothing found in headers; fall through to STORE_SEARCH_BODY */
+
+    case STORE_SEARCH_BODY:
+        for (i = 0; i < report->lineCount && !found; i++) {
+            MimeResponseLine *line = &report->line[i];
+
+            if (!SEARCH_TEXT_PART(line)) {
+                continue;
+            }
+
+            if (XplFSeek64(f, line->start, SEEK_SET)) {
+                ccode = ConnWriteStr(client->conn, MSG4224CANTREAD);
+                break;
+            }
+            found = BongoStreamSearchMimePart(ReadSourceFile, (void *)f, line->len, 
+                                              line->charset, line->encoding, line->subtype,
+                                              query->query);
+        }
+        break;
+
+    case STORE_SEARCH_HEADER:
+        found = SearchHeaders(f, &report->line[0], query->header, query->query);
+        break;
+
+    case STORE_SEARCH_QUERY:
+        /* only collections are queried */
+        break;
+    }
+
+    MimeReportFree(report);
+
+    if (found) {
+        ccode = ReportHit(client->conn, document);
+    }
+
+    return(ccode);
+}
+
+/** \internal
+ * Get the decoded value of a header from the top of a message.
+ * \return	The value, which the caller must free, or NULL
+ */
+static char *
+IndexGrabHeader(FILE *f, MimeResponseLine *message, char *header)
+{
+    if (XplFSeek64(f, message->headerStart, SEEK_SET)) {
+        return(NULL);
+    }
+
+    return(BongoStreamGrabRfc822HeaderText(ReadSourceFile, (void *)f, message->headerLen, header));
+}
+
+/**
+ * Add a mail document to the store's full-text index, replacing whatever
+ * was indexed for it before. The headers, and the decoded text of every
+ * text part (attachments included), go into the index. Without FTS4 in
+ * SQLite there is no index, and this does nothing.
+ * \param	client		Store client we're operating for
+ * \param	document	The document to index
+ * \param	path		Where to find the document content; NULL 
+ *				for its usual location.
+ * \return			0 on success, -4 io err, -5 internal err, -1 db err
+ */
+int
+SearchIndexDocument(StoreClient *client, StoreObject *document, const char *path)
+{
+    char realpath[XPL_MAX_PATH + 1];
+    char *headers[INDEX_HEADER_COUNT + 1];
+    BongoStringBuilder body;
+    MimeReport *report = NULL;
+    MsgSQLStatement stmt;
+    FILE *f = NULL;
+    unsigned long i;
+    int result;
+
+#ifndef HAVE_SQLITE_FTS4
+    return 0;
+#endif
+
+    if (document->type != STORE_DOCTYPE_MAIL || client->readonly) {
+        return 0;
+    }
+
+    if (path == NULL) {
+        FindPathToDocument(client, document->collection_guid, document->guid, 
+                           realpath, sizeof(realpath));
+        path = realpath;
+    }
+
+    result = MimeGetInfo(client, document, &report);
+    if (result != 1) {
+        return (result == 0) ? -5 : result;
+    }
+    MimeReportFixup(report);
+
+    f = fopen(path, "rb");
+    if (!f) {
+        MimeReportFree(report);
+        return -4;
+    }
+
+    if (BongoStringBuilderInit(&body)) {
+        MimeReportFree(report);
+        fclose(f);
+        return -5;
+    }
+
+    // the last column gets every header, for HEADERS searches
+    for (i = 0; i <= INDEX_HEADER_COUNT; i++) {
+        headers[i] = IndexGrabHeader(f, &report->line[0], IndexHeaders[i].header);
+    }
+
+    for (i = 0; i < report->lineCount; i++) {
+        MimeResponseLine *line = &report->line[i];
+        char *text;
+
+        if (!SEARCH_TEXT_PART(line)) {
+            continue;
         }
-        */
-        if (query->type == STORE_SEARCH_HEADERS) {
+
+        if (XplFSeek64(f, line->start, SEEK_SET)) {
             break;
         }
-        /* nothing found in headers; fall through to STORE_SEARCH_BODY */
+        text = BongoStreamGrabMimePart(ReadSourceFile, (void *)f, line->len, 
+                                       line->charset, line->encoding, line->subtype);
+        if (text) {
+            BongoStringBuilderAppend(&body, text);
+            BongoStringBuilderAppendChar(&body, '\n');
+            MemFree(text);
+        }
     }
 
-    case STORE_SEARCH_BODY: {
-        MimeReport *report = NULL;
-        unsigned i;
+    fclose(f);
+    MimeReportFree(report);
 
-        switch (MimeGetInfo(client, document, &report)) {
-        case 1:
+    result = -1;
+    memset(&stmt, 0, sizeof(MsgSQLStatement));
 
-            MimeReportFixup(report);
+    if (MsgSQLBeginTransaction(client->storedb)) {
+        goto finish;
+    }
 
-            for (i = 0; i < report->lineCount && -1 != ccode; i++) {
-                MimeResponseLine *line = &report->line[i];
+    if (MsgSQLPrepareCached(client->storedb, "DELETE FROM fulltext WHERE docid=?1;", &stmt) == NULL) {
+        goto abort;
+    }
+    MsgSQLBindInt64(&stmt, 1, document->guid);
+    if (MsgSQLExecute(client->storedb, &stmt)) {
+        goto abort;
+    }
+    MsgSQLFinalize(&stmt);
 
-                if (2002 != line->code) {
-                    continue;
-                }
+    if (MsgSQLPrepareCached(client->storedb, 
+            "INSERT INTO fulltext (docid, subject, sender, recipient, copied, headers, body) "
+            "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7);", &stmt) == NULL) {
+        goto abort;
+    }
+    MsgSQLBindInt64(&stmt, 1, document->guid);
+    for (i = 0; i <= INDEX_HEADER_COUNT; i++) {
+        MsgSQLBindString(&stmt, i + 2, headers[i], TRUE);
+    }
+    MsgSQLBindString(&stmt, INDEX_HEADER_COUNT + 3, body.value, TRUE);
+    if (MsgSQLExecute(client->storedb, &stmt)) {
+        goto abort;
+    }
+    MsgSQLFinalize(&stmt);
 
-                if (XplFSeek64(f, line->start, SEEK_SET)) {
-                    ccode = ConnWriteStr(client->conn, MSG4224CANTREAD);
-                    break;
-                }
-                if (BongoStreamSearchMimePart(ReadSourceFile, (void *)f, line->len, 
-                                             line->charset, line->encoding, line->subtype,
-                                             query->query))
-                {
-                    ccode = ReportHit(client->conn, document);
-                    break;
-                }
-            }
-   
-            MimeReportFree(report);
+    if (MsgSQLCommitTransaction(client->storedb)) {
+        goto abort;
+    }
 
-            break;
-        case -1:
-            ccode = ConnWriteStr(client->conn, MSG5005DBLIBERR);
-            break;
-        case -2:
-            ccode = ConnWriteStr(client->conn, MSG4120DBLOCKED);
-            break;
-        case -3:
-            ccode = ConnWriteF(client->conn, MSG4220NOGUID);
-            break;
-        case -4:
-            ccode = ConnWriteStr(client->conn, MSG4224CANTREAD);
-            break;
-        case -5:
-        case 0:
-        default:
-            ccode = ConnWriteStr(client->conn, MSG5004INTERNALERR);
-            break;
+    result = 0;
+    goto finish;
+
+abort:
+    MsgSQLFinalize(&stmt);
+    MsgSQLAbortTransaction(client->storedb);
+
+finish:
+    for (i = 0; i <= INDEX_HEADER_COUNT; i++) {
+        if (headers[i]) {
+            MemFree(headers[i]);
         }
-        break;
     }
+    BongoStringBuilderDestroy(&body);
 
-    case STORE_SEARCH_HEADER: {
-        /* 'subject' and 'from' fields are special cases because they are already in utf-8 in the info structure */
-        /* FIXME
-        if (info->data.mail.subject && XplStrCaseCmp(query->header, "subject") == 0) {
-            if (BongoStrCaseStr(info->data.mail.subject, query->query)) {
-                ccode = ReportHit(client->conn, info);
+    return result;
+}
+
+/** \internal
+ * Turn a SEARCH query into a phrase query against the full-text index,
+ * e.g. '"rep*"' for "annual rep", and find the column of the index it's
+ * about; "fulltext", the table itself, means any of them.
+ * \return	TRUE if the index can narrow down the mail to read
+ */
+static BOOL
+SearchMatchExpression(StoreSearchInfo *query, const char **column, char *dest, size_t size)
+{
+    int i;
+
+    *column = NULL;
+#ifndef HAVE_SQLITE_FTS4
+    // no index, so all the mail has to be read
+    return(FALSE);
+#endif
+    switch (query->type) {
+    case STORE_SEARCH_TEXT:
+        *column = "fulltext";
+        break;
+    case STORE_SEARCH_BODY:
+        *column = "body";
+        break;
+    case STORE_SEARCH_HEADERS:
+        *column = "headers";
+        break;
+    case STORE_SEARCH_HEADER:
+        for (i = 0; IndexHeaders[i].header; i++) {
+            if (0 == XplStrCaseCmp(query->header, IndexHeaders[i].header)) {
+                *column = IndexHeaders[i].column;
+                break;
             }
-            break;
         }
+        if (!*column) {
+            // not a header we index separately
+            return(FALSE);
+        }
+        break;
+    case STORE_SEARCH_QUERY:
+        return(FALSE);
+    }
+
+    return(QueryBuilderMatchPhrase(query->query, dest, size));
+}
+
+/** \internal
+ * List the mail documents in a collection which a query might be in, or
+ * all of them. Those the full-text index hasn't seen might be, as might
+ * those it finds for the query's phrase. The whole list is read up front,
+ * as going through the documents uses the database too.
+ * \param	column	The index column to match against, or NULL for all
+ *			the mail
+ * \param	match	The phrase to match
+ * \param	guids	Set to the list, which the caller must free
+ * \param	used	Set to the number of documents in the list
+ * \return	0 on success, -1 on a db or memory error
+ */
+static int
+SearchCollectionMail(StoreClient *client, StoreObject *collection, 
+                     const char *column, const char *match,
+                     uint64_t **guids, size_t *used)
+{
+    MsgSQLStatement stmt;
+    char sql[512];
+    size_t allocated = 0;
+    int status;
+
+    *guids = NULL;
+    *used = 0;
+    memset(&stmt, 0, sizeof(MsgSQLStatement));
 
-        if (XplStrCaseCmp(query->header, "from") == 0) {
-            
-            if (info->data.mail.from && BongoStrCaseStr(info->data.mail.from, query->query)) {
-                ccode = ReportHit(client->conn, info);
+    if (column) {
+        snprintf(sql, sizeof(sql),
+            "SELECT so.guid FROM storeobject so WHERE so.collection_guid = ?1 AND so.type = ?2 "
+            "AND (so.guid IN (SELECT docid FROM fulltext WHERE %s MATCH ?3) "
+            "OR NOT EXISTS (SELECT docid FROM fulltext WHERE docid = so.guid)) ORDER BY so.guid;", 
+            column);
+    } else {
+        snprintf(sql, sizeof(sql),
+            "SELECT so.guid FROM storeobject so WHERE so.collection_guid = ?1 AND so.type = ?2 "
+            "ORDER BY so.guid;");
+    }
+    if (MsgSQLPrepareCached(client->storedb, sql, &stmt) == NULL) {
+        return -1;
+    }
+
+    MsgSQLBindInt64(&stmt, 1, collection->guid);
+    MsgSQLBindInt(&stmt, 2, STORE_DOCTYPE_MAIL);
+    if (column) {
+        MsgSQLBindString(&stmt, 3, match, FALSE);
+    }
+
+    while ((status = MsgSQLResults(client->storedb, &stmt)) > 0) {
+        if (*used == allocated) {
+            uint64_t *more = MemRealloc(*guids, (allocated + SEARCH_SCAN_ALLOC_STEPS) * sizeof(uint64_t));
+            if (!more) {
+                status = -1;
+                break;
             }
-            break;
+            *guids = more;
+            allocated += SEARCH_SCAN_ALLOC_STEPS;
         }
+        (*guids)[(*used)++] = MsgSQLResultInt64(&stmt, 0);
+    }
+    MsgSQLFinalize(&stmt);
 
-        if (XplFSeek64(f, 0, SEEK_SET)) {
-            ccode = ConnWriteStr(client->conn, MSG4224CANTREAD);
-            break;
+    return (status < 0) ? -1 : 0;
+}
+
+/** \internal
+ * Search the mail in a collection by reading it. Given a phrase for the
+ * full-text index, only the mail which might match is read.
+ */
+static CCode
+SearchCollectionScan(StoreClient *client, StoreObject *collection, 
+                     StoreSearchInfo *query, const char *column, const char *match)
+{
+    StoreObject document;
+    char path[XPL_MAX_PATH + 1];
+    uint64_t *guids = NULL;
+    size_t used = 0, i;
+    CCode ccode = 0;
+    FILE *f;
+
+    if (SearchCollectionMail(client, collection, column, match, &guids, &used)) {
+        ccode = ConnWriteStr(client->conn, MSG5005DBLIBERR);
+        goto finish;
+    }
+    for (i = 0; i < used && -1 != ccode; i++) {
+        if (StoreObjectFind(client, guids[i], &document)) {
+            // gone since we looked
+            continue;
         }
-        if (BongoStreamSearchRfc822Header(ReadSourceFile, (void *)f, info->data.mail.headerSize, 
-                                 query->header, query->query))
-        {
-            ccode = ReportHit(client->conn, info);
+
+        FindPathToDocument(client, document.collection_guid, document.guid, path, sizeof(path));
+        f = fopen(path, "rb");
+        if (!f) {
+            ccode = ConnWriteStr(client->conn, MSG4224CANTREAD);
+            goto finish;
         }
-		*/
-        break;
+        ccode = SearchDocument(client, &document, query, f);
+        fclose(f);
     }
 
+finish:
+    if (guids) {
+        MemFree(guids);
     }
+    return ccode;
+}
 
-    return(ccode);
+/** \internal
+ * Add a range of uids to a line of them, writing the line out first if
+ * there mightn't be room for it.
+ */
+static CCode
+SearchAddUidRange(StoreClient *client, char *line, size_t *used, uint32_t first, uint32_t last)
+{
+    CCode ccode = 0;
+
+    if (*used > CONN_BUFSIZE - 64) {
+        ccode = ConnWriteF(client->conn, "2001 %s\r\n", line);
+        *used = 0;
+    }
+
+    if (first == last) {
+        *used += snprintf(line + *used, CONN_BUFSIZE - *used, "%s%u", *used ? "," : "", first);
+    } else {
+        *used += snprintf(line + *used, CONN_BUFSIZE - *used, "%s%u:%u", *used ? "," : "", first, last);
+    }
+    return ccode;
 }
 
+/** \internal
+ * Write out the uids of the matching documents as sets, e.g. 
+ * "2001 3:7,9,12:14", a line at a time, followed by how many there were.
+ * The uid is the third column of every query the builder makes.
+ */
+static CCode
+SearchWriteUids(StoreClient *client, MsgSQLStatement *stmt)
+{
+    char line[CONN_BUFSIZE];
+    size_t used = 0;
+    uint32_t first = 0, last = 0, uid;
+    unsigned long total = 0;
+    CCode ccode = 0;
+    int status = 0;
+
+    while (-1 != ccode && (status = MsgSQLResults(client->storedb, stmt)) > 0) {
+        uid = (uint32_t)MsgSQLResultInt(stmt, 2);
+        if (total++ > 0) {
+            if (uid == last + 1) {
+                last = uid;
+                continue;
+            }
+            ccode = SearchAddUidRange(client, line, &used, first, last);
+        }
+        first = last = uid;
+    }
+    if (-1 == ccode) {
+        return ccode;
+    }
+    if (status < 0) {
+        return ConnWriteStr(client->conn, MSG5005DBLIBERR);
+    }
+
+    if (total > 0) {
+        ccode = SearchAddUidRange(client, line, &used, first, last);
+    }
+    if (-1 != ccode && used > 0) {
+        ccode = ConnWriteF(client->conn, "2001 %s\r\n", line);
+    }
+    if (-1 != ccode) {
+        ccode = ConnWriteF(client->conn, "1000 %lu\r\n", total);
+    }
+    return ccode;
+}
+
+/** \internal
+ * Answer a query in the store's query language about the mail in a 
+ * collection, with the uids of the documents which match.
+ */
+static CCode
+SearchCollectionQuery(StoreClient *client, StoreObject *collection, const char *query)
+{
+    QueryBuilder builder;
+    MsgSQLStatement stmt;
+    char *sql = NULL;
+    CCode ccode;
+
+    memset(&stmt, 0, sizeof(MsgSQLStatement));
+
+    QueryBuilderStart(&builder);
+    QueryBuilderSetQuerySafe(&builder, "& = nmap.collection ?1 = nmap.type ?2");
+    QueryBuilderSetQueryUnsafe(&builder, query);
+    QueryBuilderAddParam(&builder, 1, TYPE_INT64, 0, collection->guid, NULL);
+    QueryBuilderAddParam(&builder, 2, TYPE_INT, STORE_DOCTYPE_MAIL, 0, NULL);
+    QueryBuilderSetResultOrder(&builder, "nmap.mail.imapuid", TRUE);
+
+    if (QueryBuilderRun(&builder)) {
+        QueryBuilderFinish(&builder);
+        return ConnWriteStr(client->conn, MSG3010BADBQL);
+    }
+
+    if (! LogicalLockGain(client, collection, LLOCK_READONLY, "StoreCommandSEARCH")) {
+        QueryBuilderFinish(&builder);
+        return ConnWriteStr(client->conn, MSG4120BOXLOCKED);
+    }
+
+    if (QueryBuilderCreateSQL(&builder, &sql)) {
+        ccode = ConnWriteStr(client->conn, MSG5009SQLBUILDER);
+    } else if (MsgSQLPrepare(client->storedb, sql, &stmt) == NULL ||
+               StoreObjectBindQueryParams(&builder, &stmt)) {
+        ccode = ConnWriteStr(client->conn, MSG5005DBLIBERR);
+    } else {
+        ccode = SearchWriteUids(client, &stmt);
+    }
 
+    MsgSQLFinalize(&stmt);
+    LogicalLockRelease(client, collection, LLOCK_READONLY, "StoreCommandSEARCH");
+
+    if (sql) {
+        MemFree(sql);
+    }
+    QueryBuilderFinish(&builder);
+    return ccode;
+}
 
 CCode
 StoreCommandSEARCH(StoreClient *client, uint64_t guid, StoreSearchInfo *query)
 {
     CCode ccode = 0;
     StoreObject document;
-//    DStoreStmt *stmt = NULL;
-//    DStoreDocInfo info;
-//    DStoreDocInfo child;
     char path[XPL_MAX_PATH + 1];
+    char match[CONN_BUFSIZE];
+    const char *column;
+    BOOL indexed;
     FILE *f = NULL;
     
     // find the document to search, check our permission on it.
@@ -189,6 +604,13 @@ StoreCommandSEARCH(StoreClient *client, uint64_t guid, StoreSearchInfo *query)
     ccode = StoreObjectCheckAuthorization(client, &document, STORE_PRIV_READ);
     if (ccode) return ccode;
 
+    if (query->type == STORE_SEARCH_QUERY) {
+        if (! STORE_IS_FOLDER(document.type)) {
+            return ConnWriteStr(client->conn, MSG3015BADDOCTYPE);
+        }
+        return SearchCollectionQuery(client, &document, query->query);
+    }
+
     if (! STORE_IS_FOLDER(document.type)) {
     	// we're searching a document
         FindPathToDocument(client, document.collection_guid, document.guid, path, sizeof(path));
@@ -206,40 +628,20 @@ StoreCommandSEARCH(StoreClient *client, uint64_t guid, StoreSearchInfo *query)
         return ccode;
     }
     
-    // we're searching a collection - so search each document in it
-	/* FIXME
-    stmt = DStoreListColl(client->handle, guid, -1, -1);
-    if (!stmt) {
-        return ConnWriteStr(client->conn, MSG5005DBLIBERR);
-        goto finish;
+    // we're searching a collection: ask the index what might match, then
+    // read that. Nothing may come or go in between.
+    if (! LogicalLockGain(client, &document, LLOCK_READONLY, "StoreCommandSEARCH")) {
+        return ConnWriteStr(client->conn, MSG4120BOXLOCKED);
     }
-    
-    while (-1 != ccode) {
-        switch (DStoreInfoStmtStep(client->handle, stmt, &child)) {
-        case 0:
-            ccode = ConnWriteStr(client->conn, MSG1000OK);
-            goto finish;
-        case -1:
-            ccode = ConnWriteStr(client->conn, MSG5005DBLIBERR);
-            goto finish;
-        case 1:
-            if (!STORE_IS_FOLDER(child.type)) {
-                FindPathToDocument(client, child.collection, child.guid, path, sizeof(path));
-                f = fopen(path, "rb");
-                if (!f) {
-                    ccode = ConnWriteStr(client->conn, MSG4224CANTREAD);
-                    goto finish;
-                }
-                ccode = SearchDocument(client, &child, query, f);
-                fclose(f);
-            }
-            break;
-        }
+
+    indexed = SearchMatchExpression(query, &column, match, sizeof(match));
+    ccode = SearchCollectionScan(client, &document, query, indexed ? column : NULL, match);
+
+    LogicalLockRelease(client, &document, LLOCK_READONLY, "StoreCommandSEARCH");
+
+    if (-1 != ccode) {
+        ccode = ConnWriteStr(client->conn, MSG1000OK);
     }
-    */
-    ccode = ConnWriteStr(client->conn, MSG1000OK);
-    
-//finish:
     
     return ccode;
 }
@@ -0,0 +1,8 @@
+.section ".note.GNU-stack","",%progbits
+.section ".rodata"
+.globl sql_create_fulltext
+.type sql_create_fulltext,@object
+sql_create_fulltext:
+.incbin "@CMAKE_CURRENT_SOURCE_DIR@/src/agents/store/sql/create-fulltext.sql"
+.byte 0
+.size sql_create_fulltext, .-sql_create_fulltext
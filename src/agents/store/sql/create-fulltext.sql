@@ -0,0 +1,8 @@
+CREATE VIRTUAL TABLE IF NOT EXISTS fulltext USING fts4(
+	subject,
+	sender,
+	recipient,
+	copied,
+	headers,
+	body
+);
@@ -0,0 +1,8 @@
+CREATE TABLE mimereport (
+	guid			INTEGER PRIMARY KEY,
+	version			INTEGER DEFAULT 0,
+	size			INTEGER DEFAULT 0,
+	report			BLOB NOT NULL
+);
+
+PRAGMA user_version = 1;
@@ -0,0 +1,8 @@
+.section ".note.GNU-stack","",%progbits
+.section ".rodata"
+.globl sql_create_store_3
+.type sql_create_store_3,@object
+sql_create_store_3:
+.incbin "@CMAKE_CURRENT_SOURCE_DIR@/src/agents/store/sql/create-store-3.sql"
+.byte 0
+.size sql_create_store_3, .-sql_create_store_3
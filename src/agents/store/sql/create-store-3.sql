@@ -0,0 +1,17 @@
+ALTER TABLE eventdocument ADD COLUMN horizon INTEGER DEFAULT 0;
+
+CREATE INDEX eventdocument_uid ON eventdocument (uid);
+CREATE INDEX eventdocument_horizon ON eventdocument (horizon);
+
+CREATE TABLE eventoccurrence (
+	guid			INTEGER NOT NULL,
+	start			INTEGER NOT NULL,
+	end			INTEGER NOT NULL,
+	span			INTEGER NOT NULL
+);
+
+CREATE INDEX eventoccurrence_guid ON eventoccurrence (guid);
+CREATE INDEX eventoccurrence_start ON eventoccurrence (start);
+CREATE INDEX eventoccurrence_span ON eventoccurrence (span);
+
+PRAGMA user_version = 3;
@@ -0,0 +1,8 @@
+.section ".note.GNU-stack","",%progbits
+.section ".rodata"
+.globl sql_create_store_4
+.type sql_create_store_4,@object
+sql_create_store_4:
+.incbin "@CMAKE_CURRENT_SOURCE_DIR@/src/agents/store/sql/create-store-4.sql"
+.byte 0
+.size sql_create_store_4, .-sql_create_store_4
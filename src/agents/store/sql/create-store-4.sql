@@ -0,0 +1,15 @@
+CREATE TABLE threadindex (
+	messageid		TEXT NOT NULL UNIQUE,
+	conversation_guid	INTEGER NOT NULL,
+	guid			INTEGER DEFAULT 0,
+	parent			TEXT DEFAULT NULL
+);
+
+CREATE INDEX threadindex_conversation_guid ON threadindex (conversation_guid);
+CREATE INDEX threadindex_guid ON threadindex (guid);
+
+ALTER TABLE conversation ADD COLUMN subject_hash INTEGER DEFAULT 0;
+
+CREATE INDEX conversation_subject_hash ON conversation (subject_hash, date);
+
+PRAGMA user_version = 4;
@@ -0,0 +1,18 @@
+CREATE TABLE modseq (
+	collection_guid		INTEGER PRIMARY KEY,
+	modseq			INTEGER NOT NULL DEFAULT 0,
+	floor			INTEGER NOT NULL DEFAULT 0
+);
+
+CREATE TABLE changelog (
+	collection_guid		INTEGER NOT NULL,
+	guid			INTEGER NOT NULL,
+	modseq			INTEGER NOT NULL,
+	kind			INTEGER NOT NULL,
+	time			INTEGER NOT NULL
+);
+
+CREATE UNIQUE INDEX changelog_guid ON changelog (collection_guid, guid);
+CREATE INDEX changelog_modseq ON changelog (collection_guid, modseq);
+
+PRAGMA user_version = 5;
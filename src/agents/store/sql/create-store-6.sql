@@ -0,0 +1,14 @@
+CREATE INDEX storeobject_collection_uid ON storeobject (collection_guid, imap_uid);
+CREATE INDEX storeobject_collection_created ON storeobject (collection_guid, time_created);
+CREATE INDEX storeobject_collection_size ON storeobject (collection_guid, size);
+
+DROP INDEX maildocument_guid;
+CREATE UNIQUE INDEX maildocument_guid ON maildocument (guid);
+CREATE INDEX maildocument_subject ON maildocument (subject, guid);
+CREATE INDEX maildocument_senders ON maildocument (senders, guid);
+CREATE INDEX maildocument_time_sent ON maildocument (time_sent, guid);
+
+DROP INDEX conversation_date;
+CREATE INDEX conversation_date ON conversation (date, guid);
+
+PRAGMA user_version = 6;
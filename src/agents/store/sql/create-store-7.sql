@@ -0,0 +1,9 @@
+CREATE TABLE collectioncounts (
+	collection_guid		INTEGER PRIMARY KEY,
+	messages		INTEGER DEFAULT 0,
+	unseen			INTEGER DEFAULT 0,
+	deleted			INTEGER DEFAULT 0,
+	bytes			INTEGER DEFAULT 0
+);
+
+PRAGMA user_version = 7;
@@ -0,0 +1,11 @@
+ALTER TABLE maildocument ADD COLUMN collection_guid INTEGER DEFAULT 0;
+UPDATE maildocument SET collection_guid = IFNULL((SELECT so.collection_guid FROM storeobject so WHERE so.guid = maildocument.guid), 0);
+
+DROP INDEX maildocument_subject;
+DROP INDEX maildocument_senders;
+DROP INDEX maildocument_time_sent;
+CREATE INDEX maildocument_collection_subject ON maildocument (collection_guid, subject, guid);
+CREATE INDEX maildocument_collection_senders ON maildocument (collection_guid, senders, guid);
+CREATE INDEX maildocument_collection_sent ON maildocument (collection_guid, time_sent, guid);
+
+PRAGMA user_version = 8;
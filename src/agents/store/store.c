@@ -103,6 +103,9 @@ StoreProcessDocument(StoreClient *client,
 	switch (document->type) {
 		case STORE_DOCTYPE_MAIL:
 			result = StoreProcessIncomingMail(client, document, path);
+			// IMAP will want the structure of this soon, so work it out now
+			MimeCacheDocument(client, document, path);
+			SearchIndexDocument(client, document, path);
 			break;
 		case STORE_DOCTYPE_EVENT:
 			// FIXME: how do we link this into a calendar automatically?
@@ -166,7 +169,7 @@ finish:
 }
 
 /* opens the store for the given user */
-/* returns: -1 on error */
+/* returns: -1 on error, 1 if the store is busy and the client is IDLE_ONLY */
 
 int 
 SelectStore(StoreClient *client, char *user)
@@ -174,6 +177,7 @@ SelectStore(StoreClient *client, char *user)
 	const char *storeRoot = NULL;
 	char path[XPL_MAX_PATH + 1];
 	struct stat sb;
+	int ret;
 	
 	// check if we already have this store selected
 	if (client->storeName && !strcmp(user, client->storeName)) {
@@ -209,7 +213,10 @@ SelectStore(StoreClient *client, char *user)
 			return -3;
 		}
 	} else {
-		if (StoreDBOpen(client, user)) {
+		ret = StoreDBOpen(client, user);
+		if (ret > 0) {
+			return 1;
+		} else if (ret < 0) {
 			Log(LOG_ERROR, "Couldn't access store database for %s", user);
 			return -4;
 		}
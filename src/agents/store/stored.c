@@ -22,6 +22,7 @@
 #include <config.h>
 #include "stored.h"
 #include "messages.h"
+#include "mail.h"
 
 #include <gmime/gmime.h>
 #include <xpl.h>
@@ -306,9 +307,28 @@ _XplServiceMain(int argc, char *argv[])
         return -1;
     }
 
-    XplOpenLocalSemaphore(StoreAgent.guid.semaphore, 0);
+    if (GroupCommitInit()) {
+        Log(LOG_FATAL, "Unable to set up group commit");
+        return -1;
+    }
+
+    if (BlobStoreInit()) {
+        Log(LOG_FATAL, "Unable to set up single-instance storage");
+        return -1;
+    }
+
+    if (MaintenanceStart()) {
+        Log(LOG_FATAL, "Unable to start store maintenance");
+        return -1;
+    }
+
+    Ringlog("Starting mail parsers");
+    if (ParserPoolInit()) {
+        Log(LOG_FATAL, "Unable to start mail parsers");
+        return -1;
+    }
+
     GuidReset();
-    XplSignalLocalSemaphore(StoreAgent.guid.semaphore);
 
     XplSignalHandler(SignalHandler);
 
@@ -319,6 +339,11 @@ _XplServiceMain(int argc, char *argv[])
     Ringlog("Stopping main thread");
     
     LogicalLockDestroy();
+    ParserPoolShutdown();
+    MaintenanceShutdown();
+    DBPoolShutdown();
+    BlobStoreShutdown();
+    GroupCommitShutdown();
 
     XplUnloadApp(XplGetThreadID());
     MsgClearRecoveryFlag("store");
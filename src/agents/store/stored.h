@@ -103,6 +103,7 @@ typedef enum {
     STORE_CLIENT_FLAG_STORE =         1 << 2,     /* store attached */
     STORE_CLIENT_FLAG_NEEDS_COMPACTING = 1 << 3,
     STORE_CLIENT_FLAG_DONT_CACHE =    1 << 4,
+    STORE_CLIENT_FLAG_IDLE_ONLY =     1 << 5,     /* don't share an open store */
 } StoreClientFlags;
 
 
@@ -160,6 +161,14 @@ typedef struct {
 	uint32_t	time_modified;
 } StoreObject;
 
+/* what's in a collection, kept up to date by the object model */
+typedef struct {
+	uint64_t	messages;
+	uint64_t	unseen;
+	uint64_t	deleted;
+	uint64_t	bytes;
+} CollectionCounts;
+
 struct _StoreClient {
     Connection *conn;
     unsigned int flags;
@@ -198,10 +207,18 @@ struct _StoreClient {
             int events[STORE_CLIENT_WATCH_JOURNAL_LEN];
             int count;
         } journal;
+
+        BOOL idle;              /* in IDLE; events should wake it via wakeup */
+        int wakeup;
     } watch;
 
     NLockStruct *watchLock;
 
+    struct { /** guid.c **/
+        uint64_t next;   /* ids reserved for this client by GuidAlloc() */
+        uint64_t end;
+    } guids;
+
     /* zeroed by STORE command: */
     struct {
         int insertions;
@@ -264,22 +281,88 @@ struct StoreGlobals {
         /* FIXME: need a better name for this var: */
         int incomingQueueBytes;  /* max size of "incoming" file */ 
         int lockTimeoutMs;
+        BOOL lockPerCollection;  /* logical locks per collection, not per store */
+        BOOL groupCommit;        /* share syncs between writers; see groupcommit.c */
+        int groupCommitWindowMs; /* how long a batch waits for others to join */
+
+        struct {
+            /* protected by the group commit lock: */
+            uint64_t batches;
+            uint64_t writers;
+        } groupCommitStats;
+
+        BOOL singleInstance;     /* share content between delivered copies; see blobs.c */
+        int blobGracePeriod;     /* seconds an unused blob is kept */
+        int blobCollectInterval; /* seconds between sweeps of the blob area, 0 for none */
+
+        struct {
+            /* protected by the blob store lock: */
+            uint64_t stored;
+            uint64_t links;
+            uint64_t collected;
+        } blobStats;
+
+        int eventHorizonDays;      /* how far ahead recurring events are indexed; see calendar.c */
+        int eventHorizonLimitDays; /* how far ahead EVENTS will extend that on demand */
+
+        int changeLogRetention;      /* seconds tombstones are kept for CHANGES; see changelog.c */
+        int changeLogCompactInterval; /* seconds between compactions, 0 for none */
     } store;
 
     struct {
         BongoHashtable *entries;
         XplMutex lock;
-        int capacity;
+        int capacity;       /* handles kept open when not in use */
+        int idleTimeout;    /* seconds before an unused handle is closed */
+        int checkpointInterval; /* seconds between wal checkpoints, 0 for none */
+        MsgSQLTuning tuning;
+
+        struct {
+            /* protected by the pool lock: */
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t evictions;
+            uint64_t checkpoints;
+        } stats;
     } dbpool;
 
+    struct { /** maintenance.c **/
+        int interval;           /* seconds between walks over every store, 0 for none */
+        int iops;               /* file and database operations per second, 0 for no limit */
+        int bandwidthKB;        /* KB read or written per second, 0 for no limit */
+        int gracePeriod;        /* seconds before stray files are removed */
+        int vacuumFreePercent;  /* unused space which makes rebuilding a database worthwhile */
+
+        BOOL running;
+        XplSemaphore done;
+    } maintenance;
+
+    struct { /** parserpool.c **/
+        int poolSize;       /* number of worker processes, 0 to disable */
+        int queueDepth;     /* max. jobs waiting for a worker */
+        int jobTimeout;     /* seconds */
+        int memoryLimit;    /* MB of address space per worker, 0 for no limit */
+
+        struct {
+            XplAtomic waiting;
+            XplAtomic overflows;
+            XplAtomic restarts;
+            /* protected by the pool lock: */
+            uint64_t jobs;
+            uint64_t failures;
+            uint64_t latencyTotal;  /* microseconds */
+            uint64_t latencyMax;
+        } stats;
+    } parser;
+
     struct {
         int count;
         unsigned long *hosts;
     } trustedHosts;
 
     struct { /** guid.c **/
-        XplSemaphore semaphore;
-        char next[NMAP_GUID_LENGTH];
+        char prefix[NMAP_GUID_PREFIX_LENGTH - 16 + 1]; /* fixed for this run */
+        XplAtomic64 next;   /* next id nobody has been given yet */
     } guid;
 };
 
@@ -317,10 +400,18 @@ int StoreWatcherAdd(StoreClient *client, StoreObject *collection);
 int StoreWatcherRemove(StoreClient *client, StoreObject *collection);
 void StoreWatcherEvent(StoreClient *client, StoreObject *object, 
                        StoreWatchEvents event);
+CCode StoreWatcherWriteStats(StoreClient *client);
+CCode StoreWatcherIdle(StoreClient *client);
 
 /** db.c **/
 
 int     DBPoolInit(void);
+void    DBPoolReap(void);
+void    DBPoolCheckpoint(void);
+void    DBPoolCompactChangeLogs(void);
+int     DBPoolClients(const char *user);
+void    DBPoolShutdown(void);
+CCode   DBPoolWriteStats(StoreClient *client);
 int  StoreDBOpen(StoreClient *client, const char *user);
 void StoreDBClose(StoreClient *client);
 
@@ -398,7 +489,7 @@ int StoreParseAccessControlList(StoreClient *client, const char *acl);
 
 /** guid.c **/
 void GuidReset(void);
-void GuidAlloc(unsigned char *guid);
+void GuidAlloc(StoreClient *client, unsigned char *guid);
 int NmapCommandGuid(void *param);
 
 /** maildir.c **/
@@ -417,6 +508,31 @@ int MaildirDeliverTempDocument(StoreClient *client, uint64_t collection, const c
 #include "mime.h"
 int MimeGetInfo(StoreClient *client, StoreObject *object, MimeReport **outReport);
 int MimeGetGuid(StoreClient *client, uint64_t guid, MimeReport **outReport);
+int MimeCacheDocument(StoreClient *client, StoreObject *document, const char *path);
+
+/** search.c **/
+int SearchIndexDocument(StoreClient *client, StoreObject *document, const char *path);
+
+/** changelog.c **/
+int ChangeLogRecord(StoreClient *client, uint64_t collection, uint64_t guid, int kind);
+int ChangeLogSave(StoreClient *client, const StoreObject *old, StoreObject *object);
+int ChangeLogForget(StoreClient *client, uint64_t collection);
+int ChangeLogGetModseq(StoreClient *client, uint64_t collection, uint64_t *modseq, uint64_t *floor);
+int ChangeLogGetDocumentModseq(StoreClient *client, uint64_t collection, uint64_t guid, uint64_t *modseq);
+CCode ChangeLogWrite(StoreClient *client, StoreObject *collection, uint64_t since);
+int ChangeLogCompact(MsgSQLHandle *handle);
+
+/** counts.c **/
+int CollectionCountsSave(StoreClient *client, const StoreObject *old, const StoreObject *object);
+int CollectionCountsRemove(StoreClient *client, const StoreObject *object);
+int CollectionCountsForget(StoreClient *client, uint64_t collection);
+int CollectionCountsGet(StoreClient *client, uint64_t collection, CollectionCounts *counts);
+int CollectionCountsRebuild(StoreClient *client);
+
+/** maintenance.c **/
+int MaintenanceStart(void);
+void MaintenanceShutdown(void);
+CCode MaintenanceWriteStats(StoreClient *client);
 
 /** account.c **/
 
@@ -433,6 +549,23 @@ void Ringlog(char *message);
 void RinglogDumpConsole();
 void RinglogDumpFilehandle(int fh);
 
+/** blobs.c **/
+int BlobStoreInit(void);
+void BlobStoreShutdown(void);
+void BlobStoreCollect(void);
+int BlobStoreTempFile(char *dest, size_t size);
+int BlobStoreAdd(const char *path, char *blob, size_t size);
+int BlobStoreLink(const char *blob, const char *path);
+int BlobStoreUnlink(const char *path);
+CCode BlobStoreWriteStats(StoreClient *client);
+
+/** groupcommit.c **/
+int GroupCommitInit(void);
+void GroupCommitShutdown(void);
+int GroupCommitWait(FILE *fh);
+int GroupCommitFlush(FILE *fh);
+CCode GroupCommitWriteStats(StoreClient *client);
+
 /** locking.c **/
 typedef enum {
 	LLOCK_NONE,
@@ -440,9 +573,15 @@ typedef enum {
 	LLOCK_READWRITE
 } LogicalLockType;
 
+/* lock wait time histogram buckets: <1ms, <10ms, <100ms, <1s, <10s, >=10s */
+#define LLOCK_WAIT_BUCKETS 6
+
 void LogicalLockInit();
 int LogicalLockGain(StoreClient *client, StoreObject *object, LogicalLockType type, const char *location);
 void LogicalLockRelease(StoreClient *client, StoreObject *object, LogicalLockType type, const char *location);
+int LogicalLockGainPair(StoreClient *client, StoreObject *x, LogicalLockType *xType,
+                        StoreObject *y, LogicalLockType *yType, const char *location);
+CCode LogicalLockWriteStats(StoreClient *client);
 void LogicalLockDestroy();
 
 /* hardcoded guids: */
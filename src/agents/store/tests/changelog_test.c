@@ -0,0 +1,30 @@
+#include <config.h>
+#include <xpl.h>
+#include <memmgr.h>
+#include "../changelog.c"
+
+START_TEST(testchangelogkind)
+{
+    StoreObject old, object;
+
+    memset(&old, 0, sizeof(StoreObject));
+    old.guid = 0x20;
+    old.collection_guid = 0x10;
+    strcpy(old.filename, "/mail/INBOX/a");
+    memcpy(&object, &old, sizeof(StoreObject));
+
+    // saving without a change still counts as one
+    fail_unless(ChangeLogKind(&old, &object) == STORE_WATCH_EVENT_MODIFIED);
+
+    object.flags = 1;
+    fail_unless(ChangeLogKind(&old, &object) == STORE_WATCH_EVENT_FLAGS);
+
+    object.size = 100;
+    fail_unless(ChangeLogKind(&old, &object) == (STORE_WATCH_EVENT_FLAGS | STORE_WATCH_EVENT_MODIFIED));
+
+    // a rename within the collection is a modification
+    memcpy(&object, &old, sizeof(StoreObject));
+    strcpy(object.filename, "/mail/INBOX/b");
+    fail_unless(ChangeLogKind(&old, &object) == STORE_WATCH_EVENT_MODIFIED);
+}
+END_TEST
@@ -1,8 +1,14 @@
 #include <include/bongocheck.h>
 #ifdef BONGO_HAVE_CHECK
 
+#include "changelog_test.c"
 #include "conversations_test.c"
+#include "counts_test.c"
+#include "guid_test.c"
+#include "maintenance_test.c"
+#include "query_builder_test.c"
 #include "query_parser_test.c"
+#include "watch_test.c"
 // #include "mail_parser_test.c"
 
 // TODO Write your tests above, and/or
@@ -12,8 +18,22 @@ START_CHECK_SUITE_SETUP("Unit testing the store agent.\n")
     CREATE_CHECK_CASE   (tc_core  , "Core"   );
     CHECK_SUITE_ADD_CASE(top_suite, tc_core  );
     CHECK_CASE_ADD_TEST (tc_core  , testnormalizesubject    );
+    CHECK_CASE_ADD_TEST (tc_core  , testparsemessageids     );
 //    CHECK_CASE_ADD_TEST (tc_core  , testmailparser    );
     CHECK_CASE_ADD_TEST (tc_core , testqueryparser );
+    CHECK_CASE_ADD_TEST (tc_core , testoutputfields );
+#ifdef HAVE_SQLITE_FTS4
+    CHECK_CASE_ADD_TEST (tc_core , testfulltextwords );
+#endif
+    CHECK_CASE_ADD_TEST (tc_core , testqueryplans );
+    CHECK_CASE_ADD_TEST (tc_core , testwatchregistry );
+    CHECK_CASE_ADD_TEST (tc_core , testwatchfanout );
+    CHECK_CASE_ADD_TEST (tc_core , testchangelogkind );
+    CHECK_CASE_ADD_TEST (tc_core , testcollectioncounts );
+    CHECK_CASE_ADD_TEST (tc_core , testmaintenancebudget );
+    CHECK_CASE_ADD_TEST (tc_core , testmaintenanceorder );
+    CHECK_CASE_ADD_TEST (tc_core , testguidalloc );
+    CHECK_CASE_ADD_TEST (tc_core , testguidthreads );
     // TODO register additional tests here
 END_CHECK_SUITE_SETUP
 #else
@@ -2,20 +2,38 @@
 #include <xpl.h>
 #include <memmgr.h>
 #include "../conversations.c"
-#include "../db.c"
 
-START_TEST(testnormalizesubject) 
+START_TEST(testnormalizesubject)
 {
     char* result;
     const char* subject = "Re: Fwd: This is a subject to normalize";
     result = NormalizeSubject(subject);
-    //FIXME: this test fails :D
-    //fail_unless( strcmp(result, "This is a subject to normalize") == 0 );
-    fail_if(1==2);
-    // TODO
-    // fail_unless(1==1);
-    // fail_if(1 == 2);
+    fail_unless( strcmp(result, "This is a subject to normalize") == 0 );
+    MemFree(result);
+
+    result = NormalizeSubject("[bongo-devel] RE:  SV: a\tsubject  ");
+    fail_unless( strcmp(result, "a subject") == 0 );
+    MemFree(result);
+
+    result = NormalizeSubject("Re:");
+    fail_unless( strcmp(result, "") == 0 );
+    MemFree(result);
 }
 END_TEST
 
+START_TEST(testparsemessageids)
+{
+    char header[] = "<a@example.com> <b@example.com>\r\n\t<c@example.com> <>";
+    char extra[] = "junk <1@x> <2@x> <3@x>";
+    char *ids[2];
+
+    // the last ones are the closest relatives, so they're the ones kept
+    fail_unless(ParseMessageIds(header, ids, 2) == 2);
+    fail_unless(strcmp(ids[0], "b@example.com") == 0);
+    fail_unless(strcmp(ids[1], "c@example.com") == 0);
+
+    fail_unless(ParseMessageIds(extra, ids, 1) == 1);
+    fail_unless(strcmp(ids[0], "3@x") == 0);
+}
+END_TEST
 
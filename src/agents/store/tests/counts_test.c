@@ -0,0 +1,38 @@
+#include <config.h>
+#include <xpl.h>
+#include <memmgr.h>
+#include "../counts.c"
+
+START_TEST(testcollectioncounts)
+{
+    StoreObject object;
+    CollectionCounts counts;
+
+    memset(&object, 0, sizeof(StoreObject));
+    object.guid = 0x20;
+    object.collection_guid = 0x10;
+    object.type = STORE_DOCTYPE_MAIL;
+    object.size = 1234;
+
+    CollectionCountsOf(&object, &counts);
+    fail_unless(counts.messages == 1);
+    fail_unless(counts.unseen == 1);
+    fail_unless(counts.deleted == 0);
+    fail_unless(counts.bytes == 1234);
+
+    object.flags = STORE_MSG_FLAG_SEEN | STORE_MSG_FLAG_DELETED;
+    CollectionCountsOf(&object, &counts);
+    fail_unless(counts.unseen == 0);
+    fail_unless(counts.deleted == 1);
+
+    // stubs being created and subcollections don't count
+    object.collection_guid = (uint64_t)-1;
+    CollectionCountsOf(&object, &counts);
+    fail_unless(counts.messages == 0);
+
+    object.collection_guid = 0x10;
+    object.type = STORE_DOCTYPE_FOLDER;
+    CollectionCountsOf(&object, &counts);
+    fail_unless(counts.messages == 0 && counts.bytes == 0);
+}
+END_TEST
@@ -0,0 +1,108 @@
+#include <config.h>
+#include <xpl.h>
+#include <memmgr.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "../guid.c"
+
+START_TEST(testguidalloc)
+{
+    StoreClient *a, *b;
+    unsigned char first[NMAP_GUID_LENGTH], prev[NMAP_GUID_LENGTH], guid[NMAP_GUID_LENGTH];
+    int i;
+
+    a = MemNew0(StoreClient, 1);
+    b = MemNew0(StoreClient, 1);
+    GuidReset();
+
+    // each client's ids go up, across the blocks it takes
+    GuidAlloc(a, first);
+    memcpy(prev, first, NMAP_GUID_LENGTH);
+    for (i = 1; i < 3 * GUID_BLOCK_SIZE; i++) {
+        GuidAlloc(a, guid);
+        fail_unless(memcmp(guid, prev, NMAP_GUID_LENGTH) > 0);
+        memcpy(prev, guid, NMAP_GUID_LENGTH);
+    }
+
+    // a block taken later comes after all of them
+    GuidAlloc(b, guid);
+    fail_unless(memcmp(guid, prev, NMAP_GUID_LENGTH) > 0);
+    memcpy(prev, guid, NMAP_GUID_LENGTH);
+    GuidAlloc(NULL, guid);
+    fail_unless(memcmp(guid, prev, NMAP_GUID_LENGTH) > 0);
+    fail_unless(!memcmp(guid, first, sizeof(StoreAgent.guid.prefix) - 1));
+
+    // and a later run's ids come after this one's
+    memcpy(prev, guid, NMAP_GUID_LENGTH);
+    usleep(10);
+    GuidReset();
+    GuidAlloc(NULL, guid);
+    fail_unless(memcmp(guid, prev, NMAP_GUID_LENGTH) > 0);
+
+    MemFree(a);
+    MemFree(b);
+}
+END_TEST
+
+#define GUID_THREADS 4
+#define GUID_THREAD_ALLOCS (4 * GUID_BLOCK_SIZE)
+
+typedef struct {
+    StoreClient client;
+    unsigned char guids[GUID_THREAD_ALLOCS][NMAP_GUID_LENGTH];
+} GuidThreadIds;
+
+static void *
+GuidAllocThread(void *arg)
+{
+    GuidThreadIds *ids = arg;
+    int i;
+
+    for (i = 0; i < GUID_THREAD_ALLOCS; i++) {
+        GuidAlloc(&ids->client, ids->guids[i]);
+    }
+    return NULL;
+}
+
+static int
+GuidCompare(const void *a, const void *b)
+{
+    return memcmp(a, b, NMAP_GUID_LENGTH);
+}
+
+/* Clients allocating at once still each get ids which go up, and nobody
+   gets the same one as anyone else. */
+START_TEST(testguidthreads)
+{
+    pthread_t threads[GUID_THREADS];
+    GuidThreadIds *ids;
+    unsigned char (*all)[NMAP_GUID_LENGTH];
+    int i, j;
+
+    ids = MemNew0(GuidThreadIds, GUID_THREADS);
+    all = MemMalloc(GUID_THREADS * GUID_THREAD_ALLOCS * NMAP_GUID_LENGTH);
+    GuidReset();
+
+    for (i = 0; i < GUID_THREADS; i++) {
+        pthread_create(&threads[i], NULL, GuidAllocThread, &ids[i]);
+    }
+    for (i = 0; i < GUID_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < GUID_THREADS; i++) {
+        for (j = 1; j < GUID_THREAD_ALLOCS; j++) {
+            fail_unless(memcmp(ids[i].guids[j], ids[i].guids[j - 1], NMAP_GUID_LENGTH) > 0);
+        }
+        memcpy(all[i * GUID_THREAD_ALLOCS], ids[i].guids, sizeof(ids[i].guids));
+    }
+
+    qsort(all, GUID_THREADS * GUID_THREAD_ALLOCS, NMAP_GUID_LENGTH, GuidCompare);
+    for (i = 1; i < GUID_THREADS * GUID_THREAD_ALLOCS; i++) {
+        fail_unless(memcmp(all[i], all[i - 1], NMAP_GUID_LENGTH) != 0);
+    }
+
+    MemFree(all);
+    MemFree(ids);
+}
+END_TEST
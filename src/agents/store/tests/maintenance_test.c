@@ -0,0 +1,56 @@
+#include <config.h>
+#include <xpl.h>
+#include <memmgr.h>
+#include "../maintenance.c"
+
+START_TEST(testmaintenancebudget)
+{
+    MaintenanceBudget budget;
+    time_t now = 1000;
+
+    memset(&budget, 0, sizeof(MaintenanceBudget));
+
+    // within budget: no waiting
+    fail_unless(MaintenanceBudgetCharge(&budget, now, 100, 0, 100, 0) == 0);
+    // one over: wait out the rest of this second
+    fail_unless(MaintenanceBudgetCharge(&budget, now, 100, 0, 1, 0) == 1);
+    // a second later the excess has drained
+    fail_unless(MaintenanceBudgetCharge(&budget, now + 1, 100, 0, 99, 0) == 0);
+
+    // one big charge waits in proportion
+    memset(&budget, 0, sizeof(MaintenanceBudget));
+    fail_unless(MaintenanceBudgetCharge(&budget, now, 0, 1024, 1, 10 * 1024) == 9);
+    fail_unless(MaintenanceBudgetCharge(&budget, now + 9, 0, 1024, 1, 0) == 0);
+
+    // the tighter of the two limits wins
+    memset(&budget, 0, sizeof(MaintenanceBudget));
+    fail_unless(MaintenanceBudgetCharge(&budget, now, 10, 1024, 50, 2048) == 4);
+
+    // no limits at all
+    memset(&budget, 0, sizeof(MaintenanceBudget));
+    fail_unless(MaintenanceBudgetCharge(&budget, now, 0, 0, 1000000, 1LL << 40) == 0);
+}
+END_TEST
+
+START_TEST(testmaintenanceorder)
+{
+    uint64_t guid;
+    MaintenanceStoreEntry stores[3] = {
+        { "carol", 300 },
+        { "alice", 100 },
+        { "bob", 100 },
+    };
+
+    // idle longest first, then by name
+    qsort(stores, 3, sizeof(MaintenanceStoreEntry), MaintenanceStoreCompare);
+    fail_unless(!strcmp(stores[0].name, "alice"));
+    fail_unless(!strcmp(stores[1].name, "bob"));
+    fail_unless(!strcmp(stores[2].name, "carol"));
+
+    // only maildirs are named after a guid
+    fail_unless(MaintenanceParseGuid("000000000000002a", &guid) && guid == 0x2a);
+    fail_unless(!MaintenanceParseGuid("store.db", &guid));
+    fail_unless(!MaintenanceParseGuid("000000000000002a-wal", &guid));
+
+}
+END_TEST
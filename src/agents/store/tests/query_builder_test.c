@@ -0,0 +1,238 @@
+#include <config.h>
+#include <xpl.h>
+#include <memmgr.h>
+#include <sqlite3.h>
+#include "../query-builder.c"
+
+START_TEST(testoutputfields)
+{
+    QueryBuilder builder;
+
+    QueryBuilderStart(&builder);
+
+    fail_unless(QueryBuilderSetOutputFields(&builder, "guid,imapuid,flags") == 0);
+    fail_unless(builder.field_count == 3);
+    fail_unless(builder.fields[0] == FIELD_GUID);
+    fail_unless(builder.fields[1] == FIELD_IMAPUID);
+    fail_unless(builder.fields[2] == FIELD_FLAGS);
+
+    // anything unknown means the whole list is refused
+    fail_unless(QueryBuilderSetOutputFields(&builder, "guid,subject") == -1);
+    fail_unless(builder.field_count == 0);
+    fail_unless(QueryBuilderSetOutputFields(&builder, "guid,") == 0);
+    fail_unless(builder.field_count == 1);
+    fail_unless(QueryBuilderSetOutputFields(&builder, "guid,guid,guid,guid,guid,guid,guid,guid") == -1);
+
+    QueryBuilderFinish(&builder);
+}
+END_TEST
+
+/* The schema the store upgrades through, applied in order to a scratch
+   database so the planner sees the same indexes a real store has */
+static const char *plan_schema[] = {
+    "create-store.sql", "create-store-1.sql", "create-store-2.sql",
+    "create-store-3.sql", "create-store-4.sql", "create-store-5.sql",
+    "create-store-6.sql", "create-store-7.sql", "create-store-8.sql",
+#ifdef HAVE_SQLITE_FTS4
+    "create-fulltext.sql",
+#endif
+    NULL
+};
+
+static sqlite3 *
+PlanTestOpen(void)
+{
+    char dir[XPL_MAX_PATH + 1];
+    char path[XPL_MAX_PATH + 1];
+    char sql[16384];
+    sqlite3 *db;
+    char *slash;
+    FILE *f;
+    size_t len;
+    int i;
+
+    // the schema lives next to the sources, not wherever we're run from
+    strncpy(dir, __FILE__, XPL_MAX_PATH);
+    dir[XPL_MAX_PATH] = '\0';
+    slash = strrchr(dir, '/');
+    if (slash) {
+        *slash = '\0';
+    } else {
+        strcpy(dir, ".");
+    }
+
+    if (sqlite3_open(":memory:", &db) != SQLITE_OK) return NULL;
+
+    for (i = 0; plan_schema[i] != NULL; i++) {
+        snprintf(path, XPL_MAX_PATH, "%s/../sql/%s", dir, plan_schema[i]);
+        f = fopen(path, "r");
+        if (f == NULL) goto abort;
+        len = fread(sql, 1, sizeof(sql) - 1, f);
+        fclose(f);
+        sql[len] = '\0';
+
+        if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) goto abort;
+    }
+    return db;
+
+abort:
+    sqlite3_close(db);
+    return NULL;
+}
+
+/* Ask SQLite how it would run the query the builder makes. A step which
+   SCANs a table without USING an index reads all of it; a TEMP B-TREE
+   means sorting everything found before the first row comes back. */
+static void
+PlanTestCheck(sqlite3 *db, QueryBuilder *builder, BOOL sorted_by_index)
+{
+    sqlite3_stmt *stmt;
+    char *sql = NULL;
+    char *explain;
+
+    fail_unless(QueryBuilderRun(builder) == 0);
+    fail_unless(QueryBuilderCreateSQL(builder, &sql) == 0);
+
+    explain = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sql);
+    fail_unless(sqlite3_prepare_v2(db, explain, -1, &stmt, NULL) == SQLITE_OK, sql);
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *detail = (const char *)sqlite3_column_text(stmt, 3);
+
+        fail_if(strncmp(detail, "SCAN", 4) == 0 && strstr(detail, "USING") == NULL, sql);
+        if (sorted_by_index) {
+            fail_if(strstr(detail, "TEMP B-TREE") != NULL, sql);
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    sqlite3_free(explain);
+    MemFree(sql);
+    QueryBuilderFinish(builder);
+}
+
+START_TEST(testqueryplans)
+{
+    QueryBuilder builder;
+    sqlite3 *db;
+
+    db = PlanTestOpen();
+    fail_unless(db != NULL);
+
+    // IMAP's view of a folder: everything in uid order
+    QueryBuilderStart(&builder);
+    QueryBuilderSetQuerySafe(&builder, "= nmap.collection ?1");
+    QueryBuilderAddPropertyOutput(&builder, "nmap.mail.headersize");
+    QueryBuilderAddPropertyOutput(&builder, "nmap.modseq");
+    QueryBuilderSetResultOrder(&builder, "nmap.mail.imapuid", TRUE);
+    PlanTestCheck(db, &builder, TRUE);
+
+    // a page of flagged mail, newest first
+    QueryBuilderStart(&builder);
+    QueryBuilderSetQuerySafe(&builder, "& = nmap.collection ?1 = nmap.flags ?2");
+    QueryBuilderSetResultOrder(&builder, "nmap.created", FALSE);
+    QueryBuilderSetResultRange(&builder, 0, 50);
+    PlanTestCheck(db, &builder, TRUE);
+
+    // largest first
+    QueryBuilderStart(&builder);
+    QueryBuilderSetQuerySafe(&builder, "= nmap.collection ?1");
+    QueryBuilderSetResultOrder(&builder, "nmap.length", FALSE);
+    PlanTestCheck(db, &builder, TRUE);
+
+    // carrying on from a document
+    QueryBuilderStart(&builder);
+    QueryBuilderSetQuerySafe(&builder, "& = nmap.collection ?1 | > nmap.mail.imapuid ?4 & = nmap.mail.imapuid ?4 > nmap.guid ?5");
+    QueryBuilderSetResultOrder(&builder, "nmap.mail.imapuid", TRUE);
+    PlanTestCheck(db, &builder, TRUE);
+
+    // mail headers are searched and sorted through their own indexes
+    QueryBuilderStart(&builder);
+    QueryBuilderSetQuerySafe(&builder, "& = nmap.collection ?1 = nmap.mail.subject ?2");
+    PlanTestCheck(db, &builder, TRUE);
+
+    QueryBuilderStart(&builder);
+    QueryBuilderSetQuerySafe(&builder, "& = nmap.collection ?1 = nmap.mail.senders ?2");
+    QueryBuilderSetResultOrder(&builder, "nmap.mail.sent", FALSE);
+    PlanTestCheck(db, &builder, TRUE);
+
+    QueryBuilderStart(&builder);
+    QueryBuilderSetQuerySafe(&builder, "= nmap.collection ?1");
+    QueryBuilderSetResultOrder(&builder, "nmap.mail.subject", TRUE);
+    QueryBuilderSetResultRange(&builder, 0, 50);
+    PlanTestCheck(db, &builder, TRUE);
+
+    // CONVERSATIONS
+    QueryBuilderStart(&builder);
+    QueryBuilderSetQuerySafe(&builder, "= nmap.collection ?1");
+    QueryBuilderSetResultOrder(&builder, "nmap.conversation.date", FALSE);
+    QueryBuilderSetResultRange(&builder, 0, 20);
+    PlanTestCheck(db, &builder, TRUE);
+
+    sqlite3_close(db);
+}
+END_TEST
+
+#ifdef HAVE_SQLITE_FTS4
+/* How many indexed documents the phrase QueryBuilderMatchPhrase() makes
+   of some text finds, in one column or (for "fulltext") any of them; -1
+   if it makes none, and all the mail has to be read */
+static int
+FullTextTestCount(sqlite3 *db, const char *column, const char *text)
+{
+    sqlite3_stmt *stmt;
+    char match[256];
+    char *sql;
+    int count = 0;
+
+    if (!QueryBuilderMatchPhrase(text, match, sizeof(match))) {
+        return -1;
+    }
+    sql = sqlite3_mprintf("SELECT docid FROM fulltext WHERE %s MATCH ?1;", column);
+    fail_unless(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK, sql);
+    sqlite3_free(sql);
+    sqlite3_bind_text(stmt, 1, match, -1, SQLITE_STATIC);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        count++;
+    }
+    sqlite3_finalize(stmt);
+    return count;
+}
+
+START_TEST(testfulltextwords)
+{
+    sqlite3 *db;
+
+    db = PlanTestOpen();
+    fail_unless(db != NULL);
+    fail_unless(sqlite3_exec(db,
+        "INSERT INTO fulltext (docid, subject, sender, body) VALUES "
+        "(1, 'Annual report', 'Anne <anne@example.com>', 'The figures are in.');"
+        "INSERT INTO fulltext (docid, subject, sender, body) VALUES "
+        "(2, 'Lunch', 'Bob <bob@example.com>', 'We planned it under the banner.');",
+        NULL, NULL, NULL) == SQLITE_OK);
+
+    // the text may start and end part way through words, so the first
+    // word is left out and the last is a prefix; case doesn't matter
+    fail_unless(FullTextTestCount(db, "fulltext", "annual rep") == 1);
+    fail_unless(FullTextTestCount(db, "fulltext", "ANNUAL REPORT") == 1);
+    fail_unless(FullTextTestCount(db, "body", "e figures ar") == 1);
+
+    // the column is respected
+    fail_unless(FullTextTestCount(db, "subject", " report") == 1);
+    fail_unless(FullTextTestCount(db, "body", " report") == 0);
+
+    // the index only narrows things down: "anne@example" is looked up
+    // as "example*", which bob@example.com has too
+    fail_unless(FullTextTestCount(db, "sender", "anne@example") == 2);
+
+    // a lone word could be inside any other, e.g. "ann" is in "planned"
+    // and "banner", so the index is no help
+    fail_unless(FullTextTestCount(db, "fulltext", "ann") == -1);
+    fail_unless(FullTextTestCount(db, "fulltext", "annual ") == -1);
+    fail_unless(FullTextTestCount(db, "fulltext", "--") == -1);
+
+    sqlite3_close(db);
+}
+END_TEST
+#endif
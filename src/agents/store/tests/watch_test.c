@@ -0,0 +1,127 @@
+#include <config.h>
+#include <xpl.h>
+#include <memmgr.h>
+#include "../watch.c"
+
+static void
+SetupWatchClient(StoreClient *client, char *store)
+{
+    memset(client, 0, sizeof(StoreClient));
+    client->storeName = store;
+    client->storeHash = BongoStringHash(store);
+    client->watch.flags = STORE_WATCH_EVENT_NEW;
+}
+
+START_TEST(testwatchregistry)
+{
+    static StoreClient clients[100];
+    StoreClient writer;
+    StoreObject collection, document;
+    int i;
+
+    StoreWatcherInit();
+    SetupWatchClient(&writer, "alice");
+    memset(&collection, 0, sizeof(StoreObject));
+    memset(&document, 0, sizeof(StoreObject));
+
+    // more watchers on one collection than the old fixed slots allowed
+    collection.guid = 0x10;
+    for (i = 0; i < 100; i++) {
+        SetupWatchClient(&clients[i], "alice");
+        fail_unless(StoreWatcherAdd(&clients[i], &collection) == 0);
+    }
+    fail_unless(XplSafeRead(WatchRegistry.items) == 1);
+
+    document.guid = 0x20;
+    document.collection_guid = 0x10;
+    StoreWatcherEvent(&writer, &document, STORE_WATCH_EVENT_NEW);
+    for (i = 0; i < 100; i++) {
+        fail_unless(clients[i].watch.journal.count == 1);
+    }
+
+    // the same guid in another store is a different collection
+    writer.storeName = "bob";
+    writer.storeHash = BongoStringHash("bob");
+    StoreWatcherEvent(&writer, &document, STORE_WATCH_EVENT_NEW);
+    fail_unless(clients[0].watch.journal.count == 1);
+
+    // and once everyone stops watching, the entry is reclaimed
+    for (i = 0; i < 100; i++) {
+        fail_unless(StoreWatcherRemove(&clients[i], &collection) == 0);
+    }
+    fail_unless(XplSafeRead(WatchRegistry.items) == 0);
+    fail_unless(StoreWatcherRemove(&clients[0], &collection) == -1);
+
+    // more watched collections than the old global list held
+    for (i = 0; i < 100; i++) {
+        collection.guid = 0x100 + i;
+        fail_unless(StoreWatcherAdd(&clients[i], &collection) == 0);
+    }
+    fail_unless(XplSafeRead(WatchRegistry.items) == 100);
+    for (i = 0; i < 100; i++) {
+        collection.guid = 0x100 + i;
+        fail_unless(StoreWatcherRemove(&clients[i], &collection) == 0);
+    }
+    fail_unless(XplSafeRead(WatchRegistry.items) == 0);
+}
+END_TEST
+
+/* An event reaches the watchers of its collection and nobody else, however
+ * many other collections are being watched. The timing lives in
+ * watchbench.c. */
+START_TEST(testwatchfanout)
+{
+    static StoreClient watchers[1000];
+    static StoreClient shared[10];
+    StoreClient writer;
+    StoreObject collection, document;
+    int notified, i;
+
+    StoreWatcherInit();
+    SetupWatchClient(&writer, "alice");
+    memset(&collection, 0, sizeof(StoreObject));
+    memset(&document, 0, sizeof(StoreObject));
+
+    for (i = 0; i < 1000; i++) {
+        SetupWatchClient(&watchers[i], "alice");
+        collection.guid = 0x1000 + i;
+        fail_unless(StoreWatcherAdd(&watchers[i], &collection) == 0);
+    }
+    collection.guid = 0x1000 + 500;
+    for (i = 0; i < 10; i++) {
+        SetupWatchClient(&shared[i], "alice");
+        fail_unless(StoreWatcherAdd(&shared[i], &collection) == 0);
+    }
+    fail_unless(XplSafeRead(WatchRegistry.items) == 1000);
+
+    document.guid = 1;
+    document.collection_guid = 0x1000 + 500;
+    StoreWatcherEvent(&writer, &document, STORE_WATCH_EVENT_NEW);
+
+    notified = 0;
+    for (i = 0; i < 1000; i++) {
+        notified += watchers[i].watch.journal.count;
+    }
+    fail_unless(notified == 1);
+    fail_unless(watchers[500].watch.journal.count == 1);
+    for (i = 0; i < 10; i++) {
+        fail_unless(shared[i].watch.journal.count == 1);
+    }
+
+    // the shared entry stays until its last watcher leaves
+    fail_unless(StoreWatcherRemove(&watchers[500], &collection) == 0);
+    for (i = 0; i < 9; i++) {
+        fail_unless(StoreWatcherRemove(&shared[i], &collection) == 0);
+        fail_unless(XplSafeRead(WatchRegistry.items) == 1000);
+    }
+    fail_unless(StoreWatcherRemove(&shared[9], &collection) == 0);
+    fail_unless(XplSafeRead(WatchRegistry.items) == 999);
+
+    for (i = 0; i < 1000; i++) {
+        if (i == 500) continue;
+        collection.guid = 0x1000 + i;
+        fail_unless(StoreWatcherRemove(&watchers[i], &collection) == 0);
+    }
+    fail_unless(XplSafeRead(WatchRegistry.items) == 0);
+}
+END_TEST
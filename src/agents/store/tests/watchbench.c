@@ -0,0 +1,88 @@
+#include <config.h>
+#include <xpl.h>
+#include <memmgr.h>
+#include <sys/time.h>
+#include "../watch.c"
+
+/**
+ * Time StoreWatcherEvent() with more and more collections being watched.
+ * What an event costs should depend on how many watch its own collection,
+ * not on how many others are watched. This drives the registry directly,
+ * as each store connection can only watch one collection, and opening one
+ * per watcher would be timing the connections instead.
+ *
+ * It's only meant for testing use, and isn't run with the unit tests.
+ */
+
+#define WATCHBENCH_EVENTS 1000000
+
+static void
+SetupBenchClient(StoreClient *client, char *store)
+{
+    memset(client, 0, sizeof(StoreClient));
+    client->storeName = store;
+    client->storeHash = BongoStringHash(store);
+    client->watch.flags = STORE_WATCH_EVENT_FLAGS;
+}
+
+/* Events per second to a collection with shared watchers, while
+ * watched other collections have a watcher each. */
+static double
+WatchBenchRun(int watched, int shared)
+{
+    StoreClient *clients;
+    StoreClient writer;
+    StoreObject collection, document;
+    struct timeval start, end;
+    int total = watched + shared;
+    int i;
+
+    clients = MemMalloc0(total * sizeof(StoreClient));
+    if (!clients) {
+        return -1;
+    }
+
+    SetupBenchClient(&writer, "bench");
+    memset(&collection, 0, sizeof(StoreObject));
+    memset(&document, 0, sizeof(StoreObject));
+
+    for (i = 0; i < total; i++) {
+        SetupBenchClient(&clients[i], "bench");
+        // the shared watchers all watch the first collection
+        collection.guid = 0x1000 + ((i < shared) ? 0 : i);
+        StoreWatcherAdd(&clients[i], &collection);
+    }
+
+    document.guid = 1;
+    document.collection_guid = 0x1000;
+    gettimeofday(&start, NULL);
+    for (i = 0; i < WATCHBENCH_EVENTS; i++) {
+        StoreWatcherEvent(&writer, &document, STORE_WATCH_EVENT_FLAGS);
+    }
+    gettimeofday(&end, NULL);
+
+    for (i = 0; i < total; i++) {
+        collection.guid = 0x1000 + ((i < shared) ? 0 : i);
+        StoreWatcherRemove(&clients[i], &collection);
+    }
+    MemFree(clients);
+
+    return WATCHBENCH_EVENTS / ((end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+}
+
+int
+main(int argc, char **argv)
+{
+    int shared = (argc > 1) ? atoi(argv[1]) : 1;
+    int watched;
+
+    XplInit();
+    StoreWatcherInit();
+
+    for (watched = 0; watched <= 100000; watched = watched ? watched * 10 : 1) {
+        XplConsolePrintf("%d other collections watched, %d watching: %.0f events/s\n",
+                         watched, shared, WatchBenchRun(watched, shared));
+    }
+
+    return 0;
+}
@@ -1,58 +1,132 @@
+#include <config.h>
+#include <xpl.h>
+#include <memmgr.h>
+
 #include "stored.h"
 #include "messages.h"
 #include "lock.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 /** Watch stuff **/
 
-typedef struct {
+/* Every collection being watched by at least one client has a WatchItem,
+ * kept in a hash table keyed on (store, collection guid). The table's
+ * buckets are guarded by a fixed set of lock stripes: bucket i is always
+ * covered by lock (i % WATCH_LOCK_STRIPES), whatever size the table has
+ * grown to, so normal operations only ever take one stripe. Growing the
+ * table takes all of them, in order.
+ */
+
+#define WATCH_LOCK_STRIPES	64
+#define WATCH_INITIAL_BUCKETS	1024
+#define WATCH_MAX_LOAD		2	/* items per bucket before we grow */
+
+typedef struct _WatchItem {
+	struct _WatchItem *next;
 	char *store;
-	StoreObject collection;
-	StoreClient *watchers[STORE_COLLECTION_MAX_WATCHERS];
+	uint64_t collection;
+	uint32_t hash;
+	StoreClient **watchers;
+	int count;
+	int allocated;
 } WatchItem;
 
-WatchItem * StoreWatcherFindWatchItem(StoreClient *client, StoreObject *collection);
-WatchItem * StoreWatcherFindWatchItemByGUID(StoreClient *client, uint64_t collection);
+static struct {
+	XplMutex locks[WATCH_LOCK_STRIPES];
+	WatchItem **buckets;
+	uint32_t size;		/* always a power of two */
+	XplAtomic items;
+	XplAtomic watchers;
+} WatchRegistry;
 
-#define MAX_STORE_WATCH	50
+static uint32_t
+WatchHash(unsigned long storeHash, uint64_t collection)
+{
+	// spread the guid's bits out; consecutive guids are common
+	collection *= 0x9E3779B97F4A7C15ULL;
+	return (uint32_t) storeHash ^ (uint32_t) (collection >> 32);
+}
 
-static XplMutex global_watch_list_lock;
-static WatchItem global_watch_list[MAX_STORE_WATCH];
+#define WatchStripe(hash)	(WatchRegistry.locks[(hash) & (WATCH_LOCK_STRIPES - 1)])
 
 void
 StoreWatcherInit()
 {
-	XplMutexInit(global_watch_list_lock);
-	memset(global_watch_list, 0, sizeof(global_watch_list));
+	int i;
+
+	for (i = 0; i < WATCH_LOCK_STRIPES; i++) {
+		XplMutexInit(WatchRegistry.locks[i]);
+	}
+	WatchRegistry.size = WATCH_INITIAL_BUCKETS;
+	WatchRegistry.buckets = MemMalloc0(WatchRegistry.size * sizeof(WatchItem *));
+	XplSafeWrite(WatchRegistry.items, 0);
+	XplSafeWrite(WatchRegistry.watchers, 0);
 }
 
-WatchItem *
-StoreWatcherFindWatchItem(StoreClient *client, StoreObject *collection)
+/** \internal
+ * Find the watch item for a collection. The caller holds the item's stripe.
+ * \param	prev	If not NULL, set to the link pointing at the item
+ */
+static WatchItem *
+StoreWatcherFindWatchItem(const char *store, uint64_t collection, uint32_t hash,
+                          WatchItem ***prev)
 {
-	return StoreWatcherFindWatchItemByGUID(client, collection->guid);
+	WatchItem **link;
+
+	for (link = &WatchRegistry.buckets[hash & (WatchRegistry.size - 1)];
+	     *link != NULL;
+	     link = &((*link)->next))
+	{
+		if ((*link)->hash == hash && (*link)->collection == collection &&
+		    !strcmp((*link)->store, store))
+		{
+			if (prev) *prev = link;
+			return *link;
+		}
+	}
+	return NULL;
 }
 
-WatchItem *
-StoreWatcherFindWatchItemByGUID(StoreClient *client, uint64_t collection)
+/** \internal
+ * Double the number of buckets once the table gets too full.
+ */
+static void
+StoreWatcherGrow(void)
 {
-	int i;
-	WatchItem *to_watch = NULL;
-	
-	for (i = 0; i < MAX_STORE_WATCH; i++) {
-	WatchItem *item = &global_watch_list[i];
-		if ((item->collection.guid == collection) && (item->store != NULL) && (strcmp(item->store, client->storeName)==0)) {
-			// found the watch item for this collection in the right store
-			to_watch = item;
-		}
-		if ((to_watch == NULL) && (item->store == NULL)) {
-			// found the first free entry (overridden by above)
-			to_watch = item;
+	WatchItem **buckets, *item, *next;
+	uint32_t size, i;
+
+	for (i = 0; i < WATCH_LOCK_STRIPES; i++) {
+		XplMutexLock(WatchRegistry.locks[i]);
+	}
+
+	// someone may have got here first
+	if ((uint32_t) XplSafeRead(WatchRegistry.items) > WatchRegistry.size * WATCH_MAX_LOAD) {
+		size = WatchRegistry.size * 2;
+		buckets = MemMalloc0(size * sizeof(WatchItem *));
+		if (buckets) {
+			for (i = 0; i < WatchRegistry.size; i++) {
+				for (item = WatchRegistry.buckets[i]; item != NULL; item = next) {
+					next = item->next;
+					item->next = buckets[item->hash & (size - 1)];
+					buckets[item->hash & (size - 1)] = item;
+				}
+			}
+			MemFree(WatchRegistry.buckets);
+			WatchRegistry.buckets = buckets;
+			WatchRegistry.size = size;
 		}
 	}
-	return to_watch;
+
+	for (i = WATCH_LOCK_STRIPES; i > 0; i--) {
+		XplMutexUnlock(WatchRegistry.locks[i - 1]);
+	}
 }
 
 /** \internal
- * Add the client as a watcher of the collection locked by cLock 
+ * Add the client as a watcher of the collection
  * returns: -1 on failure, 0 o/w
  */
 
@@ -61,71 +135,96 @@ StoreWatcherAdd(StoreClient *client, StoreObject *collection)
 {
 	WatchItem *to_watch = NULL;
 	StoreClient **watchers = NULL;
-	int i;
+	uint32_t hash;
+	BOOL grow = FALSE;
 	int retcode = -1;
 
-	XplMutexLock(global_watch_list_lock);
+	hash = WatchHash(client->storeHash, collection->guid);
 
-	to_watch = StoreWatcherFindWatchItem(client, collection);
-	if (to_watch == NULL)
-		// can't find a free entry
-		goto done;
+	XplMutexLock(WatchStripe(hash));
 
-	if (to_watch->store == NULL) {
+	to_watch = StoreWatcherFindWatchItem(client->storeName, collection->guid, hash, NULL);
+	if (to_watch == NULL) {
 		// we need to start a new item
-		to_watch->store = strdup(client->storeName);
-		memcpy(&(to_watch->collection), collection, sizeof(StoreObject));
-		memset(to_watch->watchers, 0, sizeof(to_watch->watchers));
-	}
-	watchers = to_watch->watchers;
-
-	for (i = 0; i < STORE_COLLECTION_MAX_WATCHERS; i++) {
-		if (watchers[i] == NULL) {
-			watchers[i] = client;
-			retcode = 0;
+		to_watch = MemMalloc0(sizeof(WatchItem));
+		if (to_watch == NULL)
+			goto done;
+		to_watch->store = MemStrdup(client->storeName);
+		if (to_watch->store == NULL) {
+			MemFree(to_watch);
 			goto done;
 		}
+		to_watch->collection = collection->guid;
+		to_watch->hash = hash;
+		to_watch->next = WatchRegistry.buckets[hash & (WatchRegistry.size - 1)];
+		WatchRegistry.buckets[hash & (WatchRegistry.size - 1)] = to_watch;
+
+		XplSafeIncrement(WatchRegistry.items);
+		grow = (uint32_t) XplSafeRead(WatchRegistry.items) > WatchRegistry.size * WATCH_MAX_LOAD;
 	}
 
-	// can't find a free watch slot on this entry
+	if (to_watch->count == to_watch->allocated) {
+		watchers = MemRealloc(to_watch->watchers, 
+			(to_watch->allocated ? to_watch->allocated * 2 : 4) * sizeof(StoreClient *));
+		if (watchers == NULL)
+			goto done;
+		to_watch->watchers = watchers;
+		to_watch->allocated = to_watch->allocated ? to_watch->allocated * 2 : 4;
+	}
+	to_watch->watchers[to_watch->count++] = client;
+	XplSafeIncrement(WatchRegistry.watchers);
+	retcode = 0;
 
 done:
-	XplMutexUnlock(global_watch_list_lock);
+	XplMutexUnlock(WatchStripe(hash));
+
+	if (grow) {
+		StoreWatcherGrow();
+	}
 	return retcode;
 }
 
 /** \internal
- * Remove the client as a watcher of the collection
+ * Remove the client as a watcher of the collection. Once nobody is
+ * watching it, the collection's entry goes too.
  */
 int
 StoreWatcherRemove(StoreClient *client, StoreObject *collection)
 {
 	WatchItem *to_watch = NULL;
-	StoreClient **watchers = NULL;
+	WatchItem **prev = NULL;
+	uint32_t hash;
 	int i;
 	int retcode = -1;
 
-	XplMutexLock(global_watch_list_lock);
+	hash = WatchHash(client->storeHash, collection->guid);
+
+	XplMutexLock(WatchStripe(hash));
 
-	to_watch = StoreWatcherFindWatchItem(client, collection);
-	if ((to_watch == NULL) || (to_watch->store == NULL))
+	to_watch = StoreWatcherFindWatchItem(client->storeName, collection->guid, hash, &prev);
+	if (to_watch == NULL)
 		// can't find the entry
 		goto done;
-    
-	watchers = to_watch->watchers;
 
-	for (i = 0; i < STORE_COLLECTION_MAX_WATCHERS; i++) {
-		if (watchers[i] == client) {
-			watchers[i] = NULL;
+	for (i = 0; i < to_watch->count; i++) {
+		if (to_watch->watchers[i] == client) {
+			to_watch->watchers[i] = to_watch->watchers[--to_watch->count];
+			XplSafeDecrement(WatchRegistry.watchers);
 			retcode = 0;
-			goto done;
+			break;
 		}
 	}
 
-	// FIXME - remove unused slots from the global list, otherwise we run out!
-    
+	if (to_watch->count == 0) {
+		*prev = to_watch->next;
+		XplSafeDecrement(WatchRegistry.items);
+		MemFree(to_watch->watchers);
+		MemFree(to_watch->store);
+		MemFree(to_watch);
+	}
+
 done:
-	XplMutexUnlock(global_watch_list_lock);
+	XplMutexUnlock(WatchStripe(hash));
 	return retcode;
 }
 
@@ -137,36 +236,141 @@ StoreWatcherEvent(StoreClient *thisClient,
 {
 	WatchItem *to_watch = NULL;
 	StoreClient *client;
+	uint32_t hash;
 	int i;
 
-	XplMutexLock(global_watch_list_lock);
+	hash = WatchHash(thisClient->storeHash, object->collection_guid);
 
-	to_watch = StoreWatcherFindWatchItemByGUID(thisClient, object->collection_guid);
-	if ((to_watch == NULL) || (to_watch->store == NULL))
-		// can't find the entry
+	XplMutexLock(WatchStripe(hash));
+
+	to_watch = StoreWatcherFindWatchItem(thisClient->storeName, object->collection_guid, hash, NULL);
+	if (to_watch == NULL)
+		// nobody's watching
 		goto done;
                   
-	for (i = 0; i < STORE_COLLECTION_MAX_WATCHERS; i++) {
-		if (to_watch->watchers[i]) {
-			client = to_watch->watchers[i];
+	for (i = 0; i < to_watch->count; i++) {
+		client = to_watch->watchers[i];
 
-			if (client != thisClient) {
-				if (!(client->watch.flags & event)) {
-					continue;
-				}
-				if (client->watch.journal.count < STORE_CLIENT_WATCH_JOURNAL_LEN) {
-					client->watch.journal.events[client->watch.journal.count] = event;
-					client->watch.journal.guids[client->watch.journal.count] = object->guid;
-					client->watch.journal.imapuids[client->watch.journal.count] = object->imap_uid;
-					client->watch.journal.flags[client->watch.journal.count] = object->flags;
+		if (client != thisClient) {
+			if (!(client->watch.flags & event)) {
+				continue;
+			}
+			if (client->watch.journal.count < STORE_CLIENT_WATCH_JOURNAL_LEN) {
+				client->watch.journal.events[client->watch.journal.count] = event;
+				client->watch.journal.guids[client->watch.journal.count] = object->guid;
+				client->watch.journal.imapuids[client->watch.journal.count] = object->imap_uid;
+				client->watch.journal.flags[client->watch.journal.count] = object->flags;
+			}
+			++client->watch.journal.count;
+			if (client->watch.idle) {
+				// the pipe is non-blocking; if it's full the client is awake anyway
+				if (write(client->watch.wakeup, "", 1)) {
+					;
 				}
-				++client->watch.journal.count;
 			}
 		}
 	}
 
 done: 
-	XplMutexUnlock(global_watch_list_lock);
+	XplMutexUnlock(WatchStripe(hash));
+}
+
+/**
+ * Write out the size of the watch registry as 2001 lines, for the STATS
+ * command.
+ */
+CCode
+StoreWatcherWriteStats(StoreClient *client)
+{
+	return ConnWriteF(client->conn,
+		"2001 watch.collections %d\r\n"
+		"2001 watch.watchers %d\r\n"
+		"2001 watch.buckets %lu\r\n",
+		XplSafeRead(WatchRegistry.items),
+		XplSafeRead(WatchRegistry.watchers),
+		(unsigned long) WatchRegistry.size);
+}
+
+
+/**
+ * Sleep until the client sends a line or an event arrives for the
+ * collection it is watching, writing out the events as they happen.
+ * StoreWatcherEvent() wakes us through a pipe, so an idle client costs
+ * nothing until something changes.
+ * returns: -1 on a connection failure, 0 once a line is waiting
+ */
+CCode
+StoreWatcherIdle(StoreClient *client)
+{
+	CCode ccode = 0;
+	struct pollfd pfd[2];
+	int fds[2];
+	uint32_t hash;
+	char drain[64];
+	BOOL pending;
+
+	if (pipe(fds)) {
+		return -1;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+	hash = WatchHash(client->storeHash, client->watch.collection.guid);
+
+	XplMutexLock(WatchStripe(hash));
+	client->watch.wakeup = fds[1];
+	client->watch.idle = TRUE;
+	pending = client->watch.journal.count > 0;
+	XplMutexUnlock(WatchStripe(hash));
+
+	while (BONGO_AGENT_STATE_RUNNING == StoreAgent.agent.state) {
+		if (pending && client->watch.collection.guid > 0) {
+			ccode = StoreShowWatcherEvents(client);
+			if (-1 == ccode) {
+				break;
+			}
+		}
+		if (-1 == (ccode = ConnFlush(client->conn))) {
+			break;
+		}
+		if (ConnLinePending(client->conn)) {
+			break;
+		}
+
+		pfd[0].fd = client->conn->socket;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		pfd[1].fd = fds[0];
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+
+		// wake up now and then to notice the agent shutting down
+		if (poll(pfd, 2, 60 * 1000) < 0 && errno != EINTR) {
+			ccode = -1;
+			break;
+		}
+
+		pending = FALSE;
+		if (pfd[1].revents & POLLIN) {
+			while (read(fds[0], drain, sizeof(drain)) > 0) {
+				;
+			}
+			pending = TRUE;
+		}
+		if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			break;
+		}
+	}
+
+	XplMutexLock(WatchStripe(hash));
+	client->watch.idle = FALSE;
+	client->watch.wakeup = -1;
+	XplMutexUnlock(WatchStripe(hash));
+
+	close(fds[0]);
+	close(fds[1]);
+
+	return ccode;
 }
 
 
@@ -6,7 +6,11 @@
 #include <xpl.h>
 #include <xpldns.h>
 #include <msgapi.h>
+#include <connio.h>
+#include <nmlib.h>
 #include <arpa/inet.h>
+#include <sys/time.h>
+#include <pthread.h>
 #include "config.h"
 
 #include <libintl.h>
@@ -19,6 +23,11 @@ usage(void) {
                 "Usage: bongo-testtool [command]\n\n"
                 "Commands:\n"
 		" checkmx <domain>	Search for mail exchangers\n"
+		" storebench <user> [<count> [<depth>]]\n"
+		"			Time INFO and FLAG commands against a store\n"
+		" guidbench [<threads> [<block>]]\n"
+		"			Time handing out ids from a shared counter, <block>\n"
+		"			at a time, as the store does its GUIDs\n"
                 "";
 
         XplConsolePrintf("%s", text);
@@ -56,6 +65,139 @@ LookupMxRecords(const char *domain)
 	XplDnsFreeMxLookup(mx);
 }
 
+/* Send count commands to the store, depth at a time before reading
+ * any replies, alternating between the two given. Returns commands per
+ * second, or -1 on error. */
+static double
+StoreBenchRun(Connection *conn, int count, int depth, const char *even, const char *odd)
+{
+	char line[CONN_BUFSIZE + 1];
+	struct timeval start, end;
+	int sent = 0, batch, done, code, i;
+
+	gettimeofday(&start, NULL);
+	while (sent < count) {
+		batch = (count - sent < depth) ? count - sent : depth;
+		for (i = 0; i < batch; i++) {
+			if (ConnWriteStr(conn, ((sent + i) & 1) ? odd : even) < 0) {
+				return -1;
+			}
+		}
+		if (ConnFlush(conn) < 0) {
+			return -1;
+		}
+
+		for (done = 0; done < batch; ) {
+			code = NMAPReadAnswer(conn, line, CONN_BUFSIZE, TRUE);
+			if (code == -1) {
+				return -1;
+			}
+			if (code != 2001) {
+				done++;
+			}
+		}
+		sent += batch;
+	}
+	gettimeofday(&end, NULL);
+
+	return count / ((end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+}
+
+/* Drive a stream of small commands over a single store connection, first
+ * waiting for each reply and then with depth commands in flight. */
+void
+StoreBench(char *user, int count, int depth)
+{
+	Connection *conn;
+	double rate;
+
+	conn = NMAPConnect("127.0.0.1", NULL);
+	if (!conn || !NMAPAuthenticateThenUserAndStore(conn, (unsigned char *)user)) {
+		XplConsolePrintf(_("ERROR: Couldn't open the store for %s\n"), user);
+		if (conn) {
+			NMAPQuit(conn);
+			ConnFree(conn);
+		}
+		return;
+	}
+
+	// neither changes anything: FLAG without a value just shows them
+	rate = StoreBenchRun(conn, count, 1, "INFO /mail/INBOX\r\n", "FLAG /mail/INBOX\r\n");
+	XplConsolePrintf(_("%d commands, one at a time: %.0f/s\n"), count, rate);
+	if (rate >= 0) {
+		rate = StoreBenchRun(conn, count, depth, "INFO /mail/INBOX\r\n", "FLAG /mail/INBOX\r\n");
+		XplConsolePrintf(_("%d commands, %d in flight: %.0f/s\n"), count, depth, rate);
+	}
+
+	NMAPQuit(conn);
+	ConnFree(conn);
+}
+
+#define GUID_BENCH_IDS 10000000
+
+static XplAtomic64 GuidBenchCounter;
+
+/* Hand out ids the way the store's GuidAlloc() does: take a block of them
+ * from the shared counter, then use them up without touching it. */
+static void *
+GuidBenchThread(void *arg)
+{
+	uint64_t block = *(uint64_t *)arg;
+	uint64_t next = 0, left = 0;
+	volatile uint64_t id;
+	int i;
+
+	for (i = 0; i < GUID_BENCH_IDS; i++) {
+		if (left == 0) {
+			next = XplSafeFetchAdd64(GuidBenchCounter, block);
+			left = block;
+		}
+		id = next++;
+		left--;
+	}
+	(void)id;
+	return NULL;
+}
+
+/* Ids handed out per second from one thread up to threads at once; this
+ * shouldn't fall as threads are added, unless there are fewer cpus. */
+void
+GuidBench(int threads, int block)
+{
+	pthread_t *ids;
+	struct timeval start, end;
+	uint64_t size = (block > 0) ? block : 1;
+	double seconds;
+	int n, i;
+
+	if (threads < 1) {
+		threads = 1;
+	}
+	ids = MemMalloc0(threads * sizeof(pthread_t));
+	if (!ids) {
+		return;
+	}
+
+	for (n = 1; n <= threads; n *= 2) {
+		XplSafeWrite(GuidBenchCounter, 0);
+		gettimeofday(&start, NULL);
+		for (i = 0; i < n; i++) {
+			pthread_create(&ids[i], NULL, GuidBenchThread, &size);
+		}
+		for (i = 0; i < n; i++) {
+			pthread_join(ids[i], NULL);
+		}
+		gettimeofday(&end, NULL);
+
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+		XplConsolePrintf(_("%d threads, blocks of %d: %.0f ids/s (%ld cpus)\n"),
+			n, (int)size, n * (double)GUID_BENCH_IDS / seconds, 
+			sysconf(_SC_NPROCESSORS_ONLN));
+	}
+
+	MemFree(ids);
+}
+
 int 
 main(int argc, char *argv[]) {
 	int next_arg = 0;
@@ -70,6 +212,10 @@ main(int argc, char *argv[]) {
 	if (next_arg < argc) {
 		if (!strcmp(argv[next_arg], "checkmx")) { 
 			command = 1;
+		} else if (!strcmp(argv[next_arg], "storebench")) {
+			command = 2;
+		} else if (!strcmp(argv[next_arg], "guidbench")) {
+			command = 3;
 		} else {
 			printf(_("Unrecognized command: %s\n"), argv[next_arg]);
 		}
@@ -95,6 +241,21 @@ main(int argc, char *argv[]) {
 				LookupMxRecords(argv[next_arg]);
 			}
 			break;
+		case 2:
+			next_arg++;
+			if (next_arg >= argc) {
+				printf(_("Usage: storebench <user> [<count> [<depth>]]\n"));
+			} else {
+				StoreBench(argv[next_arg],
+					(next_arg + 1 < argc) ? atoi(argv[next_arg + 1]) : 1000000,
+					(next_arg + 2 < argc) ? atoi(argv[next_arg + 2]) : 64);
+			}
+			break;
+		case 3:
+			next_arg++;
+			GuidBench((next_arg < argc) ? atoi(argv[next_arg]) : 8,
+				(next_arg + 1 < argc) ? atoi(argv[next_arg + 1]) : 1024);
+			break;
 		default:
 			break;
 	}
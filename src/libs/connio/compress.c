@@ -0,0 +1,253 @@
+/****************************************************************************
+ * <Novell-copyright>
+ * Copyright (c) 2001 Novell, Inc. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, contact Novell, Inc.
+ *
+ * To contact Novell about this file by physical or electronic mail, you
+ * may find current contact information at www.novell.com.
+ * </Novell-copyright>
+ ****************************************************************************/
+
+#include <config.h>
+#include <xpl.h>
+#include <memmgr.h>
+
+#include <connio.h>
+#include <zlib.h>
+
+#include "conniop.h"
+
+/* Streaming deflate layer.  It sits between the connection buffers and */
+/* ConnTcpRawRead()/ConnTcpRawWrite(), so it composes with tls: data is */
+/* compressed first and the compressed stream is what gets encrypted. */
+
+typedef struct {
+    z_stream deflate;
+    z_stream inflate;
+
+    /* inflate filled the caller's buffer last time and may hold more output */
+    BOOL pending;
+
+    /* compressed bytes read off the wire but not yet inflated */
+    char in[CONN_TCP_MTU];
+} ConnCompressState;
+
+/* what one connection is expected to cost once both streams are warm; */
+/* used to turn new sessions away before the global budget is exceeded */
+#define CONN_COMPRESS_COST   (sizeof(ConnCompressState) \
+                              + (1 << (CONN_COMPRESS_WINDOW_BITS + 2)) \
+                              + (1 << (CONN_COMPRESS_MEM_LEVEL + 9)) \
+                              + (1 << 15) \
+                              + (16 * 1024))
+
+static voidpf
+CompressAlloc(voidpf opaque, uInt items, uInt size)
+{
+    size_t *block;
+    size_t bytes = (size_t)items * size;
+
+    UNUSED_PARAMETER(opaque);
+
+    /* remember the size so that CompressFree() can give it back */
+    block = (size_t *)MemMalloc(sizeof(size_t) + bytes);
+    if (block) {
+        block[0] = bytes;
+        XplSafeAdd(ConnIO.compress.memory, (int)bytes);
+        return((voidpf)(block + 1));
+    }
+
+    return(Z_NULL);
+}
+
+static void
+CompressFree(voidpf opaque, voidpf address)
+{
+    size_t *block = (size_t *)address - 1;
+
+    UNUSED_PARAMETER(opaque);
+
+    XplSafeSub(ConnIO.compress.memory, (int)block[0]);
+    MemFree(block);
+}
+
+static int
+CompressSend(Connection *c, char *b, size_t l)
+{
+    size_t sent;
+
+    while (l > 0) {
+        if ((ConnTcpRawWrite(c, b, l, &sent) != 0) || (sent == 0)) {
+            return(-1);
+        }
+        b += sent;
+        l -= sent;
+    }
+
+    return(0);
+}
+
+/* Whether the compression memory budget can take another connection.  The */
+/* check is advisory; protocols use it to refuse before committing to a */
+/* reply that switches compression on. */
+BOOL
+ConnCompressAvailable(void)
+{
+    return((unsigned long)XplSafeRead(ConnIO.compress.memory) + CONN_COMPRESS_COST <= ConnIO.compress.limit);
+}
+
+/* Size the compression memory budget for this many sessions at once. */
+void
+ConnCompressSetSessions(unsigned long sessions)
+{
+    ConnIO.compress.limit = sessions * CONN_COMPRESS_COST;
+}
+
+/* Start compressing both directions.  Anything already buffered for sending */
+/* is flushed uncompressed first; the protocol reply announcing compression */
+/* must be the last thing the peer sees in the clear. */
+int
+ConnCompress(Connection *conn)
+{
+    register Connection *c = conn;
+    ConnCompressState *state;
+
+    if (c->compress.enable) {
+        return(-1);
+    }
+
+    if (!ConnCompressAvailable()) {
+        CONN_TRACE_ERROR(c, "COMPRESS LIMIT", XplSafeRead(ConnIO.compress.memory));
+        return(-1);
+    }
+
+    if (c->send.buffer && (ConnFlush(c) == -1)) {
+        return(-1);
+    }
+
+    state = (ConnCompressState *)MemMalloc(sizeof(ConnCompressState));
+    if (state) {
+        memset(state, 0, sizeof(ConnCompressState));
+        XplSafeAdd(ConnIO.compress.memory, (int)sizeof(ConnCompressState));
+
+        state->deflate.zalloc = CompressAlloc;
+        state->deflate.zfree = CompressFree;
+        state->inflate.zalloc = CompressAlloc;
+        state->inflate.zfree = CompressFree;
+
+        /* negative window bits select a raw stream without zlib framing */
+        if (deflateInit2(&state->deflate, CONN_COMPRESS_LEVEL, Z_DEFLATED, -CONN_COMPRESS_WINDOW_BITS, CONN_COMPRESS_MEM_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK) {
+            if (inflateInit2(&state->inflate, -MAX_WBITS) == Z_OK) {
+                c->compress.state = state;
+                c->compress.enable = TRUE;
+                return(0);
+            }
+
+            deflateEnd(&state->deflate);
+        }
+
+        XplSafeSub(ConnIO.compress.memory, (int)sizeof(ConnCompressState));
+        MemFree(state);
+    }
+
+    return(-1);
+}
+
+void
+ConnCompressEnd(Connection *c)
+{
+    ConnCompressState *state = (ConnCompressState *)c->compress.state;
+
+    c->compress.enable = FALSE;
+    c->compress.state = NULL;
+
+    if (state) {
+        deflateEnd(&state->deflate);
+        inflateEnd(&state->inflate);
+
+        XplSafeSub(ConnIO.compress.memory, (int)sizeof(ConnCompressState));
+        MemFree(state);
+    }
+}
+
+/* Callers only write when a send buffer fills or is flushed, so every write */
+/* ends with a sync flush; the peer can then decode each response as soon as */
+/* it arrives instead of waiting for the next one to push it out. */
+int
+ConnCompressWrite(Connection *c, char *b, size_t l, size_t *r)
+{
+    ConnCompressState *state = (ConnCompressState *)c->compress.state;
+    char out[CONN_TCP_MTU];
+    int ccode;
+
+    state->deflate.next_in = (Bytef *)b;
+    state->deflate.avail_in = l;
+
+    do {
+        state->deflate.next_out = (Bytef *)out;
+        state->deflate.avail_out = sizeof(out);
+
+        ccode = deflate(&state->deflate, Z_SYNC_FLUSH);
+        if ((ccode != Z_OK) && (ccode != Z_BUF_ERROR)) {
+            CONN_TRACE_ERROR(c, "DEFLATE", ccode);
+            *r = 0;
+            return(-1);
+        }
+
+        if (CompressSend(c, out, sizeof(out) - state->deflate.avail_out) != 0) {
+            *r = 0;
+            return(-1);
+        }
+    } while (state->deflate.avail_out == 0);
+
+    *r = l;
+    return(0);
+}
+
+int
+ConnCompressRead(Connection *c, char *b, size_t l, size_t *r)
+{
+    ConnCompressState *state = (ConnCompressState *)c->compress.state;
+    size_t count;
+    int ccode;
+
+    do {
+        if (state->pending || (state->inflate.avail_in > 0)) {
+            state->inflate.next_out = (Bytef *)b;
+            state->inflate.avail_out = l;
+
+            ccode = inflate(&state->inflate, Z_SYNC_FLUSH);
+            if ((ccode != Z_OK) && (ccode != Z_BUF_ERROR) && (ccode != Z_STREAM_END)) {
+                CONN_TRACE_ERROR(c, "INFLATE", ccode);
+                *r = 0;
+                return(-1);
+            }
+
+            state->pending = (state->inflate.avail_out == 0);
+            if (state->inflate.avail_out < l) {
+                *r = l - state->inflate.avail_out;
+                return(0);
+            }
+        }
+
+        /* nothing decoded yet; the rest of the block is still on the wire */
+        ccode = ConnTcpRawRead(c, state->in, sizeof(state->in), &count);
+        if ((ccode != 0) || (count == 0)) {
+            *r = 0;
+            return(ccode);
+        }
+
+        state->inflate.next_in = (Bytef *)state->in;
+        state->inflate.avail_in = count;
+    } while (TRUE);
+}
@@ -159,6 +159,8 @@ ConnStartup(unsigned long TimeOut)
     ConnIO.encryption.enabled = FALSE;
     ConnIO.trace.enabled = FALSE;
     ConnIO.encryption.enabled = TRUE;
+    XplSafeWrite(ConnIO.compress.memory, 0);
+    ConnCompressSetSessions(CONN_COMPRESS_SESSIONS);
 
     IPInit();
 
@@ -504,6 +506,10 @@ ConnFree(Connection *Conn)
         ConnTcpClose(c);
     }
 
+    if (c->compress.state) {
+        ConnCompressEnd(c);
+    }
+
     if (c->receive.buffer) {
         MemFree(c->receive.buffer);
     }
@@ -995,6 +1001,23 @@ ConnReadAnswer(Connection *Conn, char *Line, int Length)
     return(dest - Line);
 }
 
+/**
+ * Find out whether a whole line has already been received, so that
+ * reading it won't have to wait for the peer. Anything still inside the
+ * SSL layer doesn't count.
+ * \param	Conn	Connection to look at
+ * \return	TRUE if ConnReadLine() or ConnReadAnswer() can return at once
+ */
+BOOL
+ConnLinePending(Connection *Conn)
+{
+    if (Conn->receive.read == NULL || Conn->receive.read >= Conn->receive.write) {
+        return(FALSE);
+    }
+
+    return(memchr(Conn->receive.read, '\n', Conn->receive.write - Conn->receive.read) != NULL);
+}
+
 /**
  * Append bytes to a buffer, allocating the buffer and/or resizing it as necessary.
  * If enough space cannot be allocated, the buffer is destroyed, and further calls
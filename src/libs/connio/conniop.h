@@ -37,6 +37,11 @@ typedef struct _ConnIO {
         BOOL enabled;
     } encryption;
 
+    struct {
+        XplAtomic memory;
+        unsigned long limit;
+    } compress;
+
     struct {
         BOOL enabled;
         unsigned long flags;
@@ -52,4 +57,11 @@ BOOL __gnutls_new(Connection *conn, bongo_ssl_context *context, gnutls_connectio
 long ConnAppendToAllocatedBuffer(const char *source, const long size, char **buffer,
     unsigned long start_of_buffer, unsigned long *buffersize);
 
+int ConnTcpRawWrite(Connection *c, char *b, size_t l, size_t *r);
+int ConnTcpRawRead(Connection *c, char *b, size_t l, size_t *r);
+
+int ConnCompressWrite(Connection *c, char *b, size_t l, size_t *r);
+int ConnCompressRead(Connection *c, char *b, size_t l, size_t *r);
+void ConnCompressEnd(Connection *c);
+
 #endif
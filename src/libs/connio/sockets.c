@@ -5,6 +5,7 @@
 #include <xpl.h>
 #include <connio.h>
 #include "config.h"
+#include "conniop.h"
 
 void
 CHOP_NEWLINE(char *s)
@@ -64,6 +65,9 @@ ConnTcpClose(Connection *c)
 		c->send.remaining = 0;
 	}
 	c->send.read = c->send.write = c->send.buffer;
+	if (c->compress.enable) {
+		ConnCompressEnd(c);
+	}
 	if (c->ssl.enable) {
 		if (c->ssl.context) {
 			gnutls_bye(c->ssl.context, GNUTLS_SHUT_RDWR);
@@ -80,7 +84,27 @@ ConnTcpClose(Connection *c)
 }
 
 int
-ConnTcpRead(Connection *c, char *b, size_t l, size_t *r) 
+ConnTcpRead(Connection *c, char *b, size_t l, size_t *r)
+{
+	if (c->compress.enable) {
+		return ConnCompressRead(c, b, l, r);
+	}
+	return ConnTcpRawRead(c, b, l, r);
+}
+
+int
+ConnTcpWrite(Connection *c, char *b, size_t l, size_t *r)
+{
+	if (c->compress.enable) {
+		return ConnCompressWrite(c, b, l, r);
+	}
+	return ConnTcpRawWrite(c, b, l, r);
+}
+
+/* the Raw variants talk to the socket (or tls) directly, below any compression */
+
+int
+ConnTcpRawRead(Connection *c, char *b, size_t l, size_t *r) 
 {
 	int Result=0;
 
@@ -132,7 +156,7 @@ ConnTcpRead(Connection *c, char *b, size_t l, size_t *r)
 }
 
 int
-ConnTcpWrite(Connection *c, char *b, size_t l, size_t *r)
+ConnTcpRawWrite(Connection *c, char *b, size_t l, size_t *r)
 {
 	int Result=0;
 
@@ -15,6 +15,40 @@
 #include <msgapi.h>
 #include <sqlite3.h>
 #include <logger.h>
+#include <bongoutil.h>
+
+/** \internal
+ * Change the number of prepared statements the handle keeps. Any cached
+ * statements are thrown away, so this mustn't be called while one of
+ * them is in use.
+ */
+static void
+MsgSQLStatementCacheResize(MsgSQLHandle *handle, int size)
+{
+	MsgSQLCachedStatement *entry;
+	int i;
+
+	XplMutexLock(handle->cache.lock);
+	for (i = 0; i < handle->cache.size; i++) {
+		entry = &handle->cache.entries[i];
+		if (entry->inUse) {
+			Log(LOG_ERROR, "sql3: cached statement \"%s\" still in use", entry->query);
+		}
+		if (entry->stmt) sqlite3_finalize(entry->stmt);
+		MemFree(entry->query);
+	}
+	MemFree(handle->cache.entries);
+	handle->cache.entries = NULL;
+	handle->cache.size = 0;
+
+	if (size > 0) {
+		handle->cache.entries = MemMalloc0(sizeof(MsgSQLCachedStatement) * size);
+		if (handle->cache.entries) {
+			handle->cache.size = size;
+		}
+	}
+	XplMutexUnlock(handle->cache.lock);
+}
 
 MsgSQLHandle *
 MsgSQLOpen(char *path, BongoMemStack *memstack, int locktimeoutms)
@@ -42,8 +76,12 @@ MsgSQLOpen(char *path, BongoMemStack *memstack, int locktimeoutms)
 
 	handle->memstack = memstack;
 	handle->lockTimeoutMs = locktimeoutms;
+	// let SQLite wait for locks itself, rather than us polling
+	sqlite3_busy_timeout(handle->db, locktimeoutms);
 	handle->transactionDepth = 0;
+	handle->transactionOwner = 0;
 	XplMutexInit(handle->transactionLock);
+	XplMutexInit(handle->cache.lock);
 
 	if (create) {
 		handle->isNew = TRUE;
@@ -64,6 +102,8 @@ void
 MsgSQLClose(MsgSQLHandle *handle)
 {
 	MsgSQLReset(handle);
+	MsgSQLStatementCacheResize(handle, 0);
+	XplMutexDestroy(handle->cache.lock);
 	XplMutexDestroy(handle->transactionLock);
 	if (SQLITE_BUSY == sqlite3_close(handle->db)) {
 		Log(LOG_ERROR, "sql3: couldn't close database");
@@ -89,7 +129,19 @@ void
 MsgSQLFinalize(MsgSQLStatement *stmt)
 {
 	int result;
-	if (stmt->stmt) {
+	if (stmt->cached) {
+		MsgSQLCachedStatement *entry = stmt->cached;
+
+		// give it back to the cache rather than throwing it away
+		sqlite3_reset(stmt->stmt);
+		sqlite3_clear_bindings(stmt->stmt);
+		XplMutexLock(entry->handle->cache.lock);
+		entry->inUse = FALSE;
+		XplMutexUnlock(entry->handle->cache.lock);
+		Log(LOG_TRACE, "sql3: return stmt %ld", stmt->stmt);
+		stmt->cached = NULL;
+		stmt->stmt = NULL;
+	} else if (stmt->stmt) {
 		result = sqlite3_finalize(stmt->stmt);
 		if (result != SQLITE_OK)
 			Log(LOG_ERROR, "sql3: Error finalizing statement: %d", result);
@@ -128,6 +180,172 @@ void
 MsgSQLSetLockTimeout(MsgSQLHandle *handle, int timeoutms)
 {
 	handle->lockTimeoutMs = timeoutms;
+	sqlite3_busy_timeout(handle->db, timeoutms);
+}
+
+/**
+ * Apply a set of performance settings to an open database. Switching
+ * to WAL is remembered in the file itself, so the first open of an older
+ * database converts it and later opens find it already done; the other
+ * settings only last as long as the handle.
+ * 
+ * \return	0 on success, -1 if any of the settings couldn't be applied
+ */
+int
+MsgSQLTune(MsgSQLHandle *handle, const MsgSQLTuning *tuning)
+{
+	char query[128];
+	sqlite3_stmt *stmt;
+	const char *mode;
+	int ret = 0;
+
+	if (tuning->wal) {
+		if (SQLITE_OK != sqlite3_prepare(handle->db, "PRAGMA journal_mode;", -1, &stmt, NULL)) {
+			return -1;
+		}
+		if (SQLITE_ROW == sqlite3_step(stmt)) {
+			mode = (const char *)sqlite3_column_text(stmt, 0);
+			if (mode && strcasecmp(mode, "wal")) {
+				Log(LOG_INFO, "sql3: converting database from %s to wal journal", mode);
+				sqlite3_finalize(stmt);
+				if (SQLITE_OK != sqlite3_prepare(handle->db, "PRAGMA journal_mode=WAL;", -1, &stmt, NULL)) {
+					return -1;
+				}
+				if (SQLITE_ROW != sqlite3_step(stmt) ||
+				    strcasecmp((const char *)sqlite3_column_text(stmt, 0), "wal")) {
+					// most likely someone else has it open; try next time
+					Log(LOG_WARNING, "sql3: couldn't switch database to wal: %s", sqlite3_errmsg(handle->db));
+					ret = -1;
+				}
+			}
+		}
+		sqlite3_finalize(stmt);
+
+		// a crash can only lose the last few commits, not corrupt anything
+		if (MsgSQLQuickExecute(handle, "PRAGMA synchronous=NORMAL;")) ret = -1;
+	}
+
+	if (tuning->cacheSizeKB > 0) {
+		// negative means kibibytes, rather than pages
+		snprintf(query, sizeof(query), "PRAGMA cache_size=-%d;", tuning->cacheSizeKB);
+		if (MsgSQLQuickExecute(handle, query)) ret = -1;
+	}
+
+	if (tuning->statementCacheSize != handle->cache.size) {
+		MsgSQLStatementCacheResize(handle, tuning->statementCacheSize);
+	}
+
+	if (tuning->mmapSize > 0) {
+		// returns a row, so sqlite3_exec() is simplest
+		snprintf(query, sizeof(query), "PRAGMA mmap_size=%lld;", (long long)tuning->mmapSize);
+		if (MsgSQLQuickExecute(handle, query)) ret = -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Copy committed transactions from the write-ahead log back into the
+ * database, without waiting for readers or writers. Waits for any
+ * transaction in progress on this handle to finish first.
+ * 
+ * \return	0 on success, -1 on error
+ */
+int
+MsgSQLCheckpoint(MsgSQLHandle *handle)
+{
+	int result, logged = 0, copied = 0;
+
+	XplMutexLock(handle->transactionLock);
+	result = sqlite3_wal_checkpoint_v2(handle->db, NULL, SQLITE_CHECKPOINT_PASSIVE, &logged, &copied);
+	XplMutexUnlock(handle->transactionLock);
+
+	if (result != SQLITE_OK) {
+		Log(LOG_ERROR, "sql3: Checkpoint failed (%d): %s", result, sqlite3_errmsg(handle->db));
+		return -1;
+	}
+	Log(LOG_TRACE, "sql3: checkpointed %d of %d frames", copied, logged);
+	return 0;
+}
+
+/** \internal
+ * Read a pragma which answers with a single number.
+ * \return	0 on success, -1 on error
+ */
+static int
+MsgSQLPragmaInt64(MsgSQLHandle *handle, const char *pragma, int64_t *value)
+{
+	sqlite3_stmt *stmt;
+	int ret = -1;
+
+	if (SQLITE_OK != sqlite3_prepare_v2(handle->db, pragma, -1, &stmt, NULL)) {
+		return -1;
+	}
+	if (SQLITE_ROW == sqlite3_step(stmt)) {
+		*value = sqlite3_column_int64(stmt, 0);
+		ret = 0;
+	}
+	sqlite3_finalize(stmt);
+	return ret;
+}
+
+/**
+ * Find out how much of a database file is going unused, so that the
+ * caller can decide whether it's worth vacuuming.
+ * \return	0 on success, -1 on error
+ */
+int
+MsgSQLGetSpace(MsgSQLHandle *handle, MsgSQLSpace *space)
+{
+	int64_t autovacuum = 0;
+	int ret = 0;
+
+	memset(space, 0, sizeof(MsgSQLSpace));
+
+	XplMutexLock(handle->transactionLock);
+	if (MsgSQLPragmaInt64(handle, "PRAGMA page_count;", &space->pageCount) ||
+	    MsgSQLPragmaInt64(handle, "PRAGMA freelist_count;", &space->freePages) ||
+	    MsgSQLPragmaInt64(handle, "PRAGMA page_size;", &space->pageSize) ||
+	    MsgSQLPragmaInt64(handle, "PRAGMA auto_vacuum;", &autovacuum)) {
+		Log(LOG_ERROR, "sql3: Couldn't read database space: %s", sqlite3_errmsg(handle->db));
+		ret = -1;
+	}
+	XplMutexUnlock(handle->transactionLock);
+
+	// 2 is INCREMENTAL; FULL (1) gives pages back by itself
+	space->incremental = (autovacuum == 2);
+	return ret;
+}
+
+/**
+ * Give unused pages at the end of a database back to the filesystem.
+ * Waits for any transaction in progress on this handle to finish first.
+ *
+ * A database which isn't set up for incremental vacuuming has to be
+ * rebuilt once to convert it, which means copying the whole file and
+ * keeping everyone else out until it's done; pass 0 for that. After that
+ * it can be done a few pages at a time.
+ *
+ * \param	pages	How many pages to free, or 0 to rebuild the database
+ * \return	0 on success, -1 on error
+ */
+int
+MsgSQLVacuum(MsgSQLHandle *handle, int pages)
+{
+	char query[64];
+	int ret;
+
+	XplMutexLock(handle->transactionLock);
+	if (pages > 0) {
+		snprintf(query, sizeof(query), "PRAGMA incremental_vacuum(%d);", pages);
+		ret = MsgSQLQuickExecute(handle, query);
+	} else {
+		ret = MsgSQLQuickExecute(handle, "PRAGMA auto_vacuum=INCREMENTAL;");
+		if (!ret) ret = MsgSQLQuickExecute(handle, "VACUUM;");
+	}
+	XplMutexUnlock(handle->transactionLock);
+
+	return ret;
 }
 
 // returns 0 on success, -2 db busy, -1 on error
@@ -135,12 +353,22 @@ int
 MsgSQLBeginTransaction(MsgSQLHandle *handle)
 {
 	MsgSQLStatement *stmt;
-	int result, reset;
-	int count = 1 + handle->lockTimeoutMs / MSGSQL_STMT_SLEEP_MS;
+	int result;
 	BOOL locked = FALSE;
 	
+	// we already have a transaction open: nest this one inside it, so
+	// that it can be rolled back on its own
+	if (handle->transactionDepth > 0 && handle->transactionOwner == XplGetThreadID()) {
+		if (MsgSQLQuickExecute(handle, "SAVEPOINT msgsql_nested;")) {
+			return -1;
+		}
+		++(handle->transactionDepth);
+		return 0;
+	}
+
 	// acquire the transaction lock to prevent other people doing stuff 
 	XplMutexLock(handle->transactionLock);
+	handle->transactionOwner = XplGetThreadID();
 	if (locked) {
 		Log(LOG_TRACE, "sql3: Acquired lock successfully");
 	}
@@ -148,26 +376,35 @@ MsgSQLBeginTransaction(MsgSQLHandle *handle)
 	stmt = MsgSQLPrepare(handle, "BEGIN TRANSACTION;", &handle->stmts.begin);
 	if (!stmt) {
 		Log(LOG_ERROR, "sql3: Unable to begin transaction");
-		return -1;
+		result = -1;
+		goto fail;
 	}
 
-	do {
-		result = sqlite3_step(stmt->stmt);
-		Log(LOG_TRACE, "sql3: BEGIN TRAN stmt %ld", stmt->stmt);
-		reset = sqlite3_reset(stmt->stmt);
-		Log(LOG_TRACE, "sql: - bt reset stmt %ld", stmt->stmt);
-	} while (SQLITE_BUSY == result && --count && (XplDelay(MSGSQL_STMT_SLEEP_MS), 1));
+	// any waiting for the database lock happens in the busy handler
+	result = sqlite3_step(stmt->stmt);
+	Log(LOG_TRACE, "sql3: BEGIN TRAN stmt %ld", stmt->stmt);
+	sqlite3_reset(stmt->stmt);
+	Log(LOG_TRACE, "sql: - bt reset stmt %ld", stmt->stmt);
 
 	switch (result) {
 		case SQLITE_DONE:
 			++(handle->transactionDepth);
 			return 0;
 		case SQLITE_BUSY:
-			return -2;
+			result = -2;
+			break;
 		default:
 			Log(LOG_ERROR, "sql3: Database error %d : %s", result, sqlite3_errmsg(handle->db));
-			return -1;
+			result = -1;
+			break;
 	}
+
+fail:
+	// there's no transaction for the caller to commit or abort, so let
+	// everyone else back in
+	handle->transactionOwner = 0;
+	XplMutexUnlock(handle->transactionLock);
+	return result;
 }
 
 // returns 0 on success, -1 on error
@@ -176,7 +413,14 @@ MsgSQLCommitTransaction(MsgSQLHandle *handle)
 {
 	MsgSQLStatement *stmt;
 	int result;
-	int count = 1 + handle->lockTimeoutMs / MSGSQL_STMT_SLEEP_MS;
+
+	if (handle->transactionDepth > 1) {
+		if (MsgSQLQuickExecute(handle, "RELEASE msgsql_nested;")) {
+			return -1;
+		}
+		--handle->transactionDepth;
+		return 0;
+	}
 
 	stmt = MsgSQLPrepare(handle, "END TRANSACTION;", &handle->stmts.end);
 	if (!stmt) {
@@ -184,12 +428,10 @@ MsgSQLCommitTransaction(MsgSQLHandle *handle)
 		return -1;
 	}
 
-	do {
-		result = sqlite3_step(stmt->stmt);
-		Log(LOG_TRACE, "sql3: COMMIT stmt %ld", stmt->stmt);
-		sqlite3_reset(stmt->stmt);
-		Log(LOG_TRACE, "sql3:  - ct reset stmt %ld", stmt->stmt);
-	} while (SQLITE_BUSY == result && --count && (XplDelay(MSGSQL_STMT_SLEEP_MS), 1));
+	result = sqlite3_step(stmt->stmt);
+	Log(LOG_TRACE, "sql3: COMMIT stmt %ld", stmt->stmt);
+	sqlite3_reset(stmt->stmt);
+	Log(LOG_TRACE, "sql3:  - ct reset stmt %ld", stmt->stmt);
 
 	if (SQLITE_DONE != result) {
 		Log(LOG_ERROR, "sql3: Database commit error %d: %s", result, sqlite3_errmsg(handle->db));
@@ -197,6 +439,7 @@ MsgSQLCommitTransaction(MsgSQLHandle *handle)
 	}
 
 	--handle->transactionDepth;
+	handle->transactionOwner = 0;
 	XplMutexUnlock(handle->transactionLock);
 
 	return 0;
@@ -209,6 +452,14 @@ MsgSQLAbortTransaction(MsgSQLHandle *handle)
 	MsgSQLStatement *stmt;
 	int result;
 
+	if (handle->transactionDepth > 1) {
+		// only undo what the nested transaction did
+		result = MsgSQLQuickExecute(handle, 
+			"ROLLBACK TO msgsql_nested; RELEASE msgsql_nested;");
+		--handle->transactionDepth;
+		return result;
+	}
+
 	stmt = MsgSQLPrepare(handle, "ROLLBACK TRANSACTION;", &handle->stmts.abort);
 	if (!stmt) {
 		Log(LOG_ERROR, "sql3: Unable to rollback transaction");
@@ -223,6 +474,7 @@ MsgSQLAbortTransaction(MsgSQLHandle *handle)
 	sqlite3_reset(stmt->stmt);
 	Log(LOG_TRACE, "sql3: - at reset stmt %ld\n", stmt->stmt);
 	--handle->transactionDepth;
+	handle->transactionOwner = 0;
 	XplMutexUnlock(handle->transactionLock);
 	
 	return SQLITE_DONE == result ? 0 : -1;
@@ -243,7 +495,6 @@ MsgSQLStatement *
 MsgSQLPrepare(MsgSQLHandle *handle, const char *statement, MsgSQLStatement *stmt)
 {
 	int ret;
-	int count = 1 + handle->lockTimeoutMs / MSGSQL_STMT_SLEEP_MS;
 
 	Log(LOG_TRACE, "sql3: PREPARE '%s'", statement);
 	// stmt->filter = NULL;
@@ -254,24 +505,129 @@ MsgSQLPrepare(MsgSQLHandle *handle, const char *statement, MsgSQLStatement *stmt
 	}
 	stmt->query = statement;
 
-	while (count--) {
-		ret = sqlite3_prepare(handle->db, statement, -1, &stmt->stmt, NULL);
-		Log(LOG_TRACE, "sql3: - new statement %ld", stmt->stmt);
-		
-		switch (ret) {
-			case SQLITE_OK:
-				return stmt;
-			case SQLITE_BUSY:
-				XplDelay(MSGSQL_STMT_SLEEP_MS);
-				continue;
-			default:
-				Log(LOG_ERROR, "sql3: Prepare statement \"%s\" failed; %s", 
-					statement, sqlite3_errmsg(handle->db));
-				return NULL;
-		}
+	ret = sqlite3_prepare(handle->db, statement, -1, &stmt->stmt, NULL);
+	Log(LOG_TRACE, "sql3: - new statement %ld", stmt->stmt);
+	
+	if (ret != SQLITE_OK) {
+		Log(LOG_ERROR, "sql3: Prepare statement \"%s\" failed; %s", 
+			statement, sqlite3_errmsg(handle->db));
+		return NULL;
 	}
 	
-	return NULL;
+	return stmt;
+}
+
+/**
+ * Like MsgSQLPrepare(), but the prepared statement is kept in a cache on
+ * the handle, keyed on the statement text, so the next caller with the
+ * same text can skip the parsing. The caller must still MsgSQLFinalize()
+ * the statement once done, which gives it back to the cache.
+ * Only use this for statements whose text repeats: anything with values
+ * pasted into the text would just push useful statements out.
+ */
+MsgSQLStatement *
+MsgSQLPrepareCached(MsgSQLHandle *handle, const char *statement, MsgSQLStatement *stmt)
+{
+	MsgSQLCachedStatement *entry = NULL;
+	MsgSQLCachedStatement *victim = NULL;
+	sqlite3_stmt *prepared = NULL;
+	uint32_t hash;
+	int i;
+
+	if (stmt == NULL) return NULL;
+	if (stmt->stmt) return stmt;
+	if (handle->cache.size == 0) {
+		return MsgSQLPrepare(handle, statement, stmt);
+	}
+
+	hash = BongoStringHash((char *)statement);
+
+	XplMutexLock(handle->cache.lock);
+	for (i = 0; i < handle->cache.size; i++) {
+		entry = &handle->cache.entries[i];
+		if (entry->stmt && entry->hash == hash && !strcmp(entry->query, statement)) {
+			break;
+		}
+		entry = NULL;
+	}
+	if (entry && !entry->inUse) {
+		entry->inUse = TRUE;
+		entry->lastUsed = ++handle->cache.clock;
+		handle->cache.hits++;
+		XplMutexUnlock(handle->cache.lock);
+
+		Log(LOG_TRACE, "sql3: PREPARE (cached) '%s'", statement);
+		stmt->stmt = entry->stmt;
+		stmt->query = entry->query;
+		stmt->cached = entry;
+		return stmt;
+	}
+	handle->cache.misses++;
+	XplMutexUnlock(handle->cache.lock);
+
+	if (entry) {
+		// someone else has this one just now, e.g. a nested iteration
+		return MsgSQLPrepare(handle, statement, stmt);
+	}
+
+	// _v2 so that a schema change re-prepares the statement for us,
+	// rather than failing whoever has it next
+	if (SQLITE_OK != sqlite3_prepare_v2(handle->db, statement, -1, &prepared, NULL)) {
+		Log(LOG_ERROR, "sql3: Prepare statement \"%s\" failed; %s", 
+			statement, sqlite3_errmsg(handle->db));
+		return NULL;
+	}
+	Log(LOG_TRACE, "sql3: PREPARE (new cached) '%s'", statement);
+
+	XplMutexLock(handle->cache.lock);
+	// take an empty slot, or the least recently used free one
+	for (i = 0; i < handle->cache.size; i++) {
+		entry = &handle->cache.entries[i];
+		if (entry->inUse) continue;
+		if (entry->stmt && entry->hash == hash && !strcmp(entry->query, statement)) {
+			// another thread beat us to it; keep ours out of the cache
+			victim = NULL;
+			break;
+		}
+		if (!victim || (victim->stmt && (!entry->stmt || entry->lastUsed < victim->lastUsed))) {
+			victim = entry;
+		}
+	}
+	if (victim) {
+		if (victim->stmt) {
+			sqlite3_finalize(victim->stmt);
+			MemFree(victim->query);
+		}
+		victim->query = MemStrdup(statement);
+		victim->hash = hash;
+		victim->stmt = prepared;
+		victim->inUse = TRUE;
+		victim->lastUsed = ++handle->cache.clock;
+		victim->handle = handle;
+	}
+	XplMutexUnlock(handle->cache.lock);
+
+	stmt->stmt = prepared;
+	if (victim) {
+		stmt->query = victim->query;
+		stmt->cached = victim;
+	} else {
+		// everything's busy; this one is finalized as normal
+		stmt->query = statement;
+	}
+	return stmt;
+}
+
+/**
+ * Report how often MsgSQLPrepareCached() found its statement ready.
+ */
+void
+MsgSQLStatementCacheStats(MsgSQLHandle *handle, uint64_t *hits, uint64_t *misses)
+{
+	XplMutexLock(handle->cache.lock);
+	*hits = handle->cache.hits;
+	*misses = handle->cache.misses;
+	XplMutexUnlock(handle->cache.lock);
 }
 
 int
@@ -310,6 +666,13 @@ MsgSQLBindInt64(MsgSQLStatement *stmt, int var, uint64_t value)
 	return sqlite3_bind_int64(stmt->stmt, var, value);
 }
 
+int
+MsgSQLBindBlob(MsgSQLStatement *stmt, int var, const void *data, size_t len)
+{
+	Log(LOG_TRACE, "sql3: - bind blob stmt %ld", stmt->stmt);
+	return sqlite3_bind_blob(stmt->stmt, var, data, len, SQLITE_STATIC);
+}
+
 int
 MsgSQLExecute(MsgSQLHandle *handle, MsgSQLStatement *_stmt)
 {
@@ -347,25 +710,17 @@ int
 MsgSQLStatementStep(MsgSQLHandle *handle, MsgSQLStatement *_stmt)
 {
 	sqlite3_stmt *stmt = _stmt->stmt;
-	int count = 1 + handle->lockTimeoutMs / MSGSQL_STMT_SLEEP_MS;
-	int dbg;
-	while (count--) {
-		Log(LOG_TRACE, "sql3: - f stmt step %ld", stmt);
-		switch ((dbg = sqlite3_step(stmt))) {
-			case SQLITE_ROW:
-				return 1;
-			case SQLITE_DONE:
-				return 0;
-			case SQLITE_BUSY:
-				XplDelay(MSGSQL_STMT_SLEEP_MS);
-				continue;
-			default:
-				Log(LOG_ERROR, "sql3: Step error: %s", sqlite3_errmsg(handle->db));
-				return -1;
-		}
-	}
 
-	return -1;
+	Log(LOG_TRACE, "sql3: - f stmt step %ld", stmt);
+	switch (sqlite3_step(stmt)) {
+		case SQLITE_ROW:
+			return 1;
+		case SQLITE_DONE:
+			return 0;
+		default:
+			Log(LOG_ERROR, "sql3: Step error: %s", sqlite3_errmsg(handle->db));
+			return -1;
+	}
 }
 
 int
@@ -373,30 +728,22 @@ MsgSQLResults(MsgSQLHandle *handle, MsgSQLStatement *_stmt)
 {
 	sqlite3_stmt *stmt = _stmt->stmt;
 	int result;
-	int count = 1 + handle->lockTimeoutMs / MSGSQL_STMT_SLEEP_MS;
-
-	while (count--) {
-		result = sqlite3_step(stmt);
-		Log(LOG_TRACE, "sql3: - f stmt results %ld", stmt);
-		switch (result) {
-			case SQLITE_DONE:
-				return 0; // no more results
-				break;
-			case SQLITE_ROW:
-				return 1;
-				break;
-			case SQLITE_BUSY:
-				XplDelay(MSGSQL_STMT_SLEEP_MS);
-				continue;
-			default:
-				// FIXME
-				//XplConsolePrintf("SQL Prepare statement \"%s\" failed; %s\r\n", 
-				// statement, sqlite3_errmsg(handle->db));
-				return -1;
-		}
-	}
 
-	return -1;
+	result = sqlite3_step(stmt);
+	Log(LOG_TRACE, "sql3: - f stmt results %ld", stmt);
+	switch (result) {
+		case SQLITE_DONE:
+			return 0; // no more results
+			break;
+		case SQLITE_ROW:
+			return 1;
+			break;
+		default:
+			// FIXME
+			//XplConsolePrintf("SQL Prepare statement \"%s\" failed; %s\r\n", 
+			// statement, sqlite3_errmsg(handle->db));
+			return -1;
+	}
 }
 
 uint64_t
@@ -441,3 +788,23 @@ MsgSQLResultTextPtr(MsgSQLStatement *_stmt, int column, char **ptr)
 	
 	return 0;
 }
+
+// returns a copy of the blob in *ptr, which the caller must free
+int
+MsgSQLResultBlob(MsgSQLStatement *_stmt, int column, void **ptr, size_t *len)
+{
+	const void *result;
+	int size;
+
+	*ptr = NULL;
+	*len = 0;
+
+	result = sqlite3_column_blob(_stmt->stmt, column);
+	size = sqlite3_column_bytes(_stmt->stmt, column);
+	if (result == NULL || size <= 0) return -1;
+
+	*ptr = g_memdup(result, size);
+	*len = size;
+
+	return 0;
+}
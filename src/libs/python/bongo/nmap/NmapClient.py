@@ -142,7 +142,7 @@ class NmapClient:
         if r.code != 1000:
             raise CommandError(r)
 
-        (old, new) = r.message.split(" ", 1)
+        (old, new) = r.message.split(" ")[:2]
         return (old, new)
 
     def Info(self, seqNum=None):
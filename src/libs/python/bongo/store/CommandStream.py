@@ -2,7 +2,9 @@ import re
 import logging
 from bongo.BongoError import BongoError
 
-__all__ = ["CommandError",
+__all__ = ["Change",
+           "ChangeIterator",
+           "CommandError",
            "CommandStream",
            "Item",
            "ItemIterator",
@@ -52,6 +54,16 @@ class Collection:
         self.type = int(self.type)
 
 
+class Change:
+    def __init__(self, response):
+        self.uid, self.modseq, self.kind, self.imapuid, self.flags = response.message.split(" ")
+
+        self.modseq = int(self.modseq)
+        self.kind = int(self.kind)
+        self.imapuid = int(self.imapuid)
+        self.flags = int(self.flags)
+
+
 class MimeItem:
     def __init__(self, response):
         self.end = False
@@ -202,3 +214,9 @@ class CollectionIterator(ResponseIterator):
         collection = Collection(ResponseIterator.next(self))
         return collection
 
+class ChangeIterator(ResponseIterator):
+    # once finished, total is the collection's modseq to ask from next time
+    def next(self):
+        change = Change(ResponseIterator.next(self))
+        return change
+
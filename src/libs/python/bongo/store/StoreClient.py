@@ -400,6 +400,15 @@ class StoreClient:
     def _escape_query(self, s):
         return self._escape_quotes(s)
 
+    def Changes(self, path, modseq=None):
+        command = "CHANGES %s" % path.replace(" ", "\ ")
+
+        if modseq is not None:
+            command = command + " %d" % modseq
+
+        self.stream.Write(command)
+        return ChangeIterator(self.stream)
+
     def Collections(self, path=""):
         command = "COLLECTIONS %s" % path
         self.stream.Write(command)
@@ -526,7 +535,7 @@ class StoreClient:
         if r.code != 1000:
             raise CommandError(r)
 
-        (old, new) = r.message.split(" ", 1)
+        (old, new) = r.message.split(" ")[:2]
         return (old, new)
 
     def GetACL(self, doc) :
@@ -595,7 +604,8 @@ class StoreClient:
         if r.code != 1000 :
             raise CommandError(r)
 
-    def List(self, path, props=[], start=-1, end=-1, flags=None, mask=None):
+    def List(self, path, props=[], start=-1, end=-1, flags=None, mask=None,
+             order=None, after=None):
         path = path.replace(" ", "\ ")
         command = "LIST %s" % path
 
@@ -613,6 +623,14 @@ class StoreClient:
         if mask is not None:
             command = command + " M" + str(mask)
 
+        # e.g. "-date" for newest first; after is the uid of the last
+        # item of the previous page
+        if order is not None:
+            command = command + " O" + order
+
+        if after is not None:
+            command = command + " A" + after
+
         self.stream.Write(command)
         return ItemIterator(self.stream, len(props))
 
@@ -830,6 +848,14 @@ class StoreClient:
         if force or acl.changed :
             self.PropSet(doc, "nmap.access-control", str(acl))
         
+    def Status(self, path):
+        """Returns (documents, unseen, deleted, bytes) for a collection."""
+        self.stream.Write("STATUS %s" % path.replace(" ", "\ "))
+        r = self.stream.GetResponse()
+        if r.code != 1000:
+            raise CommandError(r)
+        return tuple([int(x) for x in r.message.split(" ")[:4]])
+
     def Store(self, name):
         self.stream.Write("STORE %s" % (name))
         r = self.stream.GetResponse()
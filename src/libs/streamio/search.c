@@ -164,14 +164,37 @@ BongoStreamSearchRfc822Header(SourceReader readerFunction, void *source, size_t
 }
 
 
-BOOL
-BongoStreamSearchMimePart(SourceReader readerFunction, void *source, size_t sourceSize, char *charset, char *encoding, char *subtype, char *substring)
+char *
+BongoStreamGrabRfc822HeaderText(SourceReader readerFunction, void *source, size_t sourceSize, char *headerName)
+{
+    BongoStream *stream;
+    char *codec[3];
+
+    codec[0] = "rfc822_fold";
+
+    codec[1] = "rfc822_header_value";
+
+    codec[2] = "rfc1522";
+
+    stream = BongoStreamCreate(codec, 3, FALSE);
+    if (!stream) {
+        return(NULL);
+    }
+
+    /* set the headerName in the rfc822header_filter codec */ 
+    stream->first->Next->StreamData = headerName;
+
+    return(BongoStreamGrabOutput(stream, readerFunction, source, sourceSize));
+}
+
+/* build the chain which turns a MIME part into utf-8 text */
+static BongoStream *
+BongoStreamCreateMimePart(char *charset, char *encoding, char *subtype)
 {
     BongoStream *stream;
     int codecCount = 0;
     char *codec[4];
 
-    /* create the stream */
     if (encoding) {
         codec[codecCount] = encoding;
         codecCount++;
@@ -183,34 +206,57 @@ BongoStreamSearchMimePart(SourceReader readerFunction, void *source, size_t sour
             codecCount++;
         }
 
-        stream = BongoStreamCreate(codec, codecCount, FALSE);
-        if (!stream) {
-            return(FALSE);        
-        }
+        return(BongoStreamCreate(codec, codecCount, FALSE));
+    }
+
+    if (!charset) {
+        charset = "us-ascii";
+    }
+
+    codec[codecCount] = "html_text";
+    codecCount++;
+
+    codec[codecCount] = charset;
+    codecCount++;
+
+    stream = BongoStreamCreate(codec, codecCount, FALSE);
+    if (!stream) {
+        return(NULL);
+    }
+
+    /* tell the html_text codec where to find the charset codec */
+    /* which, in this case, happens to be its next codec */
+    if (encoding) {
+        stream->first->Next->Charset = stream->first->Next->Next;
     } else {
-        if (!charset) {
-            charset = "us-ascii";
-        }
+        stream->first->Charset = stream->first->Next;
+    }
 
-        codec[codecCount] = "html_text";
-        codecCount++;
+    return(stream);
+}
 
-        codec[codecCount] = charset;
-        codecCount++;
+char *
+BongoStreamGrabMimePart(SourceReader readerFunction, void *source, size_t sourceSize, char *charset, char *encoding, char *subtype)
+{
+    BongoStream *stream;
 
-        
-        stream = BongoStreamCreate(codec, codecCount, FALSE);
-        if (!stream) {
-            return(FALSE);        
-        }
+    stream = BongoStreamCreateMimePart(charset, encoding, subtype);
+    if (!stream) {
+        return(NULL);
+    }
 
-        /* tell the html_text codec where to find the charset codec */
-        /* which, in this case, happens to be its next codec */
-        if (encoding) {
-            stream->first->Next->Charset = stream->first->Next->Next;
-        } else {
-            stream->first->Charset = stream->first->Next;
-        }
+    return(BongoStreamGrabOutput(stream, readerFunction, source, sourceSize));
+}
+
+
+BOOL
+BongoStreamSearchMimePart(SourceReader readerFunction, void *source, size_t sourceSize, char *charset, char *encoding, char *subtype, char *substring)
+{
+    BongoStream *stream;
+
+    stream = BongoStreamCreateMimePart(charset, encoding, subtype);
+    if (!stream) {
+        return(FALSE);
     }
 
     if(BongoStreamAddCodecWithData(stream, "search_substring", FALSE, (void *)substring, NULL)) {